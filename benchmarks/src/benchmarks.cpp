@@ -0,0 +1,490 @@
+// Benchmarks of the DRM removal hot paths. Every benchmark runs for at
+// least --min-time seconds and reports its throughput (input bytes per
+// second) and the peak RSS reached while it ran. Fixtures are generated in
+// a temporary directory, recorded files can be added on the command line
+// (their key comes from adept_remove -o / the book key cache).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zip.h>
+#include <pugixml.hpp>
+#include <uPDFParser.h>
+#include "drmprocessorclientimpl.h"
+#include "libgourou.h"
+#include "libgourou_common.h"
+
+struct Options {
+  double min_time = 1.0;
+  std::string filter;
+  bool json = false;
+  std::vector<std::string> pdf_files;
+  std::vector<std::string> epub_files;
+  std::vector<unsigned char> key;
+};
+
+Options options;
+std::string work_dir;
+
+// removes the temporary work directory, also when a benchmark throws
+struct WorkDirGuard {
+  ~WorkDirGuard() {
+    std::error_code error;
+    std::filesystem::remove_all(work_dir, error);
+  }
+};
+
+// peak RSS is reset before each benchmark when the kernel allows it
+void reset_peak_rss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (clear_refs) {
+    clear_refs << "5";
+  }
+}
+
+uint64_t peak_rss_kb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::strtoull(line.c_str() + 6, nullptr, 10);
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// runs job until min_time is reached, job returns the number of bytes it
+// processed
+void run(const std::string &name, const std::function<uint64_t()> &job) {
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+    return;
+  }
+
+  reset_peak_rss();
+
+  uint64_t bytes = 0;
+  unsigned iterations = 0;
+  double elapsed = 0;
+  auto start = std::chrono::steady_clock::now();
+  do {
+    bytes += job();
+    iterations++;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (elapsed < options.min_time);
+
+  const double mb_per_s = bytes / elapsed / (1024 * 1024);
+  const double ms_per_iteration = elapsed * 1000 / iterations;
+  const double peak_rss_mb = peak_rss_kb() / 1024.0;
+
+  if (options.json) {
+    printf("{\"name\": \"%s\", \"iterations\": %u, \"ms_per_iteration\": %.3f, "
+           "\"mb_per_s\": %.2f, \"peak_rss_mb\": %.1f}\n",
+           name.c_str(), iterations, ms_per_iteration, mb_per_s, peak_rss_mb);
+  } else {
+    printf("%-48s %8u it %12.3f ms/it %10.2f MB/s %9.1f MB peak RSS\n",
+           name.c_str(), iterations, ms_per_iteration, mb_per_s, peak_rss_mb);
+  }
+  fflush(stdout);
+}
+
+uint64_t file_size(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    throw std::runtime_error("unable to stat " + path);
+  }
+  return st.st_size;
+}
+
+std::string read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("unable to read " + path);
+  }
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// pseudo random, partly compressible, like images and fonts of real books
+std::string make_data(size_t size, unsigned seed) {
+  std::string data(size, 0);
+  uint32_t state = seed * 2654435761u + 1;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1103515245u + 12345u;
+    data[i] = (i % 64 < 16) ? (char)(state >> 24) : "uPDFParser"[i % 10];
+  }
+  return data;
+}
+
+std::string hex_key() {
+  std::string res;
+  char tmp[3];
+  for (unsigned char c : options.key) {
+    snprintf(tmp, sizeof(tmp), "%02x", c);
+    res += tmp;
+  }
+  return res;
+}
+
+// ADEPT-like PDF : EBX_HANDLER referenced by trailer's Encrypt, objects own
+// a dictionary with a string and a stream. Content doesn't need to be really
+// encrypted, RC4 costs the same in both directions.
+std::string make_pdf(const std::string &path, int nb_objects, size_t stream_size) {
+  std::string pdf = "%PDF-1.6\n%\xe2\xe3\xcf\xd3\n";
+  std::vector<size_t> offsets;
+  char tmp[256];
+
+  offsets.push_back(pdf.size());
+  pdf += "1 0 obj\n<</Type/Catalog/Pages 2 0 R>>\nendobj\n";
+  offsets.push_back(pdf.size());
+  pdf += "2 0 obj\n<</Type/Pages/Count 0/Kids[]>>\nendobj\n";
+  offsets.push_back(pdf.size());
+  pdf += "3 0 obj\n<</Filter/EBX_HANDLER/V 4/ADEPT_LICENSE(bench)>>\nendobj\n";
+
+  for (int i = 0; i < nb_objects; i++) {
+    const int id = i + 4;
+    const std::string data = make_data(stream_size, id);
+    offsets.push_back(pdf.size());
+    snprintf(tmp, sizeof(tmp), "%d 0 obj\n<</Length %zu/Title(object %d)/Filter/FlateDecode>>\nstream\n",
+             id, stream_size, id);
+    pdf += tmp;
+    pdf += data;
+    pdf += "\nendstream\nendobj\n";
+  }
+
+  const size_t xref = pdf.size();
+  snprintf(tmp, sizeof(tmp), "xref\n0 %zu\n0000000000 65535 f\r\n", offsets.size() + 1);
+  pdf += tmp;
+  for (size_t offset : offsets) {
+    snprintf(tmp, sizeof(tmp), "%010zu 00000 n\r\n", offset);
+    pdf += tmp;
+  }
+  snprintf(tmp, sizeof(tmp), "trailer\n<</Size %zu/Root 1 0 R/Encrypt 3 0 R>>\nstartxref\n%zu\n%%%%EOF\n",
+           offsets.size() + 1, xref);
+  pdf += tmp;
+
+  std::ofstream(path, std::ios::binary) << pdf;
+  return path;
+}
+
+void zip_add(zip_t *zip, const std::string &name, const std::string &content, bool compress) {
+  void *copy = malloc(content.size());
+  memcpy(copy, content.data(), content.size());
+  zip_source_t *source = zip_source_buffer(zip, copy, content.size(), 1);
+  zip_int64_t idx = zip_file_add(zip, name.c_str(), source, ZIP_FL_OVERWRITE);
+  if (idx < 0) {
+    zip_source_free(source);
+    throw std::runtime_error("unable to add " + name);
+  }
+  zip_set_file_compression(zip, idx, compress ? ZIP_CM_DEFLATE : ZIP_CM_STORE, 0);
+}
+
+// ePub with nb_files resources encrypted as ADEPT does : AES-CBC (random
+// IV first) of the raw deflated content, stored as is in the archive
+std::string make_epub(DRMProcessorClientImpl &client, const std::string &path,
+                      int nb_files, size_t file_size) {
+  int error;
+  zip_t *zip = zip_open(path.c_str(), ZIP_CREATE | ZIP_TRUNCATE, &error);
+  if (!zip) {
+    throw std::runtime_error("unable to create " + path);
+  }
+
+  zip_add(zip, "mimetype", "application/epub+zip", false);
+  zip_add(zip, "META-INF/rights.xml", "<rights/>", true);
+
+  std::string encryption = "<?xml version=\"1.0\"?>\n"
+    "<encryption xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n";
+
+  for (int i = 0; i < nb_files; i++) {
+    const std::string name = "OEBPS/file" + std::to_string(i) + ((i % 4) ? ".xhtml" : ".jpg");
+    gourou::ByteArray plain(make_data(file_size, i));
+    gourou::ByteArray deflated;
+    client.deflate(plain, deflated);
+
+    unsigned char iv[16];
+    client.randBytes(iv, sizeof(iv));
+    std::string encrypted((const char *)iv, sizeof(iv));
+    encrypted.resize(sizeof(iv) + deflated.length() + 16);
+    unsigned int length = 0;
+    client.encrypt(gourou::CryptoInterface::ALGO_AES, gourou::CryptoInterface::CHAIN_CBC,
+                   options.key.data(), 16, iv, sizeof(iv),
+                   deflated.data(), deflated.length(),
+                   (unsigned char *)&encrypted[sizeof(iv)], &length);
+    encrypted.resize(sizeof(iv) + length);
+    zip_add(zip, name, encrypted, false);
+
+    encryption += "<EncryptedData xmlns=\"http://www.w3.org/2001/04/xmlenc#\">"
+      "<EncryptionMethod Algorithm=\"http://www.w3.org/2001/04/xmlenc#aes128-cbc\"/>"
+      "<CipherData><CipherReference URI=\"" + name + "\"/></CipherData></EncryptedData>\n";
+  }
+  encryption += "</encryption>\n";
+  zip_add(zip, "META-INF/encryption.xml", encryption, true);
+
+  if (zip_close(zip)) {
+    throw std::runtime_error("unable to write " + path);
+  }
+  return path;
+}
+
+// createDRMProcessor() only fetches activation service info when there is
+// none : a fake one keeps the processor offline (the key is always
+// provided to removeDRM())
+gourou::DRMProcessor *create_offline_processor(DRMProcessorClientImpl &client) {
+  const std::string adept_dir = work_dir + "/adept";
+  mkdir(adept_dir.c_str(), 0700);
+  std::ofstream(adept_dir + "/activation.xml")
+    << "<?xml version=\"1.0\"?>\n"
+       "<activationInfo xmlns=\"http://ns.adobe.com/adept\">"
+       "<adept:activationServiceInfo xmlns:adept=\"http://ns.adobe.com/adept\">"
+       "<adept:authURL>http://localhost</adept:authURL>"
+       "<adept:userInfoURL>http://localhost</adept:userInfoURL>"
+       "<adept:activationURL>http://localhost</adept:activationURL>"
+       "<adept:certificate>AA==</adept:certificate>"
+       "<adept:authenticationCertificate>AA==</adept:authenticationCertificate>"
+       "</adept:activationServiceInfo></activationInfo>\n";
+
+  return gourou::DRMProcessor::createDRMProcessor(&client, false, adept_dir);
+}
+
+class StringWriter : public uPDFParser::Writer {
+public:
+  virtual void write(const char *buffer, size_t size) { data.append(buffer, size); }
+  std::string data;
+};
+
+void bench_parser(const std::string &name, const std::string &path) {
+  const std::string content = read_file(path);
+
+  run("pdf.parse/" + name, [&]() {
+    uPDFParser::Parser parser;
+    parser.parse((const unsigned char *)content.data(), content.size());
+    return (uint64_t)content.size();
+  });
+
+  run("pdf.parseLazy+getObjects/" + name, [&]() {
+    uPDFParser::Parser parser;
+    parser.parseLazy((const unsigned char *)content.data(), content.size());
+    parser.objects();
+    return (uint64_t)content.size();
+  });
+
+  uPDFParser::Parser parser;
+  parser.parse((const unsigned char *)content.data(), content.size());
+  run("pdf.write/" + name, [&]() {
+    StringWriter writer;
+    writer.data.reserve(content.size() + content.size() / 8);
+    parser.write(writer);
+    return (uint64_t)writer.data.size();
+  });
+}
+
+void bench_remove_pdf(gourou::DRMProcessor *processor, const std::string &name,
+                      const std::string &path) {
+  const std::string out = work_dir + "/out.pdf";
+  const uint64_t size = file_size(path);
+
+  for (bool streaming : {false, true}) {
+    for (unsigned threads : {1u, 0u}) {
+      processor->setPDFStreamingMode(streaming);
+      processor->setDecryptionThreads(threads);
+      run(std::string("removePDFDRM") + (streaming ? "/streaming" : "") +
+            (threads ? "" : "/threads") + "/" + name, [&]() {
+        processor->removeDRM(path, out, gourou::DRMProcessor::PDF,
+                             options.key.data(), options.key.size());
+        return size;
+      });
+    }
+  }
+  unlink(out.c_str());
+}
+
+void bench_remove_epub(gourou::DRMProcessor *processor, const std::string &name,
+                       const std::string &path) {
+  gourou::ByteArray encrypted(read_file(path));
+
+  for (unsigned threads : {1u, 0u}) {
+    processor->setDecryptionThreads(threads);
+    run(std::string("removeEPubDRM") + (threads ? "" : "/threads") + "/" + name, [&]() {
+      gourou::ByteArray clear;
+      processor->removeDRM(encrypted, clear, gourou::DRMProcessor::EPUB,
+                           options.key.data(), options.key.size());
+      return (uint64_t)encrypted.length();
+    });
+  }
+}
+
+void bench_bytearray() {
+  const std::string chunk = make_data(4096, 1);
+  const size_t total = 64 * 1024 * 1024;
+
+  run("ByteArray.append/4KiB", [&]() {
+    gourou::ByteArray array(true);
+    for (size_t done = 0; done < total; done += chunk.size()) {
+      array.append((const unsigned char *)chunk.data(), chunk.size());
+    }
+    return (uint64_t)array.length();
+  });
+
+  gourou::ByteArray big((const unsigned char *)make_data(total, 2).data(), total);
+  run("ByteArray.copy", [&]() {
+    gourou::ByteArray copy(big.data(), big.length());
+    return (uint64_t)copy.length();
+  });
+}
+
+void bench_zlib(DRMProcessorClientImpl &client) {
+  gourou::ByteArray plain(make_data(16 * 1024 * 1024, 3));
+  gourou::ByteArray deflated;
+  client.deflate(plain, deflated);
+
+  run("deflate/16MiB", [&]() {
+    gourou::ByteArray result;
+    client.deflate(plain, result);
+    return (uint64_t)plain.length();
+  });
+
+  run("inflate/16MiB", [&]() {
+    gourou::ByteArray result;
+    client.inflate(deflated, result, -15, plain.length());
+    return (uint64_t)plain.length();
+  });
+}
+
+// fulfill replies are the biggest nodes hashed (and signed)
+void bench_hash_node(gourou::DRMProcessor *processor) {
+  pugi::xml_document doc;
+  pugi::xml_node root = doc.append_child("adept:fulfillmentResult");
+  root.append_attribute("xmlns:adept") = ADOBE_ADEPT_NS;
+  for (int i = 0; i < 2000; i++) {
+    pugi::xml_node item = root.append_child("adept:fulfillmentItem");
+    item.append_attribute("id") = std::to_string(i).c_str();
+    item.append_child("adept:resource").append_child(pugi::node_pcdata).set_value("urn:uuid:00000000-0000-0000-0000-000000000000");
+    item.append_child("dc:title").append_child(pugi::node_pcdata).set_value("A benchmark title with some words");
+    item.append_child("adept:licenseToken").append_child(pugi::node_pcdata).set_value("MIIBIjANBgkqhkiG9w0BAQEFAAOCAQ8AMIIBCgKCAQEAu1SU1LfVLPHCozMxH2Mo4lgOEePzNm0tRgeLezV6ffAt0gunVTLw7onLRnrq0");
+  }
+
+  gourou::StringXMLWriter writer;
+  doc.save(writer, "");
+  const uint64_t size = writer.getResult().size();
+
+  run("hashNode/2000 items", [&]() {
+    unsigned char sha[gourou::SHA1_LEN];
+    processor->hashNode(root, sha);
+    return size;
+  });
+}
+
+void usage(const char *name) {
+  std::cout << "usage: " << name << " [--min-time SECONDS] [--filter NAME] [--json]\n"
+    "       [--key HEX] [--pdf FILE]... [--epub FILE]...\n"
+    "recorded files need the key they are encrypted with (16 bytes, hex),\n"
+    "synthetic fixtures use it too (default: 000102...0f)" << std::endl;
+}
+
+int main(int argc, char **argv) try {
+  for (unsigned char c = 0; c < 16; c++) {
+    options.key.push_back(c);
+  }
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--json") {
+      options.json = true;
+      continue;
+    }
+    if (arg == "--help" || arg == "-h") {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const std::string value = argv[++i];
+    if (arg == "--min-time") {
+      options.min_time = std::strtod(value.c_str(), nullptr);
+    } else if (arg == "--filter") {
+      options.filter = value;
+    } else if (arg == "--pdf") {
+      options.pdf_files.push_back(value);
+    } else if (arg == "--epub") {
+      options.epub_files.push_back(value);
+    } else if (arg == "--key") {
+      if (value.size() != 32) {
+        throw std::invalid_argument("key must be 16 bytes (32 hex digits)");
+      }
+      options.key.clear();
+      for (size_t j = 0; j < value.size(); j += 2) {
+        options.key.push_back(std::strtoul(value.substr(j, 2).c_str(), nullptr, 16));
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  char tmp_template[] = "/tmp/gourou_bench_XXXXXX";
+  if (!mkdtemp(tmp_template)) {
+    throw std::runtime_error("unable to create temporary directory");
+  }
+  work_dir = tmp_template;
+  WorkDirGuard work_dir_guard;
+
+  DRMProcessorClientImpl client;
+  gourou::DRMProcessor *processor = create_offline_processor(client);
+
+  struct PDFFixture {
+    const char *name;
+    int nb_objects;
+    size_t stream_size;
+  };
+  const PDFFixture pdf_fixtures[] = {
+    {"100 objects x 64KiB", 100, 64 * 1024},
+    {"10000 objects x 1KiB", 10000, 1024},
+    {"2000 objects x 32KiB", 2000, 32 * 1024},
+  };
+
+  for (const PDFFixture &fixture : pdf_fixtures) {
+    const std::string path = make_pdf(work_dir + "/bench.pdf", fixture.nb_objects,
+                                      fixture.stream_size);
+    bench_parser(fixture.name, path);
+    bench_remove_pdf(processor, fixture.name, path);
+  }
+  for (const std::string &path : options.pdf_files) {
+    bench_parser(path, path);
+    bench_remove_pdf(processor, path, path);
+  }
+
+  bench_remove_epub(processor, "200 files x 64KiB",
+                    make_epub(client, work_dir + "/bench.epub", 200, 64 * 1024));
+  for (const std::string &path : options.epub_files) {
+    bench_remove_epub(processor, path, path);
+  }
+
+  bench_bytearray();
+  bench_zlib(client);
+  bench_hash_node(processor);
+
+  if (!options.json) {
+    std::cout << "key: " << hex_key() << std::endl;
+  }
+
+  delete processor;
+  return 0;
+} catch (const std::exception &e) {
+  std::cerr << "error: " << e.what() << std::endl;
+  return 1;
+}
@@ -20,6 +20,8 @@
 #ifndef _BYTEARRAY_H_
 #define _BYTEARRAY_H_
 
+#include <atomic>
+#include <cstddef>
 #include <map>
 #include <string>
 
@@ -32,7 +34,9 @@ namespace gourou
      *
      * Data handled is first copied in a newly allocated buffer
      * and then shared between all copies until last object is destroyed
-     * (internal reference counter == 0)
+     * (internal reference counter == 0).
+     * Reference counter is stored (atomically) just before data in the same
+     * allocation, so copies are O(1) and thread safe. Data itself is not protected.
      */
     class ByteArray
     {
@@ -170,17 +174,47 @@ namespace gourou
 	 */
 	void resize(unsigned int length, bool keepData=true);
 
+	/**
+	 * @brief Pre allocate internal buffer so that next append()/resize()
+	 * up to capacity don't need a new allocation
+	 * @param capacity Minimum size of internal buffer
+	 */
+	void reserve(unsigned int capacity);
+
+	/**
+	 * @brief Get size of internal buffer
+	 */
+	unsigned int capacity() const;
+
 	ByteArray& operator=(const ByteArray& other);
 	
     private:
+	/**
+	 * @brief Control block allocated in front of data
+	 */
+	struct Header
+	{
+	    std::atomic<int> refCounter;
+	    bool useMalloc;
+	    unsigned int capacity;
+	};
+
+	/* Keep data aligned as if it was allocated directly */
+	static const unsigned int HEADER_SIZE = (sizeof(Header) + alignof(std::max_align_t) - 1) &
+	    ~(alignof(std::max_align_t) - 1);
+
+	Header* header() const {return (Header*)(_data - HEADER_SIZE);}
+	
+	static unsigned char* allocate(unsigned int length, bool useMalloc);
 	void initData(const unsigned char* data, unsigned int length);
+	bool canWriteInPlace(unsigned int length) const;
+	void reallocate(unsigned int capacity, bool keepData);
 	void addRef();
 	void delRef();
 
 	bool _useMalloc;
 	unsigned char* _data;
 	unsigned int _length;
-	static std::map<unsigned char*, int> refCounter;
     };
 }
 #endif
@@ -20,6 +20,8 @@
 #ifndef _DEVICE_H_
 #define _DEVICE_H_
 
+#include <mutex>
+
 namespace gourou
 {
     class DRMProcessor;
@@ -34,7 +36,7 @@ namespace gourou
 	static const int DEVICE_SERIAL_LEN = 10;
 
 	/**
-	 * @brief Main Device constructor
+	 * @brief Main Device constructor. Files are read on first access.
 	 *
 	 * @param processor      Instance of DRMProcessor
 	 * @param deviceFile     Path of device.xml
@@ -54,7 +56,9 @@ namespace gourou
 	std::string operator[](const std::string& property);
 
 	/**
-	 * @brief Create device.xml and devicesalt files when they did not exists
+	 * @brief Create device.xml and devicesalt files when they did not exists.
+	 * Existing devicesalt is read now, device.xml on first access
+	 * (both are re-created if invalid).
 	 *
 	 * @param processor      Instance of DRMProcessor
 	 * @param dirName        Directory where to put files (.adept)
@@ -69,11 +73,22 @@ namespace gourou
         std::string deviceKeyFile;
 	unsigned char deviceKey[DEVICE_KEY_SIZE];
 	std::map<std::string, std::string> properties;
+	bool deviceKeyLoaded;
+	bool deviceFileLoaded;
+	/* Files can be first accessed by several threads */
+	std::once_flag deviceKeyOnce;
+	std::once_flag deviceFileOnce;
+	/* Set by createDevice() to re-create an invalid device.xml on first access */
+	bool createIfInvalid;
+	std::string hobbes;
+	bool randomSerial;
 
 	Device(DRMProcessor* processor);
 	
 	std::string makeFingerprint(const std::string& serial);
 	std::string makeSerial(bool random);
+	void loadDeviceFile();
+	void loadDeviceKeyFile();
 	void parseDeviceFile();
 	void parseDeviceKeyFile();
 	void createDeviceFile(const std::string& hobbes, bool randomSerial);
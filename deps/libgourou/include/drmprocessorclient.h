@@ -21,6 +21,7 @@
 #define _DRMPROCESSORCLIENT_H_
 
 #include <string>
+#include <stdint.h>
 #include <bytearray.h>
 
 namespace gourou
@@ -60,6 +61,7 @@ namespace gourou
 
 	/**
 	 * @brief Global digest function
+	 * Must be thread safe if DRMProcessor decryption threads > 1
 	 *
 	 * @param digestName      Digest name to instanciate
 	 * @param data            Data to digest
@@ -81,6 +83,26 @@ namespace gourou
 	virtual void randBytes(unsigned char* bytesOut, unsigned int length) = 0;
     };
 
+    /**
+     * @brief Receive the body of an HTTP response as it's downloaded
+     */
+    class HTTPResponseSink
+    {
+    public:
+	virtual ~HTTPResponseSink() {}
+
+	/**
+	 * @brief Announced body size (Content-Length), called before
+	 * first data when it's known
+	 */
+	virtual void expectedSize(uint64_t /*size*/) {}
+
+	/**
+	 * @brief Next part of body. Throw an exception to abort transfer
+	 */
+	virtual void write(const unsigned char* data, unsigned int length) = 0;
+    };
+
     class HTTPInterface
     {
     public:
@@ -98,6 +120,19 @@ namespace gourou
 	 * @return data of HTTP response
 	 */
 	virtual std::string sendHTTPRequest(const std::string& URL, const std::string& POSTData=std::string(""), const std::string& contentType=std::string(""), std::map<std::string, std::string>* responseHeaders=0, int fd=0, bool resume=false) = 0;
+
+	/**
+	 * @brief Send HTTP GET request and give response body to sink while
+	 * it's received, without keeping it. A broken transfer is resumed
+	 * where it stopped, as for a download into a file descriptor.
+	 * Default implementation calls sendHTTPRequest(), then gives whole
+	 * body at once.
+	 *
+	 * @param URL             HTTP URL
+	 * @param sink            Receiver of response body
+	 * @param responseHeaders Optional Response headers of HTTP request
+	 */
+	virtual void downloadHTTPRequest(const std::string& URL, HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders=0);
     };
 
     class RSAInterface
@@ -141,6 +176,73 @@ namespace gourou
 				       const unsigned char* data, unsigned dataLength,
 				       unsigned char* res) = 0;
 
+	/**
+	 * @brief Decode RSA private key once in order to use it for several
+	 * operations. Handler must be freed with freeRSAPrivateKey().
+	 * Default implementation only keeps a copy of the key, operations
+	 * go through byte based RSAPrivateEncrypt()/RSAPrivateDecrypt().
+	 *
+	 * @param RSAKey         RSA key in binary form
+	 * @param RSAKeyLength   RSA key length
+	 * @param keyType        Key type (RSA_KEY_PKCS12 or RSA_KEY_PKCS8)
+	 * @param password       Optional password for RSA PKCS12 certificate
+	 *
+	 * @return RSA handler
+	 */
+	virtual void* loadRSAPrivateKey(const unsigned char* RSAKey, unsigned int RSAKeyLength,
+					const RSA_KEY_TYPE keyType, const std::string& password)
+	{
+	    RSAPrivateKeyData* key = new RSAPrivateKeyData;
+	    key->data = ByteArray(RSAKey, RSAKeyLength);
+	    key->keyType = keyType;
+	    key->password = password;
+	    return key;
+	}
+
+	/**
+	 * @brief Free handler returned by loadRSAPrivateKey()
+	 *
+	 * @param handler        RSA handler (from loadRSAPrivateKey())
+	 */
+	virtual void freeRSAPrivateKey(void* handler)
+	{
+	    delete (RSAPrivateKeyData*)handler;
+	}
+
+	/**
+	 * @brief Encrypt data with RSA private key handler. Data is padded using PKCS1.5
+	 *
+	 * @param handler        RSA handler (from loadRSAPrivateKey())
+	 * @param data           Data to encrypt
+	 * @param dataLength     Data length
+	 * @param res            Encryption result (pre allocated buffer)
+	 */
+	virtual void RSAPrivateEncrypt(void* handler,
+				       const unsigned char* data, unsigned dataLength,
+				       unsigned char* res)
+	{
+	    RSAPrivateKeyData* key = (RSAPrivateKeyData*)handler;
+	    RSAPrivateEncrypt(key->data.data(), key->data.length(), key->keyType, key->password,
+			      data, dataLength, res);
+	}
+
+	/**
+	 * @brief Decrypt data with RSA private key handler
+	 *
+	 * @param handler        RSA handler (from loadRSAPrivateKey())
+	 * @param data           Data to decrypt
+	 * @param dataLength     Data length
+	 * @param res            Decryption result (pre allocated buffer)
+	 */
+	virtual void RSAPrivateDecrypt(void* handler,
+				       const unsigned char* data, unsigned dataLength,
+				       unsigned char* res)
+	{
+	    RSAPrivateKeyData* key = (RSAPrivateKeyData*)handler;
+	    RSAPrivateDecrypt(key->data.data(), key->data.length(), key->keyType, key->password,
+			      data, dataLength, res);
+	}
+
 	/**
 	 * @brief Encrypt data with RSA public key. Data is padded using PKCS1.5
 	 *
@@ -204,6 +306,15 @@ namespace gourou
 	virtual void extractCertificate(const unsigned char* RSAKey, unsigned int RSAKeyLength,
 					const RSA_KEY_TYPE keyType, const std::string& password,
 					unsigned char** certOut, unsigned int* certOutLength) = 0;
+
+    private:
+	/* Handler of default loadRSAPrivateKey() */
+	struct RSAPrivateKeyData
+	{
+	    ByteArray data;
+	    RSA_KEY_TYPE keyType;
+	    std::string password;
+	};
     };
 
     class CryptoInterface
@@ -278,6 +389,7 @@ namespace gourou
 
 	/**
 	 * @brief Do decryption. If length of data is not multiple of block size, PKCS#5 padding is done
+	 * Must be thread safe if DRMProcessor decryption threads > 1
 	 *
 	 * @param algo           Algorithm to use
 	 * @param chaining       Chaining mode
@@ -345,6 +457,17 @@ namespace gourou
 	 * @return ZIP file handler
 	 */
 	virtual void* zipOpen(const std::string& path) = 0;
+
+	/**
+	 * @brief Open a zip file in memory and return an handler.
+	 * When handler is closed, data is replaced by updated zip file.
+	 * Default implementation raises CLIENT_ZIP_ERROR (not supported).
+	 *
+	 * @param data           Zip file content
+	 *
+	 * @return ZIP file handler
+	 */
+	virtual void* zipOpen(ByteArray& data);
 	
 	/**
 	 * @brief Read zip internal file
@@ -365,6 +488,13 @@ namespace gourou
 	 */
 	virtual void zipWriteFile(void* handler, const std::string& path, ByteArray& content) = 0;
 
+	/**
+	 * @brief Same as zipWriteFile(handler, path, content), content is
+	 * stored without compression if compress is false.
+	 * Default implementation ignores compress (content is compressed).
+	 */
+	virtual void zipWriteFile(void* handler, const std::string& path, ByteArray& content, bool compress);
+
 	/**
 	 * @brief Delete zip internal file
 	 *
@@ -384,11 +514,35 @@ namespace gourou
 	 * @brief Inflate algorithm
 	 *
 	 * @param data           Data to inflate
-	 * @param result         Zipped data
+	 * @param result         Unzipped data (appended)
 	 * @param wbits          Window bits value for libz
 	 */
 	virtual void inflate(gourou::ByteArray& data, gourou::ByteArray& result,
 			     int wbits=-15) = 0;
+
+	/**
+	 * @brief Same as inflate(data, result, wbits), with expected size of
+	 * inflated data if known (0 otherwise) to allocate output once.
+	 * Default implementation ignores sizeHint.
+	 */
+	virtual void inflate(gourou::ByteArray& data, gourou::ByteArray& result,
+			     int wbits, unsigned int sizeHint);
+
+	/**
+	 * @brief Inflate algorithm into caller provided memory.
+	 * Default implementation inflates into a temporary ByteArray.
+	 *
+	 * @param data           Data to inflate
+	 * @param dataLength     Length of data
+	 * @param result         Output buffer
+	 * @param resultLength   Size of output buffer, an exception is raised if too small
+	 * @param wbits          Window bits value for libz
+	 *
+	 * @return Size of inflated data
+	 */
+	virtual unsigned int inflate(const unsigned char* data, unsigned int dataLength,
+				     unsigned char* result, unsigned int resultLength,
+				     int wbits=-15);
 	
 	/**
 	 * @brief Deflate algorithm
@@ -25,9 +25,13 @@
 #include "user.h"
 #include "fulfillment_item.h"
 #include "drmprocessorclient.h"
+#include "metrics.h"
 
 #include <pugixml.hpp>
 #include <stdint.h>
+#include <functional>
+#include <list>
+#include <vector>
 
 #ifndef HOBBES_DEFAULT_VERSION
 #define HOBBES_DEFAULT_VERSION  "10.0.4"
@@ -37,7 +41,14 @@
 #define ACS_SERVER              "http://adeactivate.adobe.com/adept"
 #endif
 
-#define LIBGOUROU_VERSION       "0.8.7"
+#define LIBGOUROU_VERSION       "0.8.8"
+
+namespace uPDFParser
+{
+    class Object;
+    class Parser;
+    class Writer;
+}
 
 namespace gourou
 {
@@ -73,6 +84,17 @@ namespace gourou
 	 */
 	FulfillmentItem* fulfill(const std::string& ACSMFile, bool notify=true);
 
+	/**
+	 * @brief Same as fulfill(ACSMFile), with ACSM content in memory
+	 *
+	 * @param ACSMContent    Content of ACSM file
+	 * @param notify         Notify server if requested by response
+	 */
+	FulfillmentItem* fulfill(const ByteArray& ACSMContent, bool notify=true);
+
+	/* Keep fulfill("file.acsm") unambiguous */
+	FulfillmentItem* fulfill(const char* ACSMFile, bool notify=true) { return fulfill(std::string(ACSMFile), notify); }
+
 	/**
 	 * @brief Once fulfilled, ePub file needs to be downloaded.
 	 * During this operation, DRM information is added into downloaded file
@@ -85,6 +107,55 @@ namespace gourou
 	 */
 	ITEM_TYPE download(FulfillmentItem* item, std::string path, bool resume=false);
 
+	/**
+	 * @brief Same as download(item, path), but item is downloaded
+	 * (and DRM information added) into memory
+	 *
+	 * @param item            Item from fulfill() method
+	 * @param content         Downloaded file
+	 *
+	 * @return Type of downloaded item
+	 */
+	ITEM_TYPE download(FulfillmentItem* item, ByteArray& content);
+
+	/**
+	 * @brief Download a fulfilled item and remove its DRM in the same step.
+	 * Unlike download() + removeDRM(), rights are not injected into the
+	 * downloaded file (so it's not parsed/rewritten once more) : book key
+	 * comes from item (or encryptionKey) and DRM free file is written into path.
+	 * Encrypted file is never stored : it's decrypted while it's received.
+	 * PDF objects are decrypted (and written) as soon as they're parsed,
+	 * ePub archive entries as soon as META-INF/encryption.xml is known.
+	 * Output is removed if an error occurs.
+	 *
+	 * @param item               Item from fulfill() method
+	 * @param path               Output file path
+	 * @param encryptionKey      Optional book key (see decryptItemKey())
+	 * @param encryptionKeySize  Size of encryption key (if provided)
+	 *
+	 * @return Type of downloaded item
+	 */
+	ITEM_TYPE downloadAndRemoveDRM(FulfillmentItem* item, const std::string& path, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Same as downloadAndRemoveDRM(item, path), DRM free file is returned into content
+	 */
+	ITEM_TYPE downloadAndRemoveDRM(FulfillmentItem* item, ByteArray& content, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Same as downloadAndRemoveDRM(item, path), DRM free file is
+	 * sent to writer (socket, upload...) while it's produced
+	 */
+	ITEM_TYPE downloadAndRemoveDRM(FulfillmentItem* item, uPDFParser::Writer& writer, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Decrypt the book key of a fulfilled item with user private license key
+	 *
+	 * @param item            Item from fulfill() method
+	 * @param decryptedKey    Output buffer (16 bytes)
+	 */
+	void decryptItemKey(FulfillmentItem* item, unsigned char* decryptedKey);
+
 	/**
 	 * @brief SignIn into ACS Server (required to activate device)
 	 * 
@@ -98,6 +169,14 @@ namespace gourou
 	 */
 	void activateDevice();
 
+	/**
+	 * @brief Check whether current activation (activation.xml) can be used as is.
+	 * User must be signed in, device activated for this exact device and its
+	 * PKCS12 certificate readable with current device key.
+	 * If true, signIn() and activateDevice() don't need to be called again.
+	 */
+	bool hasValidActivation();
+
 	/**
 	 * @brief Return loaned book to server
 	 *
@@ -159,6 +238,11 @@ namespace gourou
 	 */
 	ByteArray sendRequest(const pugi::xml_document& document, const std::string& url);
 	
+	/**
+	 * @brief Compute SHA1 of an XML node, as done before signing requests
+	 */
+	void hashNode(const pugi::xml_node& root, unsigned char* sha_out);
+
 	/**
 	 * @brief In place encrypt data with private device key
 	 */
@@ -210,18 +294,127 @@ namespace gourou
 	 * @param encryptionKeySize  Size of encryption key (if provided)
 	 */
 	void removeDRM(const std::string& filenameIn, const std::string& filenameOut, ITEM_TYPE type, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Remove ADEPT DRM of a file in memory
+	 *
+	 * @param dataIn             Input file (with ADEPT DRM)
+	 * @param dataOut            Output file (without ADEPT DRM), can be dataIn
+	 * @param type               Type of file (ePub or PDF)
+	 * @param encryptionKey      Optional encryption key, do not try to decrypt the one inside input file
+	 * @param encryptionKeySize  Size of encryption key (if provided)
+	 */
+	void removeDRM(const ByteArray& dataIn, ByteArray& dataOut, ITEM_TYPE type, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Remove ADEPT DRM of a file in memory, result is sent to a writer
+	 * (socket, upload...). In PDF streaming mode, output is written while
+	 * objects are decrypted. ePub archive is sent once rebuilt.
+	 *
+	 * @param dataIn             Input file (with ADEPT DRM)
+	 * @param writer             Output (file without ADEPT DRM)
+	 * @param type               Type of file (ePub or PDF)
+	 * @param encryptionKey      Optional encryption key, do not try to decrypt the one inside input file
+	 * @param encryptionKeySize  Size of encryption key (if provided)
+	 */
+	void removeDRM(const ByteArray& dataIn, uPDFParser::Writer& writer, ITEM_TYPE type, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+
+	/**
+	 * @brief Remove PDF DRM in streaming mode : objects are read, decrypted and
+	 * written one at a time instead of loading the whole document in memory.
+	 * Input file is read twice (first pass only looks for EBX_HANDLER).
+	 */
+	void setPDFStreamingMode(bool enable) { pdfStreamingMode = enable; }
+
+	/**
+	 * @brief Is PDF streaming mode enabled
+	 */
+	bool getPDFStreamingMode() { return pdfStreamingMode; }
+
+	/**
+	 * @brief Set number of threads used to decrypt PDF objects and ePub files.
+	 * 0 means one thread per available core, 1 (default) decrypts
+	 * serially. Output is the same whatever the value.
+	 * When > 1, client decrypt(), digest() and inflate() are called concurrently.
+	 * Decryption threads are started once (on first use) and kept until
+	 * processor is deleted or this value is changed.
+	 */
+	void setDecryptionThreads(unsigned threads);
+
+	/**
+	 * @brief Get number of threads used to decrypt PDF objects and ePub files
+	 */
+	unsigned getDecryptionThreads() { return decryptionThreads; }
+
+	/**
+	 * @brief Keep decrypted book keys (indexed by resource ID) so that
+	 * books already seen don't need RSA decryption of their key anymore.
+	 * Least recently used keys are dropped when cache is full.
+	 *
+	 * @param maxEntries       Maximum number of keys, 0 disables the cache (default)
+	 * @param persistentFile   Optional file (created with 0600 permissions) where keys
+	 *                         are loaded from and saved to. It contains clear keys !
+	 */
+	void setBookKeyCache(unsigned maxEntries, const std::string& persistentFile="");
+
+	/**
+	 * @brief When removing ePub DRM, store already compressed resources
+	 * (images, audio, video, woff fonts) without deflating them again.
+	 * Default is false (all decrypted files are deflated).
+	 */
+	void setStoreCompressedResources(bool enable) { storeCompressedResources = enable; }
+
+	/**
+	 * @brief Are already compressed resources stored as is
+	 */
+	bool getStoreCompressedResources() { return storeCompressedResources; }
+
+	/**
+	 * @brief Record time spent in each phase (signIn, activateDevice,
+	 * fulfill, download, pdf.parse, pdf.decrypt, pdf.write, epub.zip,
+	 * epub.decrypt, epub.write) and counters (download.bytes,
+	 * decrypt.objects, decrypt.streams, decrypt.bytes, epub.files) into
+	 * metrics (not owned). In PDF streaming mode, pdf.decrypt also includes
+	 * the second parse and objects writing. 0 (default) disables it.
+	 */
+	void setMetrics(Metrics* metrics) { this->metrics = metrics; }
+
+	/**
+	 * @brief Get current metrics (may be 0)
+	 */
+	Metrics* getMetrics() { return metrics; }
 	
     private:
+	class PDFStreamingHandler;
+	class PDFIO;
+	class EPubStreamingHandler;
+	class DRMRemovalSink;
+	class WorkerPool;
+
 	gourou::DRMProcessorClient* client;
         gourou::Device* device;
         gourou::User* user;
+	bool pdfStreamingMode;
+	unsigned decryptionThreads;
+	WorkerPool* workerPool;
+	bool storeCompressedResources;
+	unsigned bookKeyCacheSize;
+	std::string bookKeyCacheFile;
+	std::list<std::pair<std::string, ByteArray> > bookKeys;
+	/* Decoded user keys (RSA handlers) and the value they were decoded from */
+	void* pkcs12KeyHandler;
+	std::string pkcs12KeySource;
+	void* licenseKeyHandler;
+	std::string licenseKeySource;
+	Metrics* metrics;
 	
         DRMProcessor(DRMProcessorClient* client);
 	
 	void pushString(void* sha_ctx, const std::string& string);
 	void pushTag(void* sha_ctx, uint8_t tag);
-	void hashNode(const pugi::xml_node& root, void *sha_ctx, std::map<std::string,std::string> nsHash);
-	void hashNode(const pugi::xml_node& root, unsigned char* sha_out);
+	void hashNode(const pugi::xml_node& root, void *sha_ctx, std::map<std::string,std::string>& nsHash);
+	void* getPKCS12Key();
+	void* getLicenseKey();
 	void signNode(pugi::xml_node& rootNode);
 	void addNonce(pugi::xml_node& root);
 	void buildAuthRequest(pugi::xml_document& authReq);
@@ -231,7 +424,10 @@ namespace gourou
 	void buildFulfillRequest(pugi::xml_document& acsmDoc, pugi::xml_document& fulfillReq);
 	void buildActivateReq(pugi::xml_document& activateReq);
 	void buildReturnReq(pugi::xml_document& returnReq, const std::string& loanID, const std::string& operatorURL);
+	FulfillmentItem* fulfillDocument(pugi::xml_document& acsmDoc, bool notify);
+	void addPDFRights(FulfillmentItem* item, uPDFParser::Parser& parser);
 	ByteArray sendFulfillRequest(const pugi::xml_document& document, const std::string& url);
+	ITEM_TYPE getItemType(FulfillmentItem* item, std::map<std::string, std::string>& headers);
 	void buildSignInRequest(pugi::xml_document& signInRequest, const std::string& adobeID, const std::string& adobePassword, const std::string& authenticationCertificate);
 	void fetchLicenseServiceCertificate(const std::string& licenseURL,
 					    const std::string& operatorURL);
@@ -240,12 +436,34 @@ namespace gourou
 	void notifyServer(pugi::xml_document& fulfillReply);
 	std::string encryptedKeyFirstPass(pugi::xml_document& rightsDoc, const std::string& encryptedKey, const std::string& keyType);
 	void decryptADEPTKey(pugi::xml_document& rightsDoc, unsigned char* decryptedKey, const unsigned char* encryptionKey=0, unsigned encryptionKeySize=0);
+	bool findBookKey(const std::string& resource, unsigned char* decryptedKey);
+	void addBookKey(const std::string& resource, const unsigned char* decryptedKey);
+	void loadBookKeys();
+	void saveBookKeys();
 	void removeEPubDRM(const std::string& filenameIn, const std::string& filenameOut, const unsigned char* encryptionKey, unsigned encryptionKeySize);
+	void removeEPubDRM(void* zipHandler, const unsigned char* encryptionKey, unsigned encryptionKeySize);
+	void decryptEPubFile(const unsigned char* decryptedKey, const unsigned char* data, unsigned int length, ByteArray& result);
 	void generatePDFObjectKey(int version,
 				  const unsigned char* masterKey, unsigned int masterKeyLength,
 				  int objectId, int objectGenerationNumber,
 				  unsigned char* keyOut);
-	void removePDFDRM(const std::string& filenameIn, const std::string& filenameOut, const unsigned char* encryptionKey, unsigned encryptionKeySize);
+	int decryptEBXHandlerKey(uPDFParser::Object* ebx, unsigned char* decryptedKey, const unsigned char* encryptionKey, unsigned encryptionKeySize);
+	/**
+	 * @brief Counters of decrypted PDF objects, added to metrics at once
+	 * (by batch) instead of for each object
+	 */
+	struct PDFDecryptionStats
+	{
+	    PDFDecryptionStats(): objects(0), streams(0), bytes(0) {}
+	    uint64_t objects, streams, bytes;
+	};
+	void decryptPDFObject(int version, const unsigned char* decryptedKey, uPDFParser::Object* object, PDFDecryptionStats& stats, bool inPlace);
+	void decryptPDFObjects(int version, const unsigned char* decryptedKey, const std::vector<uPDFParser::Object*>& objects, PDFDecryptionStats& stats, bool inPlace);
+	void addPDFDecryptionStats(PDFDecryptionStats& stats);
+	unsigned decryptionThreadsCount(size_t nbObjects);
+	void runParallel(size_t nbJobs, const std::function<void(size_t)>& job);
+	void removePDFDRM(PDFIO& io, const unsigned char* encryptionKey, unsigned encryptionKeySize);
+	void removePDFDRMStreaming(PDFIO& io, const unsigned char* encryptionKey, unsigned encryptionKeySize);
     };
 }
 
@@ -484,18 +484,25 @@ namespace gourou
 	return 0;
     }
 
-    static inline void dumpBuffer(GOUROU_LOG_LEVEL level, const char* title, const unsigned char* data, unsigned int len)
+    /**
+     * @brief Log data as hex. Message is reported at caller location
+     */
+    static inline void dumpBuffer(GOUROU_LOG_LEVEL level, const char* title, const unsigned char* data, unsigned int len,
+				  const char* file=__builtin_FILE(), int line=__builtin_LINE())
     {
-	if (gourou::logLevel < level)
+	if (level > GOUROU_LOG_MIN_LEVEL || gourou::logLevel < level)
 	    return;
-	
-	printf("%s", title);
+
+	std::string out(title);
+	char tmp[4];
 	for(unsigned int i=0; i<len; i++)
 	{
-	    if (i && !(i%16)) printf("\n");
-	    printf("%02x ", data[i]);
+	    if (i && !(i%16)) out += "\n";
+	    snprintf(tmp, sizeof(tmp), "%02x ", data[i]);
+	    out += tmp;
 	}
-	printf("\n");	
+
+	logMessage(level, file, line, out);
     }
 }
 
@@ -21,6 +21,19 @@
 #define _LIBGOUROU_LOG_H_
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Least severe level compiled in (0: ERROR ... 4: TRACE). Messages above it
+ * are removed at compile time, whatever the runtime log level is.
+ */
+#ifndef GOUROU_LOG_MIN_LEVEL
+#define GOUROU_LOG_MIN_LEVEL 4
+#endif
 
 namespace gourou {
     enum GOUROU_LOG_LEVEL {
@@ -33,9 +46,91 @@ namespace gourou {
 
     extern GOUROU_LOG_LEVEL logLevel;
 
-#define GOUROU_LOG(__lvl, __msg) if (gourou::LG_LOG_##__lvl <= gourou::logLevel) {std::cout << __msg << std::endl << std::flush;}
+#define GOUROU_LOG_ENABLED(__lvl) (gourou::LG_LOG_##__lvl <= GOUROU_LOG_MIN_LEVEL && gourou::LG_LOG_##__lvl <= gourou::logLevel)
+#define GOUROU_LOG(__lvl, __msg) do { if (GOUROU_LOG_ENABLED(__lvl)) {std::ostringstream __log; __log << __msg; gourou::logMessage(gourou::LG_LOG_##__lvl, __FILE__, __LINE__, __log.str());} } while (0)
 #define GOUROU_LOG_FUNC() GOUROU_LOG(TRACE, __FUNCTION__ << "() @ " << __FILE__ << ":" << __LINE__)
 
+    /**
+     * @brief Log messages output. log() can be called from several threads.
+     */
+    class LogSink
+    {
+    public:
+	virtual ~LogSink() {}
+
+	/**
+	 * @brief Output a formatted message
+	 *
+	 * @param level    Message level
+	 * @param file     Source file of message
+	 * @param line     Source line of message
+	 * @param message  Message
+	 */
+	virtual void log(GOUROU_LOG_LEVEL level, const char* file, int line, const std::string& message) = 0;
+
+	/**
+	 * @brief Wait for all messages to be written
+	 */
+	virtual void flush() {}
+    };
+
+    /**
+     * @brief Buffered sink : messages are written to a file descriptor by
+     * a background thread, either as raw text or as JSON lines
+     * ({"time":..., "level":..., "file":..., "line":..., "message":...}).
+     * When output can't keep up, messages beyond maxPending bytes are dropped
+     * (and counted) instead of blocking callers.
+     * Destroying the current sink restores the default one.
+     */
+    class AsyncLogSink : public LogSink
+    {
+    public:
+	AsyncLogSink(int fd, bool json=false, size_t maxPending=4*1024*1024);
+	~AsyncLogSink();
+
+	virtual void log(GOUROU_LOG_LEVEL level, const char* file, int line, const std::string& message);
+	virtual void flush();
+
+    private:
+	void run();
+	void output(const std::string& data);
+
+	int fd;
+	bool json;
+	size_t maxPending;
+	std::string pending;
+	unsigned long dropped;
+	bool writing;
+	bool stop;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable drained;
+	std::thread worker;
+    };
+
+    /**
+     * @brief Set log sink (not owned by libgourou). 0 restores the
+     * default one, which writes to std::cout.
+     * Returns once previous sink is no more in use : it can then be
+     * destroyed. Must not be called from LogSink::log().
+     */
+    void setLogSink(LogSink* sink);
+
+    /**
+     * @brief Get current log sink
+     */
+    LogSink* getLogSink();
+
+    /**
+     * @brief Send a message to current log sink (use GOUROU_LOG)
+     */
+    void logMessage(GOUROU_LOG_LEVEL level, const char* file, int line, const std::string& message);
+
+    /**
+     * @brief Get level name ("ERROR", "WARN"...)
+     */
+    const char* logLevelName(GOUROU_LOG_LEVEL level);
+
     /**
      * @brief Get current log level
      */
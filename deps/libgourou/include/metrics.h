@@ -0,0 +1,127 @@
+/*
+  Copyright 2021 Grégory Soutadé
+
+  This file is part of libgourou.
+
+  libgourou is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libgourou is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libgourou. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace gourou
+{
+    /**
+     * @brief Time spent in processing phases and counters. Can be updated
+     * by several threads (and several DRMProcessor) at the same time.
+     */
+    class Metrics
+    {
+    public:
+	struct Phase
+	{
+	    double time;          // Seconds spent in phase (cumulated)
+	    unsigned long count;  // Number of times phase has been entered
+	};
+
+	/**
+	 * @brief Add time to a phase
+	 */
+	void addTime(const std::string& phase, double seconds);
+
+	/**
+	 * @brief Increment a counter
+	 */
+	void add(const std::string& counter, uint64_t value=1);
+
+	/**
+	 * @brief Get phases (sorted by name)
+	 */
+	std::map<std::string, Phase> phases();
+
+	/**
+	 * @brief Get counters (sorted by name)
+	 */
+	std::map<std::string, uint64_t> counters();
+
+	/**
+	 * @brief Get a counter value, 0 if not set
+	 */
+	uint64_t counter(const std::string& counter);
+
+	/**
+	 * @brief Remove all phases and counters
+	 */
+	void reset();
+
+	/**
+	 * @brief JSON representation :
+	 * {"phases": {"name": {"time": seconds, "count": N}, ...}, "counters": {"name": N, ...}}
+	 */
+	std::string toJSON();
+
+    private:
+	std::mutex lock;
+	std::map<std::string, Phase> _phases;
+	std::map<std::string, uint64_t> _counters;
+    };
+
+    /**
+     * @brief Add time spent in current scope to a phase.
+     * Nothing is done if metrics is null.
+     */
+    class MetricsSpan
+    {
+    public:
+	MetricsSpan(Metrics* metrics, const char* phase):
+	    metrics(metrics), phase(phase)
+	{
+	    if (metrics)
+		start = std::chrono::steady_clock::now();
+	}
+
+	~MetricsSpan() { stop(); }
+
+	/**
+	 * @brief Record span now instead of at end of scope
+	 */
+	void stop()
+	{
+	    if (metrics)
+		metrics->addTime(phase, elapsed());
+	    metrics = 0;
+	}
+
+	/**
+	 * @brief Seconds since span creation
+	 */
+	double elapsed()
+	{
+	    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+    private:
+	Metrics* metrics;
+	const char* phase;
+	std::chrono::steady_clock::time_point start;
+    };
+}
+
+#endif
@@ -16,7 +16,10 @@
   You should have received a copy of the GNU Lesser General Public License
   along with libgourou. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <new>
 #include <stdexcept>
 
 #include <Base64.h>
@@ -25,8 +28,6 @@
 
 namespace gourou
 {
-    std::map<unsigned char*, int> ByteArray::refCounter;
-    
     ByteArray::ByteArray(bool useMalloc):_useMalloc(useMalloc), _data(0), _length(0)
     {}
 
@@ -57,12 +58,30 @@ namespace gourou
 	initData((unsigned char*)str.c_str(), (unsigned int)str.length());
     }
 
-    void ByteArray::initData(const unsigned char* data, unsigned int length)
+    unsigned char* ByteArray::allocate(unsigned int length, bool useMalloc)
     {
-	if (_useMalloc)
-	    _data = (unsigned char*)malloc(length);
+	unsigned char* buffer;
+
+	if (useMalloc)
+	{
+	    buffer = (unsigned char*)malloc(HEADER_SIZE+length);
+	    if (!buffer)
+		throw std::bad_alloc();
+	}
 	else
-	    _data = new unsigned char[length];
+	    buffer = new unsigned char[HEADER_SIZE+length];
+
+	Header* header = new (buffer) Header;
+	header->refCounter = 0;
+	header->useMalloc = useMalloc;
+	header->capacity = length;
+
+	return buffer + HEADER_SIZE;
+    }
+    
+    void ByteArray::initData(const unsigned char* data, unsigned int length)
+    {
+	_data = allocate(length, _useMalloc);
 
 	if (data)
 	    memcpy((void*)_data, data, length);
@@ -83,6 +102,9 @@ namespace gourou
 
     ByteArray& ByteArray::operator=(const ByteArray& other)
     {
+	if (this == &other)
+	    return *this;
+	
 	delRef();
 	
 	this->_useMalloc = other._useMalloc;
@@ -103,26 +125,27 @@ namespace gourou
     {
 	if (!_data) return;
 
-	if (refCounter.count(_data) == 0)
-	    refCounter[_data] = 1;
-	else
-	    refCounter[_data]++;
+	header()->refCounter.fetch_add(1, std::memory_order_relaxed);
     }
     
     void ByteArray::delRef()
     {
 	if (!_data) return;
+
+	Header* header = this->header();
 	
-	if (refCounter[_data] == 1)
+	if (header->refCounter.fetch_sub(1, std::memory_order_acq_rel) == 1)
 	{
-	    if (_useMalloc)
-		free(_data);
+	    unsigned char* buffer = (unsigned char*)header;
+	    bool useMalloc = header->useMalloc;
+
+	    header->~Header();
+	    
+	    if (useMalloc)
+		free(buffer);
 	    else
-		delete[] _data;
-	    refCounter.erase(_data);
+		delete[] buffer;
 	}
-	else
-	    refCounter[_data]--;
     }
 
     ByteArray ByteArray::fromBase64(const ByteArray& other)
@@ -218,16 +241,78 @@ namespace gourou
 	    return;
 	
 	unsigned int oldLength = _length;
+	unsigned int newLength = _length + length;
+
+	// data may point to our own buffer, keep it alive until copied
+	ByteArray previous;
+	
+	if (!canWriteInPlace(newLength))
+	{
+	    unsigned int newCapacity = capacity();
 
-	resize(_length+length, true);
+	    previous = *this;
+	    
+	    // Amortized growth
+	    if (newCapacity < UINT_MAX/2)
+		newCapacity *= 2;
+	    if (newCapacity < newLength)
+		newCapacity = newLength;
 
-	memcpy(&_data[oldLength], data, length);	
+	    reallocate(newCapacity, true);
+	}
+
+	_length = newLength;
+	memcpy(&_data[oldLength], data, length);
     }
     
     void ByteArray::append(unsigned char c) { append(&c, 1);}
     void ByteArray::append(const char* str) { append((const unsigned char*)str, strlen(str));}
     void ByteArray::append(const std::string& str) { append((const unsigned char*)str.c_str(), str.length()); }
 
+    unsigned int ByteArray::capacity() const
+    {
+	if (!_data)
+	    return 0;
+
+	return header()->capacity;
+    }
+
+    bool ByteArray::canWriteInPlace(unsigned int length) const
+    {
+	if (!_data)
+	    return false;
+
+	Header* header = this->header();
+
+	return length <= header->capacity &&
+	    header->refCounter.load(std::memory_order_acquire) == 1;
+    }
+    
+    void ByteArray::reallocate(unsigned int capacity, bool keepData)
+    {
+	unsigned char* newData = allocate(capacity, _useMalloc);
+
+	if (keepData && _length)
+	    memcpy(newData, _data, _length);
+	
+	delRef();
+
+	_data = newData;
+	
+	addRef();
+    }
+    
+    void ByteArray::reserve(unsigned int capacity)
+    {
+	if (capacity < _length)
+	    capacity = _length;
+
+	if (canWriteInPlace(capacity))
+	    return;
+
+	reallocate(capacity, true);
+    }
+    
     void ByteArray::resize(unsigned length, bool keepData)
     {
 	if (length == _length)
@@ -236,22 +321,10 @@ namespace gourou
 	    _length = length ; // Don't touch data
 	else // New size >
 	{
-	    unsigned char* newData;
-
-	    if (_useMalloc)
-		newData = (unsigned char*)malloc(_length+length);
-	    else
-		newData = new unsigned char[_length+length];
-
-	    if (keepData)
-		memcpy(newData, _data, _length);
-	
-	    delRef();
+	    if (!canWriteInPlace(length))
+		reallocate(length, keepData);
 
 	    _length = length;
-	    _data = newData;
-	
-	    addRef();
 	}
     }
 }
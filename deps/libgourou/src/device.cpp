@@ -30,6 +30,7 @@
 #include <device.h>
 
 #include <string.h>
+#include <mutex>
 #if defined(__linux__) || defined(linux) || defined(__linux)
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -126,15 +127,20 @@ int get_mac_address(unsigned char* mac_address)
 namespace gourou
 {
     Device::Device(DRMProcessor* processor):
-	processor(processor)
+	processor(processor), deviceKeyLoaded(false), deviceFileLoaded(false),
+	createIfInvalid(false), randomSerial(false)
     {}
     
     Device::Device(DRMProcessor* processor, const std::string& deviceFile, const std::string& deviceKeyFile):
-	processor(processor), deviceFile(deviceFile), deviceKeyFile(deviceKeyFile)
-    {
-	parseDeviceKeyFile();
-	parseDeviceFile();
-    }
+	processor(processor), deviceFile(deviceFile), deviceKeyFile(deviceKeyFile),
+	deviceKeyLoaded(false), deviceFileLoaded(false), createIfInvalid(false),
+	randomSerial(false)
+    {}
+
+    /* Machine serial doesn't change during process life, interfaces scan
+       and user lookup are done once for all devices created */
+    static std::mutex machineSerialLock;
+    static std::string machineSerial;
 
     /* SHA1(uid ":" username ":" macaddress ":" */
     std::string Device::makeSerial(bool random)
@@ -144,6 +150,14 @@ namespace gourou
 	
 	if (!random)
 	{
+	    std::lock_guard<std::mutex> guard(machineSerialLock);
+
+	    if (machineSerial.size())
+	    {
+		GOUROU_LOG(DEBUG, "Serial : " << machineSerial << " (cached)");
+		return machineSerial;
+	    }
+
 	    uid_t uid = getuid();
 	    struct passwd * passwd = getpwuid(uid);
 	    // Default mac address in case of failure
@@ -162,11 +176,13 @@ namespace gourou
 	    client->digest("SHA1", dataToHash, dataToHashLen+1, sha_out);
 
 	    delete[] dataToHash;
+
+	    machineSerial = ByteArray((const char*)sha_out, DEVICE_SERIAL_LEN).toHex();
+	    GOUROU_LOG(DEBUG, "Serial : " << machineSerial);
+	    return machineSerial;
 	}
-	else
-	{
-	    client->randBytes(sha_out, sizeof(sha_out));
-	}
+
+	client->randBytes(sha_out, sizeof(sha_out));
 
 	std::string res = ByteArray((const char*)sha_out, DEVICE_SERIAL_LEN).toHex();
 	GOUROU_LOG(DEBUG, "Serial : " << res);
@@ -179,6 +195,8 @@ namespace gourou
 	DRMProcessorClient* client = processor->getClient();
 	unsigned char sha_out[SHA1_LEN];
 
+	loadDeviceKeyFile();
+
 	void* handler = client->createDigest("SHA1");
 	client->digestUpdate(handler, (unsigned char*) serial.c_str(), serial.length());
 	client->digestUpdate(handler, deviceKey, sizeof(deviceKey));
@@ -230,6 +248,18 @@ namespace gourou
 	GOUROU_LOG(DEBUG, "Create device file " << deviceFile);
 
 	writeFile(deviceFile, xmlWriter.getResult());
+
+	/* No need to read it back */
+	properties.clear();
+	properties["deviceClass"]  = "Desktop";
+	properties["deviceSerial"] = serial;
+	properties["deviceName"]   = sysname.nodename;
+	properties["deviceType"]   = "standalone";
+	properties["fingerprint"]  = fingerprint;
+	properties["hobbes"]       = hobbes;
+	properties["clientOS"]     = os;
+	properties["clientLocale"] = setlocale(LC_ALL, NULL);
+	deviceFileLoaded = true;
     }
 
     void Device::createDeviceKeyFile()
@@ -241,6 +271,9 @@ namespace gourou
 	processor->getClient()->randBytes(key, sizeof(key));
 
 	writeFile(deviceKeyFile, key, sizeof(key));
+
+	memcpy(deviceKey, key, sizeof(key));
+	deviceKeyLoaded = true;
     }
     
     Device* Device::createDevice(DRMProcessor* processor, const std::string& dirName, const std::string& hobbes, bool randomSerial)
@@ -257,7 +290,11 @@ namespace gourou
 
 	device->deviceFile = dirName + "/device.xml";
 	device->deviceKeyFile = dirName + "/devicesalt";
+	device->hobbes = hobbes;
+	device->randomSerial = randomSerial;
+	device->createIfInvalid = true;
 
+	/* devicesalt is small, read it now to re-create it if unreadable */
 	try
 	{
 	    device->parseDeviceKeyFile();
@@ -265,27 +302,54 @@ namespace gourou
 	catch (...)
 	{
 	    device->createDeviceKeyFile();
-	    device->parseDeviceKeyFile();
 	}
 
-	try
-	{
-	    device->parseDeviceFile();
-	}
-	catch (...)
-	{
+	/* Only check presence of device.xml, it's parsed when first needed */
+	if (stat(device->deviceFile.c_str(), &_stat) != 0 ||
+	    _stat.st_size == 0)
 	    device->createDeviceFile(hobbes, randomSerial);
-	    device->parseDeviceFile();
-	}
 	
 	return device;
     }
     
     const unsigned char* Device::getDeviceKey()
     {
+	loadDeviceKeyFile();
 	return deviceKey;
     }
 
+    /* call_once() is retried if function throws */
+    void Device::loadDeviceKeyFile()
+    {
+	std::call_once(deviceKeyOnce, [this]()
+	{
+	    if (!deviceKeyLoaded)
+		parseDeviceKeyFile();
+	});
+    }
+
+    void Device::loadDeviceFile()
+    {
+	std::call_once(deviceFileOnce, [this]()
+	{
+	    if (deviceFileLoaded)
+		return;
+
+	    try
+	    {
+		parseDeviceFile();
+	    }
+	    catch (gourou::Exception& e)
+	    {
+		if (!createIfInvalid)
+		    throw;
+
+		GOUROU_LOG(WARN, "Invalid device file " << deviceFile << ", create a new one");
+		createDeviceFile(hobbes, randomSerial);
+	    }
+	});
+    }
+
     void Device::parseDeviceFile()
     {
 	pugi::xml_document doc;
@@ -293,6 +357,8 @@ namespace gourou
 	if (!doc.load_file(deviceFile.c_str()))
 	    EXCEPTION(DEV_INVALID_DEVICE_FILE, "Invalid device file");
 
+	properties.clear();
+
 	try
 	{
 	    properties["deviceClass"]  = gourou::extractTextElem(doc, "/adept:deviceInfo/adept:deviceClass");
@@ -312,6 +378,8 @@ namespace gourou
 
 		properties[name.value()] = value.value();
 	    }
+
+	    deviceFileLoaded = true;
 	}
 	catch (gourou::Exception& e)
 	{
@@ -327,6 +395,7 @@ namespace gourou
 	    _stat.st_size == DEVICE_KEY_SIZE)
 	{
 	    readFile(deviceKeyFile, deviceKey, sizeof(deviceKey));
+	    deviceKeyLoaded = true;
 	}
 	else
 	    EXCEPTION(DEV_INVALID_DEVICE_KEY_FILE, "Invalid device key file");
@@ -334,6 +403,8 @@ namespace gourou
 
     std::string Device::getProperty(const std::string& property, const std::string& _default)
     {
+	loadDeviceFile();
+
 	if (properties.find(property) == properties.end())
 	{
 	    if (_default == "")
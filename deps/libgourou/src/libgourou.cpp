@@ -18,8 +18,18 @@
 */
 
 #include <arpa/inet.h>
+#include <sys/file.h>
 #include <sys/time.h>
 #include <time.h>
+#include <limits.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <uPDFParser.h>
@@ -39,10 +49,191 @@
 
 namespace gourou
 {
-    GOUROU_LOG_LEVEL logLevel = LG_LOG_WARN;
     const std::string DRMProcessor::VERSION = LIBGOUROU_VERSION;
+
+    void* ZIPInterface::zipOpen(ByteArray&)
+    {
+	EXCEPTION(CLIENT_ZIP_ERROR, "In memory zip files are not supported by this client");
+    }
+
+    void ZIPInterface::zipWriteFile(void* handler, const std::string& path, ByteArray& content, bool)
+    {
+	zipWriteFile(handler, path, content);
+    }
+
+    void ZIPInterface::inflate(ByteArray& data, ByteArray& result, int wbits, unsigned int)
+    {
+	inflate(data, result, wbits);
+    }
+
+    unsigned int ZIPInterface::inflate(const unsigned char* data, unsigned int dataLength,
+				       unsigned char* result, unsigned int resultLength, int wbits)
+    {
+	ByteArray in(data, dataLength);
+	ByteArray out;
+
+	inflate(in, out, wbits);
+
+	if (out.length() > resultLength)
+	    EXCEPTION(CLIENT_ZIP_ERROR, "Inflate error, output buffer too small (" << out.length() << " > " << resultLength << ")");
+
+	memcpy(result, out.data(), out.length());
+
+	return out.length();
+    }
+
+    void HTTPInterface::downloadHTTPRequest(const std::string& URL, HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders)
+    {
+	std::string reply = sendHTTPRequest(URL, "", "", responseHeaders);
+
+	sink.expectedSize(reply.size());
+	sink.write((const unsigned char*)reply.data(), reply.size());
+    }
     
-    DRMProcessor::DRMProcessor(DRMProcessorClient* client):client(client), device(0), user(0)
+    /**
+     * @brief Threads kept by a processor to run its jobs in parallel
+     * (see runParallel()), instead of starting new ones for each batch.
+     * Jobs of a single run are dispatched at once : if pool is already
+     * running jobs (nested or concurrent call), caller runs its jobs itself.
+     */
+    class DRMProcessor::WorkerPool
+    {
+    public:
+	WorkerPool(unsigned nbWorkers):
+	    job(0), nbJobs(0), nextJob(0), helpers(0), active(0), generation(0), stopped(false)
+	{
+	    try
+	    {
+		for (unsigned i=0; i<nbWorkers; i++)
+		    threads.push_back(std::thread(&WorkerPool::work, this));
+	    }
+	    catch(...)
+	    {
+		// Started threads must be joined before being destroyed
+		stop();
+		throw;
+	    }
+	}
+
+	~WorkerPool() { stop(); }
+
+	unsigned size() { return threads.size(); }
+
+	/**
+	 * @brief Run jobs on calling thread and at most nbHelpers workers
+	 */
+	void run(size_t nbJobs, const std::function<void(size_t)>& job, unsigned nbHelpers)
+	{
+	    std::unique_lock<std::mutex> busy(runLock, std::try_to_lock);
+
+	    if (!busy.owns_lock())
+	    {
+		for (size_t i=0; i<nbJobs; i++)
+		    job(i);
+		return;
+	    }
+
+	    {
+		std::lock_guard<std::mutex> guard(lock);
+		this->job = &job;
+		this->nbJobs = nbJobs;
+		nextJob = 0;
+		helpers = nbHelpers;
+		error = std::exception_ptr();
+		generation++;
+	    }
+	    wakeUp.notify_all();
+
+	    runJobs();
+
+	    std::exception_ptr jobError;
+	    {
+		// Late workers must not join this run anymore
+		std::unique_lock<std::mutex> guard(lock);
+		helpers = 0;
+		finished.wait(guard, [this] { return active == 0; });
+		this->job = 0;
+		jobError = error;
+	    }
+
+	    if (jobError)
+		std::rethrow_exception(jobError);
+	}
+
+    private:
+	void work()
+	{
+	    uint64_t lastGeneration = 0;
+	    std::unique_lock<std::mutex> guard(lock);
+
+	    while (true)
+	    {
+		wakeUp.wait(guard, [&] { return stopped || (generation != lastGeneration && helpers > 0); });
+		if (stopped)
+		    return;
+
+		lastGeneration = generation;
+		helpers--;
+		active++;
+
+		guard.unlock();
+		runJobs();
+		guard.lock();
+
+		if (--active == 0)
+		    finished.notify_all();
+	    }
+	}
+
+	void runJobs()
+	{
+	    size_t cur;
+
+	    while ((cur = nextJob++) < nbJobs)
+	    {
+		try
+		{
+		    (*job)(cur);
+		}
+		catch(...)
+		{
+		    std::lock_guard<std::mutex> guard(lock);
+		    if (!error)
+			error = std::current_exception();
+		    nextJob = nbJobs;
+		}
+	    }
+	}
+
+	void stop()
+	{
+	    {
+		std::lock_guard<std::mutex> guard(lock);
+		stopped = true;
+	    }
+	    wakeUp.notify_all();
+
+	    for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+	    threads.clear();
+	}
+
+	const std::function<void(size_t)>* job;
+	size_t nbJobs;
+	std::atomic<size_t> nextJob;
+	unsigned helpers, active;
+	uint64_t generation;
+	bool stopped;
+	std::exception_ptr error;
+	std::mutex lock, runLock;
+	std::condition_variable wakeUp, finished;
+	std::vector<std::thread> threads;
+    };
+
+    DRMProcessor::DRMProcessor(DRMProcessorClient* client):client(client), device(0), user(0),
+							   pdfStreamingMode(false), decryptionThreads(1), workerPool(0),
+							   storeCompressedResources(false), bookKeyCacheSize(0),
+							   pkcs12KeyHandler(0), licenseKeyHandler(0), metrics(0)
     {
 	if (!client)
 	    EXCEPTION(GOUROU_INVALID_CLIENT, "DRMProcessorClient is NULL");
@@ -51,7 +242,9 @@ namespace gourou
     DRMProcessor::DRMProcessor(DRMProcessorClient* client,
 			       const std::string& deviceFile, const std::string& activationFile,
 			       const std::string& deviceKeyFile):
-	client(client), device(0), user(0)
+	client(client), device(0), user(0), pdfStreamingMode(false),
+	decryptionThreads(1), workerPool(0), storeCompressedResources(false), bookKeyCacheSize(0),
+	pkcs12KeyHandler(0), licenseKeyHandler(0), metrics(0)
     {
 	if (!client)
 	    EXCEPTION(GOUROU_INVALID_CLIENT, "DRMProcessorClient is NULL");
@@ -66,8 +259,11 @@ namespace gourou
 
     DRMProcessor::~DRMProcessor()
     {
+	if (pkcs12KeyHandler) client->freeRSAPrivateKey(pkcs12KeyHandler);
+	if (licenseKeyHandler) client->freeRSAPrivateKey(licenseKeyHandler);
 	if (device) delete device;
 	if (user) delete user;
+	delete workerPool;
     }
 
     DRMProcessor* DRMProcessor::createDRMProcessor(DRMProcessorClient* client, bool randomSerial, std::string dirName,
@@ -92,38 +288,30 @@ namespace gourou
     {
 	int length = string.length();
 	uint16_t nlength = htons(length);
-	char c;
 
-	if (logLevel >= LG_LOG_TRACE)
-	    printf("%02x %02x ", ((uint8_t*)&nlength)[0], ((uint8_t*)&nlength)[1]);
-	
 	client->digestUpdate(sha_ctx, (unsigned char*)&nlength, sizeof(nlength));
+	if (length)
+	    client->digestUpdate(sha_ctx, (unsigned char*)string.data(), length);
 
-	for(int i=0; i<length; i++)
-	{
-	    c = string[i];
-	    client->digestUpdate(sha_ctx, (unsigned char*)&c, 1);
-	    if (logLevel >= LG_LOG_TRACE)
-		printf("%c", c);
-	}
-	if (logLevel >= LG_LOG_TRACE)
-	    printf("\n");
+	GOUROU_LOG(TRACE, ByteArray((const unsigned char*)&nlength, sizeof(nlength)).toHex() << " " << string);
     }
 
     void DRMProcessor::pushTag(void* sha_ctx, uint8_t tag)
     {
 	client->digestUpdate(sha_ctx, &tag, sizeof(tag));
-	if (logLevel >= LG_LOG_TRACE)
-	    printf("%02x ", tag);
+	GOUROU_LOG(TRACE, ByteArray(&tag, sizeof(tag)).toHex());
     }
 
-    void DRMProcessor::hashNode(const pugi::xml_node& root, void *sha_ctx, std::map<std::string,std::string> nsHash)
+    void DRMProcessor::hashNode(const pugi::xml_node& root, void *sha_ctx, std::map<std::string,std::string>& nsHash)
     {
 	switch(root.type())
 	{
 	case pugi::node_element:
 	{
 	    std::string name = root.name();
+	    // Namespaces overridden by this node, restored once its children are hashed
+	    std::vector<std::pair<std::string, std::string> > previousNS;
+	    std::vector<std::string> newNS;
 
 	    // Look for "xmlns[:]" attribute
 	    for (pugi::xml_attribute_iterator ait = root.attributes_begin();
@@ -138,6 +326,12 @@ namespace gourou
 		    if (attrName.find(':') != std::string::npos)
 			ns = attrName.substr(attrName.find(':')+1);
 
+		    std::map<std::string,std::string>::iterator nsIt = nsHash.find(ns);
+		    if (nsIt == nsHash.end())
+			newNS.push_back(ns);
+		    else
+			previousNS.push_back(*nsIt);
+
 		    nsHash[ns] = ait->value();
 		    // Don't break here because we may multiple xmlns definitions
 		    // break;
@@ -150,9 +344,10 @@ namespace gourou
 	    {
 		size_t nsIndex = name.find(':');
 		std::string nodeNS = name.substr(0, nsIndex);
+		std::map<std::string,std::string>::iterator nsIt = nsHash.find(nodeNS);
 
 		pushTag(sha_ctx, ASN_NS_TAG);
-		pushString(sha_ctx, nsHash[nodeNS]);
+		pushString(sha_ctx, (nsIt != nsHash.end())?nsIt->second:std::string());
 		
 		name = name.substr(nsIndex+1);
 	    }
@@ -200,6 +395,11 @@ namespace gourou
 		hashNode(child, sha_ctx, nsHash);
 
 	    pushTag(sha_ctx, ASN_END_TAG);
+
+	    for (size_t i=0; i<newNS.size(); i++)
+		nsHash.erase(newNS[i]);
+	    for (size_t i=0; i<previousNS.size(); i++)
+		nsHash[previousNS[i].first] = previousNS[i].second;
 	    
 	    break;
 	}
@@ -234,6 +434,49 @@ namespace gourou
 	dumpBuffer(gourou::LG_LOG_DEBUG, "\nSHA OUT : ", sha_out, SHA1_LEN);
     }
 
+    /*
+     * User keys are decoded once and kept while activation doesn't
+     * change (PKCS12 decoding is expensive)
+     */
+    void* DRMProcessor::getPKCS12Key()
+    {
+	std::string& pkcs12 = user->getPKCS12();
+
+	if (!pkcs12KeyHandler || pkcs12 != pkcs12KeySource)
+	{
+	    ByteArray deviceKey(device->getDeviceKey(), Device::DEVICE_KEY_SIZE);
+	    ByteArray privateRSAKey = ByteArray::fromBase64(pkcs12);
+
+	    void* handler = client->loadRSAPrivateKey(privateRSAKey.data(), privateRSAKey.length(),
+						      RSAInterface::RSA_KEY_PKCS12, deviceKey.toBase64().data());
+	    if (pkcs12KeyHandler)
+		client->freeRSAPrivateKey(pkcs12KeyHandler);
+	    pkcs12KeyHandler = handler;
+	    pkcs12KeySource = pkcs12;
+	}
+
+	return pkcs12KeyHandler;
+    }
+
+    void* DRMProcessor::getLicenseKey()
+    {
+	std::string& privateKeyData = user->getPrivateLicenseKey();
+
+	if (!licenseKeyHandler || privateKeyData != licenseKeySource)
+	{
+	    ByteArray privateRSAKey = ByteArray::fromBase64(privateKeyData);
+
+	    void* handler = client->loadRSAPrivateKey(privateRSAKey.data(), privateRSAKey.length(),
+						      RSAInterface::RSA_KEY_PKCS8, "");
+	    if (licenseKeyHandler)
+		client->freeRSAPrivateKey(licenseKeyHandler);
+	    licenseKeyHandler = handler;
+	    licenseKeySource = privateKeyData;
+	}
+
+	return licenseKeyHandler;
+    }
+
     void DRMProcessor::signNode(pugi::xml_node& rootNode)
     {
 	// Compute hash
@@ -243,13 +486,8 @@ namespace gourou
 	    
 	// Sign with private key
 	unsigned char res[RSA_KEY_SIZE];
-	ByteArray deviceKey(device->getDeviceKey(), Device::DEVICE_KEY_SIZE);
-	std::string pkcs12 = user->getPKCS12();
-	ByteArray privateRSAKey = ByteArray::fromBase64(pkcs12);
 	
-	client->RSAPrivateEncrypt(privateRSAKey.data(), privateRSAKey.length(),
-				  RSAInterface::RSA_KEY_PKCS12, deviceKey.toBase64().data(),
-				  sha_out, sizeof(sha_out), res);
+	client->RSAPrivateEncrypt(getPKCS12Key(), sha_out, sizeof(sha_out), res);
 	
 	dumpBuffer(gourou::LG_LOG_DEBUG, "Sig : ", res, sizeof(res));
 
@@ -499,6 +737,31 @@ namespace gourou
 	if (!acsmDoc.load_file(ACSMFile.c_str(), pugi::parse_ws_pcdata_single|pugi::parse_escapes, pugi::encoding_utf8))
 	    EXCEPTION(FF_INVALID_ACSM_FILE, "Invalid ACSM file " << ACSMFile);
 
+	GOUROU_LOG(INFO, "Fulfill " << ACSMFile);
+
+	return fulfillDocument(acsmDoc, notify);
+    }
+
+    FulfillmentItem* DRMProcessor::fulfill(const ByteArray& ACSMContent, bool notify)
+    {
+	if (!user->getPKCS12().length())
+	    EXCEPTION(FF_NOT_ACTIVATED, "Device not activated");
+	
+	pugi::xml_document acsmDoc;
+	ByteArray content(ACSMContent);
+
+	if (!acsmDoc.load_buffer(content.data(), content.length(), pugi::parse_ws_pcdata_single|pugi::parse_escapes, pugi::encoding_utf8))
+	    EXCEPTION(FF_INVALID_ACSM_FILE, "Invalid ACSM content");
+
+	GOUROU_LOG(INFO, "Fulfill ACSM from memory");
+
+	return fulfillDocument(acsmDoc, notify);
+    }
+
+    FulfillmentItem* DRMProcessor::fulfillDocument(pugi::xml_document& acsmDoc, bool notify)
+    {
+	MetricsSpan span(metrics, "fulfill");
+
 	// Could be an server internal error
 	pugi::xml_node rootNode = acsmDoc.first_child();
 	if (std::string(rootNode.name()) == "error")
@@ -506,8 +769,6 @@ namespace gourou
 	    EXCEPTION(FF_SERVER_INTERNAL_ERROR, rootNode.attribute("data").value());
 	}
 
-	GOUROU_LOG(INFO, "Fulfill " << ACSMFile);
-
 	// Build req file
 	pugi::xml_document fulfillReq;
 
@@ -582,6 +843,42 @@ namespace gourou
 	return item;
     }
 
+    static bool isEBXHandler(uPDFParser::Object* object)
+    {
+	return object->hasKey(uPDFParser::NAME_FILTER) && (*object)[uPDFParser::NAME_FILTER]->str() == "/EBX_HANDLER";
+    }
+
+    /**
+     * @brief Find EBX_HANDLER object : use trailer's Encrypt reference
+     * (indexed lookup), else last parsed object with EBX_HANDLER filter
+     */
+    static uPDFParser::Object* findEBXHandler(uPDFParser::Parser& parser)
+    {
+	uPDFParser::Object& trailer = parser.getTrailer();
+
+	if (trailer.hasKey(uPDFParser::NAME_ENCRYPT) &&
+	    trailer[uPDFParser::NAME_ENCRYPT]->type() == uPDFParser::DataType::REFERENCE)
+	{
+	    uPDFParser::Reference* encrypt = (uPDFParser::Reference*)trailer[uPDFParser::NAME_ENCRYPT];
+	    uPDFParser::Object* object = parser.getObject(encrypt->objectId(),
+							  encrypt->generationNumber());
+
+	    if (object && isEBXHandler(object))
+		return object;
+	}
+
+	std::vector<uPDFParser::Object*>& objects = parser.objects();
+	std::vector<uPDFParser::Object*>::reverse_iterator it;
+
+	for(it = objects.rbegin(); it != objects.rend(); it++)
+	{
+	    if (isEBXHandler(*it))
+		return *it;
+	}
+
+	return 0;
+    }
+
     DRMProcessor::ITEM_TYPE DRMProcessor::download(FulfillmentItem* item, std::string path, bool resume)
     {
 	ITEM_TYPE res = EPUB;
@@ -593,7 +890,13 @@ namespace gourou
 
 	int fd = createNewFile(path, !resume);
 	
-	sendRequest(item->getDownloadURL(), "", 0, &headers, fd, resume);
+	{
+	    MetricsSpan span(metrics, "download");
+	    sendRequest(item->getDownloadURL(), "", 0, &headers, fd, resume);
+	}
+
+	if (metrics)
+	    metrics->add("download.bytes", lseek(fd, 0, SEEK_END));
 
 	close(fd);
 
@@ -601,15 +904,11 @@ namespace gourou
 
 	ByteArray rightsStr(item->getRights());
 
-	if (item->getMetadata("format").find("application/pdf") != std::string::npos)
-	    res = PDF;
-
-	if (headers.count("Content-Type") &&
-	    headers["Content-Type"].find("application/pdf") != std::string::npos)
-	    res = PDF;
+	res = getItemType(item, headers);
 	    
 	if (res == EPUB)
 	{
+	    MetricsSpan span(metrics, "epub.zip");
 	    void* handler = client->zipOpen(path);
 	    client->zipWriteFile(handler, "META-INF/rights.xml", rightsStr);
 	    client->zipClose(handler);
@@ -617,12 +916,13 @@ namespace gourou
 	else if (res == PDF)
 	{
 	    uPDFParser::Parser parser;
-	    bool EBXHandlerFound = false;
 	    
 	    try
 	    {
+		// Only trailer and EBX handler are needed to append rights
 		GOUROU_LOG(DEBUG, "Parse PDF");
-		parser.parse(path);
+		MetricsSpan span(metrics, "pdf.parse");
+		parser.parseLazy(path);
 	    }
 	    catch(std::invalid_argument& e)
 	    {
@@ -630,129 +930,313 @@ namespace gourou
 		return res;
 	    }
 
-	    std::vector<uPDFParser::Object*> objects = parser.objects();
-	    std::vector<uPDFParser::Object*>::reverse_iterator it;
-
-	    for(it = objects.rbegin(); it != objects.rend(); it++)
-	    {
-		// Update EBX_HANDLER with rights
-		if ((*it)->hasKey("Filter") && (**it)["Filter"]->str() == "/EBX_HANDLER")
-		{
-		    EBXHandlerFound = true;
-		    uPDFParser::Object* ebx = (*it)->clone();
-		    (*ebx)["ADEPT_ID"] = new uPDFParser::String(item->getResource());
-		    (*ebx)["EBX_BOOKID"] = new uPDFParser::String(item->getResource());
-		    ByteArray zipped;
-		    client->deflate(rightsStr, zipped);
-		    (*ebx)["ADEPT_LICENSE"] = new uPDFParser::String(zipped.toBase64());
-		    parser.addObject(ebx);
-		    break;
-		}
-	    }
+	    addPDFRights(item, parser);
 
-	    if (EBXHandlerFound)
-		parser.write(path, true);
-	    else
-	    {
-		EXCEPTION(DW_NO_EBX_HANDLER, "EBX_HANDLER not found");
-	    }
+	    MetricsSpan span(metrics, "pdf.write");
+	    parser.write(path, true);
 	}
 
 	return res;
     }
 
-    void DRMProcessor::buildSignInRequest(pugi::xml_document& signInRequest,
-					  const std::string& adobeID, const std::string& adobePassword,
-					  const std::string& authenticationCertificate)
+    /**
+     * @brief PDF writer appending into a ByteArray
+     */
+    class ByteArrayPDFWriter : public uPDFParser::Writer
     {
-	pugi::xml_node decl = signInRequest.append_child(pugi::node_declaration);
-	decl.append_attribute("version") = "1.0";
-	pugi::xml_node signIn = signInRequest.append_child("adept:signIn");
-	signIn.append_attribute("xmlns:adept") = ADOBE_ADEPT_NS;
-	std::string loginMethod = user->getLoginMethod();
+    public:
+	ByteArrayPDFWriter(ByteArray& output): output(output) {}
 
-	if (adobeID == "anonymous")
-	    signIn.append_attribute("method") = "anonymous";
-	else if (loginMethod.size())
-	    signIn.append_attribute("method") = loginMethod.c_str();
-	else
-	    signIn.append_attribute("method") = "AdobeID";
+	virtual void write(const char* buffer, size_t size)
+	{
+	    output.append((const unsigned char*)buffer, (unsigned int)size);
+	}
 
-	unsigned char encryptedSignInData[RSA_KEY_SIZE];
-	const unsigned char* deviceKey = device->getDeviceKey();
+    private:
+	ByteArray& output;
+    };
 
-	ByteArray _authenticationCertificate = ByteArray::fromBase64(authenticationCertificate);
+    /**
+     * @brief HTTP response sink appending into a ByteArray, allocated once
+     * when body size is known
+     */
+    class ByteArrayHTTPSink : public HTTPResponseSink
+    {
+    public:
+	ByteArrayHTTPSink(ByteArray& output): output(output) {}
 
-	// Build buffer <deviceKey> <len username> <username> <len password> <password>
-	ByteArray ar(deviceKey, Device::DEVICE_KEY_SIZE);
-	ar.append((unsigned char)adobeID.length());
-	ar.append(adobeID);
-	ar.append((unsigned char)adobePassword.length());
-	ar.append(adobePassword);
+	virtual void expectedSize(uint64_t size)
+	{
+	    if (output.length() + size < UINT_MAX)
+		output.reserve(output.length() + (unsigned int)size);
+	}
 
-	// Encrypt with authentication certificate (public part)
-	client->RSAPublicEncrypt(_authenticationCertificate.data(),
-				 _authenticationCertificate.length(),
-				 RSAInterface::RSA_KEY_X509,
-				 ar.data(), ar.length(), encryptedSignInData);
+	virtual void write(const unsigned char* data, unsigned int length)
+	{
+	    output.append(data, length);
+	}
 
-	ar = ByteArray(encryptedSignInData, sizeof(encryptedSignInData));
-	appendTextElem(signIn, "adept:signInData", ar.toBase64());
+    private:
+	ByteArray& output;
+    };
+
+    DRMProcessor::ITEM_TYPE DRMProcessor::download(FulfillmentItem* item, ByteArray& content)
+    {
+	ITEM_TYPE res = EPUB;
 	
-	// Generate Auth key and License Key
-	void* rsaAuth = client->generateRSAKey(RSA_KEY_SIZE_BITS);
-	void* rsaLicense = client->generateRSAKey(RSA_KEY_SIZE_BITS);
+	if (!item)
+	    EXCEPTION(DW_NO_ITEM, "No item");
 
-	std::string serializedData = serializeRSAPublicKey(rsaAuth);
-	appendTextElem(signIn, "adept:publicAuthKey", serializedData);
-	serializedData = serializeRSAPrivateKey(rsaAuth);
-	appendTextElem(signIn, "adept:encryptedPrivateAuthKey", serializedData.data());
+	std::map<std::string, std::string> headers;
 
-	serializedData = serializeRSAPublicKey(rsaLicense);
-	appendTextElem(signIn, "adept:publicLicenseKey", serializedData.data());
-	serializedData = serializeRSAPrivateKey(rsaLicense);
-	appendTextElem(signIn, "adept:encryptedPrivateLicenseKey", serializedData.data());
+	{
+	    MetricsSpan span(metrics, "download");
+	    // Not an ADEPT XML reply, don't go through sendRequest()
+	    content = ByteArray(true);
+	    ByteArrayHTTPSink sink(content);
+	    client->downloadHTTPRequest(item->getDownloadURL(), sink, &headers);
+	}
 
-	client->destroyRSAHandler(rsaAuth);
-	client->destroyRSAHandler(rsaLicense);
-    }
-    
-    void DRMProcessor::signIn(const std::string& adobeID, const std::string& adobePassword)
-    {
-	pugi::xml_document signInRequest;
-	std::string authenticationCertificate = user->getAuthenticationCertificate();
-	
-	buildSignInRequest(signInRequest, adobeID, adobePassword, authenticationCertificate);
+	if (metrics)
+	    metrics->add("download.bytes", content.length());
 
-	GOUROU_LOG(INFO, "SignIn " << adobeID);
-	
-	std::string signInURL = user->getProperty("//adept:authURL");
-	signInURL += "/SignInDirect";
+	GOUROU_LOG(INFO, "Download into memory (" << content.length() << " bytes)");
 
-	ByteArray credentials = sendRequest(signInRequest, signInURL);
-	
-	pugi::xml_document credentialsDoc;
-	if (!credentialsDoc.load_buffer(credentials.data(), credentials.length()))
-	    EXCEPTION(SIGN_INVALID_CREDENTIALS, "Invalid credentials reply");
+	ByteArray rightsStr(item->getRights());
 
-	struct adeptWalker: pugi::xml_tree_walker
+	res = getItemType(item, headers);
+	    
+	if (res == EPUB)
 	{
-	    void changeName(pugi::xml_node& node)
-	    {
-		std::string name = std::string("adept:") + node.name();
-		node.set_name(name.c_str());
-	    }
+	    MetricsSpan span(metrics, "epub.zip");
+	    void* handler = client->zipOpen(content);
+	    client->zipWriteFile(handler, "META-INF/rights.xml", rightsStr);
+	    client->zipClose(handler);
+	}
+	else if (res == PDF)
+	{
+	    // Rights are added by an update : input is only borrowed, kept alive by original
+	    ByteArray original(content);
+	    uPDFParser::Parser parser;
 	    
-	    bool begin(pugi::xml_node& node)
+	    try
 	    {
-		changeName(node);
-		return true;
+		GOUROU_LOG(DEBUG, "Parse PDF");
+		MetricsSpan span(metrics, "pdf.parse");
+		parser.parseLazy(original.data(), original.length(), false);
 	    }
-	    
-	    virtual bool for_each(pugi::xml_node& node)
+	    catch(std::invalid_argument& e)
 	    {
-		if (node.type() == pugi::node_element)
-		    changeName(node);
+		GOUROU_LOG(ERROR, "Invalid PDF");
+		return res;
+	    }
+
+	    addPDFRights(item, parser);
+
+	    MetricsSpan span(metrics, "pdf.write");
+	    ByteArray updated(true);
+	    updated.reserve(content.length() + rightsStr.length());
+	    ByteArrayPDFWriter writer(updated);
+	    parser.write(writer, true);
+	    content = updated;
+	}
+
+	return res;
+    }
+
+    /**
+     * @brief Update EBX_HANDLER with item rights (new object appended to parser)
+     */
+    void DRMProcessor::addPDFRights(FulfillmentItem* item, uPDFParser::Parser& parser)
+    {
+	uPDFParser::Object* ebxHandler = findEBXHandler(parser);
+
+	if (!ebxHandler)
+	{
+	    EXCEPTION(DW_NO_EBX_HANDLER, "EBX_HANDLER not found");
+	}
+
+	ByteArray rightsStr(item->getRights());
+	uPDFParser::Object* ebx = ebxHandler->clone();
+	(*ebx)["ADEPT_ID"] = new uPDFParser::String(item->getResource());
+	(*ebx)["EBX_BOOKID"] = new uPDFParser::String(item->getResource());
+	ByteArray zipped;
+	client->deflate(rightsStr, zipped);
+	(*ebx)["ADEPT_LICENSE"] = new uPDFParser::String(zipped.toBase64());
+	parser.addObject(ebx);
+    }
+
+    DRMProcessor::ITEM_TYPE DRMProcessor::getItemType(FulfillmentItem* item, std::map<std::string, std::string>& headers)
+    {
+	if (item->getMetadata("format").find("application/pdf") != std::string::npos)
+	    return PDF;
+
+	if (headers.count("Content-Type") &&
+	    headers["Content-Type"].find("application/pdf") != std::string::npos)
+	    return PDF;
+
+	return EPUB;
+    }
+
+    void DRMProcessor::decryptItemKey(FulfillmentItem* item, unsigned char* decryptedKey)
+    {
+	if (!item)
+	    EXCEPTION(DW_NO_ITEM, "No item");
+
+	pugi::xml_document rightsDoc;
+	std::string rights = item->getRights();
+
+	if (!rightsDoc.load_string(rights.c_str()))
+	    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "Invalid rights");
+
+	decryptADEPTKey(rightsDoc, decryptedKey);
+    }
+
+    DRMProcessor::ITEM_TYPE DRMProcessor::downloadAndRemoveDRM(FulfillmentItem* item, const std::string& path,
+							       const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (!item)
+	    EXCEPTION(DW_NO_ITEM, "No item");
+
+	unsigned char decryptedKey[16];
+
+	// Fail before creating output if key cannot be retrieved
+	if (!encryptionKey)
+	{
+	    decryptItemKey(item, decryptedKey);
+	    encryptionKey = decryptedKey;
+	    encryptionKeySize = sizeof(decryptedKey);
+	}
+
+	ITEM_TYPE res;
+	int fd = createNewFile(path);
+
+	try
+	{
+	    uPDFParser::FdWriter writer(fd);
+	    res = downloadAndRemoveDRM(item, writer, encryptionKey, encryptionKeySize);
+	}
+	catch (...)
+	{
+	    close(fd);
+	    unlink(path.c_str());
+	    throw;
+	}
+
+	close(fd);
+
+	GOUROU_LOG(INFO, "Download into " << path);
+
+	return res;
+    }
+
+    DRMProcessor::ITEM_TYPE DRMProcessor::downloadAndRemoveDRM(FulfillmentItem* item, ByteArray& content,
+							       const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	ByteArray result(true);
+	ByteArrayPDFWriter writer(result);
+
+	ITEM_TYPE res = downloadAndRemoveDRM(item, writer, encryptionKey, encryptionKeySize);
+	content = result;
+
+	GOUROU_LOG(INFO, "Download into memory (" << content.length() << " bytes)");
+
+	return res;
+    }
+
+    void DRMProcessor::buildSignInRequest(pugi::xml_document& signInRequest,
+					  const std::string& adobeID, const std::string& adobePassword,
+					  const std::string& authenticationCertificate)
+    {
+	pugi::xml_node decl = signInRequest.append_child(pugi::node_declaration);
+	decl.append_attribute("version") = "1.0";
+	pugi::xml_node signIn = signInRequest.append_child("adept:signIn");
+	signIn.append_attribute("xmlns:adept") = ADOBE_ADEPT_NS;
+	std::string loginMethod = user->getLoginMethod();
+
+	if (adobeID == "anonymous")
+	    signIn.append_attribute("method") = "anonymous";
+	else if (loginMethod.size())
+	    signIn.append_attribute("method") = loginMethod.c_str();
+	else
+	    signIn.append_attribute("method") = "AdobeID";
+
+	unsigned char encryptedSignInData[RSA_KEY_SIZE];
+	const unsigned char* deviceKey = device->getDeviceKey();
+
+	ByteArray _authenticationCertificate = ByteArray::fromBase64(authenticationCertificate);
+
+	// Build buffer <deviceKey> <len username> <username> <len password> <password>
+	ByteArray ar(deviceKey, Device::DEVICE_KEY_SIZE);
+	ar.append((unsigned char)adobeID.length());
+	ar.append(adobeID);
+	ar.append((unsigned char)adobePassword.length());
+	ar.append(adobePassword);
+
+	// Encrypt with authentication certificate (public part)
+	client->RSAPublicEncrypt(_authenticationCertificate.data(),
+				 _authenticationCertificate.length(),
+				 RSAInterface::RSA_KEY_X509,
+				 ar.data(), ar.length(), encryptedSignInData);
+
+	ar = ByteArray(encryptedSignInData, sizeof(encryptedSignInData));
+	appendTextElem(signIn, "adept:signInData", ar.toBase64());
+	
+	// Generate Auth key and License Key
+	void* rsaAuth = client->generateRSAKey(RSA_KEY_SIZE_BITS);
+	void* rsaLicense = client->generateRSAKey(RSA_KEY_SIZE_BITS);
+
+	std::string serializedData = serializeRSAPublicKey(rsaAuth);
+	appendTextElem(signIn, "adept:publicAuthKey", serializedData);
+	serializedData = serializeRSAPrivateKey(rsaAuth);
+	appendTextElem(signIn, "adept:encryptedPrivateAuthKey", serializedData.data());
+
+	serializedData = serializeRSAPublicKey(rsaLicense);
+	appendTextElem(signIn, "adept:publicLicenseKey", serializedData.data());
+	serializedData = serializeRSAPrivateKey(rsaLicense);
+	appendTextElem(signIn, "adept:encryptedPrivateLicenseKey", serializedData.data());
+
+	client->destroyRSAHandler(rsaAuth);
+	client->destroyRSAHandler(rsaLicense);
+    }
+    
+    void DRMProcessor::signIn(const std::string& adobeID, const std::string& adobePassword)
+    {
+	MetricsSpan span(metrics, "signIn");
+	pugi::xml_document signInRequest;
+	std::string authenticationCertificate = user->getAuthenticationCertificate();
+	
+	buildSignInRequest(signInRequest, adobeID, adobePassword, authenticationCertificate);
+
+	GOUROU_LOG(INFO, "SignIn " << adobeID);
+	
+	std::string signInURL = user->getProperty("//adept:authURL");
+	signInURL += "/SignInDirect";
+
+	ByteArray credentials = sendRequest(signInRequest, signInURL);
+	
+	pugi::xml_document credentialsDoc;
+	if (!credentialsDoc.load_buffer(credentials.data(), credentials.length()))
+	    EXCEPTION(SIGN_INVALID_CREDENTIALS, "Invalid credentials reply");
+
+	struct adeptWalker: pugi::xml_tree_walker
+	{
+	    void changeName(pugi::xml_node& node)
+	    {
+		std::string name = std::string("adept:") + node.name();
+		node.set_name(name.c_str());
+	    }
+	    
+	    bool begin(pugi::xml_node& node)
+	    {
+		changeName(node);
+		return true;
+	    }
+	    
+	    virtual bool for_each(pugi::xml_node& node)
+	    {
+		if (node.type() == pugi::node_element)
+		    changeName(node);
 		return true; // continue traversal
 	    }
 	} adeptWalker;
@@ -779,6 +1263,9 @@ namespace gourou
 	pugi::xml_document activationDoc;
 	user->readActivation(activationDoc);
 	pugi::xml_node activationInfo = activationDoc.select_node("activationInfo").node();
+	// Previous credentials (and device activation bound to them) are replaced
+	while (activationInfo.remove_child("adept:credentials")) ;
+	while (activationInfo.remove_child("activationToken")) ;
 	activationInfo.append_copy(credentialsNode);
 
 	user->updateActivationFile(activationDoc);
@@ -814,6 +1301,7 @@ namespace gourou
     
     void DRMProcessor::activateDevice()
     {
+	MetricsSpan span(metrics, "activateDevice");
 	pugi::xml_document activateReq;
 
 	GOUROU_LOG(INFO, "Activate device");
@@ -836,10 +1324,52 @@ namespace gourou
 	activationToken.load_buffer(reply.data(), reply.length());
 	
 	root = activationDoc.select_node("activationInfo").node();
+	while (root.remove_child(activationToken.first_child().name())) ;
 	root.append_copy(activationToken.first_child());
 	user->updateActivationFile(activationDoc);
     }
     
+    bool DRMProcessor::hasValidActivation()
+    {
+	if (!user || !device)
+	    return false;
+
+	if (!user->getUUID().length() || !user->getPKCS12().length() ||
+	    !user->getDeviceUUID().length() || !user->getPrivateLicenseKey().length() ||
+	    !user->getAuthenticationCertificate().length())
+	{
+	    GOUROU_LOG(DEBUG, "Activation incomplete");
+	    return false;
+	}
+
+	try
+	{
+	    if (user->getDeviceFingerprint() != (*device)["fingerprint"])
+	    {
+		GOUROU_LOG(DEBUG, "Activation doesn't match current device");
+		return false;
+	    }
+
+	    // PKCS12 must be readable with current device key
+	    ByteArray deviceKey(device->getDeviceKey(), Device::DEVICE_KEY_SIZE);
+	    unsigned char* pkcs12 = 0;
+	    unsigned int pkcs12Length;
+	    ByteArray pkcs12Cert = ByteArray::fromBase64(user->getPKCS12());
+
+	    client->extractCertificate(pkcs12Cert.data(), pkcs12Cert.length(),
+				       RSAInterface::RSA_KEY_PKCS12, deviceKey.toBase64().data(),
+				       &pkcs12, &pkcs12Length);
+	    free(pkcs12);
+	}
+	catch(gourou::Exception& e)
+	{
+	    GOUROU_LOG(DEBUG, "Invalid activation : " << e.what());
+	    return false;
+	}
+
+	return true;
+    }
+    
     void DRMProcessor::buildReturnReq(pugi::xml_document& returnReq, const std::string& loanID, const std::string& operatorURL)
     {
 	pugi::xml_node decl = returnReq.append_child(pugi::node_declaration);
@@ -1128,19 +1658,158 @@ namespace gourou
 	return res.toBase64();
     }
 
+    void DRMProcessor::setBookKeyCache(unsigned maxEntries, const std::string& persistentFile)
+    {
+	bookKeyCacheSize = maxEntries;
+	bookKeyCacheFile = persistentFile;
+	bookKeys.clear();
+
+	if (bookKeyCacheSize && bookKeyCacheFile.size())
+	    loadBookKeys();
+    }
+
+    bool DRMProcessor::findBookKey(const std::string& resource, unsigned char* decryptedKey)
+    {
+	std::list<std::pair<std::string, ByteArray> >::iterator it;
+
+	for (it = bookKeys.begin(); it != bookKeys.end(); it++)
+	{
+	    if (it->first == resource)
+	    {
+		// Most recently used first
+		bookKeys.splice(bookKeys.begin(), bookKeys, it);
+		memcpy(decryptedKey, it->second.data(), it->second.length());
+		return true;
+	    }
+	}
+
+	return false;
+    }
+
+    void DRMProcessor::addBookKey(const std::string& resource, const unsigned char* decryptedKey)
+    {
+	if (!bookKeyCacheSize)
+	    return;
+
+	bookKeys.push_front(std::make_pair(resource, ByteArray(decryptedKey, 16)));
+
+	while (bookKeys.size() > bookKeyCacheSize)
+	    bookKeys.pop_back();
+
+	if (bookKeyCacheFile.size())
+	    saveBookKeys();
+    }
+
+    /*
+     * Persistent cache format : one "<resource> <hex key>" line per key,
+     * most recently used first.
+     * Entries are appended after in memory ones (already known resources
+     * are skipped).
+     */
+    void DRMProcessor::loadBookKeys()
+    {
+	std::ifstream file(bookKeyCacheFile.c_str());
+	std::string line;
+	std::list<std::pair<std::string, ByteArray> >::iterator it;
+
+	while (std::getline(file, line) && bookKeys.size() < bookKeyCacheSize)
+	{
+	    size_t pos = line.find(' ');
+
+	    if (pos == std::string::npos || line.size() - pos - 1 != 32)
+		continue;
+
+	    std::string resource = line.substr(0, pos);
+
+	    for (it = bookKeys.begin(); it != bookKeys.end(); it++)
+	    {
+		if (it->first == resource)
+		    break;
+	    }
+
+	    if (it != bookKeys.end())
+		continue;
+
+	    try
+	    {
+		bookKeys.push_back(std::make_pair(resource,
+						  ByteArray::fromHex(line.substr(pos+1))));
+	    }
+	    catch (std::invalid_argument& e)
+	    {
+		GOUROU_LOG(WARN, "Invalid entry in " << bookKeyCacheFile);
+	    }
+	}
+
+	GOUROU_LOG(DEBUG, bookKeys.size() << " book keys loaded from " << bookKeyCacheFile);
+    }
+
+    /*
+     * File may be shared by several processors (threads or processes) :
+     * under an exclusive lock, keys saved by others are merged into ours,
+     * then the whole list is written aside (with 0600 permissions) and
+     * renamed.
+     */
+    void DRMProcessor::saveBookKeys()
+    {
+	std::list<std::pair<std::string, ByteArray> >::iterator it;
+	std::string content;
+
+	std::string lockFile = bookKeyCacheFile + ".lock";
+	int lockFd = open(lockFile.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	if (lockFd < 0 || flock(lockFd, LOCK_EX))
+	    GOUROU_LOG(WARN, "Unable to lock " << lockFile << ", concurrent saves may lose keys");
+
+	loadBookKeys();
+
+	for (it = bookKeys.begin(); it != bookKeys.end(); it++)
+	    content += it->first + " " + it->second.toHex() + "\n";
+
+	std::vector<char> tmpFile(bookKeyCacheFile.begin(), bookKeyCacheFile.end());
+	const char suffix[] = ".XXXXXX";
+	tmpFile.insert(tmpFile.end(), suffix, suffix+sizeof(suffix));
+
+	int fd = mkstemp(tmpFile.data());
+	if (fd < 0)
+	    GOUROU_LOG(WARN, "Unable to save book keys into " << bookKeyCacheFile);
+	else
+	{
+	    ssize_t written = write(fd, content.c_str(), content.size());
+	    close(fd);
+
+	    if (written != (ssize_t)content.size() || rename(tmpFile.data(), bookKeyCacheFile.c_str()))
+	    {
+		unlink(tmpFile.data());
+		GOUROU_LOG(WARN, "Unable to save book keys into " << bookKeyCacheFile);
+	    }
+	}
+
+	// Closing descriptor releases the lock
+	if (lockFd >= 0)
+	    close(lockFd);
+    }
+
     void DRMProcessor::decryptADEPTKey(pugi::xml_document& rightsDoc, unsigned char* decryptedKey, const unsigned char* encryptionKey, unsigned encryptionKeySize)
     {
 	unsigned char rsaKey[RSA_KEY_SIZE];
 	
-	std::string user = extractTextElem(rightsDoc, "/adept:rights/licenseToken/user");
-
 	if (!encryptionKey)
 	{
+	    std::string user = extractTextElem(rightsDoc, "/adept:rights/licenseToken/user");
+
 	    if (this->user->getUUID() != user)
 	    {
 		EXCEPTION(DRM_INVALID_USER, "This book has been downloaded for another user (" << user << ")");
 	    }
 
+	    std::string resource = extractTextElem(rightsDoc, "/adept:rights/licenseToken/resource", false);
+
+	    if (resource.size() && findBookKey(resource, decryptedKey))
+	    {
+		GOUROU_LOG(DEBUG, "Use cached encryption key for " << resource);
+		return;
+	    }
+
 	    std::string encryptedKey = extractTextElem(rightsDoc, "/adept:rights/licenseToken/encryptedKey");
 	    std::string keyType = extractTextAttribute(rightsDoc, "/adept:rights/licenseToken/encryptedKey", "keyType", false);
 
@@ -1152,13 +1821,9 @@ namespace gourou
 
 	    ByteArray arrayEncryptedKey = ByteArray::fromBase64(encryptedKey);
 
-	    std::string privateKeyData = this->user->getPrivateLicenseKey();
-	    ByteArray privateRSAKey = ByteArray::fromBase64(privateKeyData);
-	
 	    dumpBuffer(gourou::LG_LOG_DEBUG, "To decrypt : ", arrayEncryptedKey.data(), arrayEncryptedKey.length());
 
-	    client->RSAPrivateDecrypt(privateRSAKey.data(), privateRSAKey.length(),
-				      RSAInterface::RSA_KEY_PKCS8, "",
+	    client->RSAPrivateDecrypt(getLicenseKey(),
 				      arrayEncryptedKey.data(), arrayEncryptedKey.length(), rsaKey);
 
 	    dumpBuffer(gourou::LG_LOG_DEBUG, "Decrypted : ", rsaKey, sizeof(rsaKey));
@@ -1168,6 +1833,9 @@ namespace gourou
 		EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "Unable to retrieve encryption key");
 
 	    memcpy(decryptedKey, &rsaKey[sizeof(rsaKey)-16], 16);
+
+	    if (resource.size())
+		addBookKey(resource, decryptedKey);
 	}
 	else
 	{
@@ -1179,18 +1847,128 @@ namespace gourou
 	}
     }
    
-    void DRMProcessor::removeEPubDRM(const std::string& filenameIn, const std::string& filenameOut,
-				     const unsigned char* encryptionKey, unsigned encryptionKeySize)
-    {
-	ByteArray zipData;
-	bool removeEncryptionXML = true;
-	void* zipHandler = client->zipOpen(filenameOut);
+    /* Limits of ePub files decrypted at once */
+    static const size_t EPUB_BATCH_FILES = 256;
+    static const size_t EPUB_BATCH_SIZE  = 32*1024*1024;
 
-	client->zipReadFile(zipHandler, "META-INF/rights.xml", zipData);
-	pugi::xml_document rightsDoc;
-	rightsDoc.load_string((const char*)zipData.data());
+    /**
+     * @brief Files already compressed, deflating them again is useless
+     */
+    static bool isCompressedResource(const std::string& path)
+    {
+	static const char* extensions[] = {".jpg", ".jpeg", ".png", ".gif", ".webp",
+	    ".mp3", ".mp4", ".m4a", ".m4v", ".woff", ".woff2", 0};
 
-	unsigned char decryptedKey[16];
+	std::string lowerPath = path;
+	for (size_t i=0; i<lowerPath.size(); i++)
+	    lowerPath[i] = tolower(lowerPath[i]);
+
+	for (int i=0; extensions[i]; i++)
+	{
+	    size_t len = strlen(extensions[i]);
+	    if (lowerPath.size() >= len &&
+		lowerPath.compare(lowerPath.size()-len, len, extensions[i]) == 0)
+		return true;
+	}
+
+	return false;
+    }
+    
+    /**
+     * @brief Read an EncryptedData node of encryption.xml
+     *
+     * @param encryptedFile  Path of encrypted file
+     *
+     * @return true if file is encrypted with ADEPT (and can be decrypted)
+     */
+    static bool getEncryptedFile(pugi::xml_node encryptedData, std::string& encryptedFile)
+    {
+	pugi::xml_node encryptionMethod = encryptedData.child("EncryptionMethod");
+	pugi::xml_node cipherReference  = encryptedData.child("CipherData").child("CipherReference");
+
+	std::string encryptionType = encryptionMethod.attribute("Algorithm").value();
+	encryptedFile = cipherReference.attribute("URI").value();
+
+	if (encryptionType == "")
+	{
+	    EXCEPTION(DRM_MISSING_PARAMETER, "Missing Algorithm attribute in encryption.xml");
+	}
+	else if (encryptionType != "http://www.w3.org/2001/04/xmlenc#aes128-cbc")
+	{
+	    GOUROU_LOG(WARN, "Unsupported encryption algorithm " << encryptionType << ", for file " << encryptedFile);
+	    return false;
+	}
+
+	if (encryptedFile == "")
+	{
+	    EXCEPTION(DRM_MISSING_PARAMETER, "Missing URI attribute in encryption.xml");
+	}
+
+	GOUROU_LOG(DEBUG, "Encrypted file " << encryptedFile);
+
+	return true;
+    }
+
+    void DRMProcessor::decryptEPubFile(const unsigned char* decryptedKey, const unsigned char* data,
+				       unsigned int length, ByteArray& result)
+    {
+	if (length < 16)
+	    EXCEPTION(CLIENT_ZIP_ERROR, "Encrypted file too short (" << length << " bytes)");
+
+	ByteArray clearData(length-16+1, true); /* Reserve 1 byte for 'Z' */
+	unsigned char* _clearData = clearData.data();
+	unsigned int dataOutLength;
+
+	client->decrypt(CryptoInterface::ALGO_AES, CryptoInterface::CHAIN_CBC,
+			decryptedKey, 16, /* Key */
+			data, 16, /* IV */
+			&data[16], length-16,
+			_clearData, &dataOutLength);
+
+	// Add 'Z' at the end, done in ineptepub.py
+	_clearData[dataOutLength] = 'Z';
+	clearData.resize(dataOutLength+1);
+
+	result = ByteArray(true);
+	client->inflate(clearData, result);
+    }
+
+    void DRMProcessor::removeEPubDRM(const std::string& /*filenameIn*/, const std::string& filenameOut,
+				     const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	void* zipHandler;
+	{
+	    MetricsSpan span(metrics, "epub.zip");
+	    zipHandler = client->zipOpen(filenameOut);
+	}
+
+	removeEPubDRM(zipHandler, encryptionKey, encryptionKeySize);
+
+	MetricsSpan span(metrics, "epub.write");
+	client->zipClose(zipHandler);
+    }
+
+    void DRMProcessor::removeEPubDRM(void* zipHandler, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	ByteArray zipData;
+	bool removeEncryptionXML = true;
+	bool hasRights = true;
+
+	pugi::xml_document rightsDoc;
+	try
+	{
+	    client->zipReadFile(zipHandler, "META-INF/rights.xml", zipData);
+	    rightsDoc.load_string((const char*)zipData.data());
+	}
+	catch(gourou::Exception& e)
+	{
+	    // Rights are not needed when key is provided
+	    if (!encryptionKey)
+		throw;
+	    hasRights = false;
+	}
+
+	unsigned char decryptedKey[16];
 
 	decryptADEPTKey(rightsDoc, decryptedKey, encryptionKey, encryptionKeySize);
 	
@@ -1200,71 +1978,105 @@ namespace gourou
 
 	pugi::xpath_node_set nodeSet = encryptionDoc.select_nodes("//EncryptedData");
 
-	for (pugi::xpath_node_set::const_iterator it = nodeSet.begin();
-	     it != nodeSet.end(); ++it)
+	/*
+	 * Encrypted files are read by batch, decrypted and inflated in
+	 * parallel, then written back in order (zip handler is not thread safe).
+	 */
+	struct EPubFile
 	{
-	    pugi::xml_node encryptionMethod = it->node().child("EncryptionMethod");
-	    pugi::xml_node cipherReference  = it->node().child("CipherData").child("CipherReference");
-
-	    std::string encryptionType = encryptionMethod.attribute("Algorithm").value();
-	    std::string encryptedFile = cipherReference.attribute("URI").value();
-	    
-	    if (encryptionType == "")
+	    std::string path;
+	    ByteArray data;
+	    std::string error;
+	};
+	std::vector<EPubFile> batch;
+	size_t batchSize = 0;
+
+	auto flushBatch = [&]()
+	{
+	    if (metrics)
 	    {
-		EXCEPTION(DRM_MISSING_PARAMETER, "Missing Algorithm attribute in encryption.xml");
+		metrics->add("epub.files", batch.size());
+		metrics->add("decrypt.bytes", batchSize);
 	    }
-	    else if (encryptionType == "http://www.w3.org/2001/04/xmlenc#aes128-cbc")
+
+	    MetricsSpan decryptSpan(metrics, "epub.decrypt");
+	    runParallel(batch.size(), [&](size_t i)
 	    {
-		if (encryptedFile == "")
+		try
 		{
-		    EXCEPTION(DRM_MISSING_PARAMETER, "Missing URI attribute in encryption.xml");
+		    ByteArray inflateData;
+		    decryptEPubFile(decryptedKey, batch[i].data.data(), batch[i].data.length(), inflateData);
+		    batch[i].data = inflateData;
 		}
+		catch(gourou::Exception& e)
+		{
+		    if (e.getErrorCode() == CLIENT_ZIP_ERROR)
+			batch[i].error = e.what();
+		    else
+			throw;
+		}
+	    });
 
-		GOUROU_LOG(DEBUG, "Encrypted file " << encryptedFile);
+	    decryptSpan.stop();
+	    MetricsSpan zipSpan(metrics, "epub.zip");
 
-		client->zipReadFile(zipHandler, encryptedFile, zipData, false);
-	    
-		unsigned char* _data = zipData.data();
-		ByteArray clearData(zipData.length()-16+1, true); /* Reserve 1 byte for 'Z' */
-		unsigned char* _clearData = clearData.data();
-		gourou::ByteArray inflateData(true);
-		unsigned int dataOutLength;
-
-		client->decrypt(CryptoInterface::ALGO_AES, CryptoInterface::CHAIN_CBC,
-				decryptedKey, sizeof(decryptedKey), /* Key */
-				_data, 16, /* IV */
-				&_data[16], zipData.length()-16,
-				_clearData, &dataOutLength);
-
-		// Add 'Z' at the end, done in ineptepub.py
-		_clearData[dataOutLength] = 'Z';
-		clearData.resize(dataOutLength+1);
+	    for (size_t i=0; i<batch.size(); i++)
+	    {
+		if (!batch[i].error.empty())
+		{
+		    GOUROU_LOG(ERROR, batch[i].error << std::endl << "Skip file " << batch[i].path);
+		    continue;
+		}
 
 		try
 		{
-		    client->inflate(clearData, inflateData);
-		    client->zipWriteFile(zipHandler, encryptedFile, inflateData);
+		    client->zipWriteFile(zipHandler, batch[i].path, batch[i].data,
+					 !storeCompressedResources || !isCompressedResource(batch[i].path));
 		}
 		catch(gourou::Exception& e)
 		{
 		    if (e.getErrorCode() == CLIENT_ZIP_ERROR)
 		    {
-			GOUROU_LOG(ERROR, e.what() << std::endl << "Skip file " << encryptedFile);
+			GOUROU_LOG(ERROR, e.what() << std::endl << "Skip file " << batch[i].path);
 		    }
 		    else
 			throw e;
 		}
+	    }
+
+	    batch.clear();
+	    batchSize = 0;
+	};
+
+	for (pugi::xpath_node_set::const_iterator it = nodeSet.begin();
+	     it != nodeSet.end(); ++it)
+	{
+	    std::string encryptedFile;
+
+	    if (getEncryptedFile(it->node(), encryptedFile))
+	    {
+		EPubFile file;
+		file.path = encryptedFile;
+		{
+		    MetricsSpan span(metrics, "epub.zip");
+		    client->zipReadFile(zipHandler, encryptedFile, file.data, false);
+		}
+		batchSize += file.data.length();
+		batch.push_back(file);
+
+		if (batch.size() >= EPUB_BATCH_FILES || batchSize >= EPUB_BATCH_SIZE)
+		    flushBatch();
 
 		it->node().parent().remove_child(it->node());
 	    }
 	    else
-	    {
-		GOUROU_LOG(WARN, "Unsupported encryption algorithm " << encryptionType << ", for file " << encryptedFile);
 		removeEncryptionXML = false;
-	    }
 	}
 	
-	client->zipDeleteFile(zipHandler, "META-INF/rights.xml");
+	flushBatch();
+	
+	if (hasRights)
+	    client->zipDeleteFile(zipHandler, "META-INF/rights.xml");
 	if (removeEncryptionXML)
 	    client->zipDeleteFile(zipHandler, "META-INF/encryption.xml");
 	else
@@ -1275,8 +2087,6 @@ namespace gourou
 	    ByteArray ba(xmlStr);
 	    client->zipWriteFile(zipHandler, "META-INF/encryption.xml", ba);
 	}
-	
-	client->zipClose(zipHandler);
     }
     
     void DRMProcessor::generatePDFObjectKey(int version,
@@ -1298,216 +2108,1330 @@ namespace gourou
 	}
     }
     
-    void DRMProcessor::removePDFDRM(const std::string& filenameIn, const std::string& filenameOut,
-				    const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    int DRMProcessor::decryptEBXHandlerKey(uPDFParser::Object* ebx, unsigned char* decryptedKey,
+					   const unsigned char* encryptionKey, unsigned encryptionKeySize)
     {
-	uPDFParser::Parser parser;
-	bool EBXHandlerFound = false;
-		
-	if (filenameIn == filenameOut)
-	{
-	    EXCEPTION(DRM_IN_OUT_EQUALS, "PDF IN must be different of PDF OUT");
-	}
-	
-	try
-	{
-	    GOUROU_LOG(DEBUG, "Parse PDF");
-	    parser.parse(filenameIn);
-	}
-	catch(std::invalid_argument& e)
+	uPDFParser::Integer* ebxVersion;
+
+	ebxVersion  = (uPDFParser::Integer*)(*ebx)[uPDFParser::NAME_V];
+	if (ebxVersion->value() != 4)
 	{
-	    GOUROU_LOG(ERROR, "Invalid PDF");
-	    return;
+	    EXCEPTION(DRM_VERSION_NOT_SUPPORTED, "EBX encryption version not supported " << ebxVersion->value());		    
 	}
 
-	uPDFParser::Integer* ebxVersion;
-	std::vector<uPDFParser::Object*> objects = parser.objects();
-	std::vector<uPDFParser::Object*>::iterator it;
-	std::vector<uPDFParser::Object*>::reverse_iterator rIt;
-	std::vector<uPDFParser::Object*> ebxObjects;
-	unsigned char decryptedKey[16];
-	int ebxId;
-	
-	for(rIt = objects.rbegin(); rIt != objects.rend(); rIt++)
+	pugi::xml_document rightsDoc;
+
+	// License is not needed when key is provided
+	if (!encryptionKey)
 	{
-	    // Update EBX_HANDLER with rights
-	    if ((*rIt)->hasKey("Filter") && (**rIt)["Filter"]->str() == "/EBX_HANDLER")
+	    if (!(ebx->hasKey("ADEPT_LICENSE")))
 	    {
-		EBXHandlerFound = true;
-		uPDFParser::Object* ebx = *rIt;
-		
-		ebxVersion  = (uPDFParser::Integer*)(*ebx)["V"];
-		if (ebxVersion->value() != 4)
-		{
-		    EXCEPTION(DRM_VERSION_NOT_SUPPORTED, "EBX encryption version not supported " << ebxVersion->value());		    
-		}
-
-		if (!(ebx->hasKey("ADEPT_LICENSE")))
-		{
-		    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "No ADEPT_LICENSE found");
-		}
+		EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "No ADEPT_LICENSE found");
+	    }
 		
-		uPDFParser::String* licenseObject = (uPDFParser::String*)(*ebx)["ADEPT_LICENSE"];
+	    uPDFParser::String* licenseObject = (uPDFParser::String*)(*ebx)["ADEPT_LICENSE"];
 		
-		std::string value = licenseObject->value();
-		// Pad with '='
-		while ((value.size() % 4))
-		    value += "=";
-		ByteArray zippedData = ByteArray::fromBase64(value);
-
-		if (zippedData.size() == 0)
-		    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "Invalid ADEPT_LICENSE");
+	    std::string value = licenseObject->value();
+	    // Pad with '='
+	    while ((value.size() % 4))
+		value += "=";
+	    ByteArray zippedData = ByteArray::fromBase64(value);
+
+	    if (zippedData.size() == 0)
+		EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "Invalid ADEPT_LICENSE");
 		    
-		ByteArray rightsStr;
-		client->inflate(zippedData, rightsStr);
+	    ByteArray rightsStr;
+	    client->inflate(zippedData, rightsStr);
 
-		pugi::xml_document rightsDoc;
-		rightsDoc.load_string((const char*)rightsStr.data());
+	    rightsDoc.load_string((const char*)rightsStr.data());
+	}
 
-		decryptADEPTKey(rightsDoc, decryptedKey, encryptionKey, encryptionKeySize);
-		
-		ebxId = ebx->objectId();
+	decryptADEPTKey(rightsDoc, decryptedKey, encryptionKey, encryptionKeySize);
 
-		break;
-	    }
-	}
+	return ebxVersion->value();
+    }
+
+    static unsigned char hexDigitValue(char c)
+    {
+	if (c >= 'a' && c <= 'f')
+	    return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+	    return c - 'A' + 10;
+	else if (c >= '0' && c <= '9')
+	    return c - '0';
+
+	throw std::invalid_argument("Invalid character in hex string");
+    }
+
+    /**
+     * Decode hex string into out (which can be hex string buffer itself)
+     * and return decoded length
+     */
+    static unsigned int hexToBinary(const std::string& hex, unsigned char* out)
+    {
+	if (hex.size() % 2)
+	    throw std::invalid_argument("Size of hex string not multiple of 2");
+
+	unsigned int i;
+	for (i=0; i<hex.size(); i+=2)
+	    out[i/2] = (hexDigitValue(hex[i]) << 4) | hexDigitValue(hex[i+1]);
+
+	return i/2;
+    }
+
+    /**
+     * Encode data as (lower case) hex into hex. data may point to
+     * the beginning of hex buffer : it's encoded from the end
+     */
+    static void binaryToHex(const unsigned char* data, unsigned int length, std::string& hex)
+    {
+	static const char digits[] = "0123456789abcdef";
+
+	hex.resize(length*2);
 
-	if (!EBXHandlerFound)
+	for (int i=(int)length-1; i>=0; i--)
 	{
-	    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "EBX_HANDLER not found");
+	    unsigned char c = data[i];
+	    hex[i*2+1] = digits[c & 0x0f];
+	    hex[i*2] = digits[c >> 4];
 	}
+    }
 
-	for(it = objects.begin(); it != objects.end(); it++)
+    /**
+     * @brief Decrypt strings and streams of a PDF object
+     *
+     * @param inPlace  Decrypt streams into their current buffer, which may be
+     *                 parser's (private) input mapping. If false, streams are
+     *                 decrypted into a new buffer freed with the object : in
+     *                 streaming mode, writing into the mapping would copy each
+     *                 touched page and keep it until parser is deleted.
+     */
+    void DRMProcessor::decryptPDFObject(int version, const unsigned char* decryptedKey,
+					uPDFParser::Object* object, PDFDecryptionStats& stats, bool inPlace)
+    {
+	// Should not decrypt XRef stream
+	if (object->hasKey(uPDFParser::NAME_TYPE) && (*object)[uPDFParser::NAME_TYPE]->str() == "/XRef")
 	{
-	    uPDFParser::Object* object = *it;
-	        
-	    if (object->objectId() == ebxId)
-	    {
-		ebxObjects.push_back(object);
-		continue;
-	    }
-
-	    // Should not decrypt XRef stream
-	    if (object->hasKey("Type") && (*object)["Type"]->str() == "/XRef")
-	    {
-		GOUROU_LOG(DEBUG, "XRef stream at " << object->offset());
-		continue;
-	    }
+	    GOUROU_LOG(DEBUG, "XRef stream at " << object->offset());
+	    return;
+	}
 	    
-	    GOUROU_LOG(DEBUG, "Obj " << object->objectId());
+	GOUROU_LOG(DEBUG, "Obj " << object->objectId());
 
-	    unsigned char tmpKey[sizeof(decryptedKey)];
+	unsigned char tmpKey[16];
 
-	    generatePDFObjectKey(ebxVersion->value(),
-				 decryptedKey, sizeof(decryptedKey),
-				 object->objectId(), object->generationNumber(),
-				 tmpKey);
+	generatePDFObjectKey(version,
+			     decryptedKey, 16,
+			     object->objectId(), object->generationNumber(),
+			     tmpKey);
 
-	    uPDFParser::Dictionary& dictionary = object->dictionary();
-	    std::map<std::string, uPDFParser::DataType*>& dictValues = dictionary.value();
-	    std::map<std::string, uPDFParser::DataType*>::iterator dictIt;
-	    std::map<std::string, uPDFParser::DataType*> decodedStrings;
-	    std::string string;
-	    
-	    /* Parse dictionary */
-	    for (dictIt = dictValues.begin(); dictIt != dictValues.end(); dictIt++)
+	uPDFParser::Dictionary& dictionary = object->dictionary();
+	uPDFParser::Dictionary::Entries& dictValues = dictionary.value();
+	uPDFParser::Dictionary::Entries::iterator dictIt;
+	bool modified = false;
+	unsigned int dataOutLength;
+
+	/*
+	 * RC4 output has the same size than its input :
+	 * strings (and streams if inPlace) are decrypted in place
+	 */
+	
+	/* Parse dictionary */
+	for (dictIt = dictValues.begin(); dictIt != dictValues.end(); dictIt++)
+	{
+	    uPDFParser::DataType* dictData = dictIt->second;
+	    if (dictData->type() == uPDFParser::DataType::STRING)
 	    {
-		uPDFParser::DataType* dictData = dictIt->second;
-		if (dictData->type() == uPDFParser::DataType::STRING)
-		{
-		    string = ((uPDFParser::String*) dictData)->unescapedValue();
+		std::string& string = ((uPDFParser::String*) dictData)->unescape();
 		    
-		    unsigned char* encryptedData = (unsigned char*)string.c_str();
-		    unsigned int dataLength = string.size();
-		    unsigned char* clearData = new unsigned char[dataLength];
-		    unsigned int dataOutLength;
-
-		    GOUROU_LOG(DEBUG, "Decrypt string " << dictIt->first << " " << dataLength);
-
-		    client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
-				    tmpKey, sizeof(tmpKey), /* Key */
-				    NULL, 0, /* IV */
-				    encryptedData, dataLength,
-				    clearData, &dataOutLength);
+		unsigned char* data = (unsigned char*)&string[0];
+		unsigned int dataLength = string.size();
 
-		    decodedStrings[dictIt->first] = new uPDFParser::String(
-			std::string((const char*)clearData, dataOutLength));
+		GOUROU_LOG(DEBUG, "Decrypt string " << dictIt->first.str() << " " << dataLength);
 
-		    delete[] clearData;
-		}
-		else if (dictData->type() == uPDFParser::DataType::HEXASTRING)
-		{
-		    string = ((uPDFParser::HexaString*) dictData)->value();
-		    ByteArray hexStr = ByteArray::fromHex(string);
-		    
-		    unsigned char* encryptedData = hexStr.data();
-		    unsigned int dataLength = hexStr.size();
-		    unsigned char* clearData = new unsigned char[dataLength];
-		    unsigned int dataOutLength;
+		if (!dataLength)
+		    continue;
+		
+		client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
+				tmpKey, sizeof(tmpKey), /* Key */
+				NULL, 0, /* IV */
+				data, dataLength,
+				data, &dataOutLength);
 
-		    GOUROU_LOG(DEBUG, "Decrypt hexa string " << dictIt->first << " " << dataLength);
+		stats.bytes += dataLength;
+		modified = true;
+	    }
+	    else if (dictData->type() == uPDFParser::DataType::HEXASTRING)
+	    {
+		std::string& string = ((uPDFParser::HexaString*) dictData)->value();
+		unsigned char* data = (unsigned char*)&string[0];
+		unsigned int dataLength = hexToBinary(string, data);
 
-		    client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
-				    tmpKey, sizeof(tmpKey), /* Key */
-				    NULL, 0, /* IV */
-				    encryptedData, dataLength,
-				    clearData, &dataOutLength);
+		GOUROU_LOG(DEBUG, "Decrypt hexa string " << dictIt->first.str() << " " << dataLength);
 
-		    ByteArray clearHexStr = ByteArray(clearData, dataOutLength);
-		    decodedStrings[dictIt->first] = new uPDFParser::HexaString(
-			clearHexStr.toHex());
+		client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
+				tmpKey, sizeof(tmpKey), /* Key */
+				NULL, 0, /* IV */
+				data, dataLength,
+				data, &dataOutLength);
 
-		    delete[] clearData;
-		}
+		binaryToHex(data, dataOutLength, string);
+		stats.bytes += dataLength;
+		modified = true;
 	    }
+	}
 		
-	    for (dictIt = decodedStrings.begin(); dictIt != decodedStrings.end(); dictIt++)
-		dictionary.replace(dictIt->first, dictIt->second);
-	    
-	    std::vector<uPDFParser::DataType*>::iterator datasIt;
-	    std::vector<uPDFParser::DataType*>& datas = object->data();
-	    uPDFParser::Stream* stream;
+	std::vector<uPDFParser::DataType*>::iterator datasIt;
+	std::vector<uPDFParser::DataType*>& datas = object->data();
+	uPDFParser::Stream* stream;
 	    
-	    for (datasIt = datas.begin(); datasIt != datas.end(); datasIt++)
-	    {
-		if ((*datasIt)->type() != uPDFParser::DataType::STREAM)
-		    continue;
+	for (datasIt = datas.begin(); datasIt != datas.end(); datasIt++)
+	{
+	    if ((*datasIt)->type() != uPDFParser::DataType::STREAM)
+		continue;
 
-		stream = (uPDFParser::Stream*) (*datasIt);
-		unsigned char* encryptedData = stream->data();
-		unsigned int dataLength = stream->dataLength();
-		unsigned char* clearData = new unsigned char[dataLength];
-		unsigned int dataOutLength;
+	    stream = (uPDFParser::Stream*) (*datasIt);
+	    // May point into parser's (private) input mapping
+	    unsigned char* data = stream->data();
+	    unsigned int dataLength = stream->dataLength();
+	    unsigned char* dataOut = inPlace ? data : new unsigned char[dataLength];
 		
-		GOUROU_LOG(DEBUG, "Decrypt stream id " << object->objectId() << ", size " << stream->dataLength());
+	    GOUROU_LOG(DEBUG, "Decrypt stream id " << object->objectId() << ", size " << stream->dataLength());
 
-		client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
-				tmpKey, sizeof(tmpKey), /* Key */
-				NULL, 0, /* IV */
-				encryptedData, dataLength,
-				clearData, &dataOutLength);
+	    client->decrypt(CryptoInterface::ALGO_RC4, CryptoInterface::CHAIN_ECB,
+			    tmpKey, sizeof(tmpKey), /* Key */
+			    NULL, 0, /* IV */
+			    data, dataLength,
+			    dataOut, &dataOutLength);
 		
-		stream->setData(clearData, dataOutLength, true);
-		if (dataOutLength != dataLength)
-		    GOUROU_LOG(DEBUG, "New size " << dataOutLength);
-	    }
+	    if (inPlace)
+		stream->setDataLength(dataOutLength);
+	    else
+		stream->setData(dataOut, dataOutLength, true);
+	    stats.bytes += dataLength;
+	    stats.streams++;
+	    modified = true;
+	    if (dataOutLength != dataLength)
+		GOUROU_LOG(DEBUG, "New size " << dataOutLength);
 	}
 
-	for(it = ebxObjects.begin(); it != ebxObjects.end(); it++)
-	    parser.removeObject(*it);
-	
-	uPDFParser::Object& trailer = parser.getTrailer();
-	trailer.deleteKey("Encrypt");
+	// Modified objects can't be copied verbatim
+	if (modified)
+	    object->update();
+
+	stats.objects++;
+    }
+
+    void DRMProcessor::addPDFDecryptionStats(PDFDecryptionStats& stats)
+    {
+	if (metrics)
+	{
+	    if (stats.objects)
+		metrics->add("decrypt.objects", stats.objects);
+	    if (stats.streams)
+		metrics->add("decrypt.streams", stats.streams);
+	    if (stats.bytes)
+		metrics->add("decrypt.bytes", stats.bytes);
+	}
 
-	parser.write(filenameOut);
+	stats = PDFDecryptionStats();
+    }
+
+    void DRMProcessor::setDecryptionThreads(unsigned threads)
+    {
+	// Pool is sized by this value, it's started again on next use
+	if (threads != decryptionThreads)
+	{
+	    delete workerPool;
+	    workerPool = 0;
+	}
+
+	decryptionThreads = threads;
+    }
+
+    unsigned DRMProcessor::decryptionThreadsCount(size_t nbObjects)
+    {
+	unsigned nbThreads = decryptionThreads;
+
+	if (!nbThreads)
+	    nbThreads = std::thread::hardware_concurrency();
+
+	if (nbThreads > nbObjects)
+	    nbThreads = nbObjects;
+
+	return nbThreads ? nbThreads : 1;
     }
     
-    void DRMProcessor::removeDRM(const std::string& filenameIn, const std::string& filenameOut,
-				 ITEM_TYPE type, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    void DRMProcessor::runParallel(size_t nbJobs, const std::function<void(size_t)>& job)
     {
-	if (type == PDF)
-	    removePDFDRM(filenameIn, filenameOut, encryptionKey, encryptionKeySize);
-	else
-	    removeEPubDRM(filenameIn, filenameOut, encryptionKey, encryptionKeySize);
+	unsigned nbThreads = decryptionThreadsCount(nbJobs);
+	size_t i;
+
+	if (nbThreads == 1)
+	{
+	    for (i=0; i<nbJobs; i++)
+		job(i);
+	    return;
+	}
+
+	// Calling thread runs jobs too
+	if (!workerPool)
+	    workerPool = new WorkerPool(decryptionThreadsCount((size_t)-1) - 1);
+
+	workerPool->run(nbJobs, job, nbThreads - 1);
+    }
+    
+    void DRMProcessor::decryptPDFObjects(int version, const unsigned char* decryptedKey,
+					 const std::vector<uPDFParser::Object*>& objects,
+					 PDFDecryptionStats& stats, bool inPlace)
+    {
+	GOUROU_LOG(DEBUG, "Decrypt " << objects.size() << " objects with " << decryptionThreadsCount(objects.size()) << " threads");
+
+	/*
+	 * Each object has its own key, so objects are decrypted in any order
+	 * by each thread. Objects order is not modified (nor output).
+	 */
+	std::atomic<uint64_t> nbObjects(0), nbStreams(0), nbBytes(0);
+
+	runParallel(objects.size(), [&](size_t i)
+	{
+	    PDFDecryptionStats objectStats;
+	    decryptPDFObject(version, decryptedKey, objects[i], objectStats, inPlace);
+
+	    nbObjects.fetch_add(objectStats.objects, std::memory_order_relaxed);
+	    nbStreams.fetch_add(objectStats.streams, std::memory_order_relaxed);
+	    nbBytes.fetch_add(objectStats.bytes, std::memory_order_relaxed);
+	});
+
+	stats.objects += nbObjects;
+	stats.streams += nbStreams;
+	stats.bytes += nbBytes;
+    }
+
+    /**
+     * @brief First pass of streaming PDF DRM removal : only keep EBX_HANDLER
+     * candidates, other objects are freed by parser as soon as they're read
+     */
+    class EBXHandlerScanner : public uPDFParser::ObjectHandler
+    {
+    public:
+	~EBXHandlerScanner()
+	{
+	    std::vector<uPDFParser::Object*>::iterator it;
+	    for(it = candidates.begin(); it != candidates.end(); it++)
+		delete *it;
+	}
+
+	virtual bool handleObject(uPDFParser::Object* object)
+	{
+	    if (isEBXHandler(object))
+	    {
+		candidates.push_back(object);
+		return true;
+	    }
+
+	    return false;
+	}
+
+	/**
+	 * @brief Same lookup than findEBXHandler() : trailer's Encrypt reference, else last one
+	 */
+	uPDFParser::Object* find(uPDFParser::Object& trailer)
+	{
+	    std::vector<uPDFParser::Object*>::reverse_iterator it;
+
+	    if (candidates.empty())
+		return 0;
+
+	    if (trailer.hasKey(uPDFParser::NAME_ENCRYPT) &&
+		trailer[uPDFParser::NAME_ENCRYPT]->type() == uPDFParser::DataType::REFERENCE)
+	    {
+		uPDFParser::Reference* encrypt = (uPDFParser::Reference*)trailer[uPDFParser::NAME_ENCRYPT];
+		for(it = candidates.rbegin(); it != candidates.rend(); it++)
+		{
+		    if ((*it)->objectId() == encrypt->objectId() &&
+			(*it)->generationNumber() == encrypt->generationNumber())
+			return *it;
+		}
+	    }
+
+	    return candidates.back();
+	}
+	
+    private:
+	std::vector<uPDFParser::Object*> candidates;
+    };
+
+    /**
+     * @brief Second pass of streaming PDF DRM removal : decrypt and write objects one by one.
+     * With multiple decryption threads, objects are decrypted by batches
+     * (bounded in count and stream size) and written in their original order.
+     *
+     * Also used in a single pass while PDF is downloaded (key comes from
+     * item rights) : EBX_HANDLER id is then unknown (ebxId < 0), each
+     * EBX_HANDLER object is dropped once its version has been checked, and
+     * output is started on first object (after PDF header has been parsed).
+     */
+    class DRMProcessor::PDFStreamingHandler : public uPDFParser::ObjectHandler
+    {
+    public:
+	/**
+	 * @param inPlace  Streams own their data (see decryptPDFObject())
+	 * @param output   Output to start on first object, if not already done by caller
+	 */
+	PDFStreamingHandler(DRMProcessor* processor, uPDFParser::Parser& parser,
+			    int version, const unsigned char* decryptedKey, int ebxId,
+			    const std::vector<uPDFParser::XRefValue>& xrefTable,
+			    bool inPlace=false, uPDFParser::Writer* output=0):
+	    processor(processor), parser(parser), version(version),
+	    decryptedKey(decryptedKey), ebxId(ebxId), inPlace(inPlace),
+	    output(output), ebxFound(false), batchDataSize(0)
+	{
+	    // Same status than xref synchronization of non streaming parse()
+	    std::vector<uPDFParser::XRefValue> xref = xrefTable;
+	    std::vector<uPDFParser::XRefValue>::iterator it;
+	    for (it = xref.begin(); it != xref.end(); it++)
+		objectsStatus[key((*it).objectId(), (*it).generationNumber())] = (*it).used();
+
+	    nbThreads = processor->decryptionThreadsCount((size_t)-1);
+	}
+
+	~PDFStreamingHandler()
+	{
+	    std::vector<uPDFParser::Object*>::iterator it;
+	    for (it = batch.begin(); it != batch.end(); it++)
+		delete *it;
+	}
+
+	virtual bool handleObject(uPDFParser::Object* object)
+	{
+	    if (object->objectId() == ebxId)
+		return false;
+
+	    if (ebxId < 0 && isEBXHandler(object))
+	    {
+		uPDFParser::Integer* ebxVersion = (uPDFParser::Integer*)(*object)[uPDFParser::NAME_V];
+		if (ebxVersion->value() != version)
+		{
+		    EXCEPTION(DRM_VERSION_NOT_SUPPORTED, "EBX encryption version not supported " << ebxVersion->value());
+		}
+
+		ebxFound = true;
+		return false;
+	    }
+
+	    beginWrite();
+
+	    std::map<uint64_t, bool>::iterator it;
+	    it = objectsStatus.find(key(object->objectId(), object->generationNumber()));
+	    if (it != objectsStatus.end())
+		object->setUsed(it->second);
+
+	    if (nbThreads == 1)
+	    {
+		processor->decryptPDFObject(version, decryptedKey, object, stats, inPlace);
+		parser.writeObject(object);
+
+		return false;
+	    }
+
+	    // Flush before keeping object : if it fails, parser deletes current object
+	    if (batch.size() >= BATCH_OBJECTS_PER_THREAD * nbThreads ||
+		batchDataSize >= BATCH_MAX_DATA_SIZE)
+		flush();
+
+	    batch.push_back(object);
+	    batchDataSize += streamsSize(object);
+
+	    return true;
+	}
+
+	/**
+	 * @brief Decrypt and write pending objects, then record their counters
+	 */
+	void flush()
+	{
+	    std::vector<uPDFParser::Object*>::iterator it;
+
+	    processor->decryptPDFObjects(version, decryptedKey, batch, stats, inPlace);
+	    processor->addPDFDecryptionStats(stats);
+
+	    for (it = batch.begin(); it != batch.end(); it++)
+	    {
+		parser.writeObject(*it);
+		delete *it;
+		*it = 0;
+	    }
+
+	    batch.clear();
+	    batchDataSize = 0;
+	}
+
+	/**
+	 * @brief Start output given to constructor (once)
+	 */
+	void beginWrite()
+	{
+	    if (output)
+	    {
+		parser.beginWrite(*output);
+		output = 0;
+	    }
+	}
+
+	/**
+	 * @brief An EBX_HANDLER object has been dropped (ebxId < 0)
+	 */
+	bool hasEBXHandler() { return ebxFound; }
+
+    private:
+	static const unsigned BATCH_OBJECTS_PER_THREAD = 64;
+	static const size_t BATCH_MAX_DATA_SIZE = 32*1024*1024;
+	
+	static uint64_t key(int objectId, int generationNumber)
+	{
+	    return ((uint64_t)(uint32_t)objectId << 32) | (uint32_t)generationNumber;
+	}
+
+	static size_t streamsSize(uPDFParser::Object* object)
+	{
+	    std::vector<uPDFParser::DataType*>& datas = object->data();
+	    std::vector<uPDFParser::DataType*>::iterator it;
+	    size_t size = 0;
+
+	    for (it = datas.begin(); it != datas.end(); it++)
+	    {
+		if ((*it)->type() == uPDFParser::DataType::STREAM)
+		    size += ((uPDFParser::Stream*)(*it))->dataLength();
+	    }
+
+	    return size;
+	}
+
+	DRMProcessor* processor;
+	uPDFParser::Parser& parser;
+	int version;
+	const unsigned char* decryptedKey;
+	int ebxId;
+	bool inPlace;
+	uPDFParser::Writer* output;
+	bool ebxFound;
+	std::map<uint64_t, bool> objectsStatus;
+	unsigned nbThreads;
+	std::vector<uPDFParser::Object*> batch;
+	size_t batchDataSize;
+	PDFDecryptionStats stats;
+    };
+
+    /**
+     * @brief Input and output of PDF DRM removal : files or memory buffers
+     */
+    class DRMProcessor::PDFIO
+    {
+    public:
+	PDFIO(const std::string& filenameIn, const std::string& filenameOut):
+	    filenameIn(filenameIn), filenameOut(filenameOut), dataOut(0), output(0), writer(0)
+	{}
+
+	/* dataIn is kept (shared) : dataOut may be the same object */
+	PDFIO(const ByteArray& dataIn, ByteArray& dataOut):
+	    dataIn(dataIn), dataOut(&dataOut), output(0), writer(0)
+	{}
+
+	PDFIO(const ByteArray& dataIn, uPDFParser::Writer& output):
+	    dataIn(dataIn), dataOut(0), output(&output), writer(0)
+	{}
+
+	~PDFIO() { delete writer; }
+
+	/*
+	 * Streaming mode doesn't modify input (streams are decrypted into their
+	 * own buffers) : dataIn is then borrowed instead of copied at each pass
+	 */
+	void parse(uPDFParser::Parser& parser, uPDFParser::ObjectHandler* handler=0)
+	{
+	    if (dataOut || output)
+		parser.parse(dataIn.data(), dataIn.length(), handler, !handler);
+	    else
+		parser.parse(filenameIn, handler);
+	}
+
+	void beginWrite(uPDFParser::Parser& parser)
+	{
+	    if (output)
+		return parser.beginWrite(*output);
+
+	    if (!dataOut)
+		return parser.beginWrite(filenameOut);
+
+	    *dataOut = ByteArray(true);
+	    dataOut->reserve(dataIn.length());
+	    delete writer;
+	    writer = new ByteArrayPDFWriter(*dataOut);
+	    parser.beginWrite(*writer);
+	}
+
+	void write(uPDFParser::Parser& parser)
+	{
+	    if (output)
+		return parser.write(*output);
+
+	    if (!dataOut)
+		return parser.write(filenameOut);
+
+	    *dataOut = ByteArray(true);
+	    dataOut->reserve(dataIn.length());
+	    ByteArrayPDFWriter writer(*dataOut);
+	    parser.write(writer);
+	}
+
+    private:
+	std::string filenameIn, filenameOut;
+	ByteArray dataIn;
+	ByteArray* dataOut;
+	uPDFParser::Writer* output;
+	ByteArrayPDFWriter* writer;
+    };
+
+    void DRMProcessor::removePDFDRMStreaming(PDFIO& io, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	uPDFParser::Parser parser;
+	EBXHandlerScanner scanner;
+	unsigned char decryptedKey[16];
+
+	// Only decrypted objects are serialized again
+	parser.setCopyCleanObjects(true);
+	
+	try
+	{
+	    GOUROU_LOG(DEBUG, "Scan PDF");
+	    MetricsSpan span(metrics, "pdf.parse");
+	    io.parse(parser, &scanner);
+	}
+	catch(std::invalid_argument& e)
+	{
+	    // Nothing written : don't report an empty output as a success
+	    EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid PDF (" << e.what() << ")");
+	}
+
+	uPDFParser::Object* ebx = scanner.find(parser.getTrailer());
+
+	if (!ebx)
+	{
+	    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "EBX_HANDLER not found");
+	}
+
+	int version = decryptEBXHandlerKey(ebx, decryptedKey, encryptionKey, encryptionKeySize);
+
+	PDFStreamingHandler handler(this, parser, version, decryptedKey,
+				    ebx->objectId(), parser.xrefTable());
+
+	io.beginWrite(parser);
+
+	try
+	{
+	    GOUROU_LOG(DEBUG, "Decrypt PDF");
+	    MetricsSpan span(metrics, "pdf.decrypt");
+	    io.parse(parser, &handler);
+	    handler.flush();
+	}
+	catch(std::invalid_argument& e)
+	{
+	    // Output has already been started : don't report a truncated file as a success
+	    EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid PDF (" << e.what() << ")");
+	}
+
+	uPDFParser::Object& trailer = parser.getTrailer();
+	trailer.deleteKey(uPDFParser::NAME_ENCRYPT);
+
+	MetricsSpan span(metrics, "pdf.write");
+	parser.endWrite();
+    }
+    
+    void DRMProcessor::removePDFDRM(PDFIO& io, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (pdfStreamingMode)
+	    return removePDFDRMStreaming(io, encryptionKey, encryptionKeySize);
+
+	uPDFParser::Parser parser;
+
+	// Only decrypted objects are serialized again
+	parser.setCopyCleanObjects(true);
+	
+	try
+	{
+	    GOUROU_LOG(DEBUG, "Parse PDF");
+	    MetricsSpan span(metrics, "pdf.parse");
+	    io.parse(parser);
+	}
+	catch(std::invalid_argument& e)
+	{
+	    EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid PDF (" << e.what() << ")");
+	}
+
+	std::vector<uPDFParser::Object*> objects = parser.objects();
+	std::vector<uPDFParser::Object*>::iterator it;
+	std::vector<uPDFParser::Object*> ebxObjects;
+	unsigned char decryptedKey[16];
+	int ebxId;
+
+	uPDFParser::Object* ebx = findEBXHandler(parser);
+
+	if (!ebx)
+	{
+	    EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "EBX_HANDLER not found");
+	}
+
+	int version = decryptEBXHandlerKey(ebx, decryptedKey, encryptionKey, encryptionKeySize);
+		
+	ebxId = ebx->objectId();
+
+	std::vector<uPDFParser::Object*> toDecrypt;
+	
+	for(it = objects.begin(); it != objects.end(); it++)
+	{
+	    uPDFParser::Object* object = *it;
+	        
+	    if (object->objectId() == ebxId)
+	    {
+		ebxObjects.push_back(object);
+		continue;
+	    }
+
+	    toDecrypt.push_back(object);
+	}
+
+	{
+	    MetricsSpan span(metrics, "pdf.decrypt");
+	    PDFDecryptionStats stats;
+	    decryptPDFObjects(version, decryptedKey, toDecrypt, stats, true);
+	    addPDFDecryptionStats(stats);
+	}
+
+	for(it = ebxObjects.begin(); it != ebxObjects.end(); it++)
+	    parser.removeObject(*it);
+	
+	uPDFParser::Object& trailer = parser.getTrailer();
+	trailer.deleteKey(uPDFParser::NAME_ENCRYPT);
+
+	MetricsSpan span(metrics, "pdf.write");
+	io.write(parser);
+    }
+    
+    void DRMProcessor::removeDRM(const std::string& filenameIn, const std::string& filenameOut,
+				 ITEM_TYPE type, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (type == PDF)
+	{
+	    if (filenameIn == filenameOut)
+	    {
+		EXCEPTION(DRM_IN_OUT_EQUALS, "PDF IN must be different of PDF OUT");
+	    }
+
+	    PDFIO io(filenameIn, filenameOut);
+	    removePDFDRM(io, encryptionKey, encryptionKeySize);
+	}
+	else
+	    removeEPubDRM(filenameIn, filenameOut, encryptionKey, encryptionKeySize);
+    }
+
+    void DRMProcessor::removeDRM(const ByteArray& dataIn, ByteArray& dataOut,
+				 ITEM_TYPE type, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (type == PDF)
+	{
+	    PDFIO io(dataIn, dataOut);
+	    removePDFDRM(io, encryptionKey, encryptionKeySize);
+	}
+	else
+	{
+	    // zipClose() replaces dataOut with updated archive
+	    dataOut = dataIn;
+	    void* zipHandler;
+	    {
+		MetricsSpan span(metrics, "epub.zip");
+		zipHandler = client->zipOpen(dataOut);
+	    }
+
+	    removeEPubDRM(zipHandler, encryptionKey, encryptionKeySize);
+
+	    MetricsSpan span(metrics, "epub.write");
+	    client->zipClose(zipHandler);
+	}
+    }
+
+    void DRMProcessor::removeDRM(const ByteArray& dataIn, uPDFParser::Writer& writer,
+				 ITEM_TYPE type, const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (type == PDF)
+	{
+	    PDFIO io(dataIn, writer);
+	    removePDFDRM(io, encryptionKey, encryptionKeySize);
+	    return;
+	}
+
+	// Archive is only complete after zipClose()
+	ByteArray dataOut;
+	removeDRM(dataIn, dataOut, type, encryptionKey, encryptionKeySize);
+
+	writer.write((const char*)dataOut.data(), dataOut.length());
+    }
+
+    /* Zip records (see APPNOTE.TXT), only those read by ePub streaming DRM removal */
+    static const uint32_t ZIP_LOCAL_FILE_HEADER    = 0x04034b50;
+    static const uint32_t ZIP_DATA_DESCRIPTOR      = 0x08074b50;
+    static const uint32_t ZIP_CENTRAL_DIRECTORY    = 0x02014b50;
+    static const uint32_t ZIP_END_OF_CENTRAL_DIR   = 0x06054b50;
+    static const uint16_t ZIP_FLAG_DATA_DESCRIPTOR = 0x0008;
+    static const uint16_t ZIP_FLAG_UTF8            = 0x0800;
+    static const uint16_t ZIP_STORED               = 0;
+    static const uint16_t ZIP_DEFLATED             = 8;
+
+    static uint16_t readLE16(const unsigned char* p)
+    {
+	return p[0] | (p[1] << 8);
+    }
+
+    static uint32_t readLE32(const unsigned char* p)
+    {
+	return readLE16(p) | ((uint32_t)readLE16(p+2) << 16);
+    }
+
+    static void appendLE16(std::string& s, uint16_t value)
+    {
+	s += (char)(value & 0xFF);
+	s += (char)(value >> 8);
+    }
+
+    static void appendLE32(std::string& s, uint32_t value)
+    {
+	appendLE16(s, value & 0xFFFF);
+	appendLE16(s, value >> 16);
+    }
+
+    /**
+     * @brief CRC-32 of zip entries
+     */
+    static uint32_t zipCRC32(const unsigned char* data, unsigned int length)
+    {
+	static const std::vector<uint32_t> table = []()
+	{
+	    std::vector<uint32_t> table(256);
+	    for (uint32_t i=0; i<256; i++)
+	    {
+		uint32_t c = i;
+		for (int k=0; k<8; k++)
+		    c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		table[i] = c;
+	    }
+	    return table;
+	}();
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (unsigned int i=0; i<length; i++)
+	    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+    }
+
+    /**
+     * @brief Entry of a zip archive read (or written) sequentially
+     */
+    struct ZipEntry
+    {
+	std::string name;
+	uint16_t flags, method, time, date;
+	uint32_t crc, compressedSize, uncompressedSize;
+	const unsigned char* data; // Compressed data
+	ByteArray storage;         // Owner of data when entry is kept
+    };
+
+    /**
+     * @brief Write a zip archive entry after entry, central directory is
+     * built along and written by close() (no zip64 support)
+     */
+    class ZipStreamWriter
+    {
+    public:
+	ZipStreamWriter(uPDFParser::Writer& output): output(output), offset(0), nbEntries(0) {}
+
+	void addEntry(const ZipEntry& entry)
+	{
+	    // Sizes are now known
+	    uint16_t flags = entry.flags & ~ZIP_FLAG_DATA_DESCRIPTOR;
+	    std::string header;
+
+	    if (offset > 0xFFFFFFFF || nbEntries == 0xFFFF)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "ePub archive too big (zip64 not supported)");
+
+	    appendLE32(header, ZIP_LOCAL_FILE_HEADER);
+	    appendRecord(header, flags, entry);
+	    appendLE16(header, 0); // Extra field length
+	    header += entry.name;
+
+	    appendLE32(centralDirectory, ZIP_CENTRAL_DIRECTORY);
+	    appendLE16(centralDirectory, 20); // Version made by
+	    appendRecord(centralDirectory, flags, entry);
+	    appendLE16(centralDirectory, 0); // Extra field length
+	    appendLE16(centralDirectory, 0); // Comment length
+	    appendLE16(centralDirectory, 0); // Disk number
+	    appendLE16(centralDirectory, 0); // Internal attributes
+	    appendLE32(centralDirectory, 0); // External attributes
+	    appendLE32(centralDirectory, (uint32_t)offset);
+	    centralDirectory += entry.name;
+
+	    output.write(header.data(), header.size());
+	    output.write((const char*)entry.data, entry.compressedSize);
+
+	    offset += header.size() + entry.compressedSize;
+	    nbEntries++;
+	}
+
+	void close()
+	{
+	    std::string end;
+
+	    if (offset + centralDirectory.size() > 0xFFFFFFFF)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "ePub archive too big (zip64 not supported)");
+
+	    appendLE32(end, ZIP_END_OF_CENTRAL_DIR);
+	    appendLE16(end, 0); // Disk number
+	    appendLE16(end, 0); // Disk of central directory
+	    appendLE16(end, nbEntries);
+	    appendLE16(end, nbEntries);
+	    appendLE32(end, centralDirectory.size());
+	    appendLE32(end, (uint32_t)offset);
+	    appendLE16(end, 0); // Comment length
+
+	    output.write(centralDirectory.data(), centralDirectory.size());
+	    output.write(end.data(), end.size());
+	}
+
+    private:
+	/* Common part of local header and central directory record, up to name length */
+	static void appendRecord(std::string& s, uint16_t flags, const ZipEntry& entry)
+	{
+	    appendLE16(s, 20); // Version needed to extract
+	    appendLE16(s, flags);
+	    appendLE16(s, entry.method);
+	    appendLE16(s, entry.time);
+	    appendLE16(s, entry.date);
+	    appendLE32(s, entry.crc);
+	    appendLE32(s, entry.compressedSize);
+	    appendLE32(s, entry.uncompressedSize);
+	    appendLE16(s, entry.name.size());
+	}
+
+	uPDFParser::Writer& output;
+	uint64_t offset;
+	uint16_t nbEntries;
+	std::string centralDirectory;
+    };
+
+    /**
+     * @brief ePub DRM removal while archive is received : local entries are
+     * read as soon as they're complete, encrypted ones are decrypted and
+     * inflated, and the archive is written again entry after entry.
+     * Entries preceding META-INF/encryption.xml are kept until it's
+     * received, otherwise only the entry being received is buffered.
+     * Entries whose sizes are only in a data descriptor can't be delimited
+     * and are not supported.
+     */
+    class DRMProcessor::EPubStreamingHandler
+    {
+    public:
+	EPubStreamingHandler(DRMProcessor* processor, const unsigned char* decryptedKey, uPDFParser::Writer& output):
+	    processor(processor), decryptedKey(decryptedKey), writer(output),
+	    encryptionLoaded(false), done(false), nbFiles(0), nbBytes(0)
+	{}
+
+	void push(const unsigned char* data, unsigned int length)
+	{
+	    // Central directory is rebuilt, don't keep it
+	    if (done)
+		return;
+
+	    pending.insert(pending.end(), data, data+length);
+
+	    size_t pos = 0, entrySize;
+	    while ((entrySize = readEntry(pos)))
+		pos += entrySize;
+
+	    if (done)
+		pending.clear();
+	    else
+		pending.erase(pending.begin(), pending.begin()+pos);
+	}
+
+	void finish()
+	{
+	    if (!done)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Truncated ePub archive");
+
+	    if (!encryptionLoaded)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "No META-INF/encryption.xml in ePub archive");
+
+	    writer.close();
+
+	    if (processor->metrics)
+	    {
+		processor->metrics->add("epub.files", nbFiles);
+		processor->metrics->add("decrypt.bytes", nbBytes);
+	    }
+	}
+
+    private:
+	/**
+	 * @brief Read entry at pos in pending data
+	 *
+	 * @return Size of entry, 0 if it's not complete (or archive's end is reached)
+	 */
+	size_t readEntry(size_t pos)
+	{
+	    const unsigned char* header = pending.data() + pos;
+	    size_t available = pending.size() - pos;
+
+	    if (available < 4)
+		return 0;
+
+	    uint32_t signature = readLE32(header);
+	    if (signature != ZIP_LOCAL_FILE_HEADER)
+	    {
+		if (signature != ZIP_CENTRAL_DIRECTORY && signature != ZIP_END_OF_CENTRAL_DIR)
+		    EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid ePub archive");
+
+		done = true;
+		return 0;
+	    }
+
+	    if (available < 30)
+		return 0;
+
+	    ZipEntry entry;
+	    entry.flags            = readLE16(header+6);
+	    entry.method           = readLE16(header+8);
+	    entry.time             = readLE16(header+10);
+	    entry.date             = readLE16(header+12);
+	    entry.crc              = readLE32(header+14);
+	    entry.compressedSize   = readLE32(header+18);
+	    entry.uncompressedSize = readLE32(header+22);
+	    uint16_t nameLength    = readLE16(header+26);
+	    uint16_t extraLength   = readLE16(header+28);
+
+	    if ((entry.flags & ZIP_FLAG_DATA_DESCRIPTOR) && !entry.compressedSize)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "ePub archive entries without size not supported");
+
+	    if (entry.compressedSize == 0xFFFFFFFF || entry.uncompressedSize == 0xFFFFFFFF)
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "ePub archive too big (zip64 not supported)");
+
+	    size_t size = 30 + nameLength + extraLength + (size_t)entry.compressedSize;
+
+	    if (entry.flags & ZIP_FLAG_DATA_DESCRIPTOR)
+	    {
+		// CRC and sizes, optionally preceded by a signature. Archive
+		// goes on after it (central directory), so wait for 16 bytes
+		if (available < size + 16)
+		    return 0;
+
+		const unsigned char* descriptor = header + size;
+		if (readLE32(descriptor) == ZIP_DATA_DESCRIPTOR)
+		{
+		    descriptor += 4;
+		    size += 4;
+		}
+
+		entry.crc              = readLE32(descriptor);
+		entry.uncompressedSize = readLE32(descriptor+8);
+		size += 12;
+	    }
+	    else if (available < size)
+		return 0;
+
+	    entry.name = std::string((const char*)header+30, nameLength);
+	    entry.data = header + 30 + nameLength + extraLength;
+
+	    handleEntry(entry);
+
+	    return size;
+	}
+
+	void handleEntry(ZipEntry& entry)
+	{
+	    // Not needed anymore
+	    if (entry.name == "META-INF/rights.xml")
+		return;
+
+	    if (entry.name == "META-INF/encryption.xml")
+		return loadEncryptionXML(entry);
+
+	    if (!encryptionLoaded)
+	    {
+		entry.storage = ByteArray(entry.data, entry.compressedSize);
+		entry.data = entry.storage.data();
+		delayed.push_back(entry);
+		return;
+	    }
+
+	    writeEntry(entry);
+	}
+
+	void loadEncryptionXML(ZipEntry& entry)
+	{
+	    ByteArray stored(entry.data, entry.compressedSize);
+	    ByteArray content;
+
+	    if (entry.method == ZIP_DEFLATED)
+		processor->client->inflate(stored, content, -15, entry.uncompressedSize);
+	    else if (entry.method == ZIP_STORED)
+		content = stored;
+	    else
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Unsupported compression method " << entry.method << " for " << entry.name);
+
+	    pugi::xml_document encryptionDoc;
+	    encryptionDoc.load_buffer(content.data(), content.length());
+
+	    pugi::xpath_node_set nodeSet = encryptionDoc.select_nodes("//EncryptedData");
+	    bool removeEncryptionXML = true;
+
+	    for (pugi::xpath_node_set::const_iterator it = nodeSet.begin();
+		 it != nodeSet.end(); ++it)
+	    {
+		std::string encryptedFile;
+
+		if (getEncryptedFile(it->node(), encryptedFile))
+		{
+		    encryptedFiles.insert(encryptedFile);
+		    it->node().parent().remove_child(it->node());
+		}
+		else
+		    removeEncryptionXML = false;
+	    }
+
+	    encryptionLoaded = true;
+
+	    std::vector<ZipEntry>::iterator it;
+	    for (it = delayed.begin(); it != delayed.end(); it++)
+		writeEntry(*it);
+	    delayed.clear();
+
+	    if (!removeEncryptionXML)
+	    {
+		StringXMLWriter xmlWriter;
+		encryptionDoc.save(xmlWriter, "  ");
+		ByteArray ba(xmlWriter.getResult());
+		writeData(entry, ba, true);
+	    }
+	}
+
+	void writeEntry(ZipEntry& entry)
+	{
+	    if (!encryptedFiles.count(entry.name))
+		return writer.addEntry(entry);
+
+	    ByteArray clearData;
+
+	    try
+	    {
+		processor->decryptEPubFile(decryptedKey, entry.data, entry.compressedSize, clearData);
+	    }
+	    catch(gourou::Exception& e)
+	    {
+		if (e.getErrorCode() != CLIENT_ZIP_ERROR)
+		    throw;
+
+		GOUROU_LOG(ERROR, e.what() << std::endl << "Skip file " << entry.name);
+		return writer.addEntry(entry);
+	    }
+
+	    nbFiles++;
+	    nbBytes += entry.compressedSize;
+
+	    writeData(entry, clearData, !processor->storeCompressedResources || !isCompressedResource(entry.name));
+	}
+
+	/**
+	 * @brief Write entry with new (uncompressed) content
+	 */
+	void writeData(ZipEntry& entry, ByteArray& data, bool compress)
+	{
+	    entry.flags &= ZIP_FLAG_UTF8;
+	    entry.crc = zipCRC32(data.data(), data.length());
+	    entry.uncompressedSize = data.length();
+
+	    if (compress)
+	    {
+		entry.storage = ByteArray(true);
+		processor->client->deflate(data, entry.storage);
+		entry.method = ZIP_DEFLATED;
+	    }
+	    else
+	    {
+		entry.storage = data;
+		entry.method = ZIP_STORED;
+	    }
+
+	    entry.data = entry.storage.data();
+	    entry.compressedSize = entry.storage.length();
+
+	    writer.addEntry(entry);
+	}
+
+	DRMProcessor* processor;
+	const unsigned char* decryptedKey;
+	ZipStreamWriter writer;
+	std::vector<unsigned char> pending;
+	std::vector<ZipEntry> delayed;
+	std::set<std::string> encryptedFiles;
+	bool encryptionLoaded, done;
+	uint64_t nbFiles, nbBytes;
+    };
+
+    /**
+     * @brief Body of fused download and DRM removal : item type is known
+     * once reply headers are received, then each chunk is given to PDF
+     * parser (incremental mode) or to ePub handler
+     */
+    class DRMProcessor::DRMRemovalSink : public HTTPResponseSink
+    {
+    public:
+	DRMRemovalSink(DRMProcessor* processor, FulfillmentItem* item,
+		       std::map<std::string, std::string>& headers,
+		       const unsigned char* decryptedKey, uPDFParser::Writer& output):
+	    processor(processor), item(item), headers(headers), decryptedKey(decryptedKey),
+	    output(output), started(false), type(EPUB), pdfHandler(0), epubHandler(0), received(0)
+	{}
+
+	~DRMRemovalSink()
+	{
+	    delete pdfHandler;
+	    delete epubHandler;
+	}
+
+	virtual void write(const unsigned char* data, unsigned int length)
+	{
+	    start();
+	    received += length;
+
+	    if (type == EPUB)
+		return epubHandler->push(data, length);
+
+	    try
+	    {
+		parser.push(data, length);
+	    }
+	    catch(std::invalid_argument& e)
+	    {
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid PDF (" << e.what() << ")");
+	    }
+	}
+
+	/**
+	 * @brief Process end of body, once it has been fully received
+	 */
+	ITEM_TYPE finish()
+	{
+	    start();
+
+	    if (type == EPUB)
+	    {
+		epubHandler->finish();
+		return type;
+	    }
+
+	    try
+	    {
+		parser.endPush();
+		pdfHandler->flush();
+	    }
+	    catch(std::invalid_argument& e)
+	    {
+		EXCEPTION(DRM_FORMAT_NOT_SUPPORTED, "Invalid PDF (" << e.what() << ")");
+	    }
+
+	    // Objects may have been decrypted with a wrong key
+	    if (!pdfHandler->hasEBXHandler())
+	    {
+		EXCEPTION(DRM_ERR_ENCRYPTION_KEY, "EBX_HANDLER not found");
+	    }
+
+	    pdfHandler->beginWrite();
+
+	    uPDFParser::Object& trailer = parser.getTrailer();
+	    trailer.deleteKey(uPDFParser::NAME_ENCRYPT);
+
+	    parser.endWrite();
+
+	    return type;
+	}
+
+	uint64_t receivedBytes() { return received; }
+
+    private:
+	void start()
+	{
+	    if (started)
+		return;
+
+	    started = true;
+	    type = processor->getItemType(item, headers);
+
+	    if (type == EPUB)
+	    {
+		epubHandler = new EPubStreamingHandler(processor, decryptedKey, output);
+		return;
+	    }
+
+	    // Only decrypted objects are serialized again. Key comes from
+	    // item : only EBX version 4 is supported (see decryptEBXHandlerKey())
+	    parser.setCopyCleanObjects(true);
+	    pdfHandler = new PDFStreamingHandler(processor, parser, 4, decryptedKey, -1,
+						 std::vector<uPDFParser::XRefValue>(), true, &output);
+	    parser.beginPush(pdfHandler);
+	}
+
+	DRMProcessor* processor;
+	FulfillmentItem* item;
+	std::map<std::string, std::string>& headers;
+	const unsigned char* decryptedKey;
+	uPDFParser::Writer& output;
+	bool started;
+	ITEM_TYPE type;
+	uPDFParser::Parser parser;
+	PDFStreamingHandler* pdfHandler;
+	EPubStreamingHandler* epubHandler;
+	uint64_t received;
+    };
+
+    DRMProcessor::ITEM_TYPE DRMProcessor::downloadAndRemoveDRM(FulfillmentItem* item, uPDFParser::Writer& writer,
+							       const unsigned char* encryptionKey, unsigned encryptionKeySize)
+    {
+	if (!item)
+	    EXCEPTION(DW_NO_ITEM, "No item");
+
+	unsigned char decryptedKey[16];
+
+	// Fail before downloading if key cannot be retrieved
+	if (encryptionKey)
+	{
+	    pugi::xml_document noRights;
+	    decryptADEPTKey(noRights, decryptedKey, encryptionKey, encryptionKeySize);
+	}
+	else
+	    decryptItemKey(item, decryptedKey);
+
+	std::map<std::string, std::string> headers;
+	DRMRemovalSink sink(this, item, headers, decryptedKey, writer);
+	ITEM_TYPE res;
+
+	{
+	    MetricsSpan span(metrics, "download");
+	    client->downloadHTTPRequest(item->getDownloadURL(), sink, &headers);
+	    res = sink.finish();
+	}
+
+	if (metrics)
+	    metrics->add("download.bytes", sink.receivedBytes());
+
+	return res;
     }
 }
@@ -0,0 +1,271 @@
+/*
+  Copyright 2021 Grégory Soutadé
+
+  This file is part of libgourou.
+
+  libgourou is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libgourou is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libgourou. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <shared_mutex>
+
+#include <libgourou_log.h>
+
+namespace gourou
+{
+    GOUROU_LOG_LEVEL logLevel = LG_LOG_WARN;
+
+    GOUROU_LOG_LEVEL getLogLevel() {return logLevel;}
+    void setLogLevel(GOUROU_LOG_LEVEL level) {logLevel = level;}
+
+    const char* logLevelName(GOUROU_LOG_LEVEL level)
+    {
+	switch(level)
+	{
+	case LG_LOG_ERROR: return "ERROR";
+	case LG_LOG_WARN:  return "WARN";
+	case LG_LOG_INFO:  return "INFO";
+	case LG_LOG_DEBUG: return "DEBUG";
+	case LG_LOG_TRACE: return "TRACE";
+	}
+
+	return "UNKNOWN";
+    }
+
+    /* Default sink : no flush per message, except for errors */
+    class CoutLogSink : public LogSink
+    {
+    public:
+	virtual void log(GOUROU_LOG_LEVEL level, const char*, int, const std::string& message)
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    std::cout << message << '\n';
+	    if (level == LG_LOG_ERROR)
+		std::cout << std::flush;
+	}
+
+	virtual void flush()
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    std::cout << std::flush;
+	}
+
+    private:
+	std::mutex mutex;
+    };
+
+    static CoutLogSink coutLogSink;
+    static LogSink* logSink = &coutLogSink;
+    /* Held (shared) while a message is written to logSink, so that a
+       replaced sink is no more in use once setLogSink() returns */
+    static std::shared_mutex logSinkLock;
+
+    void setLogSink(LogSink* sink)
+    {
+	std::unique_lock<std::shared_mutex> lock(logSinkLock);
+	logSink = sink ? sink : &coutLogSink;
+    }
+
+    /* Restore default sink if sink is the current one */
+    static void removeLogSink(LogSink* sink)
+    {
+	std::unique_lock<std::shared_mutex> lock(logSinkLock);
+	if (logSink == sink)
+	    logSink = &coutLogSink;
+    }
+
+    LogSink* getLogSink()
+    {
+	std::shared_lock<std::shared_mutex> lock(logSinkLock);
+	return logSink;
+    }
+
+    void logMessage(GOUROU_LOG_LEVEL level, const char* file, int line, const std::string& message)
+    {
+	std::shared_lock<std::shared_mutex> lock(logSinkLock);
+	logSink->log(level, file, line, message);
+    }
+
+    static void appendJSONString(std::string& out, const char* str, size_t length)
+    {
+	out += '"';
+	for (size_t i=0; i<length; i++)
+	{
+	    unsigned char c = str[i];
+	    switch(c)
+	    {
+	    case '"':  out += "\\\""; break;
+	    case '\\': out += "\\\\"; break;
+	    case '\n': out += "\\n"; break;
+	    case '\r': out += "\\r"; break;
+	    case '\t': out += "\\t"; break;
+	    default:
+		if (c < 0x20)
+		{
+		    char tmp[8];
+		    snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+		    out += tmp;
+		}
+		else
+		    out += c;
+	    }
+	}
+	out += '"';
+    }
+
+    AsyncLogSink::AsyncLogSink(int fd, bool json, size_t maxPending):
+	fd(fd), json(json), maxPending(maxPending), dropped(0),
+	writing(false), stop(false)
+    {
+	worker = std::thread(&AsyncLogSink::run, this);
+    }
+
+    AsyncLogSink::~AsyncLogSink()
+    {
+	/* Waits for in flight log() calls */
+	removeLogSink(this);
+
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    stop = true;
+	}
+	wakeUp.notify_one();
+	worker.join();
+    }
+
+    void AsyncLogSink::log(GOUROU_LOG_LEVEL level, const char* file, int line, const std::string& message)
+    {
+	std::string entry;
+
+	/* Format out of lock */
+	if (json)
+	{
+	    struct timeval tv;
+	    struct tm tm;
+	    char tmp[64];
+
+	    gettimeofday(&tv, 0);
+	    gmtime_r(&tv.tv_sec, &tm);
+	    strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	    const char* basename = strrchr(file, '/');
+	    basename = basename ? basename+1 : file;
+
+	    entry.reserve(message.size() + 96);
+	    entry += "{\"time\":\"";
+	    entry += tmp;
+	    snprintf(tmp, sizeof(tmp), ".%03dZ\",\"level\":\"", (int)(tv.tv_usec/1000));
+	    entry += tmp;
+	    entry += logLevelName(level);
+	    entry += "\",\"file\":";
+	    appendJSONString(entry, basename, strlen(basename));
+	    snprintf(tmp, sizeof(tmp), ",\"line\":%d,\"message\":", line);
+	    entry += tmp;
+	    appendJSONString(entry, message.data(), message.size());
+	    entry += "}\n";
+	}
+	else
+	{
+	    entry.reserve(message.size() + 1);
+	    entry += message;
+	    entry += '\n';
+	}
+
+	bool wasEmpty;
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    if (pending.size() + entry.size() > maxPending)
+	    {
+		dropped++;
+		return;
+	    }
+	    wasEmpty = pending.empty();
+	    pending += entry;
+	}
+
+	/* Worker is already awake if there was something to write */
+	if (wasEmpty)
+	    wakeUp.notify_one();
+    }
+
+    void AsyncLogSink::flush()
+    {
+	std::unique_lock<std::mutex> lock(mutex);
+	drained.wait(lock, [this] { return pending.empty() && !writing; });
+    }
+
+    void AsyncLogSink::output(const std::string& data)
+    {
+	size_t done = 0;
+
+	while (done < data.size())
+	{
+	    ssize_t ret = ::write(fd, data.data()+done, data.size()-done);
+	    if (ret < 0)
+	    {
+		if (errno == EINTR)
+		    continue;
+		/* Nowhere to report it */
+		return;
+	    }
+	    done += ret;
+	}
+    }
+
+    void AsyncLogSink::run()
+    {
+	std::string buffer;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+	    wakeUp.wait(lock, [this] { return stop || !pending.empty(); });
+
+	    if (pending.empty())
+		break;
+
+	    buffer.clear();
+	    buffer.swap(pending);
+	    if (dropped)
+	    {
+		std::string message = std::to_string(dropped) + " log messages dropped";
+		if (json)
+		{
+		    std::string entry = "{\"level\":\"WARN\",\"message\":";
+		    appendJSONString(entry, message.data(), message.size());
+		    buffer += entry + "}\n";
+		}
+		else
+		    buffer += message + "\n";
+		dropped = 0;
+	    }
+	    writing = true;
+
+	    lock.unlock();
+	    output(buffer);
+	    lock.lock();
+
+	    writing = false;
+	    if (pending.empty())
+		drained.notify_all();
+	}
+
+	drained.notify_all();
+    }
+}
@@ -0,0 +1,101 @@
+/*
+  Copyright 2021 Grégory Soutadé
+
+  This file is part of libgourou.
+
+  libgourou is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libgourou is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libgourou. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+namespace gourou
+{
+    void Metrics::addTime(const std::string& phase, double seconds)
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	Phase& cur = _phases[phase];
+	cur.time += seconds;
+	cur.count++;
+    }
+
+    void Metrics::add(const std::string& counter, uint64_t value)
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	_counters[counter] += value;
+    }
+
+    std::map<std::string, Metrics::Phase> Metrics::phases()
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return _phases;
+    }
+
+    std::map<std::string, uint64_t> Metrics::counters()
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return _counters;
+    }
+
+    uint64_t Metrics::counter(const std::string& counter)
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::map<std::string, uint64_t>::iterator it = _counters.find(counter);
+	return (it != _counters.end()) ? it->second : 0;
+    }
+
+    void Metrics::reset()
+    {
+	std::lock_guard<std::mutex> guard(lock);
+
+	_phases.clear();
+	_counters.clear();
+    }
+
+    std::string Metrics::toJSON()
+    {
+	std::lock_guard<std::mutex> guard(lock);
+	std::string res = "{\"phases\": {";
+	char tmp[64];
+	bool first = true;
+
+	/* Names are identifiers chosen by callers, not escaped */
+	for (std::map<std::string, Phase>::iterator it = _phases.begin(); it != _phases.end(); it++)
+	{
+	    snprintf(tmp, sizeof(tmp), "{\"time\": %.6f, \"count\": %lu}", it->second.time, it->second.count);
+	    res += std::string(first ? "" : ", ") + "\"" + it->first + "\": " + tmp;
+	    first = false;
+	}
+
+	res += "}, \"counters\": {";
+	first = true;
+
+	for (std::map<std::string, uint64_t>::iterator it = _counters.begin(); it != _counters.end(); it++)
+	{
+	    snprintf(tmp, sizeof(tmp), "%llu", (unsigned long long)it->second);
+	    res += std::string(first ? "" : ", ") + "\"" + it->first + "\": " + tmp;
+	    first = false;
+	}
+
+	res += "}}";
+
+	return res;
+    }
+}
@@ -142,7 +142,7 @@ namespace gourou {
 	user->activationFile = dirName + "/activation.xml";
 	user->parseActivationFile(false);
 
-	pugi::xpath_node nodeActivationInfo = user->activationDoc.select_node("activation_info");
+	pugi::xpath_node nodeActivationInfo = user->activationDoc.select_node("activationInfo");
 	pugi::xpath_node nodeActivationServiceInfo = nodeActivationInfo.node().select_node("adept:activationServiceInfo");
 	pugi::xml_node activationInfo;
 	pugi::xml_node activationServiceInfo;
@@ -29,8 +29,16 @@
 
 #include <algorithm> 
 #include <cctype>
+#include <list>
 #include <locale>
+#include <limits.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <thread>
+#include <chrono>
+#include <exception>
 
 #define OPENSSL_NO_DEPRECATED 1
 
@@ -49,8 +57,33 @@
 #include <libgourou_common.h>
 #include "drmprocessorclientimpl.h"
 
+/* ERR_error_string() with a NULL buffer is not thread safe */
+static std::string opensslError()
+{
+    char buffer[256];
+
+    ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+
+    return std::string(buffer);
+}
+
+/* HTTP interface */
+#define HTTP_MAX_IDLE_HANDLES 4
+
+static std::mutex curlShareLocks[CURL_LOCK_DATA_LAST];
+
+static void curlShareLock(CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void* /*userptr*/)
+{
+    curlShareLocks[data].lock();
+}
+
+static void curlShareUnlock(CURL* /*handle*/, curl_lock_data data, void* /*userptr*/)
+{
+    curlShareLocks[data].unlock();
+}
+
 DRMProcessorClientImpl::DRMProcessorClientImpl():
-    legacy(0), deflt(0)
+    legacy(0), deflt(0), curlShare(0), downloadConnections(1)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
     legacy = OSSL_PROVIDER_load(NULL, "legacy");
@@ -69,10 +102,31 @@ DRMProcessorClientImpl::DRMProcessorClientImpl():
 #endif
     
     mkstemp(cookiejar);
+
+    initCryptoObjects();
+
+    resetConnectionStats();
+
+    defaultRetry = TransferContext().retry;
+
+    // Share DNS cache, TLS sessions, connections and cookies between all our requests
+    CURLSH* share = curl_share_init();
+    if (share)
+    {
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, curlShareLock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, curlShareUnlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	curlShare = share;
+    }
 }
 
 DRMProcessorClientImpl::~DRMProcessorClientImpl()
 {
+    freeCryptoObjects();
+
 #if OPENSSL_VERSION_MAJOR >= 3
     if (legacy)
 	OSSL_PROVIDER_unload(legacy);
@@ -81,19 +135,111 @@ DRMProcessorClientImpl::~DRMProcessorClientImpl()
 	OSSL_PROVIDER_unload(deflt);
 #endif
 
+    std::vector<void*>::iterator it;
+    for (it = curlHandles.begin(); it != curlHandles.end(); it++)
+	curl_easy_cleanup((CURL*)*it);
+
+    if (curlShare)
+	curl_share_cleanup((CURLSH*)curlShare);
+
     unlink(cookiejar);
 }
 
+/*
+ * Per thread crypto contexts used by one shot decrypt/encrypt/digest calls.
+ * They're allocated once and only rekeyed between calls, which matters
+ * when removing DRM as every string and stream of a PDF is decrypted
+ * separately.
+ */
+struct CryptoSession
+{
+    static const int CIPHER_COUNT = DRMProcessorClientImpl::CIPHER_COUNT;
+
+    CryptoSession(): mdCtx(0)
+    {
+	memset(cipherCtx, 0, sizeof(cipherCtx));
+	memset(cipher, 0, sizeof(cipher));
+    }
+
+    ~CryptoSession()
+    {
+	for (int i=0; i<CIPHER_COUNT; i++)
+	    for (int enc=0; enc<2; enc++)
+		if (cipherCtx[i][enc])
+		    EVP_CIPHER_CTX_free(cipherCtx[i][enc]);
+
+	if (mdCtx)
+	    EVP_MD_CTX_free(mdCtx);
+    }
+
+    /* Indexed by cipher and direction (0 decrypt, 1 encrypt) */
+    EVP_CIPHER_CTX* cipherCtx[CIPHER_COUNT][2];
+    const EVP_CIPHER* cipher[CIPHER_COUNT][2];
+    EVP_MD_CTX* mdCtx;
+};
+
+static thread_local CryptoSession cryptoSession;
+
 /* Digest interface */
+void DRMProcessorClientImpl::initCryptoObjects()
+{
+    static const char* digestNames[] = {"md5", "sha1", "sha256"};
+
+#if OPENSSL_VERSION_MAJOR >= 3
+    ciphers[CIPHER_AES_128_ECB] = EVP_CIPHER_fetch(NULL, "AES-128-ECB", NULL);
+    ciphers[CIPHER_AES_128_CBC] = EVP_CIPHER_fetch(NULL, "AES-128-CBC", NULL);
+    ciphers[CIPHER_RC4] = EVP_CIPHER_fetch(NULL, "RC4", NULL);
+
+    for (unsigned int i=0; i<sizeof(digestNames)/sizeof(digestNames[0]); i++)
+	digests[digestNames[i]] = EVP_MD_fetch(NULL, digestNames[i], NULL);
+#else
+    ciphers[CIPHER_AES_128_ECB] = (void*)EVP_aes_128_ecb();
+    ciphers[CIPHER_AES_128_CBC] = (void*)EVP_aes_128_cbc();
+    ciphers[CIPHER_RC4] = (void*)EVP_rc4();
+
+    for (unsigned int i=0; i<sizeof(digestNames)/sizeof(digestNames[0]); i++)
+	digests[digestNames[i]] = (void*)EVP_get_digestbyname(digestNames[i]);
+#endif
+
+    for (int i=0; i<CIPHER_COUNT; i++)
+	if (!ciphers[i])
+	    EXCEPTION(gourou::CLIENT_OSSL_ERROR, "Error, unable to fetch cipher: " << opensslError());
+}
+
+void DRMProcessorClientImpl::freeCryptoObjects()
+{
+#if OPENSSL_VERSION_MAJOR >= 3
+    for (int i=0; i<CIPHER_COUNT; i++)
+	if (ciphers[i])
+	    EVP_CIPHER_free((EVP_CIPHER*)ciphers[i]);
+
+    std::map<std::string, void*>::iterator it;
+    for (it = digests.begin(); it != digests.end(); it++)
+	if (it->second)
+	    EVP_MD_free((EVP_MD*)it->second);
+#endif
+}
+
+const void* DRMProcessorClientImpl::getDigest(const std::string& digestName)
+{
+    // Filled at construction time, so no lock is needed
+    std::map<std::string, void*>::const_iterator it = digests.find(digestName);
+
+    if (it != digests.end() && it->second)
+	return it->second;
+
+    return EVP_get_digestbyname(digestName.c_str());
+}
+
 void* DRMProcessorClientImpl::createDigest(const std::string& digestName)
 {
     EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
-    const EVP_MD* md = EVP_get_digestbyname(digestName.c_str());
+    const EVP_MD* md = (const EVP_MD*)getDigest(digestName);
 
-    if (EVP_DigestInit(md_ctx, md) != 1)
+    if (EVP_DigestInit_ex(md_ctx, md, NULL) != 1)
     {
 	EVP_MD_CTX_free(md_ctx);
-	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, opensslError());
     }
 
     return md_ctx;
@@ -102,23 +248,34 @@ void* DRMProcessorClientImpl::createDigest(const std::string& digestName)
 void DRMProcessorClientImpl::digestUpdate(void* handler, unsigned char* data, unsigned int length)
 {
     if (EVP_DigestUpdate((EVP_MD_CTX *)handler, data, length) != 1)
-	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::digestFinalize(void* handler, unsigned char* digestOut)
 {
-    int res = EVP_DigestFinal((EVP_MD_CTX *)handler, digestOut, NULL);
+    int res = EVP_DigestFinal_ex((EVP_MD_CTX *)handler, digestOut, NULL);
     EVP_MD_CTX_free((EVP_MD_CTX *)handler);
 
     if (res <= 0)
-	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::digest(const std::string& digestName, unsigned char* data, unsigned int length, unsigned char* digestOut)
 {
-    void* handler = createDigest(digestName);
-    digestUpdate(handler, data, length);
-    digestFinalize(handler, digestOut);
+    EVP_MD_CTX* md_ctx = cryptoSession.mdCtx;
+
+    if (!md_ctx)
+    {
+	md_ctx = EVP_MD_CTX_new();
+	if (!md_ctx)
+	    EXCEPTION(gourou::CLIENT_DIGEST_ERROR, opensslError());
+	cryptoSession.mdCtx = md_ctx;
+    }
+
+    if (EVP_DigestInit_ex(md_ctx, (const EVP_MD*)getDigest(digestName), NULL) != 1 ||
+	EVP_DigestUpdate(md_ctx, data, length) != 1 ||
+	EVP_DigestFinal_ex(md_ctx, digestOut, NULL) != 1)
+	EXCEPTION(gourou::CLIENT_DIGEST_ERROR, opensslError());
 }
 
 /* Random interface */
@@ -127,47 +284,157 @@ void DRMProcessorClientImpl::randBytes(unsigned char* bytesOut, unsigned int len
     RAND_bytes(bytesOut, length);
 }
 
-/* HTTP interface */
 #define HTTP_REQ_MAX_RETRY  5
+#define HTTP_REQ_RETRY_DELAY 250 // ms, multiplied by attempt number
 #define DISPLAY_THRESHOLD   10*1024 // Threshold to display download progression
-static unsigned downloadedBytes;
 
-static int downloadProgress(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
-			    curl_off_t ultotal, curl_off_t ulnow)
+DRMProcessorClientImpl::TransferContext::TransferContext()
+{
+    retry.maxAttempts = HTTP_REQ_MAX_RETRY;
+    retry.delayMs = HTTP_REQ_RETRY_DELAY;
+    memset(&stats, 0, sizeof(stats));
+}
+
+static thread_local DRMProcessorClientImpl::TransferStats lastTransferStats;
+
+static void reportProgress(DRMProcessorClientImpl::TransferContext* transfer, uint64_t received, uint64_t total)
 {
-// For "big" files only
-    if (dltotal >= DISPLAY_THRESHOLD && gourou::logLevel >= gourou::LG_LOG_WARN)
+    if (transfer->progress)
+    {
+	transfer->progress(received, total);
+	return;
+    }
+
+    // For "big" files only
+    if (total >= DISPLAY_THRESHOLD && gourou::logLevel >= gourou::LG_LOG_WARN)
     {
-	int percent = 0;
-	if (dltotal)
-	    percent = (dlnow * 100) / dltotal;
+	int percent = (received * 100) / total;
 
 	std::cout << "\rDownload " << percent << "%" << std::flush;
     }
+}
+
+/* State of a single stream request */
+struct CurlRequestContext
+{
+    CURL* curl;
+    int fd;
+    gourou::ByteArray* replyData;
+    gourou::HTTPResponseSink* sink;
+    DRMProcessorClientImpl::TransferContext* transfer;
+    uint64_t attemptOffset; // Resource offset of current attempt
+    std::exception_ptr sinkError; // Raised by sink, rethrown after transfer
+};
+
+static int downloadProgress(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+			    curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+{
+    CurlRequestContext* context = (CurlRequestContext*) clientp;
+
+    if (dltotal > 0)
+    {
+	context->transfer->stats.contentLength = context->attemptOffset + dltotal;
+	reportProgress(context->transfer, context->attemptOffset + dlnow,
+		       context->transfer->stats.contentLength);
+    }
 
     return 0;
 }
 
 static size_t curlRead(void *data, size_t size, size_t nmemb, void *userp)
 {
-    gourou::ByteArray* replyData = (gourou::ByteArray*) userp;
+    CurlRequestContext* context = (CurlRequestContext*) userp;
+    gourou::ByteArray* replyData = context->replyData;
+
+    // First chunk, pre allocate buffer if size is known
+    if (!replyData->length())
+    {
+	curl_off_t contentLength = -1;
+	if (curl_easy_getinfo(context->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength) == CURLE_OK &&
+	    contentLength > 0 && contentLength < UINT_MAX)
+	    replyData->reserve((unsigned int)contentLength);
+    }
     
     replyData->append((unsigned char*)data, size*nmemb);
 
+    context->transfer->stats.bytesReceived += size*nmemb;
+
+    return size*nmemb;
+}
+
+static size_t curlReadSink(void *data, size_t size, size_t nmemb, void *userp)
+{
+    CurlRequestContext* context = (CurlRequestContext*) userp;
+    DRMProcessorClientImpl::TransferStats& stats = context->transfer->stats;
+    long http_code = 0;
+
+    curl_easy_getinfo(context->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    // Error page is not part of the body (error is reported after transfer)
+    if (http_code >= 400)
+	return size*nmemb;
+
+    // Data already given to sink can't be received again
+    if (context->attemptOffset && http_code != 206)
+    {
+	GOUROU_LOG(ERROR, "Server doesn't resume download (HTTP code " << http_code << ")");
+	return 0;
+    }
+
+    try
+    {
+	if (!stats.bytesReceived)
+	{
+	    curl_off_t contentLength = -1;
+	    if (curl_easy_getinfo(context->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength) == CURLE_OK &&
+		contentLength > 0)
+		context->sink->expectedSize((uint64_t)contentLength);
+	}
+
+	context->sink->write((const unsigned char*)data, size*nmemb);
+    }
+    catch (...)
+    {
+	context->sinkError = std::current_exception();
+	return 0;
+    }
+
+    stats.bytesReceived += size*nmemb;
+
     return size*nmemb;
 }
 
 static size_t curlReadFd(void *data, size_t size, size_t nmemb, void *userp)
 {
-    int fd = *(int*) userp;
+    CurlRequestContext* context = (CurlRequestContext*) userp;
 
-    size_t res = write(fd, data, size*nmemb);
+    ssize_t res = write(context->fd, data, size*nmemb);
 
-    downloadedBytes += res;
+    if (res <= 0)
+	return 0;
+
+    context->transfer->stats.bytesReceived += res;
 
     return res;
 }
 
+/*
+ * HTTP/2 servers send header names in lower case: use canonical
+ * form (Content-Type) whatever protocol is used
+ */
+static std::string canonicalHeaderName(std::string name)
+{
+    bool upper = true;
+
+    for (unsigned int i=0; i<name.size(); i++)
+    {
+	name[i] = upper ? std::toupper(name[i]) : std::tolower(name[i]);
+	upper = (name[i] == '-');
+    }
+
+    return name;
+}
+
 static size_t curlHeaders(char *buffer, size_t size, size_t nitems, void *userdata)
 {
     std::map<std::string, std::string>* responseHeaders = (std::map<std::string, std::string>*)userdata;
@@ -181,48 +448,562 @@ static size_t curlHeaders(char *buffer, size_t size, size_t nitems, void *userda
 	std::string key   = std::string(buffer, pos);
 	std::string value = std::string(&buffer[pos+1], (size*nitems)-(pos+1));
 
-	key = gourou::trim(key);
+	key = canonicalHeaderName(gourou::trim(key));
 	value = gourou::trim(value);
 
 	(*responseHeaders)[key] = value;
     
-	if (gourou::logLevel >= gourou::LG_LOG_DEBUG)
-	    std::cout << key << " : "  << value << std::endl;
+	GOUROU_LOG(DEBUG, key << " : "  << value);
     }
     
     return size*nitems;
 }
 
+void* DRMProcessorClientImpl::acquireCURLHandle()
+{
+    CURL* curl = 0;
+
+    {
+	std::lock_guard<std::mutex> lock(curlLock);
+	if (curlHandles.size())
+	{
+	    curl = (CURL*)curlHandles.back();
+	    curlHandles.pop_back();
+	}
+    }
+
+    if (!curl)
+    {
+	curl = curl_easy_init();
+
+	if (!curl)
+	    EXCEPTION(gourou::CLIENT_NETWORK_ERROR, "Unable to init curl");
+
+	// Share is kept by curl_easy_reset()
+	if (curlShare)
+	    curl_easy_setopt(curl, CURLOPT_SHARE, (CURLSH*)curlShare);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#ifdef CURL_HTTP_VERSION_2TLS
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+
+    return curl;
+}
+
+/*
+ * Handlers are reused, but each request starts with a clean state.
+ * Open connections are kept into share (or handler cache). Session
+ * cookies live in share memory too : nothing is written to cookie jar.
+ * Without share, cookies are dumped to cookie jar and forgotten, next
+ * request reads them back from it (see enableCookies()).
+ */
+void DRMProcessorClientImpl::releaseCURLHandle(void* handle)
+{
+    CURL* curl = (CURL*)handle;
+
+    if (!curlShare)
+    {
+	std::lock_guard<std::mutex> lock(cookieLock);
+	curl_easy_setopt(curl, CURLOPT_COOKIELIST, "FLUSH");
+	curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");
+    }
+    curl_easy_reset(curl);
+
+    std::lock_guard<std::mutex> lock(curlLock);
+
+    if (curlHandles.size() < HTTP_MAX_IDLE_HANDLES)
+	curlHandles.push_back(curl);
+    else
+	curl_easy_cleanup(curl);
+}
+
+/*
+ * Turn on cookies engine. Pooled handles run concurrently, so without
+ * share cookie jar is only accessed behind cookieLock : it's read now
+ * (RELOAD) instead of when transfer starts, and written back by
+ * releaseCURLHandle() if saveCookies is set.
+ */
+void DRMProcessorClientImpl::enableCookies(void* handle, bool saveCookies)
+{
+    CURL* curl = (CURL*)handle;
+
+    if (curlShare)
+    {
+	// Empty file name : no file, shared cookies only
+	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+	return;
+    }
+
+    std::lock_guard<std::mutex> lock(cookieLock);
+    curl_easy_setopt(curl, CURLOPT_COOKIEFILE, cookiejar);
+    curl_easy_setopt(curl, CURLOPT_COOKIELIST, "RELOAD");
+    if (saveCookies)
+	curl_easy_setopt(curl, CURLOPT_COOKIEJAR, cookiejar);
+}
+
+DRMProcessorClientImpl::CURLHandleGuard::CURLHandleGuard(DRMProcessorClientImpl* client) :
+    client(client), handle(client->acquireCURLHandle())
+{}
+
+DRMProcessorClientImpl::CURLHandleGuard::~CURLHandleGuard()
+{
+    release();
+}
+
+void DRMProcessorClientImpl::CURLHandleGuard::release()
+{
+    if (handle)
+    {
+	client->releaseCURLHandle(handle);
+	handle = 0;
+    }
+}
+
+void DRMProcessorClientImpl::updateConnectionStats(void* handle)
+{
+    CURL* curl = (CURL*)handle;
+    long newConnections = 0;
+    curl_off_t nameLookup = 0, connect = 0, tlsHandshake = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &newConnections);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &nameLookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tlsHandshake);
+
+    // Times are cumulated from the start of the transfer
+    if (tlsHandshake)
+	tlsHandshake -= connect;
+    if (connect)
+	connect -= nameLookup;
+
+    std::lock_guard<std::mutex> lock(curlLock);
+
+    connectionStats.requests++;
+    if (newConnections)
+	connectionStats.newConnections += newConnections;
+    else
+	connectionStats.reusedConnections++;
+    connectionStats.nameLookupTime   += nameLookup / 1000000.0;
+    connectionStats.connectTime      += connect / 1000000.0;
+    connectionStats.tlsHandshakeTime += tlsHandshake / 1000000.0;
+}
+
+DRMProcessorClientImpl::ConnectionStats DRMProcessorClientImpl::getConnectionStats()
+{
+    std::lock_guard<std::mutex> lock(curlLock);
+
+    return connectionStats;
+}
+
+void DRMProcessorClientImpl::resetConnectionStats()
+{
+    std::lock_guard<std::mutex> lock(curlLock);
+
+    memset(&connectionStats, 0, sizeof(connectionStats));
+}
+
+DRMProcessorClientImpl::TransferStats DRMProcessorClientImpl::getLastTransferStats()
+{
+    return lastTransferStats;
+}
+
+void DRMProcessorClientImpl::setProgressCallback(const ProgressCallback& progress)
+{
+    std::lock_guard<std::mutex> lock(defaultsLock);
+
+    defaultProgress = progress;
+}
+
+void DRMProcessorClientImpl::setRetryPolicy(const RetryPolicy& retry)
+{
+    std::lock_guard<std::mutex> lock(defaultsLock);
+
+    defaultRetry = retry;
+}
+
+static double elapsedSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#define PARALLEL_DOWNLOAD_MIN_SIZE  (4*1024*1024) // Don't split small files
+#define PARALLEL_DOWNLOAD_MIN_CHUNK (1*1024*1024)
+
+/* State shared by all chunks of a parallel download */
+struct ParallelDownloadContext
+{
+    std::string URL;
+    DRMProcessorClientImpl::TransferContext* transfer;
+    std::mutex lock; // Protects transfer
+};
+
+struct CurlRangeContext
+{
+    CURL* curl;
+    ParallelDownloadContext* parallel;
+    int fd;
+    uint64_t offset;  // Next byte to write
+    uint64_t end;     // Last byte of range (included)
+    bool rangeRefused;
+};
+
+static size_t curlWriteRange(void *data, size_t size, size_t nmemb, void *userp)
+{
+    CurlRangeContext* context = (CurlRangeContext*) userp;
+    size_t length = size*nmemb;
+    long http_code = 0;
+
+    curl_easy_getinfo(context->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    // Server sends whole file (or an error page) : abort transfer
+    if (http_code != 206)
+    {
+	if (http_code == 200)
+	    context->rangeRefused = true;
+	return 0;
+    }
+
+    if (context->offset + length > context->end + 1)
+	return 0;
+
+    ssize_t res = pwrite(context->fd, data, length, context->offset);
+
+    if (res <= 0)
+	return 0;
+
+    context->offset += res;
+
+    DRMProcessorClientImpl::TransferContext* transfer = context->parallel->transfer;
+    std::lock_guard<std::mutex> lock(context->parallel->lock);
+
+    transfer->stats.bytesReceived += res;
+    reportProgress(transfer, transfer->stats.bytesReceived, transfer->stats.contentLength);
+
+    return res;
+}
+
+/*
+ * Download [start, end] into fd. Each range keeps its own position :
+ * after a broken transfer, only missing bytes are requested again.
+ */
+void DRMProcessorClientImpl::downloadRange(void* parallelContext, int fd, uint64_t start, uint64_t end, bool* rangeRefused)
+{
+    ParallelDownloadContext* parallel = (ParallelDownloadContext*)parallelContext;
+    CURLHandleGuard curlGuard(this);
+    CURL *curl = (CURL*)curlGuard.get();
+    CURLcode res = CURLE_OK;
+    CurlRangeContext context = {curl, parallel, fd, start, end, false};
+    const RetryPolicy& retry = parallel->transfer->retry;
+    uint64_t prevOffset;
+    long http_code = 0;
+
+    curl_easy_setopt(curl, CURLOPT_URL, parallel->URL.c_str());
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "book2png");
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    // Sub request of a download : read session cookies, don't save them
+    enableCookies(curl, false);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriteRange);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&context);
+
+    for (int i=0; i<(int)retry.maxAttempts && context.offset <= context.end; i++)
+    {
+	std::string range = std::to_string((unsigned long long)context.offset) + "-" + std::to_string((unsigned long long)context.end);
+	curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+
+	prevOffset = context.offset;
+
+	res = curl_easy_perform(curl);
+
+	updateConnectionStats(curl);
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+	{
+	    std::lock_guard<std::mutex> lock(parallel->lock);
+	    parallel->transfer->stats.attempts++;
+	    parallel->transfer->stats.httpCode = http_code;
+	}
+
+	if (context.rangeRefused || (res == CURLE_OK && http_code >= 400))
+	    break;
+
+	if (res == CURLE_OK && context.offset > context.end)
+	    break;
+
+	// Data received, try again without incrementing tries
+	if (context.offset != prevOffset)
+	{
+	    GOUROU_LOG(WARN, "Range " << range << " broken, but data received, try again");
+	    i--;
+	}
+	else
+	    GOUROU_LOG(WARN, "Range " << range << " failed (" << curl_easy_strerror(res) << "), attempt " << (i+1) << "/" << retry.maxAttempts);
+
+	{
+	    std::lock_guard<std::mutex> lock(curlLock);
+	    connectionStats.retries++;
+	}
+
+	usleep((retry.delayMs * 1000) * (i+1));
+    }
+
+    curlGuard.release();
+
+    if (context.rangeRefused)
+    {
+	*rangeRefused = true;
+	return;
+    }
+
+    if (http_code >= 400)
+	EXCEPTION(gourou::CLIENT_HTTP_ERROR, "HTTP Error code " << http_code);
+
+    if (context.offset <= context.end)
+	EXCEPTION(gourou::CLIENT_NETWORK_ERROR, "Error " << curl_easy_strerror(res) << " while downloading range " << start << "-" << end);
+}
+
+/*
+ * Probe server with a HEAD request. If ranges are supported, preallocate
+ * file and download it with downloadConnections concurrent range requests.
+ * Returns false if server doesn't support it (nothing has been written).
+ */
+bool DRMProcessorClientImpl::parallelDownload(TransferContext& transfer, const std::string& URL, int fd, std::map<std::string, std::string>* responseHeaders)
+{
+    CURLHandleGuard curlGuard(this);
+    CURL *curl = (CURL*)curlGuard.get();
+    CURLcode res;
+    long http_code = 0;
+    curl_off_t contentLength = -1;
+    std::map<std::string, std::string> headers;
+    ParallelDownloadContext parallel;
+
+    parallel.transfer = &transfer;
+
+    curl_easy_setopt(curl, CURLOPT_URL, URL.c_str());
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "book2png");
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    enableCookies(curl, true);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlHeaders);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)&headers);
+
+    res = curl_easy_perform(curl);
+
+    updateConnectionStats(curl);
+    transfer.stats.attempts++;
+
+    if (res == CURLE_OK)
+    {
+	char* url = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+	if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url) == CURLE_OK && url)
+	    parallel.URL = url;
+    }
+
+    curlGuard.release();
+
+    if (res != CURLE_OK || http_code != 200 || parallel.URL.empty() ||
+	headers["Accept-Ranges"] != "bytes" ||
+	contentLength < PARALLEL_DOWNLOAD_MIN_SIZE)
+	return false;
+
+    unsigned int nbChunks = downloadConnections;
+    if (contentLength / nbChunks < PARALLEL_DOWNLOAD_MIN_CHUNK)
+	nbChunks = contentLength / PARALLEL_DOWNLOAD_MIN_CHUNK;
+
+    if (ftruncate(fd, contentLength))
+	return false;
+
+#ifdef __linux__
+    // Reserve blocks now, avoid fragmentation with concurrent writes
+    posix_fallocate(fd, 0, contentLength);
+#endif
+
+    GOUROU_LOG(INFO, "Download " << contentLength << " bytes with " << nbChunks << " connections");
+
+    transfer.stats.contentLength = contentLength;
+    transfer.stats.httpCode = http_code;
+
+    uint64_t chunkSize = (contentLength + nbChunks - 1) / nbChunks;
+    std::vector<std::thread> workers;
+    std::exception_ptr error;
+    std::mutex errorLock;
+    bool rangeRefused = false;
+
+    for (unsigned int i=0; i<nbChunks; i++)
+    {
+	uint64_t start = i*chunkSize;
+	uint64_t end = std::min(start + chunkSize, (uint64_t)contentLength) - 1;
+
+	workers.push_back(std::thread([&, start, end]() {
+	    try
+	    {
+		bool refused = false;
+		downloadRange(&parallel, fd, start, end, &refused);
+		if (refused)
+		{
+		    std::lock_guard<std::mutex> lock(errorLock);
+		    rangeRefused = true;
+		}
+	    }
+	    catch(...)
+	    {
+		std::lock_guard<std::mutex> lock(errorLock);
+		if (!error)
+		    error = std::current_exception();
+	    }
+	}));
+    }
+
+    for (auto& worker : workers)
+	worker.join();
+
+    if (error)
+	std::rethrow_exception(error);
+
+    // Server announced ranges, but doesn't honor them : restart from scratch
+    if (rangeRefused)
+    {
+	GOUROU_LOG(WARN, "Server refused range request, use a single stream");
+	if (ftruncate(fd, 0))
+	    EXCEPTION(gourou::CLIENT_FILE_ERROR, "Unable to truncate output file");
+	transfer.stats.bytesReceived = 0;
+	transfer.stats.contentLength = 0;
+	return false;
+    }
+
+    lseek(fd, contentLength, SEEK_SET);
+
+    *responseHeaders = headers;
+
+    return true;
+}
+
 std::string DRMProcessorClientImpl::sendHTTPRequest(const std::string& URL, const std::string& POSTData, const std::string& contentType, std::map<std::string, std::string>* responseHeaders, int fd, bool resume)
+{
+    TransferContext transfer;
+    std::string reply;
+
+    {
+	std::lock_guard<std::mutex> lock(defaultsLock);
+	transfer.progress = defaultProgress;
+	transfer.retry = defaultRetry;
+    }
+
+    try
+    {
+	reply = sendHTTPRequest(transfer, URL, POSTData, contentType, responseHeaders, fd, resume);
+    }
+    catch (...)
+    {
+	lastTransferStats = transfer.stats;
+	throw;
+    }
+
+    lastTransferStats = transfer.stats;
+
+    return reply;
+}
+
+void DRMProcessorClientImpl::downloadHTTPRequest(const std::string& URL, gourou::HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders)
+{
+    TransferContext transfer;
+
+    {
+	std::lock_guard<std::mutex> lock(defaultsLock);
+	transfer.progress = defaultProgress;
+	transfer.retry = defaultRetry;
+    }
+
+    try
+    {
+	downloadHTTPRequest(transfer, URL, sink, responseHeaders);
+    }
+    catch (...)
+    {
+	lastTransferStats = transfer.stats;
+	throw;
+    }
+
+    lastTransferStats = transfer.stats;
+}
+
+void DRMProcessorClientImpl::downloadHTTPRequest(TransferContext& transfer, const std::string& URL, gourou::HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders)
+{
+    performHTTPRequest(transfer, URL, "", "", responseHeaders, 0, false, 0, &sink);
+}
+
+std::string DRMProcessorClientImpl::sendHTTPRequest(TransferContext& transfer, const std::string& URL, const std::string& POSTData, const std::string& contentType, std::map<std::string, std::string>* responseHeaders, int fd, bool resume)
 {
     gourou::ByteArray replyData;
     std::map<std::string, std::string> localHeaders;
 
+    if (!responseHeaders)
+	responseHeaders = &localHeaders;
+
+    performHTTPRequest(transfer, URL, POSTData, contentType, responseHeaders, fd, resume, &replyData, 0);
+
+    std::string reply((char*)replyData.data(), replyData.length());
+    
+    // replyData is not NULL terminated
+    if ((*responseHeaders)["Content-Type"] == "application/vnd.adobe.adept+xml")
+    {
+	GOUROU_LOG(DEBUG, ">>> " << std::endl << reply);
+    }
+	
+    return reply;
+}
+
+/*
+ * Body is written into fd, given to sink, or appended to replyData
+ */
+void DRMProcessorClientImpl::performHTTPRequest(TransferContext& transfer, const std::string& URL, const std::string& POSTData, const std::string& contentType, std::map<std::string, std::string>* responseHeaders, int fd, bool resume, gourou::ByteArray* replyData, gourou::HTTPResponseSink* sink)
+{
+    std::map<std::string, std::string> localHeaders;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TransferStats& stats = transfer.stats;
+
     if (!responseHeaders)
 	responseHeaders = &localHeaders;
     
-    GOUROU_LOG(INFO, "Send request to " << URL);
+    /* Query string of pre-signed URLs contains credentials */
+    GOUROU_LOG(INFO, "Send request to " << URL.substr(0, URL.find('?')));
     if (POSTData.size())
     {
 	GOUROU_LOG(DEBUG, "<<< " << std::endl << POSTData);
     }
 
-    unsigned prevDownloadedBytes;
-    downloadedBytes = 0;
+    if (fd && !resume && !POSTData.size() && downloadConnections > 1 &&
+	parallelDownload(transfer, URL, fd, responseHeaders))
+    {
+	stats.time = elapsedSince(start);
+
+	if (!transfer.progress && stats.contentLength >= DISPLAY_THRESHOLD &&
+	    gourou::logLevel >= gourou::LG_LOG_WARN)
+	    std::cout << std::endl;
+
+	return;
+    }
+
     if (fd && resume)
     {
 	struct stat _stat;
 	if (!fstat(fd, &_stat))
 	{
 	    GOUROU_LOG(WARN, "Resume download @ " << _stat.st_size << " bytes");
-	    downloadedBytes = _stat.st_size;
+	    stats.resumeOffset = _stat.st_size;
 	}
 	else
 	    GOUROU_LOG(WARN, "Want to resume, but fstat failed");
     }
     
-    CURL *curl = curl_easy_init();
-    CURLcode res;
+    CURLHandleGuard curlGuard(this);
+    CURL *curl = (CURL*)curlGuard.get();
+    CURLcode res = CURLE_OK;
+    CurlRequestContext context = {curl, fd, replyData, sink, &transfer, stats.resumeOffset, std::exception_ptr()};
     curl_easy_setopt(curl, CURLOPT_URL, URL.c_str());
     curl_easy_setopt(curl, CURLOPT_USERAGENT, "book2png");
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
@@ -238,7 +1019,7 @@ std::string DRMProcessorClientImpl::sendHTTPRequest(const std::string& URL, cons
     }
 
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-    curl_easy_setopt(curl, CURLOPT_COOKIEJAR, cookiejar);
+    enableCookies(curl, true);
 
     if (POSTData.size())
     {
@@ -247,54 +1028,61 @@ std::string DRMProcessorClientImpl::sendHTTPRequest(const std::string& URL, cons
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, POSTData.data());
     }
 
-    if (fd)
-    {
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlReadFd);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&fd);
-    }
-    else
-    {
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlRead);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&replyData);
-    }
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fd ? curlReadFd : (sink ? curlReadSink : curlRead));
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&context);
     
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlHeaders);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)responseHeaders);
     
     curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, downloadProgress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void*)&context);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
 
-    for (int i=0; i<HTTP_REQ_MAX_RETRY; i++)
+    for (int i=0; i<(int)transfer.retry.maxAttempts; i++)
     {
-	prevDownloadedBytes = downloadedBytes;
-	if (downloadedBytes)
-	    curl_easy_setopt(curl, CURLOPT_RESUME_FROM, downloadedBytes);
+	uint64_t prevReceived = stats.bytesReceived;
+
+	// Only file and sink downloads can be resumed, replies in memory restart from scratch
+	if (fd || sink)
+	    context.attemptOffset = stats.resumeOffset + stats.bytesReceived;
+	else
+	    replyData->resize(0);
+
+	if (context.attemptOffset)
+	    curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)context.attemptOffset);
 	    
 	res = curl_easy_perform(curl);
 
+	updateConnectionStats(curl);
+	stats.attempts++;
+
 	// Connexion failed, wait & retry
 	if (res == CURLE_COULDNT_CONNECT)
 	{
-	    GOUROU_LOG(WARN, "\nConnection failed, attempt " << (i+1) << "/" << HTTP_REQ_MAX_RETRY);	    
+	    GOUROU_LOG(WARN, "\nConnection failed, attempt " << (i+1) << "/" << transfer.retry.maxAttempts);
 	}
 	// Transfer failed but some data has been received
 	// --> try again without incrementing tries
 	else if (res == CURLE_RECV_ERROR)
 	{
-	    if (prevDownloadedBytes != downloadedBytes)
+	    if ((fd || sink) && prevReceived != stats.bytesReceived)
 	    {
 		GOUROU_LOG(WARN, "\nConnection broken, but data received, try again");	    
 		i--;
 	    }
 	    else
-		GOUROU_LOG(WARN, "\nConnection broken and no data received, attempt " << (i+1) << "/" << HTTP_REQ_MAX_RETRY);
+		GOUROU_LOG(WARN, "\nConnection broken and no data received, attempt " << (i+1) << "/" << transfer.retry.maxAttempts);
 	}
 	// Other error --> fail
 	else
 	    break;
 
-	// Wait a little bit (250ms * i)
-	usleep((250 * 1000) * (i+1));
+	{
+	    std::lock_guard<std::mutex> lock(curlLock);
+	    connectionStats.retries++;
+	}
+
+	usleep((transfer.retry.delayMs * 1000) * (i+1));
     }
     
     curl_slist_free_all(list);
@@ -302,7 +1090,13 @@ std::string DRMProcessorClientImpl::sendHTTPRequest(const std::string& URL, cons
     long http_code = 400;
     curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-    curl_easy_cleanup(curl);
+    curlGuard.release();
+
+    stats.httpCode = http_code;
+    stats.time = elapsedSince(start);
+
+    if (context.sinkError)
+	std::rethrow_exception(context.sinkError);
    
     if (res != CURLE_OK)
 	EXCEPTION(gourou::CLIENT_NETWORK_ERROR, "Error " << curl_easy_strerror(res));
@@ -310,15 +1104,116 @@ std::string DRMProcessorClientImpl::sendHTTPRequest(const std::string& URL, cons
     if (http_code >= 400)
 	EXCEPTION(gourou::CLIENT_HTTP_ERROR, "HTTP Error code " << http_code);
 
-    if ((downloadedBytes >= DISPLAY_THRESHOLD || replyData.size() >= DISPLAY_THRESHOLD) &&
+    if (!transfer.progress && stats.contentLength >= DISPLAY_THRESHOLD &&
 	gourou::logLevel >= gourou::LG_LOG_WARN)
 	std::cout << std::endl;
+}
 
-    if ((*responseHeaders)["Content-Type"] == "application/vnd.adobe.adept+xml")
+struct CurlUploadContext
+{
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+    DRMProcessorClientImpl::TransferContext* transfer;
+};
+
+static size_t curlUploadRead(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    CurlUploadContext* context = (CurlUploadContext*) userp;
+    size_t length = std::min(size*nitems, context->length - context->offset);
+
+    memcpy(buffer, context->data + context->offset, length);
+    context->offset += length;
+    context->transfer->stats.bytesSent += length;
+
+    return length;
+}
+
+std::string DRMProcessorClientImpl::uploadHTTPRequest(TransferContext& transfer, const std::string& URL,
+						      const unsigned char* data, size_t length,
+						      std::map<std::string, std::string>* responseHeaders)
+{
+    gourou::ByteArray replyData;
+    std::map<std::string, std::string> localHeaders;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TransferStats& stats = transfer.stats;
+
+    if (!responseHeaders)
+	responseHeaders = &localHeaders;
+
+    /* Query string of pre-signed URLs contains credentials */
+    GOUROU_LOG(INFO, "Upload " << length << " bytes to " << URL.substr(0, URL.find('?')));
+
+    CURLHandleGuard curlGuard(this);
+    CURL *curl = (CURL*)curlGuard.get();
+    CURLcode res = CURLE_OK;
+    long http_code = 0;
+    CurlRequestContext context = {curl, 0, &replyData, 0, &transfer, 0, std::exception_ptr()};
+    CurlUploadContext upload = {data, length, 0, &transfer};
+
+    curl_easy_setopt(curl, CURLOPT_URL, URL.c_str());
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "book2png");
+    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)length);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlUploadRead);
+    curl_easy_setopt(curl, CURLOPT_READDATA, (void*)&upload);
+
+    // No "Expect: 100-continue" round trip
+    struct curl_slist *list = NULL;
+    list = curl_slist_append(list, "Expect:");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlRead);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&context);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlHeaders);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)responseHeaders);
+
+    for (int i=0; i<(int)transfer.retry.maxAttempts; i++)
     {
-	GOUROU_LOG(DEBUG, ">>> " << std::endl << replyData.data());
+	upload.offset = 0;
+	replyData.resize(0);
+	responseHeaders->clear();
+
+	res = curl_easy_perform(curl);
+
+	updateConnectionStats(curl);
+	stats.attempts++;
+
+	http_code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+	if (res == CURLE_OK && http_code < 500)
+	    break;
+
+	if (res != CURLE_OK && res != CURLE_COULDNT_CONNECT &&
+	    res != CURLE_SEND_ERROR && res != CURLE_RECV_ERROR)
+	    break;
+
+	if (i+1 < (int)transfer.retry.maxAttempts)
+	{
+	    GOUROU_LOG(WARN, "Upload failed (" << (res != CURLE_OK ? curl_easy_strerror(res) : "HTTP error") << "), attempt " << (i+1) << "/" << transfer.retry.maxAttempts);
+
+	    {
+		std::lock_guard<std::mutex> lock(curlLock);
+		connectionStats.retries++;
+	    }
+
+	    usleep((transfer.retry.delayMs * 1000) * (i+1));
+	}
     }
-	
+
+    curl_slist_free_all(list);
+    curlGuard.release();
+
+    stats.httpCode = http_code;
+    stats.time = elapsedSince(start);
+
+    if (res != CURLE_OK)
+	EXCEPTION(gourou::CLIENT_NETWORK_ERROR, "Error " << curl_easy_strerror(res));
+
+    if (http_code >= 400)
+	EXCEPTION(gourou::CLIENT_HTTP_ERROR, "HTTP Error code " << http_code);
+
     return std::string((char*)replyData.data(), replyData.length());
 }
 
@@ -342,35 +1237,89 @@ void DRMProcessorClientImpl::padWithPKCS1(unsigned char* out, unsigned int outLe
 }
 
 
+void* DRMProcessorClientImpl::loadRSAPrivateKey(const unsigned char* RSAKey, unsigned int RSAKeyLength,
+						const RSA_KEY_TYPE keyType, const std::string& password)
+{
+    EVP_PKEY* pkey = NULL;
+
+    if (keyType == RSA_KEY_PKCS12)
+    {
+	PKCS12 * pkcs12 = d2i_PKCS12(NULL, &RSAKey, RSAKeyLength);
+	if (!pkcs12)
+	    EXCEPTION(gourou::CLIENT_INVALID_PKCS12, opensslError());
+
+	int ret = PKCS12_parse(pkcs12, password.c_str(), &pkey, NULL, NULL);
+	PKCS12_free(pkcs12);
+
+	if (ret <= 0)
+	    EXCEPTION(gourou::CLIENT_INVALID_PKCS12, opensslError());
+    }
+    else if (keyType == RSA_KEY_PKCS8)
+    {
+	BIO* mem = BIO_new_mem_buf(RSAKey, RSAKeyLength);
+	PKCS8_PRIV_KEY_INFO* p8inf = d2i_PKCS8_PRIV_KEY_INFO_bio(mem, NULL);
+	BIO_free(mem);
+
+	if (!p8inf)
+	    EXCEPTION(gourou::CLIENT_INVALID_PKCS8, opensslError());
+
+	pkey = EVP_PKCS82PKEY(p8inf);
+	PKCS8_PRIV_KEY_INFO_free(p8inf);
+
+	if (!pkey)
+	    EXCEPTION(gourou::CLIENT_INVALID_PKCS8, opensslError());
+    }
+    else
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, "Unsupported private key type " << keyType);
+
+    return pkey;
+}
+
+void DRMProcessorClientImpl::freeRSAPrivateKey(void* handler)
+{
+    EVP_PKEY_free((EVP_PKEY*)handler);
+}
+
 void DRMProcessorClientImpl::RSAPrivateEncrypt(const unsigned char* RSAKey, unsigned int RSAKeyLength,
-					       const RSA_KEY_TYPE keyType, const std::string& password,
+					       const RSA_KEY_TYPE /*keyType*/, const std::string& password,
+					       const unsigned char* data, unsigned dataLength,
+					       unsigned char* res)
+{
+    void* handler = loadRSAPrivateKey(RSAKey, RSAKeyLength, RSA_KEY_PKCS12, password);
+
+    try
+    {
+	RSAPrivateEncrypt(handler, data, dataLength, res);
+    }
+    catch (...)
+    {
+	freeRSAPrivateKey(handler);
+	throw;
+    }
+
+    freeRSAPrivateKey(handler);
+}
+
+void DRMProcessorClientImpl::RSAPrivateEncrypt(void* handler,
 					       const unsigned char* data, unsigned dataLength,
 					       unsigned char* res)
 {
-    PKCS12 * pkcs12;
     EVP_PKEY_CTX *ctx;
-    EVP_PKEY* pkey = NULL;
+    EVP_PKEY* pkey = (EVP_PKEY*)handler;
     size_t outlen;
     unsigned char* tmp;
     int ret;
     
-    pkcs12 = d2i_PKCS12(NULL, &RSAKey, RSAKeyLength);
-    if (!pkcs12)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, ERR_error_string(ERR_get_error(), NULL));
-
-    if (PKCS12_parse(pkcs12, password.c_str(), &pkey, NULL, NULL) <= 0)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, ERR_error_string(ERR_get_error(), NULL));
-
     outlen = EVP_PKEY_get_size(pkey);
 
     ctx = EVP_PKEY_CTX_new(pkey, NULL);
 
     /* Use RSA private key */
     if (EVP_PKEY_decrypt_init(ctx) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_NO_PADDING) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     tmp = (unsigned char*)malloc(outlen);
 
@@ -383,48 +1332,56 @@ void DRMProcessorClientImpl::RSAPrivateEncrypt(const unsigned char* RSAKey, unsi
     free(tmp);
     
     if (ret <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::RSAPrivateDecrypt(const unsigned char* RSAKey, unsigned int RSAKeyLength,
-					       const RSA_KEY_TYPE keyType, const std::string& password,
+					       const RSA_KEY_TYPE /*keyType*/, const std::string& password,
 					       const unsigned char* data, unsigned dataLength,
 					       unsigned char* res)
 {
-    BIO* mem = BIO_new_mem_buf(RSAKey, RSAKeyLength);
-    PKCS8_PRIV_KEY_INFO* p8inf = d2i_PKCS8_PRIV_KEY_INFO_bio(mem, NULL);
+    void* handler = loadRSAPrivateKey(RSAKey, RSAKeyLength, RSA_KEY_PKCS8, password);
 
-    if (!p8inf)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS8, ERR_error_string(ERR_get_error(), NULL));
-   
+    try
+    {
+	RSAPrivateDecrypt(handler, data, dataLength, res);
+    }
+    catch (...)
+    {
+	freeRSAPrivateKey(handler);
+	throw;
+    }
+
+    freeRSAPrivateKey(handler);
+}
+
+void DRMProcessorClientImpl::RSAPrivateDecrypt(void* handler,
+					       const unsigned char* data, unsigned dataLength,
+					       unsigned char* res)
+{
     EVP_PKEY_CTX *ctx;
-    EVP_PKEY* pkey = EVP_PKCS82PKEY(p8inf);
+    EVP_PKEY* pkey = (EVP_PKEY*)handler;
     size_t outlen = dataLength;
     int ret;
 
-    if (!pkey)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS8, ERR_error_string(ERR_get_error(), NULL));
-
     ctx = EVP_PKEY_CTX_new(pkey, NULL);
 
     if (EVP_PKEY_decrypt_init(ctx) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_NO_PADDING) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     ret = EVP_PKEY_decrypt(ctx, res, &outlen, data, dataLength);
 
-    PKCS8_PRIV_KEY_INFO_free(p8inf);
     EVP_PKEY_CTX_free(ctx);
-    BIO_free(mem);
 
     if (ret <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::RSAPublicEncrypt(const unsigned char* RSAKey, unsigned int RSAKeyLength,
-					      const RSA_KEY_TYPE keyType,
+					      const RSA_KEY_TYPE /*keyType*/,
 					      const unsigned char* data, unsigned dataLength,
 					      unsigned char* res)
 {
@@ -443,17 +1400,17 @@ void DRMProcessorClientImpl::RSAPublicEncrypt(const unsigned char* RSAKey, unsig
     ctx = EVP_PKEY_CTX_new(evpKey, NULL);
 
     if (EVP_PKEY_encrypt_init(ctx) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     int ret = EVP_PKEY_encrypt(ctx, res, &outlen, data, dataLength);
 
     EVP_PKEY_CTX_free(ctx);
     
     if (ret < 0)
-	EXCEPTION(gourou::CLIENT_RSA_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_RSA_ERROR, opensslError());
 
     EVP_PKEY_free(evpKey);
 }
@@ -481,7 +1438,7 @@ void* DRMProcessorClientImpl::generateRSAKey(int keyLengthBits)
 
 void DRMProcessorClientImpl::destroyRSAHandler(void* handler)
 {
-    free(handler);
+    EVP_PKEY_free((EVP_PKEY*)handler);
 }
 
 void DRMProcessorClientImpl::extractRSAPublicKey(void* handler, unsigned char** keyOut, unsigned int* keyOutLength)
@@ -504,7 +1461,7 @@ void DRMProcessorClientImpl::extractRSAPrivateKey(void* handler, unsigned char**
 }
 				 
 void DRMProcessorClientImpl::extractCertificate(const unsigned char* RSAKey, unsigned int RSAKeyLength,
-						const RSA_KEY_TYPE keyType, const std::string& password,
+						const RSA_KEY_TYPE /*keyType*/, const std::string& password,
 						unsigned char** certOut, unsigned int* certOutLength)
 {
     PKCS12 * pkcs12;
@@ -513,11 +1470,11 @@ void DRMProcessorClientImpl::extractCertificate(const unsigned char* RSAKey, uns
 
     pkcs12 = d2i_PKCS12(NULL, &RSAKey, RSAKeyLength);
     if (!pkcs12)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, opensslError());
     PKCS12_parse(pkcs12, password.c_str(), &pkey, &cert, NULL);
 
     if (!cert)
-	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_INVALID_PKCS12, opensslError());
 
     *certOutLength = i2d_X509(cert, certOut);
 
@@ -525,130 +1482,144 @@ void DRMProcessorClientImpl::extractCertificate(const unsigned char* RSAKey, uns
 }
 
 /* Crypto interface */
-void DRMProcessorClientImpl::encrypt(CRYPTO_ALGO algo, CHAINING_MODE chaining,
-				     const unsigned char* key, unsigned int keyLength,
-				     const unsigned char* iv, unsigned int ivLength,
-				     const unsigned char* dataIn, unsigned int dataInLength,
-				     unsigned char* dataOut, unsigned int* dataOutLength)
+int DRMProcessorClientImpl::cipherIndex(CRYPTO_ALGO algo, CHAINING_MODE chaining, unsigned int keyLength)
 {
-    void* handler = encryptInit(algo, chaining, key, keyLength, iv, ivLength);
-    encryptUpdate(handler, dataIn, dataInLength, dataOut, dataOutLength);
-    encryptFinalize(handler, dataOut+*dataOutLength, dataOutLength);
-}
-
-void* DRMProcessorClientImpl::encryptInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
-					  const unsigned char* key, unsigned int keyLength,
-					  const unsigned char* iv, unsigned int ivLength)
-{
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    int ret = 0;
-    
     switch (algo)
     {
     case ALGO_AES:
     {
-	switch(keyLength)
+	if (keyLength != 16)
+	    EXCEPTION(gourou::CLIENT_BAD_KEY_SIZE, "Invalid key size " << keyLength);
+
+	switch(chaining)
 	{
-	case 16:
-	    switch(chaining)
-	    {
-	    case CHAIN_ECB:
-		ret = EVP_EncryptInit(ctx, EVP_aes_128_ecb(), key, iv);
-		break;
-	    case CHAIN_CBC:
-		ret = EVP_EncryptInit(ctx, EVP_aes_128_cbc(), key, iv);
-		break;
-	    default:
-		EXCEPTION(gourou::CLIENT_BAD_CHAINING, "Unknown chaining mode " << chaining);
-	    }
-	    break;
+	case CHAIN_ECB:
+	    return CIPHER_AES_128_ECB;
+	case CHAIN_CBC:
+	    return CIPHER_AES_128_CBC;
 	default:
-	    EVP_CIPHER_CTX_free(ctx);
-	    EXCEPTION(gourou::CLIENT_BAD_KEY_SIZE, "Invalid key size " << keyLength);
+	    EXCEPTION(gourou::CLIENT_BAD_CHAINING, "Unknown chaining mode " << chaining);
 	}
-	break;
     }
     case ALGO_RC4:
     {
 	if (keyLength != 16)
-	{
-	    EVP_CIPHER_CTX_free(ctx);
 	    EXCEPTION(gourou::CLIENT_BAD_KEY_SIZE, "Invalid key size " << keyLength);
-	}
-	ret = EVP_DecryptInit(ctx, EVP_rc4(), key, iv);
-	break;
+	return CIPHER_RC4;
     }
     }
-    
-    if (ret <= 0)
+
+    EXCEPTION(gourou::CLIENT_CRYPT_ERROR, "Unknown algorithm " << algo);
+}
+
+void* DRMProcessorClientImpl::cipherInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+					 const unsigned char* key, unsigned int keyLength,
+					 const unsigned char* iv, int enc)
+{
+    const EVP_CIPHER* cipher = (const EVP_CIPHER*)ciphers[cipherIndex(algo, chaining, keyLength)];
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    // RC4 is symmetric, always use decryption
+    if (algo == ALGO_RC4)
+	enc = 0;
+
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, enc) <= 0)
     {
 	EVP_CIPHER_CTX_free(ctx);
-	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
+	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
     }
-    
+
     return ctx;
 }
 
-void* DRMProcessorClientImpl::decryptInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
-					     const unsigned char* key, unsigned int keyLength,
-					     const unsigned char* iv, unsigned int ivLength)
+void* DRMProcessorClientImpl::sessionCipher(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+					    const unsigned char* key, unsigned int keyLength,
+					    const unsigned char* iv, int enc)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    int ret = 0;
-    
-    switch(algo)
-    {
-    case ALGO_AES:
+    static const unsigned char nullIV[EVP_MAX_IV_LENGTH] = {0};
+    int index = cipherIndex(algo, chaining, keyLength);
+    const EVP_CIPHER* cipher = (const EVP_CIPHER*)ciphers[index];
+    int ret;
+
+    if (algo == ALGO_RC4)
+	enc = 0;
+
+    EVP_CIPHER_CTX*& ctx = cryptoSession.cipherCtx[index][enc];
+
+    if (!ctx)
     {
-	switch(keyLength)
-	{
-	case 16:
-	    switch(chaining)
-	    {
-	    case CHAIN_ECB:
-		ret = EVP_DecryptInit(ctx, EVP_aes_128_ecb(), key, iv);
-		break;
-	    case CHAIN_CBC:
-		ret = EVP_DecryptInit(ctx, EVP_aes_128_cbc(), key, iv);
-		break;
-	    default:
-		EXCEPTION(gourou::CLIENT_BAD_CHAINING, "Unknown chaining mode " << chaining);
-	    }
-	    break;
-	default:
-	    EVP_CIPHER_CTX_free(ctx);
-	    EXCEPTION(gourou::CLIENT_BAD_KEY_SIZE, "Invalid key size " << keyLength);
-	}
-	break;
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+	    EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
     }
-    case ALGO_RC4:
+
+    /*
+     * A previously used context keeps its last IV/chaining state
+     * when rekeyed without one : reset it like a fresh context would
+     */
+    if (!iv && EVP_CIPHER_iv_length(cipher) > 0)
+	iv = nullIV;
+
+    if (cryptoSession.cipher[index][enc] == cipher)
+	ret = EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, enc);
+    else
     {
-	if (keyLength != 16)
-	{
-	    EVP_CIPHER_CTX_free(ctx);
-	    EXCEPTION(gourou::CLIENT_BAD_KEY_SIZE, "Invalid key size " << keyLength);
-	}
-	ret = EVP_DecryptInit(ctx, EVP_rc4(), key, iv);
-	break;
+	ret = EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, enc);
+	cryptoSession.cipher[index][enc] = (ret > 0) ? cipher : 0;
     }
-    }
-    
+
     if (ret <= 0)
-    {
-	EVP_CIPHER_CTX_free(ctx);
-	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
-    }
+	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
 
     return ctx;
 }
 
+void DRMProcessorClientImpl::sessionCrypt(void* handler, const unsigned char* dataIn, unsigned int dataInLength,
+					  unsigned char* dataOut, unsigned int* dataOutLength)
+{
+    EVP_CIPHER_CTX* ctx = (EVP_CIPHER_CTX*)handler;
+    int len;
+
+    if (EVP_CipherUpdate(ctx, dataOut, (int*)dataOutLength, dataIn, dataInLength) <= 0)
+	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
+
+    if (EVP_CipherFinal_ex(ctx, dataOut+*dataOutLength, &len) <= 0)
+	EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
+
+    *dataOutLength += len;
+}
+
+void DRMProcessorClientImpl::encrypt(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+				     const unsigned char* key, unsigned int keyLength,
+				     const unsigned char* iv, unsigned int /*ivLength*/,
+				     const unsigned char* dataIn, unsigned int dataInLength,
+				     unsigned char* dataOut, unsigned int* dataOutLength)
+{
+    void* handler = sessionCipher(algo, chaining, key, keyLength, iv, 1);
+    sessionCrypt(handler, dataIn, dataInLength, dataOut, dataOutLength);
+}
+
+void* DRMProcessorClientImpl::encryptInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+					  const unsigned char* key, unsigned int keyLength,
+					  const unsigned char* iv, unsigned int /*ivLength*/)
+{
+    return cipherInit(algo, chaining, key, keyLength, iv, 1);
+}
+
+void* DRMProcessorClientImpl::decryptInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+					     const unsigned char* key, unsigned int keyLength,
+					     const unsigned char* iv, unsigned int /*ivLength*/)
+{
+    return cipherInit(algo, chaining, key, keyLength, iv, 0);
+}
+
 void DRMProcessorClientImpl::encryptUpdate(void* handler, const unsigned char* dataIn, unsigned int dataInLength,
 					   unsigned char* dataOut, unsigned int* dataOutLength)
 {
     int ret = EVP_EncryptUpdate((EVP_CIPHER_CTX*)handler, dataOut, (int*)dataOutLength, dataIn, dataInLength);
 
    if (ret <= 0)
-       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
+       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::encryptFinalize(void* handler,
@@ -661,18 +1632,17 @@ void DRMProcessorClientImpl::encryptFinalize(void* handler,
     EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*)handler);
 
    if (ret <= 0)
-       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
+       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::decrypt(CRYPTO_ALGO algo, CHAINING_MODE chaining,
 				     const unsigned char* key, unsigned int keyLength,
-				     const unsigned char* iv, unsigned int ivLength,
+				     const unsigned char* iv, unsigned int /*ivLength*/,
 				     const unsigned char* dataIn, unsigned int dataInLength,
 				     unsigned char* dataOut, unsigned int* dataOutLength)
 {
-    void* handler = decryptInit(algo, chaining, key, keyLength, iv, ivLength);
-    decryptUpdate(handler, dataIn, dataInLength, dataOut, dataOutLength);
-    decryptFinalize(handler, dataOut+*dataOutLength, dataOutLength);
+    void* handler = sessionCipher(algo, chaining, key, keyLength, iv, 0);
+    sessionCrypt(handler, dataIn, dataInLength, dataOut, dataOutLength);
 }
 
 void DRMProcessorClientImpl::decryptUpdate(void* handler, const unsigned char* dataIn, unsigned int dataInLength,
@@ -681,7 +1651,7 @@ void DRMProcessorClientImpl::decryptUpdate(void* handler, const unsigned char* d
     int ret = EVP_DecryptUpdate((EVP_CIPHER_CTX*)handler, dataOut, (int*)dataOutLength, dataIn, dataInLength);
 
     if (ret <= 0)
-       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
+       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
 }
 
 void DRMProcessorClientImpl::decryptFinalize(void* handler, unsigned char* dataOut, unsigned int* dataOutLength)
@@ -693,160 +1663,417 @@ void DRMProcessorClientImpl::decryptFinalize(void* handler, unsigned char* dataO
     EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*)handler);
 
    if (ret <= 0)
-       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, ERR_error_string(ERR_get_error(), NULL));
+       EXCEPTION(gourou::CLIENT_CRYPT_ERROR, opensslError());
 }
 
+/*
+ * libzip writes the whole archive in a single pass at zip_close(), so
+ * written contents must be readable until then.
+ * zip_source_buffer() doesn't copy data (and can't free ByteArray data) :
+ * for in memory archives, written contents are kept alive until close.
+ * For files, they're appended to a spool file next to the archive
+ * (removed at close) : memory used doesn't grow with the book.
+ */
+struct ZipHandler
+{
+    zip_t* zip;
+    std::list<gourou::ByteArray> contents;
+    /* Zip file : written contents */
+    std::string path;
+    std::string spoolPath;
+    int spoolFd;
+    uint64_t spoolSize;
+    /* In memory zip file : source buffer (and original data it points to) */
+    zip_source_t* source;
+    gourou::ByteArray original;
+    gourou::ByteArray* target;
+};
+
 void* DRMProcessorClientImpl::zipOpen(const std::string& path)
 {
-    zip_t* handler = zip_open(path.c_str(), 0, 0);
+    zip_t* zip = zip_open(path.c_str(), 0, 0);
 
-    if (!handler)
+    if (!zip)
 	EXCEPTION(gourou::CLIENT_BAD_ZIP_FILE, "Invalid zip file " << path);
 
+    ZipHandler* handler = new ZipHandler;
+    handler->zip = zip;
+    handler->path = path;
+    handler->spoolFd = -1;
+    handler->spoolSize = 0;
+    handler->source = 0;
+    handler->target = 0;
+    
+    return handler;
+}
+
+void* DRMProcessorClientImpl::zipOpen(gourou::ByteArray& data)
+{
+    zip_error_t error;
+    zip_error_init(&error);
+
+    zip_source_t* source = zip_source_buffer_create(data.data(), data.length(), 0, &error);
+
+    if (!source)
+    {
+	std::string msg = zip_error_strerror(&error);
+	zip_error_fini(&error);
+	EXCEPTION(gourou::CLIENT_BAD_ZIP_FILE, "Invalid zip buffer " << msg);
+    }
+
+    // Keep source after zip_close() to read updated archive
+    zip_source_keep(source);
+
+    zip_t* zip = zip_open_from_source(source, 0, &error);
+
+    if (!zip)
+    {
+	std::string msg = zip_error_strerror(&error);
+	zip_error_fini(&error);
+	zip_source_free(source);
+	zip_source_free(source);
+	EXCEPTION(gourou::CLIENT_BAD_ZIP_FILE, "Invalid zip buffer " << msg);
+    }
+
+    zip_error_fini(&error);
+
+    ZipHandler* handler = new ZipHandler;
+    handler->zip = zip;
+    handler->spoolFd = -1;
+    handler->spoolSize = 0;
+    handler->source = source;
+    handler->original = data;
+    handler->target = &data;
+    
     return handler;
 }
 
 void DRMProcessorClientImpl::zipReadFile(void* handler, const std::string& path, gourou::ByteArray& result, bool decompress)
 {
+    zip_t* zip = ((ZipHandler*)handler)->zip;
     std::string res;
     zip_stat_t sb;
     
-    if (zip_stat((zip_t *)handler, path.c_str(), 0, &sb) < 0)
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error, no file " << path << ", " << zip_strerror((zip_t *)handler));
+    if (zip_stat(zip, path.c_str(), 0, &sb) < 0)
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error, no file " << path << ", " << zip_strerror(zip));
 
     if (!(sb.valid & (ZIP_STAT_INDEX|ZIP_STAT_SIZE)))
 	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Required fields missing");
 
     result.resize(sb.size);
     
-    zip_file_t *f = zip_fopen_index((zip_t *)handler, sb.index, (decompress)?0:ZIP_FL_COMPRESSED);
+    zip_file_t *f = zip_fopen_index(zip, sb.index, (decompress)?0:ZIP_FL_COMPRESSED);
     zip_fread(f, result.data(), sb.size);
     zip_fclose(f);
 }
 
+/*
+ * Append content to spool file and return a source reading it back
+ */
+static zip_source_t* spoolContent(ZipHandler* handler, gourou::ByteArray& content)
+{
+    if (handler->spoolFd < 0)
+    {
+	std::vector<char> spoolPath(handler->path.begin(), handler->path.end());
+	const char suffix[] = ".XXXXXX";
+	spoolPath.insert(spoolPath.end(), suffix, suffix+sizeof(suffix));
+
+	handler->spoolFd = mkstemp(spoolPath.data());
+	if (handler->spoolFd < 0)
+	    EXCEPTION(gourou::CLIENT_FILE_ERROR, "Unable to create spool file for " << handler->path);
+
+	handler->spoolPath = spoolPath.data();
+    }
+
+    const unsigned char* data = content.data();
+    size_t remaining = content.length();
+
+    while (remaining)
+    {
+	ssize_t res = write(handler->spoolFd, data, remaining);
+	if (res <= 0)
+	    EXCEPTION(gourou::CLIENT_FILE_ERROR, "Unable to write spool file " << handler->spoolPath);
+	data += res;
+	remaining -= res;
+    }
+
+    zip_source_t* s = zip_source_file(handler->zip, handler->spoolPath.c_str(),
+				      handler->spoolSize, content.length());
+
+    handler->spoolSize += content.length();
+
+    return s;
+}
+
 void DRMProcessorClientImpl::zipWriteFile(void* handler, const std::string& path, gourou::ByteArray& content)
 {
+    zipWriteFile(handler, path, content, true);
+}
+
+void DRMProcessorClientImpl::zipWriteFile(void* handler, const std::string& path, gourou::ByteArray& content, bool compress)
+{
+    ZipHandler* zipHandler = (ZipHandler*)handler;
+    zip_t* zip = zipHandler->zip;
     zip_int64_t ret;
-    
-    zip_source_t* s = zip_source_buffer((zip_t*)handler, content.takeShadowData(), content.length(), 1);
+    zip_source_t* s;
+
+    // zip_source_file() reads until the end of file when length is 0
+    bool spool = !zipHandler->source && content.length();
+
+    if (spool)
+	s = spoolContent(zipHandler, content);
+    else
+	s = zip_source_buffer(zip, content.data(), content.length(), 0);
 
-    zip_int64_t idx = zip_name_locate((zip_t*)handler, path.c_str(), 0);
+    if (!s)
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror(zip));
+
+    zip_int64_t idx = zip_name_locate(zip, path.c_str(), 0);
 
     // File doesn't exists
     if (idx == -1)
-	ret = zip_file_add((zip_t*)handler, path.c_str(), s, 0);
+	ret = zip_file_add(zip, path.c_str(), s, 0);
     else
-	ret = zip_file_replace((zip_t*)handler, idx, s, ZIP_FL_OVERWRITE);
+	ret = zip_file_replace(zip, idx, s, ZIP_FL_OVERWRITE);
 
     if (ret < 0)
     {
 	zip_source_free(s);
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror((zip_t *)handler));
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror(zip));
     }
+
+    if (!spool)
+	zipHandler->contents.push_back(content);
+
+    if (idx == -1)
+	idx = ret;
+
+    if (!compress && zip_set_file_compression(zip, idx, ZIP_CM_STORE, 0))
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror(zip));
 }
 
 void DRMProcessorClientImpl::zipDeleteFile(void* handler, const std::string& path)
 {
-    zip_int64_t idx = zip_name_locate((zip_t*)handler, path.c_str(), 0);
+    zip_t* zip = ((ZipHandler*)handler)->zip;
+    zip_int64_t idx = zip_name_locate(zip, path.c_str(), 0);
 
     if (idx < 0)
 	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "No such file " << path.c_str());
     
-    if (zip_delete((zip_t*)handler, idx))
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror((zip_t *)handler));
+    if (zip_delete(zip, idx))
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << zip_strerror(zip));
 }
 
 void DRMProcessorClientImpl::zipClose(void* handler)
 {
-    zip_close((zip_t*)handler);
+    ZipHandler* zipHandler = (ZipHandler*)handler;
+
+    if (!zipHandler->source)
+    {
+	std::string error;
+
+	if (zip_close(zipHandler->zip) < 0)
+	{
+	    error = zip_strerror(zipHandler->zip);
+	    zip_discard(zipHandler->zip);
+	}
+
+	if (zipHandler->spoolFd >= 0)
+	{
+	    close(zipHandler->spoolFd);
+	    unlink(zipHandler->spoolPath.c_str());
+	}
+
+	delete zipHandler;
+
+	if (!error.empty())
+	    EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << error);
+
+	return;
+    }
+
+    zip_source_t* source = zipHandler->source;
+    std::string error;
+
+    if (zip_close(zipHandler->zip) < 0)
+    {
+	error = zip_strerror(zipHandler->zip);
+	zip_discard(zipHandler->zip);
+    }
+    else
+    {
+	// Read back updated archive
+	zip_stat_t sb;
+	zip_stat_init(&sb);
+
+	if (zip_source_stat(source, &sb) < 0 || !(sb.valid & ZIP_STAT_SIZE) ||
+	    zip_source_open(source) < 0)
+	    error = "Unable to read updated archive";
+	else
+	{
+	    gourou::ByteArray result((unsigned int)sb.size, true);
+
+	    if (zip_source_read(source, result.data(), sb.size) != (zip_int64_t)sb.size)
+		error = "Unable to read updated archive";
+	    else
+		*zipHandler->target = result;
+
+	    zip_source_close(source);
+	}
+    }
+
+    zip_source_free(source);
+    delete zipHandler;
+
+    if (!error.empty())
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Zip error " << error);
 }
 
-void DRMProcessorClientImpl::inflate(gourou::ByteArray& data, gourou::ByteArray& result,
-				     int wbits)
+static void initInflate(z_stream& infstream, const unsigned char* data, unsigned int dataLength, int wbits)
 {
-    unsigned int dataSize = data.size()*2;
-    unsigned char* buffer = new unsigned char[dataSize];
-    
-    z_stream infstream;
-
     infstream.zalloc = Z_NULL;
     infstream.zfree  = Z_NULL;
     infstream.opaque = Z_NULL;
 
-    infstream.avail_in  = (uInt)data.size();
-    infstream.next_in   = (Bytef *)data.data(); // input char array
-    infstream.avail_out = (uInt)dataSize; // size of output
-    infstream.next_out  = (Bytef *)buffer; // output char array
+    infstream.avail_in  = (uInt)dataLength;
+    infstream.next_in   = (Bytef *)data; // input char array
 
     int ret = inflateInit2(&infstream, wbits);
 
     if (ret != Z_OK)
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, code " << zError(ret) << ", msg " << infstream.msg);
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, code " << zError(ret) << ", msg " << (infstream.msg?infstream.msg:""));
+}
+
+#define INFLATE_MAX_INITIAL_SIZE (64*1024*1024)
 
-    ret = ::inflate(&infstream, Z_FINISH);
-    while (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR)
+void DRMProcessorClientImpl::inflate(gourou::ByteArray& data, gourou::ByteArray& result,
+				     int wbits)
+{
+    inflate(data, result, wbits, 0);
+}
+
+void DRMProcessorClientImpl::inflate(gourou::ByteArray& data, gourou::ByteArray& result,
+				     int wbits, unsigned int sizeHint)
+{
+    unsigned int offset = result.length();
+    unsigned int outputSize = sizeHint;
+    z_stream infstream;
+    int ret;
+
+    // Unknown size : start from a common ratio (capped, big inputs don't
+    // pre-allocate gigabytes), then grow geometrically
+    if (!outputSize)
     {
-	// Real error
-	if (ret == Z_BUF_ERROR && infstream.avail_out == (uInt)dataSize)
-	    break;
+	outputSize = (data.size() < INFLATE_MAX_INITIAL_SIZE/4) ? data.size()*4 : INFLATE_MAX_INITIAL_SIZE;
+	if (outputSize < 4096)
+	    outputSize = 4096;
+    }
 
-	result.append(buffer, dataSize-infstream.avail_out);
-	    
-	if ((ret == Z_OK && infstream.avail_out != 0) || ret == Z_STREAM_END)
-	    break;
-	infstream.avail_out = (uInt)dataSize; // size of output
-	infstream.next_out = (Bytef *)buffer; // output char array
+    if (offset == UINT_MAX)
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, result buffer is full");
+
+    // offset + outputSize must fit into result length
+    if (outputSize > UINT_MAX - offset)
+	outputSize = UINT_MAX - offset;
+
+    initInflate(infstream, data.data(), data.size(), wbits);
+
+    // Inflate directly into result buffer
+    result.resize(offset + outputSize);
+    infstream.avail_out = (uInt)outputSize; // size of output
+    infstream.next_out  = (Bytef *)result.data() + offset; // output char array
+
+    while (true)
+    {
 	ret = ::inflate(&infstream, Z_FINISH);
+
+	if (ret == Z_STREAM_END)
+	    break;
+
+	// Output buffer is full, grow it
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && infstream.avail_out == 0 &&
+	    outputSize < UINT_MAX - offset)
+	{
+	    unsigned int produced = (unsigned int)infstream.total_out;
+
+	    outputSize = (outputSize < (UINT_MAX - offset)/2) ? outputSize*2 : UINT_MAX - offset;
+	    result.resize(offset + outputSize);
+	    infstream.avail_out = (uInt)(outputSize - produced);
+	    infstream.next_out  = (Bytef *)result.data() + offset + produced;
+	    continue;
+	}
+
+	// Real error (or truncated input)
+	break;
     }
 
-    if (ret == Z_STREAM_END)
-	ret = inflateEnd(&infstream);
+    std::string msg = infstream.msg?infstream.msg:"";
+    result.resize(offset + (unsigned int)infstream.total_out);
+    inflateEnd(&infstream);
+
+    if (ret != Z_STREAM_END)
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, code " << zError(ret) << ", msg " << msg);
+}
+
+unsigned int DRMProcessorClientImpl::inflate(const unsigned char* data, unsigned int dataLength,
+					     unsigned char* result, unsigned int resultLength,
+					     int wbits)
+{
+    z_stream infstream;
+
+    initInflate(infstream, data, dataLength, wbits);
+
+    infstream.avail_out = (uInt)resultLength; // size of output
+    infstream.next_out  = (Bytef *)result; // output char array
+
+    int ret = ::inflate(&infstream, Z_FINISH);
+
+    std::string msg = infstream.msg?infstream.msg:"";
+    unsigned int resultSize = (unsigned int)infstream.total_out;
+    bool tooSmall = infstream.avail_out == 0;
+    inflateEnd(&infstream);
 
-    delete[] buffer;
+    if (ret != Z_STREAM_END)
+    {
+	if (tooSmall)
+	    EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, output buffer too small (" << resultLength << ")");
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, code " << zError(ret) << ", msg " << msg);
+    }
 
-    if (ret != Z_OK && ret != Z_STREAM_END)
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Inflate error, code " << zError(ret) << ", msg " << infstream.msg);
+    return resultSize;
 }
-	
+
 void DRMProcessorClientImpl::deflate(gourou::ByteArray& data, gourou::ByteArray& result,
 				     int wbits, int compressionLevel)
 {
-    unsigned int dataSize = data.size();
-    unsigned char* buffer = new unsigned char[dataSize];
-    
+    unsigned int offset = result.length();
     z_stream defstream;
 
     defstream.zalloc = Z_NULL;
     defstream.zfree  = Z_NULL;
     defstream.opaque = Z_NULL;
 
-    defstream.avail_in  = (uInt)dataSize;
+    defstream.avail_in  = (uInt)data.size();
     defstream.next_in   = (Bytef *)data.data(); // input char array
-    defstream.avail_out = (uInt)dataSize; // size of output
-    defstream.next_out  = (Bytef *)buffer; // output char array
 
     int ret = deflateInit2(&defstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, wbits,
 			   compressionLevel, Z_DEFAULT_STRATEGY);
 
     if (ret != Z_OK)
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Deflate error, code " << zError(ret) << ", msg " << defstream.msg);
-    
-    ret = ::deflate(&defstream, Z_FINISH);
-    while (ret == Z_OK || ret == Z_STREAM_END)
-    {
-	result.append(buffer, dataSize-defstream.avail_out);
-	if ((ret == Z_OK && defstream.avail_out != 0) || ret == Z_STREAM_END)
-	    break;
-	defstream.avail_out = (uInt)dataSize; // size of output
-	defstream.next_out = (Bytef *)buffer; // output char array
-	ret = ::deflate(&defstream, Z_FINISH);
-    }
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Deflate error, code " << zError(ret) << ", msg " << (defstream.msg?defstream.msg:""));
 
-    if (ret == Z_STREAM_END)
-	ret = deflateEnd(&defstream);
+    // Output is done in one pass directly into result
+    unsigned int outputSize = (unsigned int)deflateBound(&defstream, data.size());
+    result.resize(offset + outputSize);
+    defstream.avail_out = (uInt)outputSize; // size of output
+    defstream.next_out  = (Bytef *)result.data() + offset; // output char array
+
+    ret = ::deflate(&defstream, Z_FINISH);
 
-    delete[] buffer;
+    std::string msg = defstream.msg?defstream.msg:"";
+    result.resize(offset + (unsigned int)defstream.total_out);
+    deflateEnd(&defstream);
 
-    if (ret != Z_OK && ret != Z_STREAM_END)
-	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Deflate error, code " << zError(ret) << ", msg " << defstream.msg);
+    if (ret != Z_STREAM_END)
+	EXCEPTION(gourou::CLIENT_ZIP_ERROR, "Deflate error, code " << zError(ret) << ", msg " << msg);
 }
@@ -30,6 +30,10 @@
 #define _DRMPROCESSORCLIENTIMPL_H_
 
 #include <string>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <stdint.h>
 
 #if OPENSSL_VERSION_MAJOR >= 3
 #include <openssl/provider.h>
@@ -54,6 +58,124 @@ public:
 
     /* HTTP interface */
     virtual std::string sendHTTPRequest(const std::string& URL, const std::string& POSTData=std::string(""), const std::string& contentType=std::string(""), std::map<std::string, std::string>* responseHeaders=0, int fd=0, bool resume=false);
+    virtual void downloadHTTPRequest(const std::string& URL, gourou::HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders=0);
+
+    /**
+     * @brief Progress callback : bytes of the resource available so far
+     * and expected total (0 if unknown). Called from the thread doing
+     * the request.
+     */
+    typedef std::function<void(uint64_t received, uint64_t total)> ProgressCallback;
+
+    /**
+     * @brief Retry policy of a request. A broken transfer that received
+     * data is retried without consuming an attempt.
+     */
+    struct RetryPolicy
+    {
+	unsigned int maxAttempts; // Attempts before failing
+	unsigned int delayMs;     // Wait delayMs * attempt before retrying
+    };
+
+    /**
+     * @brief Statistics of one request
+     */
+    struct TransferStats
+    {
+	uint64_t resumeOffset;    // Bytes already present in output file
+	uint64_t bytesReceived;   // Body bytes received by this request
+	uint64_t bytesSent;       // Body bytes sent by this request (uploads)
+	uint64_t contentLength;   // Full resource size (0 if unknown)
+	unsigned int attempts;    // Transfers performed (including retries and chunks)
+	long httpCode;            // Last HTTP code
+	double time;              // Seconds spent in request
+
+	double throughput() const { return time > 0 ? bytesReceived / time : 0; }
+    };
+
+    /**
+     * @brief State of one request : callers fill the progress callback
+     * and retry policy, stats are updated during the transfer.
+     * A context must not be shared by concurrent requests.
+     */
+    struct TransferContext
+    {
+	TransferContext();
+
+	ProgressCallback progress; // Empty : display percent on stdout for big files
+	RetryPolicy retry;
+	TransferStats stats;
+    };
+
+    /**
+     * @brief Same as sendHTTPRequest(), but with an explicit per request context
+     */
+    std::string sendHTTPRequest(TransferContext& transfer, const std::string& URL, const std::string& POSTData=std::string(""), const std::string& contentType=std::string(""), std::map<std::string, std::string>* responseHeaders=0, int fd=0, bool resume=false);
+
+    /**
+     * @brief Same as downloadHTTPRequest(), but with an explicit per request context
+     */
+    void downloadHTTPRequest(TransferContext& transfer, const std::string& URL, gourou::HTTPResponseSink& sink, std::map<std::string, std::string>* responseHeaders=0);
+
+    /**
+     * @brief Upload data with a PUT request (pre-signed URL...). Whole
+     * request is sent again on network errors and 5xx replies, following
+     * transfer retry policy.
+     *
+     * @return Reply body
+     */
+    std::string uploadHTTPRequest(TransferContext& transfer, const std::string& URL,
+				  const unsigned char* data, size_t length,
+				  std::map<std::string, std::string>* responseHeaders=0);
+
+    /**
+     * @brief Stats of the last request done by the calling thread
+     * with the context-less sendHTTPRequest() (used by DRMProcessor)
+     */
+    TransferStats getLastTransferStats();
+
+    /**
+     * @brief Default progress callback and retry policy of
+     * context-less requests
+     */
+    void setProgressCallback(const ProgressCallback& progress);
+    void setRetryPolicy(const RetryPolicy& retry);
+
+    /**
+     * @brief HTTP connections statistics, cumulated since client creation
+     * (or last reset). Connections, TLS sessions and DNS entries are
+     * shared between all requests of a client.
+     */
+    struct ConnectionStats
+    {
+	unsigned int requests;          // Transfers performed (including retries)
+	unsigned int newConnections;    // Connections opened
+	unsigned int reusedConnections; // Transfers done on an already opened connection
+	unsigned int retries;           // Failed transfers tried again
+	double nameLookupTime;          // Seconds spent in DNS resolution
+	double connectTime;             // Seconds spent in TCP handshakes
+	double tlsHandshakeTime;        // Seconds spent in TLS handshakes
+    };
+
+    /**
+     * @brief Get HTTP connections statistics
+     */
+    ConnectionStats getConnectionStats();
+
+    /**
+     * @brief Reset HTTP connections statistics
+     */
+    void resetConnectionStats();
+
+    /**
+     * @brief Number of parallel connections used to download a file
+     * (request with an output file descriptor). If > 1 and the server
+     * supports range requests, file is preallocated and chunks are
+     * fetched concurrently, each one being retried independently.
+     * Default is 1 (single stream).
+     */
+    void setDownloadConnections(unsigned int connections) { downloadConnections = connections; }
+    unsigned int getDownloadConnections() { return downloadConnections; }
 
     virtual void RSAPrivateEncrypt(const unsigned char* RSAKey, unsigned int RSAKeyLength,
 				   const RSA_KEY_TYPE keyType, const std::string& password,
@@ -65,6 +187,19 @@ public:
 				   const unsigned char* data, unsigned dataLength,
 				   unsigned char* res);
 
+    virtual void* loadRSAPrivateKey(const unsigned char* RSAKey, unsigned int RSAKeyLength,
+				    const RSA_KEY_TYPE keyType, const std::string& password);
+
+    virtual void freeRSAPrivateKey(void* handler);
+
+    virtual void RSAPrivateEncrypt(void* handler,
+				   const unsigned char* data, unsigned dataLength,
+				   unsigned char* res);
+
+    virtual void RSAPrivateDecrypt(void* handler,
+				   const unsigned char* data, unsigned dataLength,
+				   unsigned char* res);
+
     virtual void RSAPublicEncrypt(const unsigned char* RSAKey, unsigned int RSAKeyLength,
 				  const RSA_KEY_TYPE keyType,
 				  const unsigned char* data, unsigned dataLength,
@@ -111,10 +246,13 @@ public:
 
     /* ZIP Interface */
     virtual void* zipOpen(const std::string& path);
+
+    virtual void* zipOpen(gourou::ByteArray& data);
     
     virtual void zipReadFile(void* handler, const std::string& path, gourou::ByteArray& result, bool decompress=true);
     
     virtual void zipWriteFile(void* handler, const std::string& path, gourou::ByteArray& content);
+    virtual void zipWriteFile(void* handler, const std::string& path, gourou::ByteArray& content, bool compress);
     
     virtual void zipDeleteFile(void* handler, const std::string& path);
     
@@ -122,14 +260,67 @@ public:
     
     virtual void inflate(gourou::ByteArray& data, gourou::ByteArray& result,
 			 int wbits=-15);
+    virtual void inflate(gourou::ByteArray& data, gourou::ByteArray& result,
+			 int wbits, unsigned int sizeHint);
+    virtual unsigned int inflate(const unsigned char* data, unsigned int dataLength,
+				 unsigned char* result, unsigned int resultLength,
+				 int wbits=-15);
 	
     virtual void deflate(gourou::ByteArray& data, gourou::ByteArray& result,
 			 int wbits=-15, int compressionLevel=8);
 
 private:
+    /* Fetched ciphers, also used to index per thread contexts (CryptoSession) */
+    enum CIPHER_INDEX {
+	CIPHER_AES_128_ECB=0,
+	CIPHER_AES_128_CBC,
+	CIPHER_RC4,
+	CIPHER_COUNT
+    };
+    friend struct CryptoSession;
 
     void padWithPKCS1(unsigned char* out, unsigned int outLength,
 		      const unsigned char* in, unsigned int inLength);
+
+    void* acquireCURLHandle();
+    void releaseCURLHandle(void* curl);
+    void enableCookies(void* curl, bool saveCookies);
+
+    /* Gives pooled handle back on every exit path (exceptions included) */
+    class CURLHandleGuard
+    {
+    public:
+	CURLHandleGuard(DRMProcessorClientImpl* client);
+	~CURLHandleGuard();
+
+	void* get() { return handle; }
+	void release();
+
+    private:
+	DRMProcessorClientImpl* client;
+	void* handle;
+    };
+
+    void updateConnectionStats(void* curl);
+
+    void initCryptoObjects();
+    void freeCryptoObjects();
+    const void* getDigest(const std::string& digestName);
+    static int cipherIndex(CRYPTO_ALGO algo, CHAINING_MODE chaining, unsigned int keyLength);
+    void* cipherInit(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+		     const unsigned char* key, unsigned int keyLength,
+		     const unsigned char* iv, int enc);
+    void* sessionCipher(CRYPTO_ALGO algo, CHAINING_MODE chaining,
+			const unsigned char* key, unsigned int keyLength,
+			const unsigned char* iv, int enc);
+    void sessionCrypt(void* handler, const unsigned char* dataIn, unsigned int dataInLength,
+		      unsigned char* dataOut, unsigned int* dataOutLength);
+
+    void performHTTPRequest(TransferContext& transfer, const std::string& URL, const std::string& POSTData,
+			    const std::string& contentType, std::map<std::string, std::string>* responseHeaders,
+			    int fd, bool resume, gourou::ByteArray* replyData, gourou::HTTPResponseSink* sink);
+    bool parallelDownload(TransferContext& transfer, const std::string& URL, int fd, std::map<std::string, std::string>* responseHeaders);
+    void downloadRange(void* parallelContext, int fd, uint64_t start, uint64_t end, bool* rangeRefused);
     
 #if OPENSSL_VERSION_MAJOR >= 3
     OSSL_PROVIDER *legacy, *deflt;
@@ -138,6 +329,21 @@ private:
 #endif
 
     char cookiejar[64];
+
+    /* CURL/CURLSH handlers, kept opaque to not depend on curl headers */
+    void* curlShare;
+    std::vector<void*> curlHandles;
+    std::mutex curlLock;
+    std::mutex cookieLock;
+    ConnectionStats connectionStats;
+    unsigned int downloadConnections;
+    ProgressCallback defaultProgress;
+    RetryPolicy defaultRetry;
+    std::mutex defaultsLock;
+
+    /* Fetched EVP_CIPHER (AES-128-ECB, AES-128-CBC, RC4) and EVP_MD objects */
+    void* ciphers[CIPHER_COUNT];
+    std::map<std::string, void*> digests;
 };
 
 #endif
@@ -34,7 +34,7 @@ namespace uPDFParser
 	Object():
 	    _objectId(0), _generationNumber(0),
 	    _offset(0), _isNew(false), indirectOffset(0),
-	    _used(true)
+	    _used(true), _source(0), _sourceLength(0)
 	{}
 
 	/**
@@ -51,7 +51,7 @@ namespace uPDFParser
 	       off_t indirectOffset=0, bool used=true):
 	    _objectId(objectId), _generationNumber(generationNumber),
 	    _offset(offset), _isNew(isNew), indirectOffset(indirectOffset),
-	    _used(true)
+	    _used(true), _source(0), _sourceLength(0)
 	{}
 
 	~Object()
@@ -69,16 +69,17 @@ namespace uPDFParser
 	    indirectOffset = other.indirectOffset;
 	    _isNew = true;
 	    _used = other._used;
+	    _source = other._source;
+	    _sourceLength = other._sourceLength;
 
 	    std::vector<DataType*>::const_iterator it;
 	    for(it=other._data.begin(); it!=other._data.end(); it++)
 		_data.push_back((*it)->clone());
 
-	    const std::map<std::string, DataType*> _dict = ((Dictionary)other._dictionary).value();
-	    std::map<std::string, DataType*>& _myDict = _dictionary.value();
-	    std::map<std::string, DataType*>::const_iterator it2;
+	    const Dictionary::Entries& _dict = const_cast<Dictionary&>(other._dictionary).value();
+	    Dictionary::Entries::const_iterator it2;
 	    for(it2=_dict.begin(); it2!=_dict.end(); it2++)
-		_myDict[it2->first] = it2->second->clone();
+		_dictionary.addData(it2->first, (it2->second)?it2->second->clone():0);
 	}
 
 	/**
@@ -106,6 +107,18 @@ namespace uPDFParser
 	 */
 	off_t offset() {return _offset;}
 	
+	/**
+	 * @brief Raw bytes of object ("X Y obj" ... "endobj") in parsed
+	 * input, 0 if unknown. Valid as long as streams data.
+	 */
+	const unsigned char* source() {return _source;}
+	size_t sourceLength() {return _sourceLength;}
+
+	/**
+	 * @brief Set raw bytes of object
+	 */
+	void setSource(const unsigned char* source, size_t length) {_source = source; _sourceLength = length;}
+
 	/**
 	 * @brief Set object as indirect if offset != 0 or not indirect if offset == 0
 	 */
@@ -119,12 +132,14 @@ namespace uPDFParser
 	/**
 	 * @brief Get dictionary value
 	 */
-	DataType*& operator[](const std::string& key) { return _dictionary.value()[key]; }
+	DataType*& operator[](const std::string& key) { return _dictionary[key]; }
+	DataType*& operator[](NameId key) { return _dictionary[key]; }
 
 	/**
 	 * @brief Check for key in object's dictionary
 	 */
 	bool hasKey(const std::string& key) { return _dictionary.hasKey(key); }
+	bool hasKey(NameId key) { return _dictionary.hasKey(key); }
 
 	/**
 	 * @brief Remove a key in object's dictionary
@@ -132,6 +147,8 @@ namespace uPDFParser
 	 * Value is freed during this operation
 	 */
 	void deleteKey(const std::string& key) { _dictionary.deleteKey(key); }
+	void deleteKey(NameId key) { _dictionary.deleteKey(key); }
+	void deleteKey(const Dictionary::Key& key) { _dictionary.deleteKey(key); }
 
 	/**
 	 * @brief is object new (or not updated) ?
@@ -140,6 +157,8 @@ namespace uPDFParser
 
 	/**
 	 * @brief Mark object as updated
+	 * (it must be called after any modification of a parsed object,
+	 * else it can be written from its source, see Parser::setCopyCleanObjects())
 	 */
 	void update(void) { _isNew = true; }
 
@@ -176,6 +195,8 @@ namespace uPDFParser
 	bool _isNew;
 	off_t indirectOffset;
 	bool _used;
+	const unsigned char* _source;
+	size_t _sourceLength;
 	Dictionary _dictionary;
 	std::vector<DataType*> _data;
     };
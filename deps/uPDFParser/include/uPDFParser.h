@@ -22,6 +22,7 @@
 
 #include <exception>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -36,6 +37,172 @@
 namespace uPDFParser
 {
     class XRefValue;
+
+    /**
+     * @brief Receive objects parsed in streaming mode
+     */
+    class ObjectHandler
+    {
+    public:
+	virtual ~ObjectHandler() {}
+
+	/**
+	 * @brief Called each time an object has been parsed
+	 *
+	 * @param object  Parsed object
+	 *
+	 * @return true if handler keeps object (and has to delete it),
+	 *         false if parser can delete it
+	 */
+	virtual bool handleObject(Object* object) = 0;
+    };
+
+    /**
+     * @brief Output sink of write functions
+     */
+    class Writer
+    {
+    public:
+	virtual ~Writer() {}
+
+	/**
+	 * @brief Write whole buffer (or throw an exception)
+	 */
+	virtual void write(const char* buffer, size_t size) = 0;
+    };
+
+    /**
+     * @brief Write into a file descriptor
+     */
+    class FdWriter : public Writer
+    {
+    public:
+	/**
+	 * @param fd       File descriptor
+	 * @param closeFd  Close fd when writer is deleted
+	 */
+	FdWriter(int fd, bool closeFd=false):
+	    fd(fd), closeFd(closeFd)
+	{}
+
+	~FdWriter() { if (closeFd) close(fd); }
+
+	virtual void write(const char* buffer, size_t size);
+
+    private:
+	int fd;
+	bool closeFd;
+    };
+
+    /**
+     * @brief Read only view of a whole file.
+     * File is mapped in memory (or read at once if it can't be mapped),
+     * so tokenizer doesn't need a system call for each character
+     * and streams data can point directly into it.
+     * For incremental parsing, data is appended chunk by chunk and
+     * already parsed data is discarded : offsets stay file offsets.
+     */
+    class InputBuffer
+    {
+    public:
+	InputBuffer():
+	    _data(0), _size(0), _pos(0), _base(0), _capacity(0), mapped(false), borrowed(false)
+	{}
+
+	~InputBuffer() { close(); }
+
+	/**
+	 * @brief Map (or read) file referenced by fd
+	 */
+	void open(int fd);
+
+	/**
+	 * @brief Copy a memory buffer
+	 *
+	 * @param copy  If false, data is only referenced (borrowed) : it must
+	 *              outlive this buffer and must not be modified meanwhile
+	 */
+	void open(const unsigned char* data, off_t size, bool copy=true);
+
+	/**
+	 * @brief Append a copy of data at the end of (owned) buffer.
+	 * Pointers returned by data() are invalidated
+	 */
+	void append(const unsigned char* data, size_t size);
+
+	/**
+	 * @brief Free data before offset (position must be after it).
+	 * Pointers returned by data() are invalidated
+	 */
+	void discard(off_t offset);
+
+	/**
+	 * @brief Release mapped (or allocated) data, borrowed data is only forgotten
+	 */
+	void close();
+
+	/**
+	 * @brief Move content into a new heap allocated buffer and reset current one
+	 */
+	InputBuffer* detach();
+
+	/**
+	 * @brief Read next character. Return false at end of buffer
+	 */
+	bool getChar(char& c)
+	{
+	    if (_pos >= _size)
+		return false;
+	    c = (char)_data[_pos++];
+	    return true;
+	}
+
+	/**
+	 * @brief Go back one character
+	 */
+	void ungetChar() { if (_pos) _pos--; }
+
+	/**
+	 * @brief Current position
+	 */
+	off_t tell() { return _base + _pos; }
+
+	/**
+	 * @brief Set current position, from first kept offset up to size()
+	 */
+	void seek(off_t pos);
+
+	/**
+	 * @brief Exchange content (and position) with another buffer
+	 */
+	void swap(InputBuffer& other);
+
+	/**
+	 * @brief Offset of the end of buffer (its size, unless data has been discarded)
+	 */
+	off_t size() { return _base + _size; }
+
+	/**
+	 * @brief Pointer to data at offset
+	 */
+	unsigned char* data(off_t offset=0) { return _data + (offset - _base); }
+
+	/**
+	 * @brief Data is owned by caller (see open(data, size, copy))
+	 */
+	bool isBorrowed() { return borrowed; }
+
+    private:
+	InputBuffer(const InputBuffer&);
+	InputBuffer& operator=(const InputBuffer&);
+
+	unsigned char* _data;
+	off_t _size;
+	off_t _pos;
+	off_t _base;     // Offset of _data (discarded size)
+	off_t _capacity; // Allocated size of appended data
+	bool mapped, borrowed;
+    };
     
     /**
      * @brief PDF Parser
@@ -45,22 +212,93 @@ namespace uPDFParser
     public:
 	Parser(int version_major=1, int version_minor=6):
 	    version_major(version_major), version_minor(version_minor),
-	    xrefObject(0), xrefOffset((off_t)-1), fd(0), curOffset(0)
+	    xrefObject(0), ownXrefObject(false), xrefOffset((off_t)-1), fd(0),
+	    handler(0), curOffset(0), pushing(false), pushHeader(false), pushSecondLine(false),
+	    pushObjectScan(0), pushEOFScan(0), writer(0), ownWriter(false), writeOffset(0), writeMaxId(0),
+	    writeXrefStmOffset(0), writeDroppedXref(false), copyCleanObjects(false), xrefStreams(false), objStm(0), inputModified(false)
 	{}
 
 	~Parser()
 	{
 	    if (fd) close(fd);
+	    if (ownWriter) delete writer;
+	    if (ownXrefObject) delete xrefObject;
 	    
 	    std::vector<Object*>::iterator it;
 	    for(it=_objects.begin(); it!=_objects.end(); it++)
 		delete *it;
+
+	    std::vector<InputBuffer*>::iterator it2;
+	    for(it2=oldInputs.begin(); it2!=oldInputs.end(); it2++)
+		delete *it2;
 	}
 
 	/**
 	 * @brief Parse a file
+	 *
+	 * @param filename File path
+	 * @param handler  If set, objects are not kept by parser but given one by one
+	 *                 to handler (streaming mode). Only xref table and trailer are kept,
+	 *                 they're reset at each call.
+	 *
+	 * Values of kept objects are allocated from parser's arena and live as
+	 * long as parser does : use clone() to move them into another parser.
+	 */
+	void parse(const std::string& filename, ObjectHandler* handler=0);
+
+	/**
+	 * @brief Parse a PDF file in memory
+	 *
+	 * @param data     PDF content
+	 * @param length   PDF content length
+	 * @param handler  Same as parse(filename, handler)
+	 * @param copy     Parse a copy of data (default). If false, data is only
+	 *                 referenced : it must stay valid and unchanged as long as
+	 *                 parser and its objects are used, and streams data must
+	 *                 not be modified in place (use Stream::setData())
+	 */
+	void parse(const unsigned char* data, size_t length, ObjectHandler* handler=0, bool copy=true);
+
+	/**
+	 * @brief Start an incremental parse in streaming mode : PDF content
+	 * is given chunk by chunk with push() as it's received (download...)
+	 * and each object is given to handler as soon as it's complete.
+	 * Only data not parsed yet is buffered.
+	 * Objects don't reference parser's buffer : streams own their data,
+	 * and original bytes are not kept (see setCopyCleanObjects()).
+	 *
+	 * @param handler  Same as parse(filename, handler), mandatory
+	 */
+	void beginPush(ObjectHandler* handler);
+
+	/**
+	 * @brief Append data to the PDF started by beginPush()
+	 */
+	void push(const unsigned char* data, size_t length);
+
+	/**
+	 * @brief Parse remaining data (xref table, trailer...) : same result
+	 * as parse(data, length, handler) with the whole content
+	 */
+	void endPush();
+
+	/**
+	 * @brief Only read xref tables and trailer (from the end of the file).
+	 * Objects are parsed when they're requested by getObject(),
+	 * or all at once by objects() or a full write().
+	 * Falls back to parse() if xref tables can't be used
+	 * (broken offsets...).
+	 * Unlike parse(), revisions replaced by an incremental update are never loaded.
+	 *
+	 * @param filename File path
+	 */
+	void parseLazy(const std::string& filename);
+
+	/**
+	 * @brief Same as parseLazy(filename) for a PDF in memory
+	 * (data is copied, unless copy is false : see parse(data, length, handler, copy))
 	 */
-	void parse(const std::string& filename);
+	void parseLazy(const unsigned char* data, size_t length, bool copy=true);
 
 	/**
 	 * @brief Write a PDF file with internal objects
@@ -71,15 +309,77 @@ namespace uPDFParser
 	 */
 	void write(const std::string& filename, bool update=false);
 
+	/**
+	 * @brief Write a PDF with internal objects into writer
+	 *
+	 * @param writer   Output sink
+	 * @param update   Copy parsed PDF, then append new objects if true.
+	 *                 A PDF parsed from memory can't be copied once its
+	 *                 streams data may have been modified in place, i.e. after
+	 *                 Stream::data() or Stream::setDataLength() (exception)
+	 */
+	void write(Writer& writer, bool update=false);
+
+	/**
+	 * @brief Start writing a new PDF file object by object (streaming mode).
+	 * Objects are written with writeObject() and file is finished
+	 * (xref table and trailer) by endWrite()
+	 */
+	void beginWrite(const std::string& filename);
+
+	/**
+	 * @brief Same as beginWrite(filename), but into writer.
+	 * It must stay valid until endWrite()
+	 */
+	void beginWrite(Writer& writer);
+
+	/**
+	 * @brief Write an object into file opened by beginWrite()
+	 */
+	void writeObject(Object* object);
+
+	/**
+	 * @brief Write xref table and current trailer, then close file opened by beginWrite()
+	 * (writer given to beginWrite() is not deleted)
+	 */
+	void endWrite();
+
+	/**
+	 * @brief Write objects read from input and not updated (see Object::update())
+	 * by copying their original bytes instead of serializing them again.
+	 * Faster, and untouched objects are byte-identical to the source.
+	 * Default is false.
+	 */
+	void setCopyCleanObjects(bool enable) { copyCleanObjects = enable; }
+
+	/**
+	 * @brief Write a compressed cross reference stream (PDF 1.5)
+	 * instead of an xref table and trailer.
+	 * Objects of object streams not loaded are still referenced
+	 * through their (written) object stream.
+	 * Default follows parsed file: enabled when its last cross
+	 * reference section is a stream. Call it after parsing to force a kind.
+	 */
+	void setWriteXrefStream(bool enable) { xrefStreams = enable; }
+
 	/**
 	 * @brief Get internals (or parsed) objects
+	 * Objects must be added/removed with addObject()/removeObject()
+	 * in order to keep index up to date.
+	 * Objects not loaded yet (see parseLazy()) are parsed first.
+	 * Objects stored into object streams (ObjStm) are only loaded
+	 * with getObject()
 	 */
-	std::vector<Object*>& objects() { return _objects; }
+	std::vector<Object*>& objects();
 
 	/**
 	 * @brief Add an object
 	 */
-	void addObject(Object* object) { _objects.push_back(object); }
+	void addObject(Object* object)
+	{
+	    _objects.push_back(object);
+	    objectsIndex[indexKey(object->objectId(), object->generationNumber())] = object;
+	}
 
 	/**
 	 * @brief Remove an object from list and crefTable
@@ -99,21 +399,58 @@ namespace uPDFParser
 
 	/**
 	 * @brief Return a specific object
+	 * If several objects have the same id/generation number (incremental updates),
+	 * the last one added is returned.
+	 * Object is parsed if needed (see parseLazy()), or extracted
+	 * from its object stream (not supported for encrypted documents)
 	 */
 	Object* getObject(int objectId, int generationNumber=0);
 	
     private:
+	/**
+	 * @brief Decoded entry of a cross reference stream
+	 */
+	struct XRefStreamEntry
+	{
+	    int objectId;
+	    int type;        // 0 : free, 1 : used, 2 : in object stream
+	    off_t offset;    // Offset, or object stream id (type 2)
+	    int generation;  // Generation number, or index in object stream (type 2)
+	};
+
+	static bool compareXRefStreamEntries(const XRefStreamEntry& a, const XRefStreamEntry& b)
+	{
+	    return a.objectId < b.objectId;
+	}
+
+	static uint64_t indexKey(int objectId, int generationNumber)
+	{
+	    return ((uint64_t)(uint32_t)objectId << 32) | (uint32_t)generationNumber;
+	}
+
+	Object* readObject(std::string& token);
 	void parseObject(std::string& token);
+	void handleParsedObject(Object* object);
 	void parseHeader();
-	void parseStartXref();
+	void parseStartXref(bool xrefTable);
 	bool parseXref();
+	void parseXrefEntries(std::vector<XRefValue>& table);
+	void lazyInput();
+	off_t findStartXref();
+	bool parseXrefSections();
+	void parseXrefStream(Object* object, std::vector<XRefStreamEntry>& entries);
+	Object* readXrefStream(off_t offset, std::vector<XRefStreamEntry>& entries);
+	void indexXrefStream(Object* object);
+	Object* loadCompressedObject(int objectId, int objStmId, int index);
+	Object* loadObject(int objectId, int generationNumber, off_t offset);
+	void loadObjects();
 	bool parseTrailer();
 
 	char prevChar();
 	std::string nextToken(bool exceptionOnEOF=true, bool readComment=false);
 	
-	DataType* parseType(std::string& token, Object* object, std::map<std::string, DataType*>& dict);
-	void parseDictionary(Object* object, std::map<std::string, DataType*>& dict);
+	DataType* parseType(std::string& token, Object* object);
+	void parseDictionary(Object* object, Dictionary& dict);
 	DataType* parseSignedNumber(std::string& token);
 	DataType* parseNumber(std::string& token);
 	DataType* parseNumberOrReference(std::string& token);
@@ -121,20 +458,69 @@ namespace uPDFParser
 	String* parseString();
 	HexaString* parseHexaString();
 	Stream* parseStream(Object* object);
+	Stream* newStream(Object* object, off_t startOffset, off_t endOffset);
 	Name* parseName(std::string& token);
 
 	void repairTrailer();
-	void writeBuffer(int fd, const char* buffer, int size);
+	void beginParse(ObjectHandler* handler);
+	void parseInput();
+	void parsePushed(bool last);
+	bool pushReceived(off_t offset, const char* marker, off_t& scanOffset);
+	off_t copyInput(Writer& writer, off_t offset=0);
 	void writeUpdate(const std::string& filename);
+	void writeUpdate(Writer& writer, off_t offset);
+	void writeXrefStream(Writer& writer, std::vector<XRefStreamEntry>& entries, off_t offset,
+			     int minSize, off_t prevOffset);
 
 	char c;
 	int version_major, version_minor;
+	// Must outlive every parsed object (and trailer)
+	Arena arena;
 	std::vector<Object*> _objects;
+	std::unordered_map<uint64_t, Object*> objectsIndex;
+	// Objects referenced by xref but not parsed yet (lazy parsing)
+	std::unordered_map<uint64_t, off_t> lazyObjects;
+	// Offset -> position of its entries into _xrefTable, updated when a lazy object is loaded
+	std::unordered_multimap<off_t, size_t> lazyXrefEntries;
+	// Objects stored into object streams : (object stream id, index)
+	std::unordered_map<uint64_t, std::pair<int, int> > compressedObjects;
 	Object trailer, *xrefObject;
+	bool ownXrefObject;
 	off_t xrefOffset;
 	int fd;
+	ObjectHandler* handler;
+	InputBuffer input;
+	// Buffers of previous parse() calls, still referenced by streams
+	std::vector<InputBuffer*> oldInputs;
 	off_t curOffset;
 	std::vector<XRefValue> _xrefTable;
+
+	// Incremental parsing state (see beginPush())
+	bool pushing, pushHeader, pushSecondLine;
+	// Markers of complete items are searched from these offsets
+	off_t pushObjectScan, pushEOFScan;
+
+	// Streaming write state
+	Writer* writer;
+	bool ownWriter;
+	off_t writeOffset;
+	int writeMaxId;
+	off_t writeXrefStmOffset;
+	// A source xref stream was not written (replaced by endWrite())
+	bool writeDroppedXref;
+	std::string writeXref;
+	bool copyCleanObjects;
+	bool xrefStreams;
+	std::vector<XRefStreamEntry> writeXrefEntries;
+
+	// Last decoded object stream : data and (object id, offset) of its objects
+	Object* objStm;
+	std::string objStmData;
+	std::vector<std::pair<int, off_t> > objStmOffsets;
+
+	// Set by streams pointing into input when their data may have been
+	// modified in place, checked before copying an input parsed from memory
+	bool inputModified;
     };
 
     class XRefValue
@@ -22,6 +22,7 @@
 
 #include <map>
 #include <vector>
+#include <cstdint>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -44,6 +45,55 @@ static std::string strReplace(const std::string& orig, const std::string& patter
 
 namespace uPDFParser
 {
+    /**
+     * @brief Monotonic allocator for DataType nodes.
+     * Nodes allocated while an arena is current (see Arena::Scope) are
+     * carved from large blocks and only released at once by clear().
+     * Their destructors still have to be called (by delete) before.
+     */
+    class Arena
+    {
+    public:
+	Arena(): block(0), blockUsed(0), blockSize(0) {}
+	~Arena() { clear(); }
+
+	/**
+	 * @brief Allocate size bytes (aligned on max_align_t)
+	 */
+	void* allocate(size_t size);
+
+	/**
+	 * @brief Release all blocks
+	 */
+	void clear();
+
+	/**
+	 * @brief Arena used by DataType allocations of current thread (may be null)
+	 */
+	static Arena* current();
+
+	/**
+	 * @brief Set arena as current one for the lifetime of the scope
+	 */
+	class Scope
+	{
+	public:
+	    Scope(Arena* arena);
+	    ~Scope();
+
+	private:
+	    Arena* previous;
+	};
+
+    private:
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+	std::vector<char*> blocks;
+	char* block;
+	size_t blockUsed, blockSize;
+    };
+
     /**
      * @brief Base class for PDF object type
      * From https://resources.infosecinstitute.com/topic/pdf-file-format-basic-structure/
@@ -59,6 +109,12 @@ namespace uPDFParser
 
 	virtual ~DataType() {}
 
+	/**
+	 * @brief Nodes are allocated from current arena (if any), else on the heap
+	 */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr);
+
 	/**
 	 * @brief Get current data type
 	 */
@@ -179,6 +235,12 @@ namespace uPDFParser
 	    return res;
 	}
 
+	/**
+	 * @brief Unescape value in place (same rules as unescapedValue())
+	 * and return it, so that it can be modified without a copy
+	 */
+	std::string& unescape();
+
     private:
 	std::string _value;
     };
@@ -189,7 +251,7 @@ namespace uPDFParser
 	HexaString(const std::string&);
 
 	virtual DataType* clone() {return new HexaString(_value);}
-	std::string value() {return _value;}
+	std::string& value() {return _value;}
 	virtual std::string str() { return std::string("<") + _value + std::string(">");}
 
     private:
@@ -200,19 +262,21 @@ namespace uPDFParser
     {
     public:
 	Reference(int objectId, int generationNumber):
-	    DataType(DataType::TYPE::REFERENCE), objectId(objectId), generationNumber(generationNumber)
+	    DataType(DataType::TYPE::REFERENCE), _objectId(objectId), _generationNumber(generationNumber)
 	{}
 	
-	virtual DataType* clone() {return new Reference(objectId, generationNumber);}
-	int value() {return objectId;}
+	virtual DataType* clone() {return new Reference(_objectId, _generationNumber);}
+	int value() {return _objectId;}
+	int objectId() {return _objectId;}
+	int generationNumber() {return _generationNumber;}
 	virtual std::string str() {
 	    std::stringstream res;
-	    res << " " << objectId << " " << generationNumber << " R";
+	    res << " " << _objectId << " " << _generationNumber << " R";
 	    return res.str();
 	}
 
     private:
-	int objectId, generationNumber;
+	int _objectId, _generationNumber;
     };
 
     class Array : public DataType
@@ -222,6 +286,8 @@ namespace uPDFParser
 	    DataType(DataType::TYPE::ARRAY)
 	{}
 
+	~Array();
+
 	void addData(DataType* data) {_value.push_back(data);}
 	
 	virtual DataType* clone() {
@@ -235,65 +301,196 @@ namespace uPDFParser
 	virtual std::string str();
 
     private:
+	// Values are owned : use clone()
+	Array(const Array&);
+	Array& operator=(const Array&);
+
 	std::vector<DataType*> _value;
     };
 
+    /**
+     * @brief Identifier of a common PDF name (dictionary key, without '/')
+     */
+    typedef uint32_t NameId;
+
+    /**
+     * @brief Constant identifiers of common names
+     */
+    enum KNOWN_NAME {
+	NAME_TYPE = 0,
+	NAME_SUBTYPE,
+	NAME_FILTER,
+	NAME_DECODEPARMS,
+	NAME_LENGTH,
+	NAME_ENCRYPT,
+	NAME_ROOT,
+	NAME_INFO,
+	NAME_ID,
+	NAME_SIZE,
+	NAME_PREV,
+	NAME_XREFSTM,
+	NAME_W,
+	NAME_INDEX,
+	NAME_N,
+	NAME_FIRST,
+	NAME_EXTENDS,
+	NAME_PARENT,
+	NAME_KIDS,
+	NAME_COUNT,
+	NAME_CONTENTS,
+	NAME_RESOURCES,
+	NAME_V,
+	KNOWN_NAMES_COUNT,
+	/* Any other name (stored as string) */
+	NAME_OTHER = KNOWN_NAMES_COUNT
+    };
+
+    /**
+     * @brief Static table of known names (read only, thread safe)
+     */
+    class Names
+    {
+    public:
+	/**
+	 * @brief Look for a known name
+	 *
+	 * @return false if name is not one of KNOWN_NAME
+	 */
+	static bool find(const std::string& name, NameId& id);
+
+	/**
+	 * @brief Return name of known identifier
+	 */
+	static const std::string& str(NameId id);
+    };
+
+    /**
+     * @brief Dictionary key : known names are compared by identifier,
+     * other ones (resources names like /F7, /Im12...) are owned by key
+     */
+    struct DictionaryKey
+    {
+	explicit DictionaryKey(NameId id): id(id) {}
+	explicit DictionaryKey(const std::string& name);
+
+	bool operator==(const DictionaryKey& other) const
+	{
+	    return id == other.id && (id != NAME_OTHER || name == other.name);
+	}
+	bool operator==(NameId other) const { return id == other; }
+
+	const std::string& str() const { return (id == NAME_OTHER) ? name : Names::str(id); }
+
+	NameId id;
+	std::string name;
+    };
+
+    /**
+     * @brief Flat dictionary : entries are stored in a vector (most
+     * dictionaries have only a few keys) and common keys are identifiers,
+     * so looking for them is only integer comparisons.
+     * Values are owned by dictionary and may be null.
+     */
     class Dictionary : public DataType
     {
     public:
+	typedef DictionaryKey Key;
+	typedef std::pair<Key, DataType*> Entry;
+	typedef std::vector<Entry> Entries;
+
 	Dictionary():
 	    DataType(DataType::TYPE::DICTIONARY)
 	{}
 
-	void addData(const std::string&, DataType*);
+	~Dictionary();
 
-	virtual DataType* clone() {
-	    Dictionary* res = new Dictionary();
-	    std::map<std::string, DataType*>::iterator it;
-	    for(it=_value.begin(); it!=_value.end(); it++)
-	    {
-		res->addData(it->first, it->second->clone());
-	    }
-	    return res;
-	}
-	std::map<std::string, DataType*>& value() {return _value;}
+	/**
+	 * @brief Set value of key. Previous value (if any) is freed
+	 */
+	void addData(const Key& key, DataType* value);
+	void addData(NameId key, DataType* value) { addData(Key(key), value); }
+	void addData(const std::string& key, DataType* value) { addData(Key(key), value); }
+
+	virtual DataType* clone();
+
+	/**
+	 * @brief Entries in insertion order
+	 */
+	Entries& value() {return _value;}
+
+	/**
+	 * @brief Serialization (keys are sorted by name)
+	 */
 	virtual std::string str();
 
 	bool empty() { return _value.empty(); }
+	size_t size() { return _value.size(); }
 
-	bool hasKey(const std::string& key) { return _value.count(key)?true:false;}
+	bool hasKey(const Key& key) { return find(key) != 0; }
+	bool hasKey(NameId key) { return hasKey(Key(key)); }
+	bool hasKey(const std::string& key) { return hasKey(Key(key)); }
 
-	void deleteKey(const std::string& key) {
-	    if (!hasKey(key)) return;
-	    delete _value[key];
-	    _value.erase(key);
-	}
+	/**
+	 * @brief Return value of key, 0 if not present
+	 */
+	DataType* get(const Key& key) { Entry* entry = find(key); return entry?entry->second:0; }
+	DataType* get(NameId key) { return get(Key(key)); }
+	DataType* get(const std::string& key) { return get(Key(key)); }
 
-	void replace(const std::string& key, DataType* data, bool freeData=true)
-	{
-	    if (hasKey(key))
-	    {
-		if (freeData)
-		    deleteKey(key);
-		else
-		    _value.erase(key);
+	/**
+	 * @brief Return value of key, created (null) if not present
+	 */
+	DataType*& operator[](const Key& key);
+	DataType*& operator[](NameId key) { return (*this)[Key(key)]; }
+	DataType*& operator[](const std::string& key) { return (*this)[Key(key)]; }
 
-		addData(key, data);
-	    }
-	}
+	/**
+	 * @brief Remove key and free its value (no error if key doesn't exists)
+	 */
+	void deleteKey(const Key& key);
+	void deleteKey(NameId key) { deleteKey(Key(key)); }
+	void deleteKey(const std::string& key) { deleteKey(Key(key)); }
+
+	/**
+	 * @brief Replace existing key value (nothing is done if key doesn't exists)
+	 */
+	void replace(const Key& key, DataType* data, bool freeData=true);
+	void replace(NameId key, DataType* data, bool freeData=true) { replace(Key(key), data, freeData); }
+	void replace(const std::string& key, DataType* data, bool freeData=true) { replace(Key(key), data, freeData); }
+
+	/**
+	 * @brief Remove (and free) all entries
+	 */
+	void clear();
 
     private:
-	std::map<std::string, DataType*> _value;
+	// Values are owned : use clone()
+	Dictionary(const Dictionary&);
+	Dictionary& operator=(const Dictionary&);
+
+	Entry* find(const Key& key)
+	{
+	    for (size_t i=0; i<_value.size(); i++)
+		if (_value[i].first == key)
+		    return &_value[i];
+	    return 0;
+	}
+
+	Entries _value;
     };
 
     class Stream : public DataType
     {
     public:
+	/**
+	 * @param inputModified If set, flag raised when data (pointing into
+	 *                      parser's input) may be modified in place
+	 */
 	Stream(Dictionary& dict, int startOffset, int endOffset, unsigned char* data=0, unsigned int dataLength=0,
-	       bool freeData=false, int fd=0):
+	       bool freeData=false, int fd=0, bool* inputModified=0):
 	    DataType(DataType::TYPE::STREAM), dict(dict), fd(fd),
 	    startOffset(startOffset), endOffset(endOffset),
-	    _data(data), _dataLength(dataLength), freeData(false)
+	    _data(data), _dataLength(dataLength), freeData(freeData), inputModified(inputModified)
 	{}
 
 	~Stream() {
@@ -301,19 +498,42 @@ namespace uPDFParser
 	}
 	
 	virtual DataType* clone() {return new Stream(dict, startOffset, endOffset,
-						     _data, _dataLength, false, fd);}
+						     _data, _dataLength, false, fd, inputModified);}
 	virtual std::string str();
+
+	/**
+	 * @brief Return data, that can be modified in place
+	 * (input is then considered as modified, see Parser::write())
+	 */
 	unsigned char* data();
 	unsigned int dataLength() {return _dataLength;}
 	void setData(unsigned char* data, unsigned int dataLength, bool freeData=false);
 
+	/**
+	 * @brief Update length after data() has been modified in place
+	 * (data ownership is kept)
+	 */
+	void setDataLength(unsigned int dataLength);
+
+	/**
+	 * @brief Return decoded data. Only FlateDecode filter (with PNG or TIFF
+	 * predictor) is supported, data without filter is returned as is.
+	 * Other filters raise a NOT_IMPLEMENTED exception.
+	 */
+	std::string decodedData();
+
     private:
+	// Read-only access, doesn't raise inputModified
+	const unsigned char* loadData();
+	void setInputModified() { if (inputModified && !freeData) *inputModified = true; }
+
 	Dictionary& dict;
 	int fd;
 	int startOffset, endOffset;
 	unsigned char* _data;
 	unsigned int _dataLength;
 	bool freeData;
+	bool* inputModified;
     };
 
     class Null : public DataType
@@ -19,9 +19,19 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <unordered_set>
+#include <zlib.h>
 
 #include "uPDFParser.h"
 #include "uPDFParser_common.h"
@@ -93,10 +103,174 @@ namespace uPDFParser
 	return new Integer(ivalue, (sign!='\0'));
     }
 
+    void InputBuffer::open(int fd)
+    {
+	struct stat _stat;
+
+	close();
+
+	if (fstat(fd, &_stat) == 0 && S_ISREG(_stat.st_mode) && _stat.st_size > 0)
+	{
+	    // Private writable mapping : streams can be modified in place
+	    // without altering original file
+	    void* addr = mmap(0, _stat.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	    if (addr != MAP_FAILED)
+	    {
+		_data = (unsigned char*)addr;
+		_size = _stat.st_size;
+		mapped = true;
+		return;
+	    }
+	}
+
+	// Fallback : read the whole file
+	unsigned char buffer[64*1024];
+	off_t capacity = 0;
+	int ret;
+
+	while (true)
+	{
+	    ret = ::read(fd, buffer, sizeof(buffer));
+	    if (ret < 0)
+		EXCEPTION(IO_ERROR, "IO Error (read) %m");
+	    if (ret == 0)
+		break;
+
+	    if (_size + ret > capacity)
+	    {
+		capacity = (capacity)?capacity*2:(off_t)sizeof(buffer);
+		if (capacity < _size + ret)
+		    capacity = _size + ret;
+		_data = (unsigned char*)realloc(_data, capacity);
+		if (!_data)
+		    EXCEPTION(IO_ERROR, "Unable to allocate " << capacity << " bytes");
+	    }
+	    memcpy(&_data[_size], buffer, ret);
+	    _size += ret;
+	}
+    }
+
+    void InputBuffer::open(const unsigned char* data, off_t size, bool copy)
+    {
+	close();
+
+	if (!size)
+	    return;
+
+	if (!copy)
+	{
+	    _data = (unsigned char*)data;
+	    _size = size;
+	    borrowed = true;
+	    return;
+	}
+
+	_data = (unsigned char*)malloc(size);
+	if (!_data)
+	    EXCEPTION(IO_ERROR, "Unable to allocate " << size << " bytes");
+
+	memcpy(_data, data, size);
+	_size = size;
+    }
+
+    void InputBuffer::append(const unsigned char* data, size_t size)
+    {
+	if (mapped || borrowed)
+	    EXCEPTION(IO_ERROR, "Unable to append data to a mapped or borrowed buffer");
+
+	if (_size + (off_t)size > _capacity)
+	{
+	    off_t capacity = _capacity ? _capacity*2 : (off_t)(64*1024);
+	    if (capacity < _size + (off_t)size)
+		capacity = _size + size;
+	    unsigned char* newData = (unsigned char*)realloc(_data, capacity);
+	    if (!newData)
+		EXCEPTION(IO_ERROR, "Unable to allocate " << capacity << " bytes");
+	    _data = newData;
+	    _capacity = capacity;
+	}
+
+	memcpy(&_data[_size], data, size);
+	_size += size;
+    }
+
+    void InputBuffer::discard(off_t offset)
+    {
+	off_t length = offset - _base;
+
+	if (length <= 0)
+	    return;
+
+	if (length > _pos)
+	    EXCEPTION(IO_ERROR, "Unable to discard data not read yet");
+
+	// Only the unparsed tail (usually a partial object) is moved
+	memmove(_data, &_data[length], _size - length);
+	_size -= length;
+	_pos -= length;
+	_base += length;
+    }
+
+    void InputBuffer::seek(off_t pos)
+    {
+	if (pos < _base || pos > _base + _size)
+	    EXCEPTION(TRUNCATED_FILE, "Offset " << pos << " out of file (" << _base << " - " << _base + _size << ")");
+
+	_pos = pos - _base;
+    }
+
+    void InputBuffer::close()
+    {
+	if (_data && !borrowed)
+	{
+	    if (mapped)
+		munmap(_data, _size);
+	    else
+		free(_data);
+	}
+
+	_data = 0;
+	_size = 0;
+	_pos = 0;
+	_base = 0;
+	_capacity = 0;
+	mapped = false;
+	borrowed = false;
+    }
+
+    void InputBuffer::swap(InputBuffer& other)
+    {
+	std::swap(_data, other._data);
+	std::swap(_size, other._size);
+	std::swap(_pos, other._pos);
+	std::swap(_base, other._base);
+	std::swap(_capacity, other._capacity);
+	std::swap(mapped, other.mapped);
+	std::swap(borrowed, other.borrowed);
+    }
+
+    InputBuffer* InputBuffer::detach()
+    {
+	InputBuffer* res = new InputBuffer();
+
+	res->_data = _data;
+	res->_size = _size;
+	res->_pos = _pos;
+	res->_base = _base;
+	res->_capacity = _capacity;
+	res->mapped = mapped;
+	res->borrowed = borrowed;
+
+	_data = 0;
+	close();
+
+	return res;
+    }
+
     /**
      * @brief Read data until '\n' or '\r' is found or buffer is full
      */
-    static inline int readline(int fd, char* buffer, int size, bool exceptionOnEOF=true)
+    static inline int readline(InputBuffer& input, char* buffer, int size, bool exceptionOnEOF=true)
     {
 	int res = 0;
 	char c;
@@ -105,7 +279,7 @@ namespace uPDFParser
 	
 	for (;size;size--,res++)
 	{
-	    if (read(fd, &c, 1) != 1)
+	    if (!input.getChar(c))
 	    {
 		if (exceptionOnEOF)
 		    EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
@@ -137,23 +311,23 @@ namespace uPDFParser
     /**
      * @brief Read data until EOF, '\n' or '\r' is found
      */
-    static inline void finishLine(int fd)
+    static inline void finishLine(InputBuffer& input)
     {
 	char c;
 	
 	while (1)
 	{
-	    if (read(fd, &c, 1) != 1)
+	    if (!input.getChar(c))
 		break;
 
 	    if (c == '\n' || c == '\r')
 		break;
 	}
 	// Support \r\n and \n\r
-	if (read(fd, &c, 1) == 1)
+	if (input.getChar(c))
 	{
 	    if (c != '\n' && c != '\r')
-		lseek(fd, -1, SEEK_CUR);
+		input.ungetChar();
 	}
     }
 
@@ -176,7 +350,7 @@ namespace uPDFParser
 	while (!found)
 	{
 	    prev_c = c;
-	    if (read(fd, &c, 1) != 1)
+	    if (!input.getChar(c))
 	    {
 		if (exceptionOnEOF)
 		    EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
@@ -188,11 +362,11 @@ namespace uPDFParser
 	    {
 		if (readComment)
 		{
-		    curOffset = lseek(fd, 0, SEEK_CUR)-1;
+		    curOffset = input.tell()-1;
 		    res += c;
 		    while (true)
 		    {
-			if (read(fd, &c, 1) != 1)
+			if (!input.getChar(c))
 			{
 			    if (exceptionOnEOF)
 				EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
@@ -205,7 +379,7 @@ namespace uPDFParser
 		    break;
 		}
 		
-		finishLine(fd);
+		finishLine(input);
 		if (res.size())
 		    break;
 		else
@@ -216,7 +390,7 @@ namespace uPDFParser
 	    if ((c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\0') && !res.size())
 		continue;
 
-	    // Quit on line return without lseek(fd, -1, SEEK_CUR)
+	    // Quit on line return without going back
 	    if (c == '\n' || c == '\r')
 	    {
 		if (res.size())
@@ -232,7 +406,7 @@ namespace uPDFParser
 		{
 		    if (c == delims[i])
 		    {
-			lseek(fd, -1, SEEK_CUR);
+			input.ungetChar();
 			found = true;
 			break;
 		    }
@@ -245,7 +419,7 @@ namespace uPDFParser
 		    {
 			if (c == whitespace_prev_delims[i])
 			{
-			    lseek(fd, -1, SEEK_CUR);
+			    input.ungetChar();
 			    found = true;
 			    break;
 			}
@@ -257,7 +431,7 @@ namespace uPDFParser
 	    }
 	    else
 	    {
-		curOffset = lseek(fd, 0, SEEK_CUR)-1;
+		curOffset = input.tell()-1;
 
 		// First character, is it a delimiter ?
 		for (i=0; i<(int)sizeof(start_delims); i++)
@@ -276,12 +450,12 @@ namespace uPDFParser
 	// Double '>' and '<' to compute dictionary
 	if (res == ">" || res == "<")
 	{
-	    if (read(fd, &c, 1) == 1)
+	    if (input.getChar(c))
 	    {
 		if (c == res[0])
 		    res += c;
 		else
-		    lseek(fd, -1, SEEK_CUR);
+		    input.ungetChar();
 	    }
 	}
 	
@@ -293,31 +467,31 @@ namespace uPDFParser
 	char buf[5];
 
 	// Check %PDF at startup
-	readline(fd, buf, 5, false);
+	readline(input, buf, 5, false);
 	if (strncmp(buf, "%PDF-", 5))
 	    EXCEPTION(INVALID_HEADER, "Invalid PDF header");
 
 	// Read major
-	readline(fd, buf, 1, false);
+	readline(input, buf, 1, false);
 	if (buf[0] < '0' || buf[0] > '9')
 	    EXCEPTION(INVALID_HEADER, "Invalid PDF major version " << buf[0]);
 	version_major = buf[0] - '0';
 	
-	readline(fd, buf, 1, false);
+	readline(input, buf, 1, false);
 	if (buf[0] != '.')
 	    EXCEPTION(INVALID_HEADER, "Invalid PDF header");
 
 	// Read minor
-	readline(fd, buf, 1, false);
+	readline(input, buf, 1, false);
 	if (buf[0] < '0' || buf[0] > '9')
 	    EXCEPTION(INVALID_HEADER, "Invalid PDF minor version " << buf[0]);
 	version_minor = buf[0] - '0';
 
-	finishLine(fd);
-	curOffset = lseek(fd, 0, SEEK_CUR);
+	finishLine(input);
+	curOffset = input.tell();
     }
     
-    void Parser::parseStartXref()
+    void Parser::parseStartXref(bool xrefTable)
     {
 	std::string offset, token;
 
@@ -332,10 +506,10 @@ namespace uPDFParser
 	   %%EOF1 0 obj\n
 	 */
 	if (token.size() > 5)
-	    lseek(fd, curOffset+5, SEEK_SET);
+	    input.seek(curOffset+5);
 
-	/* Case where no xref table present */
-	if (xrefOffset == (off_t)-1)
+	/* Case where no xref table present (last xref stream) */
+	if (!xrefTable || xrefOffset == (off_t)-1)
 	{
 	    DataType* integer = tokenToNumber(offset);
 	    if (integer->type() != DataType::TYPE::INTEGER)
@@ -357,29 +531,37 @@ namespace uPDFParser
 	if (token != "<<")
 	    EXCEPTION(INVALID_TRAILER, "Invalid trailer at offset " << curOffset);
 
-	parseDictionary(&trailer, trailer.dictionary().value());
+	parseDictionary(&trailer, trailer.dictionary());
 
 	token = nextToken();
 	/* trailer without xref */
 	if (token != "startxref")
 	{
-	    lseek(fd, curOffset, SEEK_SET);
+	    input.seek(curOffset);
 	    return false;
 	}
 
-	parseStartXref();
+	parseStartXref(true);
 	return true;
     }
     
     bool Parser::parseXref()
     {
-	std::string tokens[3];
-	bool res = false;
-	int curId = 0;
-	
 	// std::cout << "Parse xref" << std::endl;
 	xrefOffset = curOffset;
+	// Write back the same kind of section as last parsed one
+	xrefStreams = false;
 
+	parseXrefEntries(_xrefTable);
+
+	return parseTrailer();
+    }
+
+    void Parser::parseXrefEntries(std::vector<XRefValue>& table)
+    {
+	std::string tokens[3];
+	int curId = 0;
+	
 	while (1)
 	{
 	    tokens[0] = nextToken();
@@ -395,7 +577,7 @@ namespace uPDFParser
 		tokens[2] = nextToken();
 		XRefValue xref(curId, std::stoi(tokens[0],0,10), std::stoi(tokens[1],0,10),
 			       (tokens[2] == "n") ? true : false);
-		_xrefTable.push_back(xref);
+		table.push_back(xref);
 		curId++;
 
 	    }
@@ -405,9 +587,6 @@ namespace uPDFParser
 		curId = std::stoi(tokens[0]);
 	    }
 	}
-
-	res = parseTrailer();
-	return res;
     }
     
     DataType* Parser::parseSignedNumber(std::string& token)
@@ -429,9 +608,10 @@ namespace uPDFParser
 	if (res->type() == DataType::TYPE::REAL)
 	    return res;
 	
-	off_t offset = lseek(fd, 0, SEEK_CUR);
-	std::string token2 = nextToken();
-	std::string token3 = nextToken();
+	// A number can end input (last object of an object stream)
+	off_t offset = input.tell();
+	std::string token2 = nextToken(false);
+	std::string token3 = nextToken(false);
 
 	DataType* generationNumber = 0;
 	try
@@ -440,7 +620,7 @@ namespace uPDFParser
 	}
 	catch (std::invalid_argument& e)
 	{
-	    lseek(fd, offset, SEEK_SET);
+	    input.seek(offset);
 	    return res;
 	}
 	
@@ -448,17 +628,18 @@ namespace uPDFParser
 	    token3.size() != 1 || token3[0] != 'R')
 	{
 	    delete generationNumber;
-	    lseek(fd, offset, SEEK_SET);
+	    input.seek(offset);
 	    return res;
 	}
 
 	DataType* res2 = new Reference(((Integer*)res)->value(),
 				       ((Integer*)generationNumber)->value());
+	delete generationNumber;
 	delete res;
 	return res2;
     }
     
-    DataType* Parser::parseType(std::string& token, Object* object, std::map<std::string, DataType*>& dict)
+    DataType* Parser::parseType(std::string& token, Object* object)
     {
 	DataType* value = 0;
 	Dictionary* _value = 0;
@@ -467,7 +648,7 @@ namespace uPDFParser
 	{
 	    _value = new Dictionary();
 	    value = _value;
-	    parseDictionary(object, _value->value());
+	    parseDictionary(object, *_value);
 	}
 	else if (token == "[")
 	    value = parseArray(object);
@@ -511,7 +692,7 @@ namespace uPDFParser
 	    if (token == "]")
 		break;
 
-	    value = parseType(token, object, object->dictionary().value());
+	    value = parseType(token, object);
 	    //std::cout << "Add " << value->str() << std::endl;
 	    res->addData(value);
 	}
@@ -528,7 +709,7 @@ namespace uPDFParser
 	
 	while (1)
 	{
-	    if (read(fd, &c, 1) != 1)
+	    if (!input.getChar(c))
 		break;
 
 	    if (c == '(' && !escaped)
@@ -558,7 +739,7 @@ namespace uPDFParser
 	
 	while (1)
 	{
-	    if (read(fd, &c, 1) != 1)
+	    if (!input.getChar(c))
 		break;
 
 	    if (c == '>')
@@ -582,78 +763,76 @@ namespace uPDFParser
 	// std::cout << "parseStream" << std::endl;
 	
 	// Remove \n after \r if there is one
-	if (prevChar() == '\r' && read(fd, &c, 1) == 1)
+	if (prevChar() == '\r' && input.getChar(c))
 	{
 	    if (c != '\n')
 	    {
-		lseek(fd, -1, SEEK_CUR);
+		input.ungetChar();
 	    }
 	}
 
-	startOffset = lseek(fd, 0, SEEK_CUR);
+	startOffset = input.tell();
 
-	if (!object->hasKey("Length"))
+	if (!object->hasKey(NAME_LENGTH))
 	    EXCEPTION(INVALID_STREAM, "No Length property at offset " << curOffset);
 
-	DataType* Length = (*object)["Length"];
+	DataType* Length = (*object)[NAME_LENGTH];
 	if (Length->type() == DataType::INTEGER)
 	{
 	    Integer* length = (Integer*)Length;
 	    endOffset = startOffset + length->value();
-	    lseek(fd, endOffset, SEEK_SET);
-	    token = nextToken();
+	    // Otherwise Length is wrong (or stream truncated) : search endstream
+	    if (endOffset >= startOffset && endOffset <= input.size())
+	    {
+		input.seek(endOffset);
+		token = nextToken();
 
-	    if (token == "endstream")
-		return new Stream(object->dictionary(), startOffset, endOffset,
-				  0, 0, false, fd);
+		if (token == "endstream")
+		    return newStream(object, startOffset, endOffset);
 
-	    // No endstream, come back at the begining
-	    lseek(fd, startOffset, SEEK_SET);
+		// No endstream, come back at the begining
+		input.seek(startOffset);
+	    }
 	}
 	
 	// Don't want to parse xref table...
-	while (1)
-	{
-	    char buffer[4*1024];
-	    char* subs, c;
-	    int ret;
-	    ret = read(fd, buffer, sizeof(buffer));
-	    if (ret <= 0)
-		EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
-	    subs = (char*)memmem((void*)buffer, ret, (void*)"endstream", 9);
-	    if (subs)
-	    {
-		unsigned long pos = (unsigned long)subs - (unsigned long)buffer;
-		// Here we're juste before "enstream"
-		endOffset = lseek(fd, -(ret-pos), SEEK_CUR);
-		// Final position must be after endstream\n
-		endStream = endOffset + 10;
-		// Remove trailing \r and \n before endstream
-		for (;endOffset > startOffset; endOffset--)
-		{
-		    lseek(fd, -1, SEEK_CUR);
-		    ret = read(fd, &c, 1);
-		    if (ret <= 0)
-			break;
-		    if (c == '\r')
-		    {
-			lseek(fd, -1, SEEK_CUR);
-			continue;
-		    }
-		    else if (c == '\n')
-		    {
-			lseek(fd, -1, SEEK_CUR);
-		    }
-		    break;
-		}
-		// Adjust final position
-		lseek(fd, endStream, SEEK_SET);
-		break;
-	    }
-	}
+	if (startOffset >= input.size())
+	    EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
+
+	unsigned char* subs = (unsigned char*)memmem((void*)input.data(startOffset),
+						     input.size() - startOffset,
+						     (void*)"endstream", 9);
+	if (!subs)
+	    EXCEPTION(TRUNCATED_FILE, "Unexpected end of file");
+
+	// Here we're juste before "enstream"
+	endOffset = subs - input.data();
+	// Final position must be after endstream\n
+	endStream = endOffset + 10;
+	// Remove trailing \r before endstream
+	while (endOffset > startOffset && *input.data(endOffset-1) == '\r')
+	    endOffset--;
+	// Adjust final position (endstream may end the file)
+	input.seek(std::min(endStream, input.size()));
 	
+	return newStream(object, startOffset, endOffset);
+    }
+
+    Stream* Parser::newStream(Object* object, off_t startOffset, off_t endOffset)
+    {
+	unsigned int length = endOffset - startOffset;
+
+	// Data points directly into input buffer, unless it's discarded once parsed
+	if (!pushing)
+	    return new Stream(object->dictionary(), startOffset, endOffset,
+			      input.data(startOffset), length,
+			      false, fd, &inputModified);
+
+	unsigned char* data = new unsigned char[length];
+	memcpy(data, input.data(startOffset), length);
+
 	return new Stream(object->dictionary(), startOffset, endOffset,
-			  0, 0, false, fd);
+			  data, length, true);
     }
     
     Name* Parser::parseName(std::string& name)
@@ -665,10 +844,9 @@ namespace uPDFParser
 	return new Name(name);
     }
    
-    void Parser::parseDictionary(Object* object, std::map<std::string, DataType*>& dict)
+    void Parser::parseDictionary(Object* object, Dictionary& dict)
     {
-	std::string token;
-	Name* key;
+	std::string token, name;
 	DataType* value;
 
 	while (1)
@@ -677,21 +855,30 @@ namespace uPDFParser
 	    if (token == ">>")
 		break;
 
-	    key = parseName(token);
+	    // Key is only needed as a string (without '/')
+	    if (!token.size() || token[0] != '/')
+		EXCEPTION(INVALID_NAME, "Invalid Name at offset " << curOffset);
+	    name.assign(token, 1, std::string::npos);
+
+	    Dictionary::Key key(name);
 
 	    token = nextToken();
 	    if (token == ">>")
 	    {
-		dict[key->value()] = 0;
+		dict.addData(key, 0);
 		break;
 	    }
 
-	    value = parseType(token, object, dict);
-	    dict[key->value()] = value;
+	    value = parseType(token, object);
+	    dict.addData(key, value);
 	}
     }
     
-    void Parser::parseObject(std::string& token)
+    /**
+     * @brief Parse an indirect object ("X Y obj" ... "endobj").
+     * Returned object is not referenced by parser
+     */
+    Object* Parser::readObject(std::string& token)
     {
 	off_t offset;
 	int objectId, generationNumber;
@@ -717,207 +904,1246 @@ namespace uPDFParser
 	// std::cout << "New obj " << objectId << " " << generationNumber << std::endl;
 	
 	object = new Object(objectId, generationNumber, offset);
-	_objects.push_back(object);
 	std::vector<DataType*>& datas = object->data();
-	
-	while (1)
+
+	try
 	{
-	    token = nextToken();
+	    while (1)
+	    {
+		token = nextToken();
 
-	    if (token == "endobj")
-		break;
+		if (token == "endobj")
+		    break;
 
-	    if (token == "<<")
-		parseDictionary(object, object->dictionary().value());
-	    else if (token[0] >= '1' && token[0] <= '9')
-	    {
-		DataType* _offset = tokenToNumber(token);
-		if (_offset->type() != DataType::TYPE::INTEGER)
-		    EXCEPTION(INVALID_OBJECT, "Invalid object at offset " << curOffset);
-		object->setIndirectOffset(((Integer*)_offset)->value());
-	    }
-	    else
-	    {
-		DataType* res = parseType(token, object, object->dictionary().value());
-		datas.push_back(res);
+		if (token == "<<")
+		    parseDictionary(object, object->dictionary());
+		else if (token[0] >= '1' && token[0] <= '9')
+		{
+		    DataType* _offset = tokenToNumber(token);
+		    if (_offset->type() != DataType::TYPE::INTEGER)
+			EXCEPTION(INVALID_OBJECT, "Invalid object at offset " << curOffset);
+		    object->setIndirectOffset(((Integer*)_offset)->value());
+		}
+		else
+		{
+		    DataType* res = parseType(token, object);
+		    datas.push_back(res);
+		}
 	    }
 	}
+	catch(...)
+	{
+	    delete object;
+	    throw;
+	}
+
+	// Original bytes, without whitespaces read after endobj
+	off_t endOffset = input.tell();
+	while (endOffset > offset && isspace(*input.data(endOffset-1)))
+	    endOffset--;
+	if (!pushing && endOffset - offset >= 6 && !memcmp(input.data(endOffset-6), "endobj", 6))
+	    object->setSource(input.data(offset), endOffset - offset);
 
-	// Keep a reference to last xrefObject
-	if (object->hasKey("Type") && (*object)["Type"]->str() == "/XRef")
-	    xrefObject = object;
+	return object;
     }
 
-    void Parser::parse(const std::string& filename)
+    static inline bool isXrefStream(Object* object)
     {
-	std::string token;
-	bool secondLine = true;
-	
-	if (fd)
-	    close(fd);
+	return object->hasKey(NAME_TYPE) && (*object)[NAME_TYPE]->str() == "/XRef";
+    }
 
-	fd = open(filename.c_str(), O_RDONLY);
-	
-	if (fd <= 0)
-	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
+    void Parser::parseObject(std::string& token)
+    {
+	handleParsedObject(readObject(token));
+    }
 
-	parseHeader();
-	
-	// // Check %%EOF at then end
-	// lseek(fd, -5, SEEK_END);
-	// readline(fd, buf, 5);
-	// if (strncmp(buf, "%%EOF", 5))
-	//     EXCEPTION(INVALID_FOOTER, "Invalid PDF footer");
+    void Parser::handleParsedObject(Object* object)
+    {
+	bool isXRef = isXrefStream(object);
 
-	lseek(fd, curOffset, SEEK_SET);
+	if (isXRef)
+	    xrefStreams = true;
 
-	while (1)
+	if (!handler)
 	{
-	    token = nextToken(false);
-
-	    if (!token.size())
-		break;
+	    addObject(object);
+	    // Keep a reference to last xrefObject
+	    if (isXRef)
+		xrefObject = object;
+	    return;
+	}
 
-	    if (token == "xref")
-		parseXref();
-	    else if (token[0] >= '1' && token[0] <= '9')
-		parseObject(token);
-	    // Can have startxref without trailer (not end of document)
-	    else if (token == "startxref")
-		parseStartXref();
-	    else
+	// Keep a copy of last xrefObject dictionary (needed by repairTrailer())
+	if (isXRef)
+	{
+	    if (ownXrefObject)
+		delete xrefObject;
+	    xrefObject = new Object(object->objectId(), object->generationNumber(), object->offset());
+	    ownXrefObject = true;
+
+	    Dictionary::Entries& dict = object->dictionary().value();
+	    Dictionary::Entries::iterator it;
+	    for(it = dict.begin(); it != dict.end(); it++)
 	    {
-		// The second line may be not commented and invalid (for UTF8 stuff)
-		if (!secondLine)
-		{
-		    EXCEPTION(INVALID_LINE, "Invalid Line at offset " << curOffset);
-		}
-		else
-		    finishLine(fd);
+		if (it->second)
+		    xrefObject->dictionary().addData(it->first, it->second->clone());
 	    }
-	    // If for optimization
-	    if (secondLine) secondLine = false;
+
+	    // Stream will be deleted, only keep location of compressed objects
+	    indexXrefStream(object);
 	}
 
-	// Synchronize xref table with parsed objects
-	std::vector<XRefValue>::iterator it;
-	for (it=_xrefTable.begin(); it != _xrefTable.end(); it++)
+	bool keepObject = false;
+	try
 	{
-	    Object* object = getObject((*it).objectId(), (*it).generationNumber());
-	    if (object)
-	    {
-		(*it).setObject(object);
-		object->setUsed((*it).used());
-	    }
+	    keepObject = handler->handleObject(object);
+	}
+	catch(...)
+	{
+	    delete object;
+	    throw;
 	}
 
-	repairTrailer();
+	if (!keepObject)
+	    delete object;
+    }
+
+    void Parser::beginParse(ObjectHandler* handler)
+    {
+	// Pending objects can only be read from current input
+	if (!lazyObjects.empty())
+	    loadObjects();
+	lazyXrefEntries.clear();
+
+	this->handler = handler;
+	inputModified = false;
+
+	// Streaming mode, start from a clean state
+	if (handler)
+	{
+	    trailer.dictionary().clear();
+
+	    _xrefTable.clear();
+	    compressedObjects.clear();
+	    xrefOffset = (off_t)-1;
+	    if (ownXrefObject)
+		delete xrefObject;
+	    xrefObject = 0;
+	    ownXrefObject = false;
+	}
 	
-	// close(fd);
+	if (fd)
+	    close(fd);
+	fd = 0;
+
+	// Objects from a previous parse may still reference it
+	if (input.size())
+	    oldInputs.push_back(input.detach());
     }
 
-    Object* Parser::getObject(int objectId, int generationNumber)
+    void Parser::parse(const std::string& filename, ObjectHandler* handler)
     {
-	std::vector<Object*>::iterator it;
+	beginParse(handler);
 
-	Object object(objectId, generationNumber, 0);
+	fd = open(filename.c_str(), O_RDONLY);
 	
-	for (it = _objects.begin(); it != _objects.end(); it++)
+	if (fd <= 0)
 	{
-	    if (**it == object)
-		return *it;
+	    fd = 0;
+	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
 	}
 
-	return 0;
+	input.open(fd);
+
+	parseInput();
     }
 
-    void Parser::repairTrailer()
+    void Parser::parse(const unsigned char* data, size_t length, ObjectHandler* handler, bool copy)
     {
-	// Try to fill manadatory values not present in original trailer
-	// with xrefObject if there is one
-	if (!xrefObject)
-	    return;
+	beginParse(handler);
 
-	static const char* keys[] = {"Root", "Info", "Encrypt", "ID"};
+	input.open(data, length, copy);
 
-	for (int i=0; i<(int)(sizeof(keys)/sizeof(keys[0])); i++)
-	{
-	    if (!trailer.hasKey(keys[i]) && xrefObject->hasKey(keys[i]))
-		trailer.dictionary().addData(keys[i], (*xrefObject)[keys[i]]->clone());
-	}
+	parseInput();
     }
 
-    void Parser::removeObject(Object* object)
+    void Parser::beginPush(ObjectHandler* handler)
     {
-	std::vector<Object*>::iterator it;
+	if (!handler)
+	    EXCEPTION(NOT_IMPLEMENTED, "Incremental parsing needs an object handler");
 
-	for(it = _objects.begin(); it != _objects.end(); it++)
-	{
-	    if (**it == *object)
-	    {
-		delete *it;
-		_objects.erase(it);
-		break;
-	    }
-	}	
+	beginParse(handler);
+
+	pushing = true;
+	pushHeader = false;
+	pushSecondLine = true;
+	pushObjectScan = pushEOFScan = 0;
     }
-    
-    void Parser::writeBuffer(int fd, const char* buffer, int size)
+
+    void Parser::push(const unsigned char* data, size_t length)
     {
-	int ret;
+	if (!pushing)
+	    EXCEPTION(IO_ERROR, "push() called without beginPush()");
 
-	do {
-	    ret = ::write(fd, buffer, size);
-	    if (ret >= 0)
-	    {
-		size -= ret;
-		buffer += ret;
-	    }
-	    else
-	    {
-		EXCEPTION(IO_ERROR, "IO Error (write) %m");
-	    }
-	} while (size);
+	input.append(data, length);
+
+	parsePushed(false);
+
+	// Parsed objects own their data
+	input.discard(input.tell());
     }
-    
-    void Parser::writeUpdate(const std::string& filename)
+
+    void Parser::endPush()
     {
-	struct stat _stat;
+	if (!pushing)
+	    EXCEPTION(IO_ERROR, "endPush() called without beginPush()");
 
-	int statRet = stat(filename.c_str(), &_stat);
+	parsePushed(true);
 
-	int newFd = open(filename.c_str(), O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR);
+	repairTrailer();
 
-	if (newFd <= 0)
-	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
+	handler = 0;
+	pushing = false;
+	input.close();
+    }
 
-	// Copy file if it doesn't exists
-	if (statRet == -1 && errno == ENOENT)
-	{
-	    char buffer[4096];
-	    int ret;
-	    lseek(fd, 0, SEEK_SET);
+    /**
+     * @brief Look for marker between offset and the end of pushed data.
+     * Data before scanOffset has already been searched.
+     */
+    bool Parser::pushReceived(off_t offset, const char* marker, off_t& scanOffset)
+    {
+	size_t markerLength = strlen(marker);
+	off_t start = std::max(offset, scanOffset - (off_t)markerLength + 1);
 
-	    while (true)
-	    {
-		ret = ::read(fd, buffer, sizeof(buffer));
-		if (ret <= 0)
-		    break;
-		writeBuffer(newFd, buffer, ret);
-	    }
-	}
-	
-	writeBuffer(newFd, "\r", 1);
+	if (start < input.size() &&
+	    memmem(input.data(start), input.size() - start, marker, markerLength))
+	    return true;
 
-	int maxId = 0;
-	std::stringstream xref;
-	int nbNewObjects = 0;
+	scanOffset = input.size();
+	return false;
+    }
 
-	xref << std::setfill('0');
-	xref << "xref\n";
-	
-	std::vector<Object*>::iterator it;
-	for(it=_objects.begin(); it!=_objects.end(); it++)
+    /**
+     * @brief Same as parseInput() loop, for data pushed so far. If last is
+     * false, stop before the first item that may not be complete : objects
+     * need a following "endobj", xref sections a following "%%EOF".
+     */
+    void Parser::parsePushed(bool last)
+    {
+	std::string token;
+	off_t start;
+
+	// Objects are given to handler
+	Arena::Scope arenaScope(0);
+
+	if (!pushHeader)
+	{
+	    // Wait for header and binary comment line
+	    if (!last && input.size() < 1024)
+		return;
+
+	    parseHeader();
+	    input.seek(curOffset);
+	    pushHeader = true;
+	}
+
+	while (1)
+	{
+	    start = input.tell();
+	    token = nextToken(false);
+
+	    if (!token.size())
+	    {
+		// May be a truncated comment
+		if (!last)
+		    input.seek(start);
+		break;
+	    }
+
+	    // Token itself may be truncated
+	    if (!last && input.tell() >= input.size())
+	    {
+		input.seek(start);
+		break;
+	    }
+
+	    if (token == "xref" || token == "startxref")
+	    {
+		if (!last && !pushReceived(start, "%%EOF", pushEOFScan))
+		{
+		    input.seek(start);
+		    break;
+		}
+
+		if (token == "xref")
+		    parseXref();
+		else
+		    parseStartXref(false);
+	    }
+	    else if (token[0] >= '1' && token[0] <= '9')
+	    {
+		if (!last && !pushReceived(start, "endobj", pushObjectScan))
+		{
+		    input.seek(start);
+		    break;
+		}
+
+		Object* object;
+		try
+		{
+		    object = readObject(token);
+		}
+		catch(Exception& e)
+		{
+		    if (last || e.getErrorCode() != TRUNCATED_FILE)
+			throw;
+
+		    // "endobj" found was into stream data : wait for the next one
+		    pushObjectScan = input.size();
+		    input.seek(start);
+		    break;
+		}
+
+		handleParsedObject(object);
+	    }
+	    else
+	    {
+		if (!pushSecondLine)
+		{
+		    EXCEPTION(INVALID_LINE, "Invalid Line at offset " << curOffset);
+		}
+		else
+		    finishLine(input);
+	    }
+
+	    pushSecondLine = false;
+	}
+    }
+
+    void Parser::parseLazy(const std::string& filename)
+    {
+	beginParse(0);
+
+	fd = open(filename.c_str(), O_RDONLY);
+	
+	if (fd <= 0)
+	{
+	    fd = 0;
+	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
+	}
+
+	input.open(fd);
+
+	lazyInput();
+    }
+
+    void Parser::parseLazy(const unsigned char* data, size_t length, bool copy)
+    {
+	beginParse(0);
+
+	input.open(data, length, copy);
+
+	lazyInput();
+    }
+
+    void Parser::lazyInput()
+    {
+	bool done = false;
+
+	parseHeader();
+
+	try
+	{
+	    done = parseXrefSections();
+	}
+	catch (std::exception& e)
+	{
+	    // Broken xref table, done is false
+	}
+
+	if (done)
+	{
+	    this->handler = 0;
+	    return;
+	}
+
+	// Fallback to full parse
+	input.seek(0);
+	parseInput();
+    }
+
+    /**
+     * @brief Offset of last startxref value, -1 if not found
+     */
+    off_t Parser::findStartXref()
+    {
+	static const char startxref[] = "startxref";
+	const off_t patternSize = sizeof(startxref)-1;
+	off_t size = input.size();
+	off_t limit = (size > 1024) ? size - 1024 : 0;
+
+	for (off_t offset = size - patternSize; offset >= limit; offset--)
+	{
+	    if (memcmp(input.data(offset), startxref, patternSize))
+		continue;
+
+	    input.seek(offset + patternSize);
+	    std::string token = nextToken();
+	    DataType* value = tokenToNumber(token);
+	    off_t res = (value->type() == DataType::TYPE::INTEGER) ? ((Integer*)value)->value() : -1;
+	    delete value;
+
+	    return res;
+	}
+
+	return -1;
+    }
+
+    /**
+     * @brief Decode entries of a cross reference stream object
+     */
+    void Parser::parseXrefStream(Object* object, std::vector<XRefStreamEntry>& entries)
+    {
+	Stream* stream = 0;
+	std::vector<DataType*>::iterator it;
+
+	for (it=object->data().begin(); it!=object->data().end(); it++)
+	{
+	    if ((*it)->type() == DataType::TYPE::STREAM)
+		stream = (Stream*)*it;
+	}
+
+	if (!stream)
+	    EXCEPTION(INVALID_OBJECT, "No stream in XRef object at offset " << object->offset());
+
+	DataType* W = object->dictionary().get(NAME_W);
+	if (!W || W->type() != DataType::TYPE::ARRAY || ((Array*)W)->value().size() != 3)
+	    EXCEPTION(INVALID_OBJECT, "Invalid W in XRef object at offset " << object->offset());
+
+	int widths[3], entrySize = 0;
+	for (int i=0; i<3; i++)
+	{
+	    DataType* width = ((Array*)W)->value()[i];
+	    if (width->type() != DataType::TYPE::INTEGER ||
+		((Integer*)width)->value() < 0 || ((Integer*)width)->value() > 8)
+		EXCEPTION(INVALID_OBJECT, "Invalid W in XRef object at offset " << object->offset());
+	    widths[i] = ((Integer*)width)->value();
+	    entrySize += widths[i];
+	}
+
+	if (!entrySize)
+	    EXCEPTION(INVALID_OBJECT, "Invalid W in XRef object at offset " << object->offset());
+
+	// Subsections (first object id, count), default is [0 Size]
+	std::vector<int> index;
+	DataType* Index = object->dictionary().get(NAME_INDEX);
+	if (Index && Index->type() == DataType::TYPE::ARRAY)
+	{
+	    for (it=((Array*)Index)->value().begin(); it!=((Array*)Index)->value().end(); it++)
+	    {
+		if ((*it)->type() != DataType::TYPE::INTEGER || ((Integer*)*it)->value() < 0)
+		    EXCEPTION(INVALID_OBJECT, "Invalid Index in XRef object at offset " << object->offset());
+		index.push_back(((Integer*)*it)->value());
+	    }
+	}
+	else
+	{
+	    DataType* size = object->dictionary().get(NAME_SIZE);
+	    if (!size || size->type() != DataType::TYPE::INTEGER)
+		EXCEPTION(INVALID_OBJECT, "No Size in XRef object at offset " << object->offset());
+	    index.push_back(0);
+	    index.push_back(((Integer*)size)->value());
+	}
+
+	if (index.size() % 2)
+	    EXCEPTION(INVALID_OBJECT, "Invalid Index in XRef object at offset " << object->offset());
+
+	std::string data = stream->decodedData();
+	const unsigned char* cur = (const unsigned char*)data.data();
+	size_t pos = 0;
+	uint64_t fields[3];
+	XRefStreamEntry entry;
+
+	for (size_t i=0; i<index.size(); i+=2)
+	{
+	    for (int id=index[i]; id<index[i]+index[i+1]; id++)
+	    {
+		if (pos + entrySize > data.size())
+		    EXCEPTION(INVALID_STREAM, "Truncated XRef stream at offset " << object->offset());
+
+		for (int f=0; f<3; f++)
+		{
+		    fields[f] = 0;
+		    for (int b=0; b<widths[f]; b++)
+			fields[f] = (fields[f] << 8) | cur[pos++];
+		}
+
+		entry.objectId = id;
+		// Type field may be omitted (default is used object)
+		entry.type = (widths[0]) ? (int)fields[0] : 1;
+		entry.offset = (off_t)fields[1];
+		entry.generation = (int)fields[2];
+		entries.push_back(entry);
+	    }
+	}
+    }
+
+    /**
+     * @brief Read cross reference stream at offset (returned object has to be deleted).
+     * Returns 0 if object at offset is not a cross reference stream
+     */
+    Object* Parser::readXrefStream(off_t offset, std::vector<XRefStreamEntry>& entries)
+    {
+	input.seek(offset);
+	std::string token = nextToken();
+	Object* object = readObject(token);
+
+	try
+	{
+	    if (!isXrefStream(object))
+	    {
+		delete object;
+		return 0;
+	    }
+
+	    parseXrefStream(object, entries);
+	}
+	catch(...)
+	{
+	    delete object;
+	    throw;
+	}
+
+	return object;
+    }
+
+    /**
+     * @brief Update location of objects stored into object streams with
+     * a cross reference stream found by linear parsing (broken ones are ignored)
+     */
+    void Parser::indexXrefStream(Object* object)
+    {
+	std::vector<XRefStreamEntry> entries;
+	std::vector<XRefStreamEntry>::iterator it;
+
+	try
+	{
+	    parseXrefStream(object, entries);
+	}
+	catch (std::exception& e)
+	{
+	    return;
+	}
+
+	for (it=entries.begin(); it!=entries.end(); it++)
+	{
+	    if (it->type == 2)
+	    {
+		compressedObjects[indexKey(it->objectId, 0)] = std::make_pair((int)it->offset, it->generation);
+
+		// Revision parsed before this section is replaced by compressed one
+		std::unordered_map<uint64_t, Object*>::iterator objectIt = objectsIndex.find(indexKey(it->objectId, 0));
+		if (objectIt != objectsIndex.end() && objectIt->second->offset() < object->offset())
+		{
+		    objectIt->second->setUsed(false);
+		    objectsIndex.erase(objectIt);
+		}
+	    }
+	    // Newer revision outside of an object stream
+	    else if (it->type == 0 || it->type == 1)
+		compressedObjects.erase(indexKey(it->objectId, 0));
+	}
+    }
+
+    /**
+     * @brief Read xref tables (or streams) and trailers, from last one to first one (/Prev).
+     * Parser state is only updated if all of them can be read.
+     */
+    bool Parser::parseXrefSections()
+    {
+	static const NameId trailerKeys[] = {NAME_SIZE, NAME_ROOT, NAME_INFO, NAME_ENCRYPT, NAME_ID};
+	std::vector<std::vector<XRefValue> > sections;
+	std::vector<std::vector<XRefStreamEntry> > streamSections;
+	std::vector<Object*> trailers;
+	std::vector<off_t> visited;
+	std::string token;
+	bool res = true, lastIsStream = false;
+	off_t startOffset, offset;
+
+	startOffset = offset = findStartXref();
+
+	if (offset < 0)
+	    return false;
+
+	try
+	{
+	    while (offset >= 0)
+	    {
+		if (offset >= input.size() ||
+		    std::find(visited.begin(), visited.end(), offset) != visited.end())
+		{
+		    res = false;
+		    break;
+		}
+		visited.push_back(offset);
+
+		sections.push_back(std::vector<XRefValue>());
+		streamSections.push_back(std::vector<XRefStreamEntry>());
+		Object* sectionTrailer = new Object(0, 0, 0);
+		trailers.push_back(sectionTrailer);
+		Object* xrefStream = 0;
+		DataType* prev;
+
+		input.seek(offset);
+		bool isTable = (nextToken() == "xref");
+		// First section read is the last one of the file
+		if (visited.size() == 1)
+		    lastIsStream = !isTable;
+		if (isTable)
+		{
+		    parseXrefEntries(sections.back());
+
+		    if (nextToken() != "<<")
+		    {
+			res = false;
+			break;
+		    }
+
+		    parseDictionary(sectionTrailer, sectionTrailer->dictionary());
+
+		    // Hybrid file : objects of object streams are referenced by an xref stream
+		    DataType* xrefStm = sectionTrailer->dictionary().get(NAME_XREFSTM);
+		    if (xrefStm)
+		    {
+			if (xrefStm->type() == DataType::TYPE::INTEGER)
+			    xrefStream = readXrefStream(((Integer*)xrefStm)->value(), streamSections.back());
+			if (!xrefStream)
+			{
+			    res = false;
+			    break;
+			}
+			delete xrefStream;
+		    }
+
+		    prev = sectionTrailer->dictionary().get(NAME_PREV);
+		    offset = (prev && prev->type() == DataType::TYPE::INTEGER) ? ((Integer*)prev)->value() : -1;
+		}
+		else
+		{
+		    xrefStream = readXrefStream(offset, streamSections.back());
+		    if (!xrefStream)
+		    {
+			res = false;
+			break;
+		    }
+
+		    // Only keep trailer values of stream dictionary
+		    for (int i=0; i<(int)(sizeof(trailerKeys)/sizeof(trailerKeys[0])); i++)
+		    {
+			DataType*& value = (*xrefStream)[trailerKeys[i]];
+			if (!value)
+			    continue;
+			sectionTrailer->dictionary().addData(trailerKeys[i], value);
+			value = 0;
+		    }
+
+		    prev = xrefStream->dictionary().get(NAME_PREV);
+		    offset = (prev && prev->type() == DataType::TYPE::INTEGER) ? ((Integer*)prev)->value() : -1;
+		    delete xrefStream;
+		}
+	    }
+	}
+	catch(...)
+	{
+	    for (size_t i=0; i<trailers.size(); i++)
+		delete trailers[i];
+	    throw;
+	}
+
+	if (res)
+	{
+	    std::unordered_set<int> seen;
+	    std::vector<XRefValue>::reverse_iterator it;
+	    std::vector<XRefStreamEntry>::reverse_iterator streamIt;
+
+	    xrefOffset = startOffset;
+	    xrefStreams = lastIsStream;
+
+	    // Newest entry of each object wins (last one inside a section,
+	    // and xref table before its hybrid xref stream)
+	    for (size_t i=0; i<sections.size(); i++)
+	    {
+		for (it=sections[i].rbegin(); it!=sections[i].rend(); it++)
+		{
+		    if (!seen.insert(it->objectId()).second)
+			continue;
+
+		    if (it->used() && it->offset() > 0)
+			lazyObjects[indexKey(it->objectId(), it->generationNumber())] = it->offset();
+		}
+
+		for (streamIt=streamSections[i].rbegin(); streamIt!=streamSections[i].rend(); streamIt++)
+		{
+		    if (!seen.insert(streamIt->objectId).second)
+			continue;
+
+		    if (streamIt->type == 1 && streamIt->offset > 0)
+			lazyObjects[indexKey(streamIt->objectId, streamIt->generation)] = streamIt->offset;
+		    else if (streamIt->type == 2)
+			compressedObjects[indexKey(streamIt->objectId, 0)] =
+			    std::make_pair((int)streamIt->offset, streamIt->generation);
+		}
+	    }
+
+	    // Same as linear parsing : tables and trailers in file order
+	    for (size_t i=sections.size(); i>0; i--)
+	    {
+		for (size_t j=0; j<sections[i-1].size(); j++)
+		{
+		    if (sections[i-1][j].used() && sections[i-1][j].offset() > 0)
+			lazyXrefEntries.insert(std::make_pair((off_t)sections[i-1][j].offset(), _xrefTable.size() + j));
+		}
+		_xrefTable.insert(_xrefTable.end(), sections[i-1].begin(), sections[i-1].end());
+
+		Dictionary::Entries& entries = trailers[i-1]->dictionary().value();
+		Dictionary::Entries::iterator entryIt;
+		for (entryIt=entries.begin(); entryIt!=entries.end(); entryIt++)
+		{
+		    trailer.deleteKey(entryIt->first);
+		    trailer.dictionary().addData(entryIt->first, entryIt->second);
+		    entryIt->second = 0;
+		}
+	    }
+	}
+
+	for (size_t i=0; i<trailers.size(); i++)
+	    delete trailers[i];
+
+	return res;
+    }
+
+    Object* Parser::loadObject(int objectId, int generationNumber, off_t offset)
+    {
+	Arena::Scope arenaScope(&arena);
+	size_t nbObjects = _objects.size();
+
+	input.seek(offset);
+	std::string token = nextToken();
+	parseObject(token);
+
+	if (_objects.size() == nbObjects ||
+	    _objects.back()->objectId() != objectId ||
+	    _objects.back()->generationNumber() != generationNumber)
+	    EXCEPTION(INVALID_OBJECT, "Object " << objectId << " " << generationNumber << " not found at offset " << offset);
+
+	Object* object = _objects.back();
+
+	// Only entries at this offset may reference it
+	std::pair<std::unordered_multimap<off_t, size_t>::iterator,
+		  std::unordered_multimap<off_t, size_t>::iterator> range;
+	range = lazyXrefEntries.equal_range(offset);
+	while (range.first != range.second)
+	{
+	    XRefValue& entry = _xrefTable[range.first->second];
+	    if (entry.objectId() == objectId)
+	    {
+		entry.setObject(object);
+		range.first = lazyXrefEntries.erase(range.first);
+	    }
+	    else
+		range.first++;
+	}
+
+	return object;
+    }
+
+    void Parser::loadObjects()
+    {
+	std::vector<std::pair<off_t, uint64_t> > pending;
+	std::unordered_map<uint64_t, off_t>::iterator it;
+
+	// Read in file order
+	for (it=lazyObjects.begin(); it!=lazyObjects.end(); it++)
+	    pending.push_back(std::make_pair(it->second, it->first));
+	std::sort(pending.begin(), pending.end());
+
+	lazyObjects.clear();
+
+	for (size_t i=0; i<pending.size(); i++)
+	    loadObject((int)(pending[i].second >> 32), (int)(uint32_t)pending[i].second, pending[i].first);
+
+	// Remaining entries are revisions never loaded
+	lazyXrefEntries.clear();
+    }
+
+    /**
+     * @brief Parse from another buffer during its lifetime
+     */
+    class InputSwitch
+    {
+    public:
+	InputSwitch(InputBuffer& input, InputBuffer& other):
+	    input(input), other(other)
+	{
+	    input.swap(other);
+	}
+
+	~InputSwitch() { input.swap(other); }
+
+    private:
+	InputBuffer& input;
+	InputBuffer& other;
+    };
+
+    Object* Parser::loadCompressedObject(int objectId, int objStmId, int index)
+    {
+	// Object streams are encrypted as any other stream
+	if (trailer.hasKey(NAME_ENCRYPT))
+	    EXCEPTION(NOT_IMPLEMENTED, "Object " << objectId << " is stored into an encrypted object stream");
+
+	Object* stmObject = getObject(objStmId);
+	if (!stmObject)
+	    EXCEPTION(INVALID_OBJECT, "Object stream " << objStmId << " not found");
+
+	if (stmObject != objStm)
+	{
+	    Stream* stream = 0;
+	    std::vector<DataType*>::iterator it;
+	    for (it=stmObject->data().begin(); it!=stmObject->data().end(); it++)
+	    {
+		if ((*it)->type() == DataType::TYPE::STREAM)
+		    stream = (Stream*)*it;
+	    }
+
+	    DataType* N = stmObject->dictionary().get(NAME_N);
+	    DataType* First = stmObject->dictionary().get(NAME_FIRST);
+	    if (!stream || !N || N->type() != DataType::TYPE::INTEGER ||
+		!First || First->type() != DataType::TYPE::INTEGER)
+		EXCEPTION(INVALID_OBJECT, "Invalid object stream " << objStmId);
+
+	    objStm = 0;
+	    objStmOffsets.clear();
+	    objStmData = stream->decodedData();
+
+	    // Header : pairs of object id and offset (relative to First)
+	    int first = ((Integer*)First)->value();
+	    int id;
+	    off_t offset;
+	    std::istringstream header(objStmData.substr(0, first));
+	    for (int i=0; i<((Integer*)N)->value(); i++)
+	    {
+		if (!(header >> id >> offset) || first + offset > (off_t)objStmData.size())
+		    EXCEPTION(INVALID_OBJECT, "Invalid header of object stream " << objStmId);
+		objStmOffsets.push_back(std::make_pair(id, first + offset));
+	    }
+
+	    objStm = stmObject;
+	}
+
+	// Index from xref should be right, else look for object id
+	if (index < 0 || index >= (int)objStmOffsets.size() || objStmOffsets[index].first != objectId)
+	{
+	    for (index=0; index<(int)objStmOffsets.size(); index++)
+	    {
+		if (objStmOffsets[index].first == objectId)
+		    break;
+	    }
+	    if (index == (int)objStmOffsets.size())
+		EXCEPTION(INVALID_OBJECT, "Object " << objectId << " not found in object stream " << objStmId);
+	}
+
+	off_t start = objStmOffsets[index].second;
+	off_t end = (index+1 < (int)objStmOffsets.size()) ? objStmOffsets[index+1].second : objStmData.size();
+	if (end < start)
+	    end = objStmData.size();
+
+	// Terminate object as an indirect one, so that tokenizer stops on it
+	std::string content = objStmData.substr(start, end - start) + "\nendobj\n";
+	InputBuffer objectInput;
+	objectInput.open((const unsigned char*)content.data(), content.size());
+
+	Arena::Scope arenaScope(&arena);
+	off_t savedOffset = curOffset;
+	Object* object = new Object(objectId, 0, 0);
+
+	try
+	{
+	    InputSwitch inputSwitch(input, objectInput);
+	    std::string token;
+
+	    while (1)
+	    {
+		token = nextToken();
+
+		if (token == "endobj")
+		    break;
+
+		// Streams can't be stored into object streams
+		if (token == "stream")
+		    EXCEPTION(INVALID_OBJECT, "Stream in object " << objectId << " of object stream " << objStmId);
+
+		// No indirect offset here: a leading number is object's value
+		if (token == "<<")
+		    parseDictionary(object, object->dictionary());
+		else
+		    object->data().push_back(parseType(token, object));
+	    }
+	}
+	catch(...)
+	{
+	    curOffset = savedOffset;
+	    delete object;
+	    throw;
+	}
+
+	curOffset = savedOffset;
+	addObject(object);
+
+	return object;
+    }
+
+    void Parser::parseInput()
+    {
+	std::string token;
+	bool secondLine = true;
+	size_t nbObjects = _objects.size();
+
+	// Kept objects are freed with parser: allocate their content in bulk.
+	// Streamed ones are deleted by handler, don't grow arena with them
+	Arena::Scope arenaScope(handler ? 0 : &arena);
+
+	parseHeader();
+	
+	// // Check %%EOF at then end
+	// lseek(fd, -5, SEEK_END);
+	// readline(fd, buf, 5);
+	// if (strncmp(buf, "%%EOF", 5))
+	//     EXCEPTION(INVALID_FOOTER, "Invalid PDF footer");
+
+	input.seek(curOffset);
+
+	while (1)
+	{
+	    token = nextToken(false);
+
+	    if (!token.size())
+		break;
+
+	    if (token == "xref")
+		parseXref();
+	    else if (token[0] >= '1' && token[0] <= '9')
+		parseObject(token);
+	    // Can have startxref without trailer (not end of document)
+	    else if (token == "startxref")
+		parseStartXref(false);
+	    else
+	    {
+		// The second line may be not commented and invalid (for UTF8 stuff)
+		if (!secondLine)
+		{
+		    EXCEPTION(INVALID_LINE, "Invalid Line at offset " << curOffset);
+		}
+		else
+		    finishLine(input);
+	    }
+	    // If for optimization
+	    if (secondLine) secondLine = false;
+	}
+
+	// Synchronize xref table with parsed objects
+	if (!handler)
+	{
+	    std::vector<XRefValue>::iterator it;
+	    for (it=_xrefTable.begin(); it != _xrefTable.end(); it++)
+	    {
+		Object* object = getObject((*it).objectId(), (*it).generationNumber());
+		if (object)
+		{
+		    (*it).setObject(object);
+		    object->setUsed((*it).used());
+		}
+	    }
+
+	    // Locate objects stored into object streams (file order, newest wins)
+	    for (size_t i=nbObjects; i<_objects.size(); i++)
+	    {
+		if (isXrefStream(_objects[i]))
+		    indexXrefStream(_objects[i]);
+	    }
+	}
+
+	repairTrailer();
+
+	this->handler = 0;
+	
+	// close(fd);
+    }
+
+    Object* Parser::getObject(int objectId, int generationNumber)
+    {
+	std::unordered_map<uint64_t, Object*>::iterator it;
+
+	it = objectsIndex.find(indexKey(objectId, generationNumber));
+	if (it != objectsIndex.end())
+	    return it->second;
+
+	std::unordered_map<uint64_t, off_t>::iterator lazyIt;
+	lazyIt = lazyObjects.find(indexKey(objectId, generationNumber));
+	if (lazyIt != lazyObjects.end())
+	{
+	    off_t offset = lazyIt->second;
+	    lazyObjects.erase(lazyIt);
+
+	    return loadObject(objectId, generationNumber, offset);
+	}
+
+	std::unordered_map<uint64_t, std::pair<int, int> >::iterator compressedIt;
+	compressedIt = compressedObjects.find(indexKey(objectId, generationNumber));
+	if (compressedIt != compressedObjects.end())
+	{
+	    std::pair<int, int> location = compressedIt->second;
+	    compressedObjects.erase(compressedIt);
+
+	    return loadCompressedObject(objectId, location.first, location.second);
+	}
+
+	return 0;
+    }
+
+    std::vector<Object*>& Parser::objects()
+    {
+	if (!lazyObjects.empty())
+	    loadObjects();
+
+	return _objects;
+    }
+
+    void Parser::repairTrailer()
+    {
+	// Try to fill manadatory values not present in original trailer
+	// with xrefObject if there is one
+	if (!xrefObject)
+	    return;
+
+	static const NameId keys[] = {NAME_ROOT, NAME_INFO, NAME_ENCRYPT, NAME_ID, NAME_SIZE};
+
+	for (int i=0; i<(int)(sizeof(keys)/sizeof(keys[0])); i++)
+	{
+	    if (!trailer.hasKey(keys[i]) && xrefObject->hasKey(keys[i]))
+		trailer.dictionary().addData(keys[i], (*xrefObject)[keys[i]]->clone());
+	}
+    }
+
+    void Parser::removeObject(Object* object)
+    {
+	std::vector<Object*>::iterator it;
+	std::vector<Object*>::reverse_iterator rIt;
+	uint64_t key = indexKey(object->objectId(), object->generationNumber());
+
+	// Prefer exact object, else first one with same id/generation number
+	it = std::find(_objects.begin(), _objects.end(), object);
+	if (it == _objects.end())
+	{
+	    for(it = _objects.begin(); it != _objects.end(); it++)
+	    {
+		if (**it == *object)
+		    break;
+	    }
+	}
+
+	if (it == _objects.end())
+	    return;
+
+	Object* removed = *it;
+	_objects.erase(it);
+
+	if (removed == objStm)
+	    objStm = 0;
+
+	if (objectsIndex[key] == removed)
+	{
+	    objectsIndex.erase(key);
+	    // Index previous revision if there is one
+	    for(rIt = _objects.rbegin(); rIt != _objects.rend(); rIt++)
+	    {
+		if (**rIt == *removed)
+		{
+		    objectsIndex[key] = *rIt;
+		    break;
+		}
+	    }
+	}
+
+	delete removed;
+    }
+    
+    void FdWriter::write(const char* buffer, size_t size)
+    {
+	ssize_t ret;
+
+	do {
+	    ret = ::write(fd, buffer, size);
+	    if (ret >= 0)
+	    {
+		size -= ret;
+		buffer += ret;
+	    }
+	    else
+	    {
+		EXCEPTION(IO_ERROR, "IO Error (write) %m");
+	    }
+	} while (size);
+    }
+    
+    /**
+     * @brief Copy parsed file (or buffer) from offset into writer, return copied size
+     */
+    off_t Parser::copyInput(Writer& writer, off_t offset)
+    {
+	if (!fd)
+	{
+	    // No file to read original bytes from : streams data must not
+	    // have been modified in place (see Stream::data())
+	    if (inputModified)
+		EXCEPTION(NOT_IMPLEMENTED, "Input modified in place, it can't be copied by an update");
+
+	    writer.write((const char*)input.data(offset), input.size() - offset);
+	    return input.size() - offset;
+	}
+
+	// Don't copy input buffer : its streams may have been modified in place
+	std::vector<char> buffer(1024*1024);
+	ssize_t ret;
+	off_t size = 0;
+
+	while (true)
+	{
+	    ret = ::pread(fd, buffer.data(), buffer.size(), offset + size);
+	    if (ret < 0)
+		EXCEPTION(IO_ERROR, "IO Error (read) %m");
+	    if (ret == 0)
+		break;
+	    writer.write(buffer.data(), ret);
+	    size += ret;
+	}
+
+	return size;
+    }
+
+    /**
+     * @brief Copy size bytes of fdIn at the beginning of (empty) fdOut
+     * without going through user space : blocks are shared (reflink) if
+     * filesystem supports it, else data is copied by kernel.
+     * Returns copied size, it may be less than size (not supported)
+     */
+    static off_t copyFileData(int fdIn, int fdOut, off_t size)
+    {
+	off_t copied = 0;
+
+#ifdef __linux__
+	ssize_t ret;
+
+#ifdef FICLONE
+	if (ioctl(fdOut, FICLONE, fdIn) == 0)
+	    return size;
+#endif
+
+	loff_t inOffset = 0;
+	while (copied < size)
+	{
+	    ret = copy_file_range(fdIn, &inOffset, fdOut, 0, size - copied, 0);
+	    if (ret <= 0)
+		break;
+	    copied += ret;
+	}
+
+	// Not supported between these file systems
+	while (copied < size)
+	{
+	    off_t offset = copied;
+	    ret = sendfile(fdOut, fdIn, &offset, size - copied);
+	    if (ret <= 0)
+		break;
+	    copied += ret;
+	}
+#endif
+
+	return copied;
+    }
+
+    void Parser::writeUpdate(const std::string& filename)
+    {
+	struct stat _stat;
+
+	int statRet = stat(filename.c_str(), &_stat);
+	bool exists = !(statRet == -1 && errno == ENOENT);
+
+	// Existing file (ie parsed one) is only appended, else it's a copy of
+	// parsed file (copy_file_range() and sendfile() don't support O_APPEND)
+	int flags = (exists) ? O_WRONLY|O_APPEND|O_CREAT : O_WRONLY|O_CREAT|O_TRUNC;
+	int newFd = open(filename.c_str(), flags, S_IRUSR|S_IWUSR);
+
+	if (newFd <= 0)
+	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
+
+	FdWriter newWriter(newFd, true);
+
+	if (!exists)
+	{
+	    off_t copied = (fd) ? copyFileData(fd, newFd, input.size()) : 0;
+
+	    if (copied != input.size())
+	    {
+		lseek(newFd, copied, SEEK_SET);
+		copyInput(newWriter, copied);
+	    }
+	}
+
+	writeUpdate(newWriter, lseek(newFd, 0, SEEK_END));
+    }
+
+    /**
+     * @brief Append an xref table subsection with one entry
+     */
+    static inline void appendXrefEntry(std::string& xref, int objectId, off_t offset,
+				       int generationNumber, bool used)
+    {
+	char entry[64];
+	// Here \r seems important
+	int ret = snprintf(entry, sizeof(entry), "%d 1\n%010lld %05d %c\r\n", objectId,
+			   (long long)offset, generationNumber, (used) ? 'n' : 'f');
+	xref.append(entry, ret);
+    }
+
+    /**
+     * @brief Append trailer dictionary and startxref
+     */
+    static inline void appendTrailer(std::string& out, Object& trailer, off_t xrefOffset)
+    {
+	out += "trailer\n";
+	out += trailer.dictionary().str();
+	out += "startxref\n";
+	out += std::to_string((long long)xrefOffset);
+	out += "\n%%EOF";
+    }
+
+    /**
+     * @brief Append new objects, xref table and trailer.
+     * offset is the current size of output.
+     */
+    void Parser::writeUpdate(Writer& writer, off_t offset)
+    {
+	// Built in memory, then written at once
+	std::string out("\r");
+
+	int maxId = 0;
+	std::string xref("xref\n");
+	std::vector<XRefStreamEntry> entries;
+	int nbNewObjects = 0;
+
+	std::vector<Object*>::iterator it;
+	for(it=_objects.begin(); it!=_objects.end(); it++)
 	{
 	    Object* object = *it;
 	    if (object->objectId() > maxId)
@@ -925,122 +2151,341 @@ namespace uPDFParser
 	    if (!object->isNew())
 		continue;
 	    nbNewObjects ++;
-	    std::string objStr = object->str();
-	    curOffset = lseek(newFd, 0, SEEK_CUR);
-	    writeBuffer(newFd, objStr.c_str(), objStr.size());
-	    xref << std::setw(0) << object->objectId() << " 1\n";
-	    xref << std::setw(10) << curOffset << " " << std::setw(5) << object->generationNumber() << " n\r\n"; // Here \r seems important 
+	    curOffset = offset + out.size();
+	    out += object->str();
+	    appendXrefEntry(xref, object->objectId(), curOffset, object->generationNumber(), true);
+	    if (xrefStreams)
+	    {
+		XRefStreamEntry entry = {object->objectId(), 1, curOffset, object->generationNumber()};
+		entries.push_back(entry);
+	    }
 	}
 
 	if (!nbNewObjects)
 	{
-	    close(newFd);
+	    writer.write(out.c_str(), out.size());
 	    return;
 	}
 
-	off_t newXrefOffset = lseek(newFd, 0, SEEK_CUR);
+	// Size can't decrease : objects not loaded (lazy parsing)
+	// or stored into object streams are counted by trailer
+	DataType* size = trailer.dictionary().get(NAME_SIZE);
+	if (size && size->type() == DataType::TYPE::INTEGER &&
+	    ((Integer*)size)->value() > maxId + 1)
+	    maxId = ((Integer*)size)->value() - 1;
 
-	std::string xrefStr = xref.str();
-	writeBuffer(newFd, xrefStr.c_str(), xrefStr.size());
+	off_t newXrefOffset = offset + out.size();
+
+	if (xrefStreams)
+	{
+	    writer.write(out.c_str(), out.size());
+	    writeXrefStream(writer, entries, newXrefOffset, maxId+1, xrefOffset);
+	    return;
+	}
 
-	trailer.deleteKey("Prev");
+	trailer.deleteKey(NAME_PREV);
 	if (xrefOffset != (off_t)-1)
-	    trailer.dictionary().addData("Prev", new Integer((int)xrefOffset));
-	trailer.deleteKey("Size");
-	trailer.dictionary().addData("Size", new Integer(maxId+1));
+	    trailer.dictionary().addData(NAME_PREV, new Integer((int)xrefOffset));
+	trailer.deleteKey(NAME_SIZE);
+	trailer.dictionary().addData(NAME_SIZE, new Integer(maxId+1));
 
-	std::string trailerStr = trailer.dictionary().str();
-	writeBuffer(newFd, "trailer\n", 8);
-	writeBuffer(newFd, trailerStr.c_str(), trailerStr.size());
+	out += xref;
+	appendTrailer(out, trailer, newXrefOffset);
 
-	std::stringstream startxref;
-	startxref << "startxref\n" << newXrefOffset << "\n%%EOF";
-	
-	std::string startxrefStr = startxref.str();
-	writeBuffer(newFd, startxrefStr.c_str(), startxrefStr.size());
-	
-	close(newFd);
+	writer.write(out.c_str(), out.size());
     }
-    
+
+    /**
+     * @brief Write a cross reference stream (with trailer values) for entries and itself,
+     * then startxref. offset is the current size of output, stream object id is
+     * at least minSize.
+     */
+    void Parser::writeXrefStream(Writer& writer, std::vector<XRefStreamEntry>& entries, off_t offset,
+				 int minSize, off_t prevOffset)
+    {
+	std::vector<XRefStreamEntry>::iterator it;
+	int objectId = minSize;
+
+	for (it=entries.begin(); it!=entries.end(); it++)
+	{
+	    if (it->objectId >= objectId)
+		objectId = it->objectId + 1;
+	}
+
+	XRefStreamEntry self = {objectId, 1, offset, 0};
+	entries.push_back(self);
+
+	// Sort by id, last written wins
+	std::stable_sort(entries.begin(), entries.end(), compareXRefStreamEntries);
+	std::vector<XRefStreamEntry> sorted;
+	for (size_t i=0; i<entries.size(); i++)
+	{
+	    if (i+1 < entries.size() && entries[i+1].objectId == entries[i].objectId)
+		continue;
+	    sorted.push_back(entries[i]);
+	}
+
+	uint64_t maxOffset = 0;
+	int maxGeneration = 0;
+	for (it=sorted.begin(); it!=sorted.end(); it++)
+	{
+	    if ((uint64_t)it->offset > maxOffset)
+		maxOffset = it->offset;
+	    if (it->generation > maxGeneration)
+		maxGeneration = it->generation;
+	}
+
+	int widths[3] = {1, (maxOffset > 0xffffffffULL) ? 8 : 4, (maxGeneration > 0xffff) ? 4 : 2};
+	std::string data;
+	Array* index = new Array();
+	int first = -1, count = 0;
+
+	data.reserve(sorted.size() * (widths[0] + widths[1] + widths[2]));
+	for (it=sorted.begin(); it!=sorted.end(); it++)
+	{
+	    uint64_t fields[3] = {(uint64_t)it->type, (uint64_t)it->offset, (uint64_t)it->generation};
+	    for (int f=0; f<3; f++)
+	    {
+		for (int b=widths[f]-1; b>=0; b--)
+		    data += (char)((fields[f] >> (b*8)) & 0xff);
+	    }
+
+	    // Subsections of consecutive ids
+	    if (first != -1 && it->objectId == first + count)
+	    {
+		count++;
+		continue;
+	    }
+	    if (first != -1)
+	    {
+		index->addData(new Integer(first));
+		index->addData(new Integer(count));
+	    }
+	    first = it->objectId;
+	    count = 1;
+	}
+	index->addData(new Integer(first));
+	index->addData(new Integer(count));
+
+	uLongf compressedSize = compressBound(data.size());
+	unsigned char* compressed = new unsigned char[compressedSize];
+	if (compress2(compressed, &compressedSize, (const Bytef*)data.data(), data.size(),
+		      Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+	    delete[] compressed;
+	    delete index;
+	    EXCEPTION(INVALID_STREAM, "Unable to compress XRef stream");
+	}
+
+	trailer.deleteKey(NAME_PREV);
+	if (prevOffset != (off_t)-1)
+	    trailer.dictionary().addData(NAME_PREV, new Integer((int)prevOffset));
+	trailer.deleteKey(NAME_SIZE);
+	trailer.dictionary().addData(NAME_SIZE, new Integer(objectId+1));
+
+	Object xref(objectId, 0, offset, true);
+	Dictionary& dict = xref.dictionary();
+	Dictionary::Entries::iterator entryIt;
+	for (entryIt=trailer.dictionary().value().begin(); entryIt!=trailer.dictionary().value().end(); entryIt++)
+	{
+	    // Only valid in xref table trailer
+	    if (entryIt->first == NAME_XREFSTM)
+		continue;
+	    if (entryIt->second)
+		dict.addData(entryIt->first, entryIt->second->clone());
+	}
+
+	Array* W = new Array();
+	for (int i=0; i<3; i++)
+	    W->addData(new Integer(widths[i]));
+
+	dict.addData(NAME_TYPE, new Name("/XRef"));
+	dict.addData(NAME_W, W);
+	dict.addData(NAME_INDEX, index);
+	dict.addData(NAME_FILTER, new Name("/FlateDecode"));
+
+	Stream* stream = new Stream(dict, 0, 0);
+	stream->setData(compressed, compressedSize, true);
+	xref.data().push_back(stream);
+
+	std::string xrefStr = xref.str();
+	xrefStr += "startxref\n" + std::to_string((long long)offset) + "\n%%EOF";
+	writer.write(xrefStr.c_str(), xrefStr.size());
+    }
+
     void Parser::write(const std::string& filename, bool update)
     {
 	if (update)
 	    return writeUpdate(filename);
 
+	if (!lazyObjects.empty())
+	    loadObjects();
+
+	beginWrite(filename);
+
+	std::vector<Object*>::iterator it;
+	for(it=_objects.begin(); it!=_objects.end(); it++)
+	    writeObject(*it);
+
+	endWrite();
+    }
+
+    void Parser::write(Writer& writer, bool update)
+    {
+	if (update)
+	    return writeUpdate(writer, copyInput(writer));
+
+	if (!lazyObjects.empty())
+	    loadObjects();
+
+	beginWrite(writer);
+
+	std::vector<Object*>::iterator it;
+	for(it=_objects.begin(); it!=_objects.end(); it++)
+	    writeObject(*it);
+
+	endWrite();
+    }
+
+    void Parser::beginWrite(const std::string& filename)
+    {
 	int newFd = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
 
 	if (newFd <= 0)
 	    EXCEPTION(UNABLE_TO_OPEN_FILE, "Unable to open " << filename << " (%m)");
 
+	beginWrite(*new FdWriter(newFd, true));
+	ownWriter = true;
+    }
+
+    void Parser::beginWrite(Writer& writer)
+    {
+	if (ownWriter)
+	    delete this->writer;
+
+	this->writer = &writer;
+	ownWriter = false;
+
 	char header[18];
 	int ret = snprintf(header, sizeof(header), "%%PDF-%d.%d\r%%%c%c%c%c\r\n",
 			   version_major, version_minor,
 			   0xe2, 0xe3, 0xcf, 0xd3);
 	
-	writeBuffer(newFd, header, ret);
+	writer.write(header, ret);
+	writeOffset = ret;
 
-	int maxId = 0;
-	std::stringstream xref;
-	off_t xrefStmOffset = 0;
-	
-	xref << std::setfill('0');
-	xref << "xref\n";
-	xref << "0 1\n";
-	xref << "0000000000 65535 f\r\n";
-	
-	std::vector<Object*>::iterator it;
-	for(it=_objects.begin(); it!=_objects.end(); it++)
+	writeMaxId = 0;
+	writeXrefStmOffset = 0;
+	writeDroppedXref = false;
+
+	writeXref = "xref\n0 1\n0000000000 65535 f\r\n";
+
+	XRefStreamEntry entry = {0, 0, 0, 65535};
+	writeXrefEntries.clear();
+	writeXrefEntries.push_back(entry);
+    }
+
+    void Parser::writeObject(Object* object)
+    {
+	if (!writer)
+	    EXCEPTION(IO_ERROR, "writeObject() called without beginWrite()");
+
+	// endWrite() writes a fresh xref stream, source ones are obsolete
+	if (xrefStreams && isXrefStream(object))
+	{
+	    writeDroppedXref = true;
+	    return;
+	}
+
+	curOffset = writeOffset;
+
+	if (copyCleanObjects && !object->isNew() && object->source())
+	{
+	    writer->write((const char*)object->source(), object->sourceLength());
+	    writer->write("\n", 1);
+	    writeOffset += object->sourceLength() + 1;
+	}
+	else
 	{
-	    Object* object = *it;
 	    std::string objStr = object->str();
-	    curOffset = lseek(newFd, 0, SEEK_CUR);
-	    writeBuffer(newFd, objStr.c_str(), objStr.size());
-	    xref << std::setw(0) << object->objectId() << " 1\n";
-	    xref << std::setw(10) << curOffset << " " << std::setw(5) << object->generationNumber();
-	    if (object->used())
-		xref << " n";
-	    else
-		xref << " f" ; 
-	    xref << "\r\n" ; // Here \r seems important
+	    writer->write(objStr.c_str(), objStr.size());
+	    writeOffset += objStr.size();
+	}
+	// Streaming parse may change xrefStreams until endWrite(): fill both
+	XRefStreamEntry entry = {object->objectId(), object->used() ? 1 : 0,
+				 object->used() ? curOffset : 0, object->generationNumber()};
+	writeXrefEntries.push_back(entry);
+	appendXrefEntry(writeXref, object->objectId(), curOffset, object->generationNumber(), object->used());
 
-	    if (object->objectId() > maxId)
-		maxId = object->objectId();
+	if (object->objectId() > writeMaxId)
+	    writeMaxId = object->objectId();
 
-	    if (object->hasKey("Type") && (*object)["Type"]->str() == "/XRef")
+	if (isXrefStream(object))
+	{
+	    // Try to keep Prev link valid
+	    if (object->hasKey(NAME_PREV) && writeXrefStmOffset != 0)
 	    {
-		// Try to keep Prev link valid
-		if (object->hasKey("Prev") && xrefStmOffset != 0)
-		{
-		    object->deleteKey("Prev");
-		    object->dictionary().addData("Prev", new Integer(xrefStmOffset));
-		}
-		xrefStmOffset = curOffset;
+		object->deleteKey(NAME_PREV);
+		object->dictionary().addData(NAME_PREV, new Integer(writeXrefStmOffset));
 	    }
+	    writeXrefStmOffset = curOffset;
 	}
+    }
+
+    void Parser::endWrite()
+    {
+	if (!writer)
+	    EXCEPTION(IO_ERROR, "endWrite() called without beginWrite()");
 
-	off_t newXrefOffset = lseek(newFd, 0, SEEK_CUR);
+	off_t newXrefOffset = writeOffset;
 
-	std::string xrefStr = xref.str();
-	writeBuffer(newFd, xrefStr.c_str(), xrefStr.size());
+	// Streaming parse may have switched back to an xref table (hybrid
+	// file) after a source xref stream was dropped : its entries are
+	// only kept by a new xref stream
+	if (xrefStreams || writeDroppedXref)
+	{
+	    std::unordered_set<int> written;
+	    std::vector<XRefStreamEntry>::iterator it;
+	    for (it=writeXrefEntries.begin(); it!=writeXrefEntries.end(); it++)
+	    {
+		if (it->type)
+		    written.insert(it->objectId);
+	    }
+
+	    // Objects not loaded are still into their object stream
+	    std::unordered_map<uint64_t, std::pair<int, int> >::iterator compressedIt;
+	    for (compressedIt=compressedObjects.begin(); compressedIt!=compressedObjects.end(); compressedIt++)
+	    {
+		int objectId = (int)(compressedIt->first >> 32);
+		if (written.count(objectId) || !written.count(compressedIt->second.first))
+		    continue;
+		XRefStreamEntry entry = {objectId, 2, compressedIt->second.first, compressedIt->second.second};
+		writeXrefEntries.push_back(entry);
+	    }
+
+	    trailer.deleteKey(NAME_XREFSTM);
+	    writeXrefStream(*writer, writeXrefEntries, newXrefOffset, writeMaxId+1, (off_t)-1);
+	}
+	else
+	{
+	    trailer.deleteKey(NAME_PREV);
+	    trailer.deleteKey(NAME_SIZE);
+	    trailer.dictionary().addData(NAME_SIZE, new Integer(writeMaxId+1));
 
-	trailer.deleteKey("Prev");
-	trailer.deleteKey("Size");
-	trailer.dictionary().addData("Size", new Integer(maxId+1));
+	    trailer.deleteKey(NAME_XREFSTM);
+	    if (writeXrefStmOffset != 0)
+		trailer.dictionary().addData(NAME_XREFSTM, new Integer(writeXrefStmOffset));
 
-	trailer.deleteKey("XRefStm");
-	if (xrefStmOffset != 0)
-	    trailer.dictionary().addData("XRefStm", new Integer(xrefStmOffset));
+	    appendTrailer(writeXref, trailer, newXrefOffset);
+	    writer->write(writeXref.c_str(), writeXref.size());
+	}
 
-	std::string trailerStr = trailer.dictionary().str();
-	writeBuffer(newFd, "trailer\n", 8);
-	writeBuffer(newFd, trailerStr.c_str(), trailerStr.size());
+	writeXref.clear();
+	writeXrefEntries.clear();
 
-	std::stringstream startxref;
-	startxref << "startxref\n" << newXrefOffset << "\n%%EOF";
-	
-	std::string startxrefStr = startxref.str();
-	writeBuffer(newFd, startxrefStr.c_str(), startxrefStr.size());
-	
-	close(newFd);
+	if (ownWriter)
+	    delete writer;
+	writer = 0;
+	ownWriter = false;
     }
 }
@@ -18,13 +18,112 @@
 */
 
 #include <unistd.h>
+#include <cstddef>
 #include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include <zlib.h>
 
 #include "uPDFTypes.h"
 #include "uPDFParser_common.h"
 
 namespace uPDFParser
 {
+#define ARENA_BLOCK_SIZE (256*1024)
+
+    /*
+     * Every DataType allocation is prefixed by a header telling
+     * if it comes from an arena (no individual free)
+     */
+    union AllocationHeader
+    {
+	Arena* arena;
+	std::max_align_t align;
+    };
+
+    static thread_local Arena* currentArena = 0;
+    
+    void* Arena::allocate(size_t size)
+    {
+	// Keep alignment for next allocation
+	size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+	if (size > ARENA_BLOCK_SIZE/4)
+	{
+	    // Big allocation, dedicated block (current one is kept)
+	    char* big = new char[size];
+	    blocks.push_back(big);
+	    return big;
+	}
+	
+	if (!block || blockUsed + size > blockSize)
+	{
+	    block = new char[ARENA_BLOCK_SIZE];
+	    blocks.push_back(block);
+	    blockUsed = 0;
+	    blockSize = ARENA_BLOCK_SIZE;
+	}
+
+	void* res = block + blockUsed;
+	blockUsed += size;
+
+	return res;
+    }
+
+    void Arena::clear()
+    {
+	std::vector<char*>::iterator it;
+	for (it=blocks.begin(); it!=blocks.end(); it++)
+	    delete[] *it;
+
+	blocks.clear();
+	block = 0;
+	blockUsed = blockSize = 0;
+    }
+
+    Arena* Arena::current()
+    {
+	return currentArena;
+    }
+
+    Arena::Scope::Scope(Arena* arena):
+	previous(currentArena)
+    {
+	currentArena = arena;
+    }
+
+    Arena::Scope::~Scope()
+    {
+	currentArena = previous;
+    }
+
+    void* DataType::operator new(size_t size)
+    {
+	AllocationHeader* header;
+	Arena* arena = currentArena;
+
+	if (arena)
+	    header = (AllocationHeader*)arena->allocate(sizeof(AllocationHeader) + size);
+	else
+	    header = (AllocationHeader*)::operator new(sizeof(AllocationHeader) + size);
+
+	header->arena = arena;
+
+	return header + 1;
+    }
+
+    void DataType::operator delete(void* ptr)
+    {
+	if (!ptr)
+	    return;
+
+	AllocationHeader* header = ((AllocationHeader*)ptr) - 1;
+
+	// Arena memory is released by Arena::clear()
+	if (!header->arena)
+	    ::operator delete(header);
+    }
+
     Name::Name(const std::string& name):
 	DataType(DataType::TYPE::NAME)
     {
@@ -37,6 +136,41 @@ namespace uPDFParser
 	_value = value;
     }
 
+    std::string& String::unescape()
+    {
+	unsigned int i, j = 0;
+	char c;
+
+	for (i=0; i<_value.size(); i++)
+	{
+	    c = _value[i];
+
+	    if (c == '\\')
+	    {
+		// Like unescapedValue(), sequences of '\' are merged
+		while (i+1 < _value.size() && _value[i+1] == '\\')
+		    i++;
+
+		if (i+1 < _value.size())
+		{
+		    switch(_value[i+1])
+		    {
+		    case '(': c = '('; i++; break;
+		    case ')': c = ')'; i++; break;
+		    case 'n': c = '\n'; i++; break;
+		    case 'r': c = '\r'; i++; break;
+		    }
+		}
+	    }
+
+	    _value[j++] = c;
+	}
+
+	_value.resize(j);
+
+	return _value;
+    }
+
     HexaString::HexaString(const std::string& value):
 	DataType(DataType::TYPE::HEXASTRING)
     {
@@ -98,19 +232,180 @@ namespace uPDFParser
 	return res + "]";
     }
 
-    void Dictionary::addData(const std::string& key, DataType* value)
+    Array::~Array()
+    {
+	std::vector<DataType*>::iterator it;
+	for(it=_value.begin(); it!=_value.end(); it++)
+	    delete *it;
+    }
+
+    /*
+     * Known names. Only this fixed set is shared : other names are
+     * unbounded across documents (/F7, /Im123...) and stay owned by
+     * dictionary keys.
+     */
+    struct NamesTable
+    {
+	NamesTable()
+	{
+	    static const char* known[KNOWN_NAMES_COUNT] = {
+		"Type", "Subtype", "Filter", "DecodeParms", "Length", "Encrypt",
+		"Root", "Info", "ID", "Size", "Prev", "XRefStm", "W", "Index",
+		"N", "First", "Extends", "Parent", "Kids", "Count", "Contents",
+		"Resources", "V"
+	    };
+
+	    for (int i=0; i<KNOWN_NAMES_COUNT; i++)
+	    {
+		names[i] = known[i];
+		ids[known[i]] = (NameId)i;
+	    }
+	}
+
+	std::string names[KNOWN_NAMES_COUNT];
+	std::unordered_map<std::string, NameId> ids;
+    };
+
+    // Built once (thread safe initialization), then only read
+    static const NamesTable& namesTable()
     {
-	_value[key] = value;
+	static const NamesTable table;
+	return table;
+    }
+    
+    bool Names::find(const std::string& name, NameId& id)
+    {
+	const NamesTable& table = namesTable();
+
+	std::unordered_map<std::string, NameId>::const_iterator it = table.ids.find(name);
+	if (it == table.ids.end())
+	    return false;
+
+	id = it->second;
+	return true;
+    }
+
+    const std::string& Names::str(NameId id)
+    {
+	if (id >= KNOWN_NAMES_COUNT)
+	    EXCEPTION(INVALID_NAME, "Unknown name identifier " << id);
+
+	return namesTable().names[id];
+    }
+
+    DictionaryKey::DictionaryKey(const std::string& name)
+    {
+	if (!Names::find(name, id))
+	{
+	    id = NAME_OTHER;
+	    this->name = name;
+	}
+    }
+    
+    Dictionary::~Dictionary()
+    {
+	Entries::iterator it;
+	for(it=_value.begin(); it!=_value.end(); it++)
+	    delete it->second;
+    }
+
+    DataType* Dictionary::clone()
+    {
+	Dictionary* res = new Dictionary();
+	Entries::iterator it;
+
+	res->_value.reserve(_value.size());
+	for(it=_value.begin(); it!=_value.end(); it++)
+	    res->_value.push_back(Entry(it->first, (it->second)?it->second->clone():0));
+
+	return res;
+    }
+
+    void Dictionary::addData(const Key& key, DataType* value)
+    {
+	DataType*& entry = (*this)[key];
+
+	// Duplicated key : last value wins
+	if (entry && entry != value)
+	    delete entry;
+
+	entry = value;
+    }
+
+    DataType*& Dictionary::operator[](const Key& key)
+    {
+	Entry* entry = find(key);
+
+	if (entry)
+	    return entry->second;
+
+	// Most dictionaries are small : allocate once
+	if (_value.empty())
+	    _value.reserve(8);
+	
+	_value.push_back(Entry(key, 0));
+	return _value.back().second;
+    }
+
+    void Dictionary::deleteKey(const Key& key)
+    {
+	Entries::iterator it;
+	for(it=_value.begin(); it!=_value.end(); it++)
+	{
+	    if (it->first == key)
+	    {
+		delete it->second;
+		_value.erase(it);
+		return;
+	    }
+	}
+    }
+
+    void Dictionary::replace(const Key& key, DataType* data, bool freeData)
+    {
+	Entry* entry = find(key);
+
+	if (!entry)
+	    return;
+
+	if (freeData)
+	    delete entry->second;
+
+	entry->second = data;
+    }
+
+    void Dictionary::clear()
+    {
+	Entries::iterator it;
+	for(it=_value.begin(); it!=_value.end(); it++)
+	    delete it->second;
+
+	_value.clear();
+    }
+    
+    static bool compareEntriesName(const std::pair<const std::string*, DataType*>& a,
+				   const std::pair<const std::string*, DataType*>& b)
+    {
+	return *a.first < *b.first;
     }
     
     std::string Dictionary::str()
     {
 	std::string res("<<");
-	std::map<std::string, DataType*>::iterator it;
+	std::vector<std::pair<const std::string*, DataType*> > entries;
+	std::vector<std::pair<const std::string*, DataType*> >::iterator it;
+	Entries::iterator entryIt;
+
+	// Keep a stable (sorted) output whatever the insertion order
+	entries.reserve(_value.size());
+	for(entryIt = _value.begin(); entryIt!=_value.end(); entryIt++)
+	    entries.push_back(std::make_pair(&entryIt->first.str(), entryIt->second));
+
+	std::sort(entries.begin(), entries.end(), compareEntriesName);
 	
-	for(it = _value.begin(); it!=_value.end(); it++)
+	for(it = entries.begin(); it!=entries.end(); it++)
 	{
-	    res += std::string("/") + it->first;
+	    res += std::string("/") + *it->first;
 	    if (it->second)
 		res += it->second->str();
 	}
@@ -121,7 +416,7 @@ namespace uPDFParser
     std::string Stream::str()
     {
 	std::string res = "stream\n";
-	const char* streamData = (const char*)data(); // Force reading if not in memory
+	const char* streamData = (const char*)loadData(); // Force reading if not in memory
 	res += std::string(streamData, _dataLength);
 	res += "\nendstream\n";
 
@@ -129,6 +424,14 @@ namespace uPDFParser
     }
     
     unsigned char* Stream::data()
+    {
+	loadData();
+	setInputModified();
+
+	return _data;
+    }
+
+    const unsigned char* Stream::loadData()
     {
 	if (!_data)
 	{
@@ -151,14 +454,189 @@ namespace uPDFParser
 
     void Stream::setData(unsigned char* data, unsigned int dataLength, bool freeData)
     {
-	if (_data && freeData)
+	// Previous data may point into parser's input buffer : only free it if we own it
+	if (_data && this->freeData && _data != data)
 	    delete[] _data;
 
-	dict.deleteKey("Length");
-	dict.addData("Length", new Integer(dataLength));
+	dict.deleteKey(NAME_LENGTH);
+	dict.addData(NAME_LENGTH, new Integer(dataLength));
 
 	this->_data = data;
 	this->_dataLength = dataLength;
 	this->freeData = freeData;
+	// Doesn't point into parser's input anymore
+	this->inputModified = 0;
+    }
+
+    void Stream::setDataLength(unsigned int dataLength)
+    {
+	dict.deleteKey(NAME_LENGTH);
+	dict.addData(NAME_LENGTH, new Integer(dataLength));
+
+	this->_dataLength = dataLength;
+	setInputModified();
+    }
+
+    /**
+     * @brief Inflate zlib data. A truncated (or not terminated) stream
+     * is accepted, data decoded up to this point is returned.
+     */
+    static void inflateData(const unsigned char* data, unsigned int length, std::string& res)
+    {
+	unsigned char buffer[64*1024];
+	z_stream stream;
+	int ret;
+
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK)
+	    EXCEPTION(INVALID_STREAM, "Unable to initialize zlib");
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = length;
+
+	do
+	{
+	    stream.next_out = buffer;
+	    stream.avail_out = sizeof(buffer);
+	    ret = ::inflate(&stream, Z_NO_FLUSH);
+	    if (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR)
+		res.append((const char*)buffer, sizeof(buffer) - stream.avail_out);
+	} while (ret == Z_OK);
+
+	inflateEnd(&stream);
+
+	if (ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+	    EXCEPTION(INVALID_STREAM, "Invalid compressed stream (zlib error " << ret << ")");
+    }
+
+    static int decodeParm(Dictionary* parms, const std::string& key, int defaultValue)
+    {
+	DataType* value = (parms) ? parms->get(key) : 0;
+
+	if (!value || value->type() != DataType::TYPE::INTEGER)
+	    return defaultValue;
+
+	return ((Integer*)value)->value();
+    }
+
+    /**
+     * @brief Revert PNG (10 to 15) or TIFF (2) predictor
+     */
+    static void unpredict(std::string& data, Dictionary* parms)
+    {
+	int predictor = decodeParm(parms, "Predictor", 1);
+
+	if (predictor < 2)
+	    return;
+
+	int colors = decodeParm(parms, "Colors", 1);
+	int bitsPerComponent = decodeParm(parms, "BitsPerComponent", 8);
+	int columns = decodeParm(parms, "Columns", 1);
+
+	if (colors < 1 || bitsPerComponent < 1 || columns < 1)
+	    EXCEPTION(INVALID_STREAM, "Invalid predictor parameters");
+
+	size_t bpp = (colors * bitsPerComponent + 7) / 8;
+	size_t rowLength = ((size_t)colors * bitsPerComponent * columns + 7) / 8;
+	unsigned char* cur = (unsigned char*)&data[0];
+	size_t i, pos;
+
+	if (predictor == 2)
+	{
+	    if (bitsPerComponent != 8)
+		EXCEPTION(NOT_IMPLEMENTED, "TIFF predictor with " << bitsPerComponent << " bits per component");
+
+	    for (pos=0; pos<data.size(); pos += rowLength)
+	    {
+		for (i=bpp; i<rowLength && pos+i<data.size(); i++)
+		    cur[pos+i] += cur[pos+i-bpp];
+	    }
+	    return;
+	}
+
+	// PNG predictors : each row starts with its own filter type
+	std::string res;
+	std::vector<unsigned char> prevRow(rowLength, 0);
+	unsigned char left, up, upLeft;
+	int p, pa, pb, pc;
+
+	res.reserve(data.size());
+
+	for (pos=0; pos<data.size(); pos += rowLength+1)
+	{
+	    unsigned char type = cur[pos];
+	    unsigned char* row = &cur[pos+1];
+	    size_t length = std::min(rowLength, data.size() - pos - 1);
+
+	    for (i=0; i<length; i++)
+	    {
+		left = (i >= bpp) ? row[i-bpp] : 0;
+		up = prevRow[i];
+		upLeft = (i >= bpp) ? prevRow[i-bpp] : 0;
+
+		switch(type)
+		{
+		case 0: break;
+		case 1: row[i] += left; break;
+		case 2: row[i] += up; break;
+		case 3: row[i] += (left + up) / 2; break;
+		case 4:
+		    // Paeth
+		    p = left + up - upLeft;
+		    pa = abs(p - left); pb = abs(p - up); pc = abs(p - upLeft);
+		    if (pa <= pb && pa <= pc)
+			row[i] += left;
+		    else if (pb <= pc)
+			row[i] += up;
+		    else
+			row[i] += upLeft;
+		    break;
+		default:
+		    EXCEPTION(INVALID_STREAM, "Invalid PNG predictor " << (int)type);
+		}
+	    }
+
+	    memcpy(&prevRow[0], row, length);
+	    res.append((const char*)row, length);
+	}
+
+	data.swap(res);
+    }
+
+    /**
+     * @brief Single filter (or decode parameters) may be in an array
+     */
+    static DataType* singleValue(DataType* value, const char* what)
+    {
+	if (!value || value->type() != DataType::TYPE::ARRAY)
+	    return value;
+
+	std::vector<DataType*>& values = ((Array*)value)->value();
+
+	if (values.size() > 1)
+	    EXCEPTION(NOT_IMPLEMENTED, "Multiple " << what << " not supported");
+
+	return (values.size()) ? values[0] : 0;
+    }
+
+    std::string Stream::decodedData()
+    {
+	std::string res;
+	DataType* filter = singleValue(dict.get(NAME_FILTER), "filters");
+	DataType* parms = singleValue(dict.get(NAME_DECODEPARMS), "decode parameters");
+	const unsigned char* streamData = loadData();
+
+	if (!filter || filter->type() == DataType::TYPE::NULLOBJECT)
+	    return std::string((const char*)streamData, _dataLength);
+
+	if (filter->type() != DataType::TYPE::NAME || ((Name*)filter)->value() != "FlateDecode")
+	    EXCEPTION(NOT_IMPLEMENTED, "Unsupported filter " << filter->str());
+
+	inflateData(streamData, _dataLength, res);
+
+	if (parms && parms->type() == DataType::TYPE::DICTIONARY)
+	    unpredict(res, (Dictionary*)parms);
+
+	return res;
     }
 }
@@ -1,14 +1,705 @@
 #include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <zlib.h>
 #include <uPDFParser.h>
 #include <uPDFParser_common.h>
 
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if (!(cond))							\
+	{								\
+	    std::cout << __FILE__ << ":" << __LINE__ << " Check failed : " << #cond << std::endl; \
+	    failures++;							\
+	}								\
+    } while (0)
+
+/**
+ * @brief Keep written PDF in memory
+ */
+class StringWriter : public uPDFParser::Writer
+{
+public:
+    virtual void write(const char* buffer, size_t size) { data.append(buffer, size); }
+
+    std::string data;
+};
+
+/**
+ * @brief Build a PDF in memory, keeping offsets of its objects
+ */
+class PDFBuilder
+{
+public:
+    PDFBuilder(): data("%PDF-1.6\n") {}
+
+    void object(int objectId, const std::string& content)
+    {
+	offsets[objectId] = data.size();
+	data += std::to_string(objectId) + " 0 obj\n" + content + "\nendobj\n";
+    }
+
+    void stream(int objectId, const std::string& dict, const std::string& content)
+    {
+	object(objectId, dict + "\nstream\n" + content + "\nendstream");
+    }
+
+    /**
+     * @brief Classic xref table with objects added since last section
+     */
+    void xrefTable(const std::string& trailer)
+    {
+	off_t offset = data.size();
+	char entry[21];
+
+	data += "xref\n";
+	if (!lastXref)
+	    data += "0 1\n0000000000 65535 f\r\n";
+
+	std::map<int, off_t>::iterator it;
+	for (it=offsets.begin(); it!=offsets.end(); it++)
+	{
+	    if (it->second < lastXref)
+		continue;
+	    snprintf(entry, sizeof(entry), "%010d 00000 n\r\n", (int)it->second);
+	    data += std::to_string(it->first) + " 1\n" + entry;
+	}
+
+	data += "trailer\n" + trailer + "\n";
+	startXref(offset);
+    }
+
+    void startXref(off_t offset)
+    {
+	data += "startxref\n" + std::to_string((long long)offset) + "\n%%EOF\n";
+	xrefOffset = offset;
+	lastXref = data.size();
+    }
+
+    std::string data;
+    std::map<int, off_t> offsets;
+    off_t xrefOffset = 0, lastXref = 0;
+};
+
+static std::string deflate(const std::string& data)
+{
+    uLongf length = compressBound(data.size());
+    std::string res(length, '\0');
+
+    compress((Bytef*)&res[0], &length, (const Bytef*)data.data(), data.size());
+    res.resize(length);
+
+    return res;
+}
+
+/**
+ * @brief Encode rows with PNG Up predictor (/Predictor 12)
+ */
+static std::string pngUp(const std::string& data, int columns)
+{
+    std::string res, prev(columns, '\0');
+
+    for (size_t i=0; i<data.size(); i+=columns)
+    {
+	res += (char)2;
+	for (int c=0; c<columns; c++)
+	    res += (char)(data[i+c] - prev[c]);
+	prev = data.substr(i, columns);
+    }
+
+    return res;
+}
+
+static std::string xrefStreamEntry(int type, int field2, int field3)
+{
+    std::string res;
+
+    res += (char)type;
+    res += (char)((field2 >> 8) & 0xff);
+    res += (char)(field2 & 0xff);
+    res += (char)field3;
+
+    return res;
+}
+
+/**
+ * @brief Classic PDF (3 0 obj is "old"), updated by a cross reference stream
+ * with two subsections. 3 0 obj is replaced by one stored into an object stream,
+ * with a new integer object (5 0 obj).
+ */
+static std::string xrefStreamPDF()
+{
+    PDFBuilder pdf;
+
+    pdf.object(1, "<</Type/Catalog/Pages 2 0 R>>");
+    pdf.object(2, "<</Type/Pages/Kids[]/Count 0>>");
+    pdf.object(3, "(old)");
+    pdf.xrefTable("<</Size 4/Root 1 0 R>>");
+    off_t prev = pdf.xrefOffset;
+
+    std::string objStmHeader = "3 0 5 5 ";
+    std::string objStmContent = objStmHeader + "(new) 42";
+    pdf.stream(4, "<</Type/ObjStm/N 2/First " + std::to_string(objStmHeader.size()) +
+	       "/Length " + std::to_string(objStmContent.size()) + ">>", objStmContent);
+
+    off_t xrefOffset = pdf.data.size();
+    std::string entries = xrefStreamEntry(2, 4, 0) +
+	xrefStreamEntry(1, pdf.offsets[4], 0) +
+	xrefStreamEntry(2, 4, 1) +
+	xrefStreamEntry(1, xrefOffset, 0);
+    std::string content = deflate(pngUp(entries, 4));
+    pdf.stream(6, "<</Type/XRef/Size 7/Root 1 0 R/Prev " + std::to_string((long long)prev) +
+	       "/W[1 2 1]/Index[3 3 6 1]/Filter/FlateDecode/DecodeParms<</Predictor 12/Columns 4>>" +
+	       "/Length " + std::to_string(content.size()) + ">>", content);
+    pdf.startXref(xrefOffset);
+
+    return pdf.data;
+}
+
+static std::string stringValue(uPDFParser::Object* object)
+{
+    if (!object || object->data().empty() ||
+	object->data()[0]->type() != uPDFParser::DataType::TYPE::STRING)
+	return "";
+
+    return ((uPDFParser::String*)object->data()[0])->value();
+}
+
+static void parse(uPDFParser::Parser& parser, const std::string& data, bool lazy)
+{
+    if (lazy)
+	parser.parseLazy((const unsigned char*)data.data(), data.size());
+    else
+	parser.parse((const unsigned char*)data.data(), data.size());
+}
+
+static void testXrefStream(bool lazy)
+{
+    std::string data = xrefStreamPDF();
+    uPDFParser::Parser parser;
+
+    parse(parser, data, lazy);
+
+    // Predictor rows and both subsections decoded, compressed revision wins
+    CHECK(stringValue(parser.getObject(3)) == "new");
+    CHECK(parser.getObject(1) && parser.getObject(1)->hasKey("Type"));
+    CHECK(parser.getObject(2) != 0);
+    uPDFParser::Object* integer = parser.getObject(5);
+    CHECK(integer && !integer->isIndirect() && integer->data().size() == 1 &&
+	  integer->data()[0]->type() == uPDFParser::DataType::TYPE::INTEGER &&
+	  ((uPDFParser::Integer*)integer->data()[0])->value() == 42);
+    CHECK(parser.getTrailer().hasKey("Root"));
+
+    // Same kind of cross reference section is written back
+    StringWriter writer;
+    parser.write(writer);
+    CHECK(writer.data.find("/XRef") != std::string::npos);
+    CHECK(writer.data.find("\nxref\n") == std::string::npos);
+    // Source xref stream is replaced, not copied along
+    CHECK(writer.data.find("/XRef") == writer.data.rfind("/XRef"));
+
+    uPDFParser::Parser clean;
+    parse(clean, data, lazy);
+    clean.setCopyCleanObjects(true);
+    StringWriter cleanWriter;
+    clean.write(cleanWriter);
+    CHECK(cleanWriter.data.find("/XRef") != std::string::npos);
+    CHECK(cleanWriter.data.find("/XRef") == cleanWriter.data.rfind("/XRef"));
+
+    uPDFParser::Parser reparsed;
+    parse(reparsed, writer.data, lazy);
+    CHECK(stringValue(reparsed.getObject(3)) == "new");
+    CHECK(reparsed.getObject(1) && reparsed.getObject(1)->hasKey("Type"));
+
+    // Incremental update is a cross reference stream chained to previous one
+    uPDFParser::Parser updated;
+    parse(updated, data, lazy);
+    updated.addObject(new uPDFParser::Object(7, 0, 0, true));
+    updated.getObject(7)->data().push_back(new uPDFParser::String("added"));
+    StringWriter updateWriter;
+    updated.write(updateWriter, true);
+    CHECK(updateWriter.data.compare(0, data.size(), data) == 0);
+    CHECK(updateWriter.data.find("/XRef", data.size()) != std::string::npos);
+    CHECK(updateWriter.data.find("\nxref\n", data.size()) == std::string::npos);
+
+    uPDFParser::Parser reparsedUpdate;
+    parse(reparsedUpdate, updateWriter.data, lazy);
+    CHECK(stringValue(reparsedUpdate.getObject(7)) == "added");
+    CHECK(stringValue(reparsedUpdate.getObject(3)) == "new");
+}
+
+static void testXrefTable()
+{
+    PDFBuilder pdf;
+
+    pdf.object(1, "<</Type/Catalog/Pages 2 0 R>>");
+    pdf.object(2, "<</Type/Pages/Kids[]/Count 0>>");
+    pdf.xrefTable("<</Size 3/Root 1 0 R>>");
+
+    uPDFParser::Parser parser;
+    parse(parser, pdf.data, false);
+
+    StringWriter writer;
+    parser.write(writer);
+    CHECK(writer.data.find("\nxref\n") != std::string::npos);
+    CHECK(writer.data.find("/XRef") == std::string::npos);
+}
+
+/**
+ * @brief Objects not serialized the same way by Object::str()
+ */
+static std::string cleanObjectsPDF()
+{
+    PDFBuilder pdf;
+
+    pdf.object(1, "<<  /Type   /Catalog  /Pages 2 0 R  >>");
+    pdf.object(2, "<<  /Type   /Pages  /Kids [ ]  /Count 0  >>");
+    pdf.object(3, "<<  /Title  (copy)  >>");
+    pdf.xrefTable("<</Size 4/Root 1 0 R/Info 3 0 R>>");
+
+    return pdf.data;
+}
+
+static std::string objectSource(const std::string& data, int objectId)
+{
+    std::string start = std::to_string(objectId) + " 0 obj";
+    size_t begin = data.find(start);
+    size_t end = data.find("endobj", begin);
+
+    return data.substr(begin, end + 6 - begin);
+}
+
+static void testCopyCleanObjects(bool lazy)
+{
+    std::string data = cleanObjectsPDF();
+    uPDFParser::Parser parser;
+
+    parse(parser, data, lazy);
+    parser.setCopyCleanObjects(true);
+
+    // Modified object has to be serialized again
+    uPDFParser::Object* info = parser.getObject(3);
+    info->dictionary().addData("Author", new uPDFParser::String("me"));
+    info->update();
+
+    StringWriter writer;
+    parser.write(writer);
+
+    // Untouched objects are byte-identical
+    CHECK(writer.data.find(objectSource(data, 1)) != std::string::npos);
+    CHECK(writer.data.find(objectSource(data, 2)) != std::string::npos);
+    CHECK(writer.data.find(objectSource(data, 3)) == std::string::npos);
+
+    uPDFParser::Parser reparsed;
+    parse(reparsed, writer.data, false);
+    info = reparsed.getObject(3);
+    CHECK(info && info->hasKey("Author") && info->hasKey("Title"));
+    CHECK(reparsed.getObject(1) && reparsed.getObject(1)->hasKey("Pages"));
+
+    // Default is to serialize every object
+    uPDFParser::Parser serialized;
+    parse(serialized, data, false);
+    StringWriter serializedWriter;
+    serialized.write(serializedWriter);
+    CHECK(serializedWriter.data.find(objectSource(data, 1)) == std::string::npos);
+}
+
+static uPDFParser::Stream* objectStream(uPDFParser::Object* object)
+{
+    std::vector<uPDFParser::DataType*>::iterator it;
+
+    for (it=object->data().begin(); it!=object->data().end(); it++)
+    {
+	if ((*it)->type() == uPDFParser::DataType::TYPE::STREAM)
+	    return (uPDFParser::Stream*)*it;
+    }
+
+    return 0;
+}
+
+static void testInPlace()
+{
+    // Same result as unescapedValue(), into string own buffer
+    const char* escaped = "a\\(b\\)\\\\c\\n\\rd";
+    uPDFParser::String string(escaped);
+    std::string expected = string.unescapedValue();
+    std::string& value = string.unescape();
+    CHECK(value == expected);
+    CHECK(value == "a(b)\\c\n\rd");
+    value[0] = 'A';
+    CHECK(string.value() == "A(b)\\c\n\rd");
+
+    PDFBuilder pdf;
+    pdf.object(1, "<</Type/Catalog>>");
+    pdf.stream(2, "<</Length 11>>", "hello world");
+    pdf.xrefTable("<</Size 3/Root 1 0 R>>");
+
+    uPDFParser::Parser parser;
+    parse(parser, pdf.data, false);
+
+    // Shrink stream data where it has been parsed
+    uPDFParser::Object* object = parser.getObject(2);
+    uPDFParser::Stream* stream = objectStream(object);
+    CHECK(stream && stream->dataLength() == 11);
+    unsigned char* data = stream->data();
+    data[0] = 'j';
+    stream->setDataLength(5);
+    object->update();
+    CHECK(stream->data() == data && stream->dataLength() == 5);
+    uPDFParser::DataType* length = object->dictionary().get("Length");
+    CHECK(length && length->type() == uPDFParser::DataType::TYPE::INTEGER &&
+	  ((uPDFParser::Integer*)length)->value() == 5);
+
+    StringWriter writer;
+    parser.write(writer);
+
+    uPDFParser::Parser reparsed;
+    parse(reparsed, writer.data, false);
+    stream = objectStream(reparsed.getObject(2));
+    CHECK(stream && std::string((const char*)stream->data(), stream->dataLength()) == "jello");
+
+    // Modified input buffer can't be copied by an incremental update
+    bool copied = true;
+    StringWriter updateWriter;
+    try
+    {
+	parser.write(updateWriter, true);
+    }
+    catch(uPDFParser::Exception& e)
+    {
+	copied = false;
+    }
+    CHECK(!copied && updateWriter.data.empty());
+
+    // Reading streams doesn't prevent it
+    uPDFParser::Parser readOnly;
+    parse(readOnly, pdf.data, false);
+    stream = objectStream(readOnly.getObject(2));
+    CHECK(stream && stream->str() == "stream\nhello world\nendstream\n");
+    CHECK(stream->decodedData() == "hello world");
+    StringWriter readOnlyWriter;
+    readOnly.write(readOnlyWriter, true);
+    CHECK(readOnlyWriter.data.compare(0, pdf.data.size(), pdf.data) == 0);
+}
+
+static void testBorrowedInput()
+{
+    PDFBuilder pdf;
+    pdf.object(1, "<</Type/Catalog>>");
+    pdf.stream(2, "<</Length 11>>", "hello world");
+    pdf.xrefTable("<</Size 3/Root 1 0 R>>");
+    const unsigned char* data = (const unsigned char*)pdf.data.data();
+
+    // Streams point into caller's buffer, for each parse() call
+    uPDFParser::Parser parser;
+    for (int i=0; i<2; i++)
+    {
+	parser.parse(data, pdf.data.size(), 0, false);
+	uPDFParser::Stream* stream = objectStream(parser.getObject(2));
+	CHECK(stream && stream->data() == data + pdf.data.find("hello world"));
+    }
+
+    // Borrowed input is copied verbatim by an incremental update
+    uPDFParser::Parser lazy;
+    lazy.parseLazy(data, pdf.data.size(), false);
+    uPDFParser::Object* object = lazy.getObject(1)->clone();
+    (*object)["Title"] = new uPDFParser::String("borrowed");
+    lazy.addObject(object);
+    StringWriter writer;
+    lazy.write(writer, true);
+    CHECK(writer.data.compare(0, pdf.data.size(), pdf.data) == 0);
+
+    uPDFParser::Parser reparsed;
+    parse(reparsed, writer.data, false);
+    uPDFParser::DataType* title = reparsed.getObject(1)->dictionary().get("Title");
+    CHECK(title && title->str() == "(borrowed)");
+}
+
+static void testInputBounds()
+{
+    const std::string data("0123456789");
+    uPDFParser::InputBuffer input;
+    input.open((const unsigned char*)data.data(), data.size());
+
+    // End of buffer is a valid position, not beyond it
+    input.seek(data.size());
+    char c;
+    CHECK(!input.getChar(c));
+
+    int errors = 0;
+    off_t offsets[] = {-1, (off_t)data.size() + 1, 2};
+    for (int i=0; i<3; i++)
+    {
+	// Discarded data can't be reached anymore
+	if (i == 2)
+	{
+	    input.seek(5);
+	    input.discard(4);
+	}
+	try
+	{
+	    input.seek(offsets[i]);
+	}
+	catch(uPDFParser::Exception& e)
+	{
+	    if (e.getErrorCode() == uPDFParser::TRUNCATED_FILE)
+		errors++;
+	}
+    }
+    CHECK(errors == 3);
+    CHECK(input.tell() == 5);
+
+    // Length beyond end of file falls back to endstream search
+    PDFBuilder pdf;
+    pdf.object(1, "<</Type/Catalog>>");
+    pdf.stream(2, "<</Length 1000>>", "hello world");
+    pdf.xrefTable("<</Size 3/Root 1 0 R>>");
+    uPDFParser::Parser parser;
+    parse(parser, pdf.data, false);
+    uPDFParser::Stream* stream = objectStream(parser.getObject(2));
+    // (end of line before endstream is kept)
+    CHECK(stream && stream->dataLength() >= 11 &&
+	  !memcmp(stream->data(), "hello world", 11));
+}
+
+static void testArena()
+{
+    uPDFParser::Arena arena;
+
+    // Scopes nest and restore previous arena
+    CHECK(uPDFParser::Arena::current() == 0);
+    {
+	uPDFParser::Arena::Scope scope(&arena);
+	CHECK(uPDFParser::Arena::current() == &arena);
+	{
+	    uPDFParser::Arena::Scope heapScope(0);
+	    CHECK(uPDFParser::Arena::current() == 0);
+	}
+	CHECK(uPDFParser::Arena::current() == &arena);
+    }
+    CHECK(uPDFParser::Arena::current() == 0);
+
+    // Aligned and distinct allocations, big ones included
+    char* small = (char*)arena.allocate(1);
+    char* next = (char*)arena.allocate(100);
+    char* big = (char*)arena.allocate(16*1024*1024);
+    CHECK((uintptr_t)small % alignof(std::max_align_t) == 0);
+    CHECK((uintptr_t)next % alignof(std::max_align_t) == 0);
+    CHECK((uintptr_t)big % alignof(std::max_align_t) == 0);
+    CHECK(next >= small + 1 || next + 100 <= small);
+    memset(big, 0, 16*1024*1024);
+
+    // Nodes can be deleted outside of the scope they have been allocated in
+    uPDFParser::DataType* heapNode = new uPDFParser::Integer(1);
+    uPDFParser::DataType* arenaNode;
+    {
+	uPDFParser::Arena::Scope scope(&arena);
+	arenaNode = new uPDFParser::String("arena");
+	delete heapNode;
+    }
+    CHECK(arenaNode->str() == "(arena)");
+    delete arenaNode;
+    arena.clear();
+
+    // Parsed values live with parser, a clone made outside of it outlives it
+    uPDFParser::Object* copy;
+    {
+	uPDFParser::Parser parser;
+	parse(parser, cleanObjectsPDF(), false);
+	copy = parser.getObject(3)->clone();
+    }
+    uPDFParser::DataType* title = copy->dictionary().get("Title");
+    CHECK(title && title->str() == "(copy)");
+    delete copy;
+}
+
+static void testLazyParsing()
+{
+    // Incremental update replaces 3 0 obj and adds 5 0 obj
+    PDFBuilder pdf;
+    pdf.object(1, "<</Type/Catalog/Pages 2 0 R>>");
+    pdf.object(2, "<</Type/Pages/Kids[]/Count 0>>");
+    pdf.object(3, "<</Title(first) /Values[1 -2 3.5 true null /Name <414243>]>>");
+    pdf.stream(4, "<</Length 6>>", "stream");
+    pdf.xrefTable("<</Size 5/Root 1 0 R/Info 3 0 R>>");
+    off_t prev = pdf.xrefOffset;
+    pdf.object(3, "<</Title(second) /Parent 5 0 R>>");
+    pdf.object(5, "[(a) (b)]");
+    pdf.xrefTable("<</Size 6/Root 1 0 R/Info 3 0 R/Prev " + std::to_string((long long)prev) + ">>");
+
+    uPDFParser::Parser eager, lazy;
+    parse(eager, pdf.data, false);
+    parse(lazy, pdf.data, true);
+
+    // Same (newest) objects
+    for (int objectId=1; objectId<=5; objectId++)
+    {
+	uPDFParser::Object* eagerObject = eager.getObject(objectId);
+	uPDFParser::Object* lazyObject = lazy.getObject(objectId);
+	CHECK(eagerObject && lazyObject && eagerObject->str() == lazyObject->str());
+    }
+    CHECK(lazy.getObject(3)->dictionary().get("Title")->str() == "(second)");
+    CHECK(eager.getTrailer().str() == lazy.getTrailer().str());
+
+    // Replaced revision is never loaded by lazy parsing
+    CHECK(eager.objects().size() == 6);
+    CHECK(lazy.objects().size() == 5);
+
+    // Xref entries of loaded objects reference them, replaced revision doesn't
+    std::vector<uPDFParser::XRefValue> table = lazy.xrefTable();
+    for (size_t i=0; i<table.size(); i++)
+    {
+	if (!table[i].used())
+	    continue;
+	if (table[i].objectId() == 3 && table[i].offset() == pdf.offsets[3])
+	    CHECK(table[i].object() == lazy.getObject(3));
+	else if (table[i].objectId() == 3)
+	    CHECK(table[i].object() == 0);
+	else
+	    CHECK(table[i].object() == lazy.getObject(table[i].objectId()));
+    }
+
+    // Objects not requested are loaded by a full write
+    uPDFParser::Parser partial;
+    parse(partial, pdf.data, true);
+    StringWriter writer;
+    partial.write(writer);
+    uPDFParser::Parser reparsed;
+    parse(reparsed, writer.data, false);
+    for (int objectId=1; objectId<=5; objectId++)
+    {
+	uPDFParser::Object* object = reparsed.getObject(objectId);
+	CHECK(object && object->str() == lazy.getObject(objectId)->str());
+    }
+}
+
+/**
+ * @brief Keep all objects given in streaming mode
+ */
+class ObjectCollector : public uPDFParser::ObjectHandler
+{
+public:
+    ~ObjectCollector()
+    {
+	for (size_t i=0; i<objects.size(); i++)
+	    delete objects[i];
+    }
+
+    virtual bool handleObject(uPDFParser::Object* object)
+    {
+	objects.push_back(object);
+	return true;
+    }
+
+    std::vector<uPDFParser::Object*> objects;
+};
+
+static void testIncrementalParsing()
+{
+    PDFBuilder pdf;
+    pdf.object(1, "<</Type/Catalog/Pages 2 0 R>>");
+    pdf.object(2, "<</Type/Pages/Kids[]/Count 0>>");
+    // Markers of complete items into stream data
+    std::string content = "endobj %%EOF\nendobj" + std::string(3000, 'x') + "endobj";
+    pdf.stream(3, "<</Length " + std::to_string(content.size()) + ">>", content);
+    pdf.object(4, "(string with endobj)");
+    pdf.xrefTable("<</Size 5/Root 1 0 R>>");
+    pdf.object(4, "(updated)");
+    pdf.xrefTable("<</Size 5/Root 1 0 R/Prev " + std::to_string((long long)pdf.xrefOffset) + ">>");
+
+    std::string documents[] = {pdf.data, xrefStreamPDF()};
+    size_t chunkSizes[] = {1, 7, 1000, 1 << 20};
+
+    for (int doc=0; doc<2; doc++)
+    {
+	const std::string& data = documents[doc];
+	uPDFParser::Parser whole;
+	ObjectCollector expected;
+	whole.parse((const unsigned char*)data.data(), data.size(), &expected);
+
+	for (int i=0; i<4; i++)
+	{
+	    uPDFParser::Parser parser;
+	    ObjectCollector collector;
+
+	    parser.beginPush(&collector);
+	    for (size_t offset=0; offset<data.size(); offset+=chunkSizes[i])
+		parser.push((const unsigned char*)data.data() + offset,
+			    std::min(chunkSizes[i], data.size() - offset));
+	    parser.endPush();
+
+	    // Objects are complete, and still valid once parsed data is discarded
+	    CHECK(collector.objects.size() == expected.objects.size());
+	    for (size_t j=0; j<collector.objects.size() && j<expected.objects.size(); j++)
+	    {
+		CHECK(collector.objects[j]->offset() == expected.objects[j]->offset());
+		CHECK(collector.objects[j]->str() == expected.objects[j]->str());
+		CHECK(collector.objects[j]->source() == 0);
+	    }
+	    CHECK(parser.getTrailer().str() == whole.getTrailer().str());
+	    CHECK(parser.xrefTable().size() == whole.xrefTable().size());
+	}
+    }
+
+    // Truncated document is only reported at the end
+    uPDFParser::Parser truncated;
+    ObjectCollector collector;
+    bool failed = false;
+    truncated.beginPush(&collector);
+    truncated.push((const unsigned char*)pdf.data.data(), pdf.offsets[3] + 10);
+    try
+    {
+	truncated.endPush();
+    }
+    catch(uPDFParser::Exception& e)
+    {
+	failed = true;
+    }
+    CHECK(failed && collector.objects.size() == 2);
+}
+
+static int selfTests()
+{
+    try
+    {
+	testXrefStream(false);
+	testXrefStream(true);
+	testXrefTable();
+	testCopyCleanObjects(false);
+	testCopyCleanObjects(true);
+	testInPlace();
+	testBorrowedInput();
+	testInputBounds();
+	testArena();
+	testLazyParsing();
+	testIncrementalParsing();
+    }
+    catch(uPDFParser::Exception& e)
+    {
+	std::cout << e.what() << std::endl;
+	failures++;
+    }
+
+    std::cout << (failures ? "Self tests failed" : "Self tests passed") << std::endl;
+
+    return failures ? -1 : 0;
+}
+
 int main(int argc, char** argv)
 {
     uPDFParser::Parser parser;
 
+    // Without argument, check parser against built-in documents
+    if (argc == 1)
+	return selfTests();
+
     if (argc != 2 || std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help")
     {
-        std::cout << "Usage : " << argv[0] << " <file>" << std::endl;
+        std::cout << "Usage : " << argv[0] << " [<file>]" << std::endl;
         return 0;
     }
 
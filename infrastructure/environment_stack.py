@@ -497,6 +497,8 @@ lambda_s3_policy = aws.iam.RolePolicy(
                             "s3:PutObjectAcl",
                             "s3:GetObject",
                             "s3:DeleteObject",
+                            # knock streams converted books with multipart uploads
+                            "s3:AbortMultipartUpload",
                         ],
                         "Resource": [f"{arns[0]}/*", f"{arns[1]}/*"],
                     },
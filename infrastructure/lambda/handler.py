@@ -10,6 +10,8 @@ Updated with digest-based deployment system for reliable container updates.
 import json
 import subprocess
 import os
+import re
+import select
 import tempfile
 
 import boto3
@@ -54,6 +56,270 @@ def _parse_knock_error(stderr: str) -> Optional[str]:
     return None
 
 
+class KnockServer:
+    """
+    Long running `knock --server` process, kept alive across warm invocations.
+
+    The server reuses the same DRM processor (device, activation and HTTP
+    connections) for every conversion. It reads one ACSM path per line on
+    stdin and answers with one JSON line on stdout; its logs go to stderr.
+    """
+
+    def __init__(self, knock_binary: str, env: Dict[str, str]):
+        self.process = subprocess.Popen(
+            [knock_binary, "--server"],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            text=True,
+            bufsize=1,
+            env=env,
+        )
+        response = self._read_response(timeout=60)
+        if response.get("status") != "ready":
+            self.stop()
+            raise RuntimeError(f"Unexpected knock server greeting: {response}")
+
+    def alive(self) -> bool:
+        return self.process.poll() is None
+
+    def convert(
+        self, acsm_path: str, timeout: int, upload_urls: Optional[str] = None
+    ) -> Dict[str, Any]:
+        line = f"{acsm_path}\t{upload_urls}" if upload_urls else acsm_path
+        self.process.stdin.write(line + "\n")
+        self.process.stdin.flush()
+        return self._read_response(timeout)
+
+    def _read_response(self, timeout: int) -> Dict[str, Any]:
+        ready, _, _ = select.select([self.process.stdout], [], [], timeout)
+        if not ready:
+            self.stop()
+            raise subprocess.TimeoutExpired(self.process.args, timeout)
+        line = self.process.stdout.readline()
+        if not line:
+            self.stop()
+            raise RuntimeError("knock server exited unexpectedly")
+        return json.loads(line)
+
+    def stop(self):
+        if self.alive():
+            self.process.kill()
+        self.process.wait()
+
+
+_knock_server: Optional[KnockServer] = None
+
+
+def _stop_knock_server():
+    """Stop the persistent knock server (e.g. after a credential reset)."""
+    global _knock_server
+    if _knock_server:
+        logger.info("Stopping knock server")
+        _knock_server.stop()
+        _knock_server = None
+
+
+def _run_knock(
+    knock_binary: str,
+    acsm_path: str,
+    cwd: str,
+    env: Dict[str, str],
+    timeout: int,
+    upload_urls: Optional[str] = None,
+) -> subprocess.CompletedProcess:
+    """
+    Convert an ACSM file, through the persistent knock server when possible.
+
+    Falls back to a one-shot knock process if server mode is disabled
+    (KNOCK_SERVER_MODE=0) or the server can't be started. The result mimics
+    subprocess.run(): on error, the knock error message is in stderr.
+    With upload_urls (see StreamedUpload), the book is sent to S3 instead
+    of being written in cwd.
+    """
+    global _knock_server
+
+    if os.environ.get("KNOCK_SERVER_MODE", "1") != "0":
+        try:
+            if _knock_server and not _knock_server.alive():
+                _stop_knock_server()
+            if not _knock_server:
+                logger.info("Starting knock server")
+                _knock_server = KnockServer(knock_binary, env)
+
+            response = _knock_server.convert(acsm_path, timeout, upload_urls)
+            logger.info(f"Knock server response: {response}")
+            if response.get("status") == "ok":
+                if response.get("uploaded"):
+                    # Same message as a one-shot knock
+                    stdout = f"{response['uploaded'].upper()} file uploaded ({response.get('size')} bytes)"
+                else:
+                    stdout = f"File generated at {response.get('file')}"
+                return subprocess.CompletedProcess(
+                    knock_binary, 0, stdout=stdout, stderr=""
+                )
+            return subprocess.CompletedProcess(
+                knock_binary, 1, stdout="", stderr=response.get("error", "")
+            )
+        except subprocess.TimeoutExpired:
+            _knock_server = None
+            raise
+        except Exception as e:
+            logger.warning(f"Knock server unavailable ({e}), running knock once")
+            _stop_knock_server()
+
+    metrics_path = os.path.join(cwd, "knock-metrics.json")
+    upload_args = ["--upload", upload_urls] if upload_urls else []
+    result = subprocess.run(
+        [knock_binary, "--metrics-json", metrics_path, *upload_args, acsm_path],
+        cwd=cwd,
+        capture_output=True,
+        text=True,
+        timeout=timeout,
+        env=env,  # Use environment with updated LD_LIBRARY_PATH
+    )
+    # Per phase timings (server responses already include them)
+    try:
+        with open(metrics_path) as f:
+            logger.info(f"Knock metrics: {f.read().strip()}")
+    except OSError:
+        pass
+    return result
+
+
+def _s3_client():
+    """
+    S3 client and region. Presigned URLs must use the regional endpoint
+    (see _regional_url()), the global one causes redirects.
+    """
+    region = os.environ.get("AWS_REGION", "us-east-2")
+    s3_config = Config(
+        signature_version="s3v4",
+        s3={
+            "addressing_style": "virtual",  # Use virtual-hosted style (bucket.s3.region.amazonaws.com)
+            "use_accelerate_endpoint": False,
+            "payload_signing_enabled": True,
+        },
+    )
+    return boto3.client("s3", region_name=region, config=s3_config), region
+
+
+def _regional_url(url: str, region: str) -> str:
+    return url.replace(".s3.amazonaws.com/", f".s3.{region}.amazonaws.com/")
+
+
+class StreamedUpload:
+    """
+    Multipart uploads knock streams the DRM-free book to (knock --upload),
+    so it is never written to /tmp nor read back.
+
+    The book type is only known once fulfilled: an upload is created for
+    each type, the unused (or failed) ones are aborted by abort_pending().
+    Parts are KNOCK_UPLOAD_PART_MB (default 16) MiB, the last one of the
+    KNOCK_UPLOAD_MAX_PARTS (default 64) takes whatever remains up to the
+    part size: knock fails on books bigger than all parts (1 GiB by default).
+    """
+
+    EXTENSIONS = (".pdf", ".epub")
+    UPLOADED_RE = re.compile(r"(PDF|EPUB) file uploaded \((\d+) bytes\)")
+
+    def __init__(self, bucket: str, original_base: str, tmp_dir: str):
+        self.s3, self.region = _s3_client()
+        self.bucket = bucket
+        self.uploads: Dict[str, Dict[str, str]] = {}
+        part_size = int(os.environ.get("KNOCK_UPLOAD_PART_MB", "16")) * 1024 * 1024
+        max_parts = int(os.environ.get("KNOCK_UPLOAD_MAX_PARTS", "64"))
+        self.urls_file = os.path.join(tmp_dir, "upload-urls.txt")
+
+        lines = [f"part-size {part_size}"]
+        try:
+            for ext in self.EXTENSIONS:
+                key = f"converted/{_sanitize_key_component(original_base)}{ext}"
+                upload_id = self.s3.create_multipart_upload(
+                    Bucket=bucket, Key=key
+                )["UploadId"]
+                self.uploads[ext] = {"key": key, "upload_id": upload_id}
+                params = {"Bucket": bucket, "Key": key, "UploadId": upload_id}
+                for number in range(1, max_parts + 1):
+                    url = self.s3.generate_presigned_url(
+                        "upload_part",
+                        Params={**params, "PartNumber": number},
+                        ExpiresIn=3600,
+                    )
+                    lines.append(f"{ext[1:]} part {_regional_url(url, self.region)}")
+                url = self.s3.generate_presigned_url(
+                    "complete_multipart_upload", Params=params, ExpiresIn=3600
+                )
+                lines.append(f"{ext[1:]} complete {_regional_url(url, self.region)}")
+        except Exception:
+            self.abort_pending()
+            raise
+
+        with open(self.urls_file, "w") as f:
+            f.write("\n".join(lines) + "\n")
+
+    def uploaded(self, stdout: str) -> Optional[Dict[str, Union[str, int]]]:
+        """Type and size of the book knock reports as uploaded, if any."""
+        match = self.UPLOADED_RE.search(stdout or "")
+        if not match:
+            return None
+        ext = "." + match.group(1).lower()
+        upload = self.uploads.pop(ext)
+        return {"ext": ext, "key": upload["key"], "size": int(match.group(2))}
+
+    def abort_pending(self):
+        for ext, upload in list(self.uploads.items()):
+            try:
+                self.s3.abort_multipart_upload(
+                    Bucket=self.bucket, Key=upload["key"], UploadId=upload["upload_id"]
+                )
+            except Exception as e:
+                logger.warning(f"Unable to abort upload of {upload['key']}: {e}")
+            del self.uploads[ext]
+
+    def handle_output(
+        self, stdout: str, original_base: str, original_acsm_filename: str
+    ) -> Optional[Dict[str, Any]]:
+        """Same response as _handle_s3_output(), None if nothing was uploaded."""
+        uploaded = self.uploaded(stdout)
+        self.abort_pending()
+        if not uploaded:
+            return None
+
+        key_filename = f"{_sanitize_key_component(original_base)}{uploaded['ext']}"
+        logger.info(f"✓ File streamed to S3: {uploaded['key']} ({uploaded['size']} bytes)")
+        presigned_url = _regional_url(
+            self.s3.generate_presigned_url(
+                ClientMethod="get_object",
+                Params={"Bucket": self.bucket, "Key": uploaded["key"]},
+                ExpiresIn=3600,  # 1 hour
+                HttpMethod="GET",
+            ),
+            self.region,
+        )
+        output_files = [
+            {
+                "filename": key_filename,
+                "s3_key": uploaded["key"],
+                "download_url": presigned_url,
+                "size_bytes": uploaded["size"],
+                "source_acsm_filename": original_acsm_filename,
+            }
+        ]
+        return {
+            "statusCode": 200,
+            "headers": {"Content-Type": "application/json"},
+            "body": json.dumps(
+                {
+                    "message": "Conversion successful",
+                    "output_files": output_files,
+                    "files_count": len(output_files),
+                    "stdout": stdout,
+                    "source_acsm_filename": original_acsm_filename,
+                }
+            ),
+        }
+
+
 def _reset_device_credentials_in_s3():
     """
     Delete device credentials from S3 to force regeneration.
@@ -506,6 +772,9 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
     logger.info(f"Function version: {context.function_version if context else 'N/A'}")
     logger.info(f"Memory limit: {context.memory_limit_in_mb if context else 'N/A'} MB")
 
+    # Multipart uploads knock streams the book to, aborted if unused
+    streamed_upload: Optional[StreamedUpload] = None
+
     try:
         # Parse the request body first to validate inputs early
         if "body" in event and event["body"]:
@@ -678,15 +947,30 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
             logger.info(f"ACSM path: {acsm_path}")
             logger.info(f"Working directory: {tmp_dir}")
 
+            # Stream the book straight to S3 instead of /tmp (KNOCK_STREAM_UPLOAD=0 disables it)
+            output_bucket = os.environ.get("OUTPUT_BUCKET")
+            upload_urls = None
+            if output_bucket and os.environ.get("KNOCK_STREAM_UPLOAD", "1") != "0":
+                try:
+                    streamed_upload = StreamedUpload(
+                        output_bucket, original_base, tmp_dir
+                    )
+                    upload_urls = streamed_upload.urls_file
+                except Exception as e:
+                    logger.warning(
+                        f"Streamed upload unavailable ({e}), uploading from /tmp"
+                    )
+                    streamed_upload = None
+
             # Execute Knock conversion
             try:
-                result = subprocess.run(
-                    [knock_binary, acsm_path],
-                    cwd=tmp_dir,
-                    capture_output=True,
-                    text=True,
+                result = _run_knock(
+                    knock_binary,
+                    acsm_path,
+                    tmp_dir,
+                    env,
                     timeout=600,  # 10 minute timeout
-                    env=env,  # Use environment with updated LD_LIBRARY_PATH
+                    upload_urls=upload_urls,
                 )
 
                 # Sync device credentials immediately after first run
@@ -736,7 +1020,8 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
                         "Detected E_ADEPT_REQUEST_EXPIRED - resetting credentials and retrying..."
                     )
 
-                    # Reset credentials
+                    # Reset credentials (the knock server still holds the old ones)
+                    _stop_knock_server()
                     if not activate_device_with_adept(force_reset=True):
                         return {
                             "statusCode": 500,
@@ -753,13 +1038,13 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
                     # Retry the conversion
                     logger.info("Retrying Knock conversion with fresh credentials...")
                     try:
-                        result = subprocess.run(
-                            [knock_binary, acsm_path],
-                            cwd=tmp_dir,
-                            capture_output=True,
-                            text=True,
+                        result = _run_knock(
+                            knock_binary,
+                            acsm_path,
+                            tmp_dir,
+                            env,
                             timeout=600,
-                            env=env,
+                            upload_urls=upload_urls,
                         )
 
                         # Sync new credentials
@@ -814,8 +1099,13 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
                     }
 
             # Handle output files
-            output_bucket = os.environ.get("OUTPUT_BUCKET")
             if output_bucket:
+                if streamed_upload:
+                    response = streamed_upload.handle_output(
+                        result.stdout, original_base, original_acsm_filename
+                    )
+                    if response:
+                        return response
                 return _handle_s3_output(
                     tmp_dir,
                     output_bucket,
@@ -855,6 +1145,10 @@ def lambda_handler(event: Dict[str, Any], context: Any) -> Dict[str, Any]:
             ),
         }
 
+    finally:
+        if streamed_upload:
+            streamed_upload.abort_pending()
+
 
 def _handle_s3_output(
     tmp_dir: str,
@@ -879,19 +1173,7 @@ def _handle_s3_output(
     try:
         # Create S3 client with regional endpoint configuration
         # This ensures presigned URLs use the regional endpoint instead of the global one
-        region = os.environ.get("AWS_REGION", "us-east-2")
-
-        # Configure S3 client to use regional endpoint
-        s3_config = Config(
-            signature_version="s3v4",
-            s3={
-                "addressing_style": "virtual",  # Use virtual-hosted style (bucket.s3.region.amazonaws.com)
-                "use_accelerate_endpoint": False,
-                "payload_signing_enabled": True,
-            },
-        )
-
-        s3 = boto3.client("s3", region_name=region, config=s3_config)
+        s3, region = _s3_client()
         output_files: List[Dict[str, Union[str, int]]] = []
 
         # Find generated files (PDF/EPUB)
@@ -926,9 +1208,7 @@ def _handle_s3_output(
                     # Fix the endpoint to use regional S3 endpoint
                     # boto3 generates URLs with s3.amazonaws.com which causes redirects
                     # Replace with the regional endpoint
-                    presigned_url = presigned_url.replace(
-                        ".s3.amazonaws.com/", f".s3.{region}.amazonaws.com/"
-                    )
+                    presigned_url = _regional_url(presigned_url, region)
 
                     logger.info(f"✓ Presigned URL generated")
                     logger.info(f"URL (first 100 chars): {presigned_url[:100]}...")
@@ -1,16 +1,29 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <openssl/opensslv.h>
 #include <openssl/crypto.h>
 #include <curl/curl.h>
+#include <uPDFParser.h>
 #include "drmprocessorclientimpl.h"
 #include "libgourou.h"
 #include "libgourou_common.h"
+#include "libgourou_log.h"
+#include "metrics.h"
+#include "s3_upload.h"
 
 // Filesystem compatibility functions for older GCC
 namespace fs_compat {
@@ -62,140 +75,919 @@ namespace fs_compat {
 #error KNOCK_VERSION must be defined
 #endif
 
+// an encrypted file downloaded by fetch_acsm(), waiting for remove_drm()
+struct DownloadedItem {
+  std::string acsm_file;
+  std::string acsm_stem;
+  std::string drm_file;
+  gourou::DRMProcessor::ITEM_TYPE type;
+};
+
+// S3 requests of S3UploadWriter, sent by the client shared with DRM processors
+class CurlS3Requests : public S3Requests {
+public:
+  CurlS3Requests(DRMProcessorClientImpl &client) : client(client) {}
+
+  virtual std::string put(const std::string &url, const char *data, size_t size) {
+    DRMProcessorClientImpl::TransferContext transfer;
+    std::map<std::string, std::string> headers;
+    client.uploadHTTPRequest(transfer, url, (const unsigned char *)data, size, &headers);
+    return headers["Etag"];
+  }
+
+  virtual std::string post(const std::string &url, const std::string &request) {
+    DRMProcessorClientImpl::TransferContext transfer;
+    return client.sendHTTPRequest(transfer, url, request, "application/xml");
+  }
+
+private:
+  DRMProcessorClientImpl &client;
+};
+
+// phases and counters of all processors, see --metrics-json
+gourou::Metrics metrics;
+std::string metrics_file;
+
 std::string get_data_dir();
 void verify_absence(std::string file);
 void verify_presence(std::string file);
+void verify_acsm(const std::string &acsm_file);
+gourou::DRMProcessor *create_processor(DRMProcessorClientImpl &client,
+                                       const std::string &data_dir);
+void sign_in_and_activate(gourou::DRMProcessor *processor);
+std::string convert_acsm(gourou::DRMProcessor *processor,
+                         const std::string &acsm_file);
+DownloadedItem fetch_acsm(gourou::DRMProcessor *processor,
+                          const std::string &acsm_file);
+std::string remove_drm(gourou::DRMProcessor *processor,
+                       const DownloadedItem &downloaded);
+std::map<std::string, UploadURLs> read_upload_urls(const std::string &upload_file);
+std::string convert_acsm_to_s3(gourou::DRMProcessor *processor,
+                               DRMProcessorClientImpl &client,
+                               const std::string &acsm_file,
+                               const std::string &upload_file, uint64_t *size);
+int run_batch(DRMProcessorClientImpl &client, const std::string &data_dir,
+              int argc, char **argv);
+int run_remove(DRMProcessorClientImpl &client, const std::string &data_dir,
+               int argc, char **argv);
+std::vector<std::string> read_manifest(const std::string &manifest_file);
+int run_server(DRMProcessorClientImpl &client, const std::string &data_dir);
+void print_connection_stats(DRMProcessorClientImpl &client);
+void print_transfer_stats(DRMProcessorClientImpl &client);
+void setup_logging();
+void add_http_metrics(DRMProcessorClientImpl &client);
+void finish_metrics(DRMProcessorClientImpl &client);
+void write_metrics(DRMProcessorClientImpl &client);
+
+// writes the --metrics-json file when leaving main(), even on failure
+struct MetricsReport {
+  DRMProcessorClientImpl &client;
+  ~MetricsReport() { write_metrics(client); }
+};
+// the book download is the last request issued by the calling thread
+void print_transfer_stats(DRMProcessorClientImpl &client) {
+  DRMProcessorClientImpl::TransferStats stats = client.getLastTransferStats();
+  GOUROU_LOG(DEBUG, "Download: " << stats.bytesReceived << " bytes in "
+                    << stats.time << "s (" << (uint64_t)(stats.throughput() / 1024)
+                    << " KiB/s), attempts: " << stats.attempts);
+}
+
+std::string json_escape(const std::string &str);
 
 int main(int argc, char **argv) try {
+  setup_logging();
+
+  // --metrics-json FILE is accepted in every mode, --upload FILE by the
+  // single ACSM one
+  std::string upload_file;
+  for (int i = 1; i < argc;) {
+    const std::string arg = argv[i];
+    if (arg != "--metrics-json" && arg != "--upload") {
+      i++;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      throw std::invalid_argument(arg + " requires a value");
+    }
+    (arg == "--upload" ? upload_file : metrics_file) = argv[i + 1];
+    for (int j = i; j + 2 <= argc; j++) {
+      argv[j] = argv[j + 2];
+    }
+    argc -= 2;
+  }
+
   // Print version information for debugging
-  std::cerr << "[DEBUG] Knock version: " KNOCK_VERSION << std::endl;
-  std::cerr << "[DEBUG] libgourou version: " LIBGOUROU_VERSION << std::endl;
-  std::cerr << "[DEBUG] OpenSSL version: " << OPENSSL_VERSION_TEXT << std::endl;
-  std::cerr << "[DEBUG] libcurl version: " << curl_version() << std::endl;
+  GOUROU_LOG(DEBUG, "Knock version: " KNOCK_VERSION);
+  GOUROU_LOG(DEBUG, "libgourou version: " LIBGOUROU_VERSION);
+  GOUROU_LOG(DEBUG, "OpenSSL version: " << OPENSSL_VERSION_TEXT);
+  GOUROU_LOG(DEBUG, "libcurl version: " << curl_version());
   
   // Check if running in Lambda
   const char* lambda_root = std::getenv("LAMBDA_TASK_ROOT");
   const char* aws_region = std::getenv("AWS_REGION");
   if (lambda_root) {
-    std::cerr << "[DEBUG] Running in AWS Lambda" << std::endl;
-    std::cerr << "[DEBUG] LAMBDA_TASK_ROOT: " << lambda_root << std::endl;
+    GOUROU_LOG(DEBUG, "Running in AWS Lambda");
+    GOUROU_LOG(DEBUG, "LAMBDA_TASK_ROOT: " << lambda_root);
   }
   if (aws_region) {
-    std::cerr << "[DEBUG] AWS_REGION: " << aws_region << std::endl;
+    GOUROU_LOG(DEBUG, "AWS_REGION: " << aws_region);
   }
   
   if (argc == 1) {
     std::cout << "info: knock version " KNOCK_VERSION ", libgourou version " LIBGOUROU_VERSION "\n"
-      "usage: " << argv[0] << " [ACSM]\n"
-      "result: converts ACSM to a plain PDF/EPUB if present, otherwise prints this" << std::endl;
+      "usage: " << argv[0] << " [--upload URLS] [ACSM]\n"
+      "       " << argv[0] << " --server\n"
+      "       " << argv[0] << " --batch [--jobs N] [--manifest FILE] [ACSM...]\n"
+      "       " << argv[0] << " --remove FILE [--key HEX] [--output FILE]\n"
+      "       " << argv[0] << " --metrics-json FILE ...\n"
+      "result: converts ACSM to a plain PDF/EPUB if present, otherwise prints this\n"
+      "upload: the PDF/EPUB is not written on disk but sent to S3 while produced,\n"
+      "URLS is a file of pre-signed URLs, one \"<pdf|epub> put URL\" line or\n"
+      "\"<pdf|epub> part URL\" lines (in part order) and a \"<pdf|epub> complete URL\"\n"
+      "line for a multipart upload, optionally \"part-size BYTES\" (default 8MiB)\n"
+      "server mode: reads one ACSM path per line on stdin and writes one JSON\n"
+      "result per line on stdout, reusing the same activated device. An URLS\n"
+      "file can follow the ACSM path, separated by a tab\n"
+      "batch mode: converts every ACSM given on the command line or listed (one\n"
+      "path per line) in the manifest, downloading the next files while DRM is\n"
+      "removed from the previous ones on up to N threads (default: number of cores)\n"
+      "remove mode: only removes DRM from an already downloaded file (.drm), with\n"
+      "the given book key (16 bytes, hex) or the one cached from a previous\n"
+      "conversion, or else the activated device key. No request is sent to Adobe\n"
+      "metrics: time spent in each phase (sign in, fulfill, download, parsing,\n"
+      "decryption, writing...) and counters are written as JSON into FILE on exit\n"
+      "(and added to each result in server mode)"
+      << std::endl;
     return 0;
   }
 
-  if (argc != 2) {
+  const bool batch = std::string(argv[1]) == "--batch";
+  const bool remove_only = std::string(argv[1]) == "--remove";
+
+  if (argc != 2 && !batch && !remove_only) {
     throw std::invalid_argument("the ACSM file must be passed as the sole argument");
   }
+  if (!upload_file.empty() && (batch || remove_only || std::string(argv[1]) == "--server")) {
+    throw std::invalid_argument("--upload is only supported when converting one ACSM file");
+  }
   
   // Ensure data directory exists
   std::string data_dir = get_data_dir();
   fs_compat::create_directories(data_dir);
 
+  DRMProcessorClientImpl client;
+  // big books are fetched with concurrent range requests when the server allows it
+  client.setDownloadConnections(4);
+  MetricsReport report{client};
+
+  if (std::string(argv[1]) == "--server") {
+    return run_server(client, data_dir);
+  }
+
+  if (batch) {
+    return run_batch(client, data_dir, argc, argv);
+  }
+
+  if (remove_only) {
+    return run_remove(client, data_dir, argc, argv);
+  }
+
   const std::string acsm_file = argv[1];
-  const std::string acsm_stem = acsm_file.substr(0, acsm_file.find_last_of("."));
-  const std::string drm_file = acsm_stem + ".drm";
-  const std::string pdf_file = acsm_stem + ".pdf";
-  const std::string epub_file = acsm_stem + ".epub";
-  verify_presence(acsm_file);
-  verify_absence(drm_file);
-  verify_absence(pdf_file);
-  verify_absence(epub_file);
+  verify_acsm(acsm_file);
+
+  gourou::DRMProcessor *processor = create_processor(client, data_dir);
 
-  std::cerr << "[DEBUG] Creating DRM processor with data_dir: " << data_dir << std::endl;
+  try {
+    sign_in_and_activate(processor);
+    if (upload_file.empty()) {
+      convert_acsm(processor, acsm_file);
+    } else {
+      uint64_t size = 0;
+      convert_acsm_to_s3(processor, client, acsm_file, upload_file, &size);
+    }
+    print_transfer_stats(client);
+  } catch (...) {
+    // Clean up processor before rethrowing
+    delete processor;
+    throw;
+  }
+  
+  print_connection_stats(client);
+
+  // Clean up processor
+  delete processor;
+  return 0;
+} catch (const gourou::Exception &e) {
+  gourou::getLogSink()->flush();
+  std::cerr << "gourou library error: " << e.what() << std::endl;
+  std::cerr << "This typically indicates an issue with Adobe DRM processing." << std::endl;
+  return 1;
+} catch (const std::runtime_error &e) {
+  gourou::getLogSink()->flush();
+  std::cerr << "filesystem error: " << e.what() << std::endl;
+  std::cerr << "Check file permissions and available disk space." << std::endl;
+  return 1;
+} catch (const std::exception &e) {
+  gourou::getLogSink()->flush();
+  std::cerr << "error: " << e.what() << std::endl;
+  return 1;
+}
+
+gourou::DRMProcessor *create_processor(DRMProcessorClientImpl &client,
+                                       const std::string &data_dir) {
+  GOUROU_LOG(DEBUG, "Creating DRM processor with data_dir: " << data_dir);
   
-  DRMProcessorClientImpl client;
   gourou::DRMProcessor *processor = nullptr;
   
   try {
+    gourou::MetricsSpan span(&metrics, "createDRMProcessor");
     processor = gourou::DRMProcessor::createDRMProcessor(
         &client,
         false, // don't "always generate a new device" (default)
         data_dir
     );
-    std::cerr << "[DEBUG] DRM processor created successfully" << std::endl;
+    span.stop();
+    GOUROU_LOG(DEBUG, "DRM processor created successfully");
+    processor->setMetrics(&metrics);
+    // pdf drm is removed object by object to keep memory bounded
+    processor->setPDFStreamingMode(true);
+    // decrypt pdf objects and epub files on all available cores
+    processor->setDecryptionThreads(0);
+    // images and other compressed epub resources are not deflated again
+    processor->setStoreCompressedResources(true);
+    // books already seen (re-downloads, batch runs) skip the rsa key decryption
+    processor->setBookKeyCache(256, data_dir + "/bookkeys");
   } catch (const std::exception& e) {
-    std::cerr << "[ERROR] Failed to create DRM processor: " << e.what() << std::endl;
+    GOUROU_LOG(ERROR, "Failed to create DRM processor: " << e.what());
     throw;
   }
 
+  return processor;
+}
+
+void sign_in_and_activate(gourou::DRMProcessor *processor) {
+  // a previous run already left usable credentials in activation.xml
+  if (processor->hasValidActivation()) {
+    GOUROU_LOG(DEBUG, "Reusing existing activation, skipping signIn()/activateDevice()");
+    return;
+  }
+
   std::cout << "anonymously signing in..." << std::endl;
-  std::cerr << "[DEBUG] Calling signIn()..." << std::endl;
+  GOUROU_LOG(DEBUG, "Calling signIn()...");
   try {
     processor->signIn("anonymous", "");
-    std::cerr << "[DEBUG] signIn() completed" << std::endl;
+    GOUROU_LOG(DEBUG, "signIn() completed");
   } catch (const std::exception& e) {
-    std::cerr << "[ERROR] signIn() failed: " << e.what() << std::endl;
-    delete processor;
+    GOUROU_LOG(ERROR, "signIn() failed: " << e.what());
     throw;
   }
   
-  std::cerr << "[DEBUG] Calling activateDevice()..." << std::endl;
+  GOUROU_LOG(DEBUG, "Calling activateDevice()...");
   try {
     processor->activateDevice();
-    std::cerr << "[DEBUG] activateDevice() completed" << std::endl;
+    GOUROU_LOG(DEBUG, "activateDevice() completed");
   } catch (const std::exception& e) {
-    std::cerr << "[ERROR] activateDevice() failed: " << e.what() << std::endl;
-    delete processor;
+    GOUROU_LOG(ERROR, "activateDevice() failed: " << e.what());
+    throw;
+  }
+}
+
+void verify_acsm(const std::string &acsm_file) {
+  const std::string acsm_stem = acsm_file.substr(0, acsm_file.find_last_of("."));
+  verify_presence(acsm_file);
+  verify_absence(acsm_stem + ".drm");
+  verify_absence(acsm_stem + ".drmfree");
+  verify_absence(acsm_stem + ".pdf");
+  verify_absence(acsm_stem + ".epub");
+}
+
+// returns the path of the generated PDF/EPUB file, verify_acsm() must be
+// called first
+std::string convert_acsm(gourou::DRMProcessor *processor,
+                         const std::string &acsm_file) {
+  const std::string acsm_stem = acsm_file.substr(0, acsm_file.find_last_of("."));
+  // type is only known once downloaded, file is renamed afterwards
+  const std::string drm_free_file = acsm_stem + ".drmfree";
+  const std::string pdf_file = acsm_stem + ".pdf";
+  const std::string epub_file = acsm_stem + ".epub";
+
+  std::cout << "downloading the file from Adobe..." << std::endl;
+  gourou::FulfillmentItem *item = processor->fulfill(acsm_file);
+  gourou::DRMProcessor::ITEM_TYPE type;
+  std::cout << "downloading the file and removing its DRM..." << std::endl;
+  try {
+    // book key comes from the rights, they're not injected into the file
+    type = processor->downloadAndRemoveDRM(item, drm_free_file);
+  } catch (...) {
+    delete item;
     throw;
   }
+  delete item;
+
+  switch (type) {
+  case gourou::DRMProcessor::ITEM_TYPE::PDF:
+    fs_compat::rename_file(drm_free_file, pdf_file);
+    fs_compat::remove_file(acsm_file);
+    std::cout << "PDF file generated at " << pdf_file << std::endl;
+    return pdf_file;
+  case gourou::DRMProcessor::ITEM_TYPE::EPUB:
+    fs_compat::rename_file(drm_free_file, epub_file);
+    fs_compat::remove_file(acsm_file);
+    std::cout << "EPUB file generated at " << epub_file << std::endl;
+    return epub_file;
+  default:
+    fs_compat::remove_file(drm_free_file);
+    throw std::domain_error("the downloaded file is not a PDF nor an EPUB");
+  }
+}
+
+// network part of the conversion : fulfill the ACSM and download the
+// encrypted file next to it
+DownloadedItem fetch_acsm(gourou::DRMProcessor *processor,
+                          const std::string &acsm_file) {
+  DownloadedItem downloaded;
+  downloaded.acsm_file = acsm_file;
+  downloaded.acsm_stem = acsm_file.substr(0, acsm_file.find_last_of("."));
+  downloaded.drm_file = downloaded.acsm_stem + ".drm";
 
   std::cout << "downloading the file from Adobe..." << std::endl;
   gourou::FulfillmentItem *item = processor->fulfill(acsm_file);
-  gourou::DRMProcessor::ITEM_TYPE type = processor->download(item, drm_file);
+  try {
+    downloaded.type = processor->download(item, downloaded.drm_file);
+  } catch (...) {
+    delete item;
+    throw;
+  }
+  delete item;
+
+  return downloaded;
+}
+
+// local (CPU bound) part of the conversion, returns the path of the
+// generated PDF/EPUB file
+std::string remove_drm(gourou::DRMProcessor *processor,
+                       const DownloadedItem &downloaded) {
+  const std::string &acsm_file = downloaded.acsm_file;
+  const std::string &drm_file = downloaded.drm_file;
+  const std::string pdf_file = downloaded.acsm_stem + ".pdf";
+  const std::string epub_file = downloaded.acsm_stem + ".epub";
+
+  std::cout << "removing DRM from the file..." << std::endl;
+  switch (downloaded.type) {
+  case gourou::DRMProcessor::ITEM_TYPE::PDF: {
+    // for pdfs the function moves the pdf while removing drm
+    processor->removeDRM(drm_file, pdf_file, downloaded.type);
+    std::cout << "downloaded pdf" << std::endl;
+    fs_compat::remove_file(drm_file);
+    fs_compat::remove_file(acsm_file);
+    std::cout << "PDF file generated at " << pdf_file << std::endl;
+    return pdf_file;
+  }
+  case gourou::DRMProcessor::ITEM_TYPE::EPUB: {
+    // for epubs the drm is removed in-place so in == out
+    processor->removeDRM(drm_file, drm_file, downloaded.type);
+    std::cout << "downloaded epub" << std::endl;
+    fs_compat::rename_file(drm_file, epub_file);
+    fs_compat::remove_file(acsm_file);
+    std::cout << "EPUB file generated at " << epub_file << std::endl;
+    return epub_file;
+  }
+  default:
+    throw std::domain_error("the downloaded file is not a PDF nor an EPUB");
+  }
+}
+
+// Lines are "<type> <kind> <url>" (see usage), blank and # lines are ignored
+std::map<std::string, UploadURLs> read_upload_urls(const std::string &upload_file) {
+  std::ifstream file(upload_file);
+  if (!file) {
+    throw std::runtime_error("unable to read " + upload_file);
+  }
+
+  std::map<std::string, UploadURLs> uploads;
+  size_t part_size = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    const size_t first = line.find(' ');
+    const size_t second = line.find(' ', first == std::string::npos ? first : first + 1);
+    const std::string type = line.substr(0, first);
+    if (type == "part-size" && first != std::string::npos) {
+      part_size = std::strtoull(line.c_str() + first + 1, nullptr, 10);
+      // S3 minimum size of all parts but the last one
+      if (part_size < 5 * 1024 * 1024) {
+        throw std::invalid_argument("part-size must be at least 5MiB in " + upload_file);
+      }
+      continue;
+    }
+    if ((type != "pdf" && type != "epub") || second == std::string::npos) {
+      throw std::invalid_argument("invalid line in " + upload_file + ": " + line.substr(0, 32));
+    }
+    const std::string kind = line.substr(first + 1, second - first - 1);
+    const std::string url = line.substr(second + 1);
+    UploadURLs &urls = uploads[type];
+    if (kind == "put") {
+      urls.put_url = url;
+    } else if (kind == "part") {
+      urls.part_urls.push_back(url);
+    } else if (kind == "complete") {
+      urls.complete_url = url;
+    } else {
+      throw std::invalid_argument("invalid URL kind in " + upload_file + ": " + kind);
+    }
+  }
+
+  for (auto &upload : uploads) {
+    UploadURLs &urls = upload.second;
+    if (part_size) {
+      urls.part_size = part_size;
+    }
+    if (urls.put_url.empty() == (urls.part_urls.empty() || urls.complete_url.empty())) {
+      throw std::invalid_argument(upload.first + " upload of " + upload_file +
+                                  " needs either a put URL or part and complete URLs");
+    }
+  }
+  return uploads;
+}
+
+// Same as convert_acsm(), but DRM is removed while the encrypted file is
+// downloaded and the DRM free one is sent to the pre-signed URLs of
+// upload_file as it is produced : nothing but the ACSM file is on disk and
+// only the parts being sent are in memory. Returns the uploaded type (pdf/epub)
+std::string convert_acsm_to_s3(gourou::DRMProcessor *processor,
+                               DRMProcessorClientImpl &client,
+                               const std::string &acsm_file,
+                               const std::string &upload_file, uint64_t *size) {
+  std::map<std::string, UploadURLs> uploads = read_upload_urls(upload_file);
+
+  std::cout << "downloading the file from Adobe, removing DRM and uploading it..." << std::endl;
+  gourou::FulfillmentItem *item = processor->fulfill(acsm_file);
+  CurlS3Requests requests(client);
+  S3UploadWriter writer(requests, uploads, &metrics);
+  gourou::DRMProcessor::ITEM_TYPE type;
+  try {
+    type = processor->downloadAndRemoveDRM(item, writer);
+  } catch (...) {
+    delete item;
+    throw;
+  }
+  delete item;
+  *size = writer.finish();
+
+  fs_compat::remove_file(acsm_file);
+  std::cout << (type == gourou::DRMProcessor::ITEM_TYPE::PDF ? "PDF" : "EPUB")
+            << " file uploaded (" << *size << " bytes)" << std::endl;
+  return writer.type();
+}
+
+// Offline mode : DRM is removed from a file downloaded earlier (kept .drm
+// file, retries, another worker...). The book key is either given or found
+// in the book key cache by the processor, which falls back to the device
+// key. The processor only reads the local activation, no request is sent.
+int run_remove(DRMProcessorClientImpl &client, const std::string &data_dir,
+               int argc, char **argv) {
+  std::string input_file;
+  std::string output_file;
+  gourou::ByteArray key;
+
+  for (int i = 2; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--key" || arg == "--output") {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument(arg + " requires a value");
+      }
+      std::string value = argv[++i];
+      if (arg == "--output") {
+        output_file = value;
+        continue;
+      }
+      if (value.compare(0, 2, "0x") == 0) {
+        value = value.substr(2);
+      }
+      if (value.size() != 32) {
+        throw std::invalid_argument("the book key must be 16 bytes (32 hex digits)");
+      }
+      key = gourou::ByteArray::fromHex(value);
+    } else if (input_file.empty()) {
+      input_file = arg;
+    } else {
+      throw std::invalid_argument("only one file can be passed in remove mode");
+    }
+  }
+
+  if (input_file.empty()) {
+    throw std::invalid_argument("no file to remove DRM from");
+  }
+  verify_presence(input_file);
+
+  // the file content tells its type, .drm files have no meaningful extension
+  char magic[4] = {0};
+  std::ifstream(input_file, std::ios::binary).read(magic, sizeof(magic));
+  gourou::DRMProcessor::ITEM_TYPE type;
+  if (!memcmp(magic, "%PDF", 4)) {
+    type = gourou::DRMProcessor::ITEM_TYPE::PDF;
+  } else if (!memcmp(magic, "PK", 2)) {
+    type = gourou::DRMProcessor::ITEM_TYPE::EPUB;
+  } else {
+    throw std::domain_error("the file " + input_file + " is not a PDF nor an EPUB");
+  }
+
+  if (output_file.empty()) {
+    output_file = input_file.substr(0, input_file.find_last_of(".")) +
+      (type == gourou::DRMProcessor::ITEM_TYPE::PDF ? ".pdf" : ".epub");
+  }
+  if (output_file == input_file) {
+    throw std::invalid_argument("the output file must differ from " + input_file);
+  }
+  verify_absence(output_file);
+
+  // without activation, createDRMProcessor() would fetch the service info
+  if (!fs_compat::exists(data_dir + "/activation.xml")) {
+    throw std::runtime_error("no activated device in " + data_dir +
+                             ", run a conversion first or copy its data directory");
+  }
+  gourou::DRMProcessor *processor = create_processor(client, data_dir);
 
   std::cout << "removing DRM from the file..." << std::endl;
-  int result = 0;
   try {
-    switch (type) {
-    case gourou::DRMProcessor::ITEM_TYPE::PDF: {
-      // for pdfs the function moves the pdf while removing drm
-      processor->removeDRM(drm_file, pdf_file, type);
-            std::cout << "downloaded pdf" << std::endl;
-      fs_compat::remove_file(drm_file);
-      fs_compat::remove_file(acsm_file);
-      std::cout << "PDF file generated at " << pdf_file << std::endl;
-      break;
-    }
-    case gourou::DRMProcessor::ITEM_TYPE::EPUB: {
-      // for epubs the drm is removed in-place so in == out
-      processor->removeDRM(drm_file, drm_file, type);
-      std::cout << "downloaded epub" << std::endl;
-      fs_compat::rename_file(drm_file, epub_file);
-      fs_compat::remove_file(acsm_file);
-      std::cout << "EPUB file generated at " << epub_file << std::endl;
-      break;
+    if (type == gourou::DRMProcessor::ITEM_TYPE::EPUB) {
+      // epub drm is removed in place, the original file is kept
+      std::ifstream in(input_file, std::ios::binary);
+      std::ofstream out(output_file, std::ios::binary);
+      out << in.rdbuf();
+      if (!out.flush()) {
+        throw std::runtime_error("unable to write " + output_file);
+      }
+      out.close();
+      processor->removeDRM(output_file, output_file, type,
+                           key.length() ? key.data() : nullptr, key.length());
+    } else {
+      processor->removeDRM(input_file, output_file, type,
+                           key.length() ? key.data() : nullptr, key.length());
     }
-    default:
-      throw std::domain_error("the downloaded file is not a PDF nor an EPUB");
+  } catch (...) {
+    fs_compat::remove_file(output_file);
+    delete processor;
+    throw;
+  }
+  delete processor;
+
+  std::cout << (type == gourou::DRMProcessor::ITEM_TYPE::PDF ? "PDF" : "EPUB")
+            << " file generated at " << output_file << std::endl;
+  return 0;
+}
+
+// Long running mode : one processor (and one HTTP client) for all jobs.
+// stdout is reserved for results, everything else is sent to stderr.
+int run_server(DRMProcessorClientImpl &client, const std::string &data_dir) {
+  int result_fd = dup(STDOUT_FILENO);
+  FILE *results = result_fd >= 0 ? fdopen(result_fd, "w") : nullptr;
+  if (!results) {
+    throw std::runtime_error("unable to set up the server result channel");
+  }
+  std::cout << std::flush;
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  gourou::DRMProcessor *processor = create_processor(client, data_dir);
+  bool activated = false;
+
+  GOUROU_LOG(DEBUG, "Server mode, waiting for ACSM paths on stdin");
+  fprintf(results, "{\"status\": \"ready\"}\n");
+  fflush(results);
+
+  std::string acsm_file;
+  while (std::getline(std::cin, acsm_file)) {
+    if (acsm_file.empty()) {
+      continue;
+    }
+    std::string upload_file;
+    const size_t tab = acsm_file.find('\t');
+    if (tab != std::string::npos) {
+      upload_file = acsm_file.substr(tab + 1);
+      acsm_file.resize(tab);
+    }
+
+    std::string response;
+    // the metrics of each result only cover its own conversion
+    add_http_metrics(client);
+    metrics.reset();
+    try {
+      verify_acsm(acsm_file);
+      // sign in and activation are only needed once per device
+      if (!activated) {
+        sign_in_and_activate(processor);
+        activated = true;
+      }
+      if (upload_file.empty()) {
+        std::string output = convert_acsm(processor, acsm_file);
+        response = "{\"status\": \"ok\", \"file\": \"" + json_escape(output) + "\"}";
+      } else {
+        uint64_t size = 0;
+        std::string type = convert_acsm_to_s3(processor, client, acsm_file, upload_file, &size);
+        response = "{\"status\": \"ok\", \"uploaded\": \"" + type +
+          "\", \"size\": " + std::to_string(size) + "}";
+      }
+      print_transfer_stats(client);
+    } catch (const gourou::Exception &e) {
+      std::cerr << "gourou library error: " << e.what() << std::endl;
+      response = "{\"status\": \"error\", \"kind\": \"gourou\", \"error\": \"" +
+        json_escape(e.what()) + "\"}";
+    } catch (const std::runtime_error &e) {
+      std::cerr << "filesystem error: " << e.what() << std::endl;
+      response = "{\"status\": \"error\", \"kind\": \"filesystem\", \"error\": \"" +
+        json_escape(e.what()) + "\"}";
+    } catch (const std::exception &e) {
+      std::cerr << "error: " << e.what() << std::endl;
+      response = "{\"status\": \"error\", \"kind\": \"other\", \"error\": \"" +
+        json_escape(e.what()) + "\"}";
+    }
+
+    print_connection_stats(client);
+    finish_metrics(client);
+    response.insert(response.size() - 1, ", \"metrics\": " + metrics.toJSON());
+    fprintf(results, "%s\n", response.c_str());
+    fflush(results);
+  }
+
+  delete processor;
+  fclose(results);
+  return 0;
+}
+
+// Batch mode : fulfill and download are network bound and go through the
+// activated processor one after the other on the main thread, while DRM
+// removal (CPU bound) of already downloaded files runs on up to `jobs`
+// workers. Each worker has its own processor so that it never shares user
+// state with fulfill().
+int run_batch(DRMProcessorClientImpl &client, const std::string &data_dir,
+              int argc, char **argv) {
+  std::vector<std::string> acsm_files;
+  unsigned jobs = std::thread::hardware_concurrency();
+
+  for (int i = 2; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--jobs" || arg == "--manifest") {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument(arg + " requires a value");
+      }
+      const std::string value = argv[++i];
+      if (arg == "--manifest") {
+        std::vector<std::string> listed = read_manifest(value);
+        acsm_files.insert(acsm_files.end(), listed.begin(), listed.end());
+        continue;
+      }
+      char *end = nullptr;
+      unsigned long parsed = std::strtoul(value.c_str(), &end, 10);
+      if (value.empty() || *end || !parsed) {
+        throw std::invalid_argument("invalid number of jobs: " + value);
+      }
+      jobs = (unsigned)parsed;
+    } else {
+      acsm_files.push_back(arg);
+    }
+  }
+
+  if (acsm_files.empty()) {
+    throw std::invalid_argument("no ACSM file to convert");
+  }
+  if (!jobs) {
+    jobs = 1;
+  }
+  const unsigned nb_workers = std::min<size_t>(jobs, acsm_files.size());
+  // the cores are shared between the files processed at the same time
+  const unsigned decryption_threads =
+    std::max(1u, std::thread::hardware_concurrency() / nb_workers);
+
+  GOUROU_LOG(DEBUG, "Batch mode, " << acsm_files.size() << " files, "
+                    << nb_workers << " jobs");
+
+  gourou::DRMProcessor *processor = create_processor(client, data_dir);
+  std::vector<gourou::DRMProcessor *> worker_processors;
+  try {
+    sign_in_and_activate(processor);
+    for (unsigned i = 0; i < nb_workers; i++) {
+      worker_processors.push_back(create_processor(client, data_dir));
+      worker_processors.back()->setDecryptionThreads(decryption_threads);
     }
   } catch (...) {
-    // Clean up processor before rethrowing
+    for (gourou::DRMProcessor *worker_processor : worker_processors) {
+      delete worker_processor;
+    }
     delete processor;
     throw;
   }
-  
-  // Clean up processor
+
+  // each result slot is only written by the thread handling the item
+  std::vector<std::string> outputs(acsm_files.size());
+  std::vector<std::string> errors(acsm_files.size());
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<std::pair<size_t, DownloadedItem>> pending;
+  bool done = false;
+
+  std::vector<std::thread> workers;
+  for (gourou::DRMProcessor *worker_processor : worker_processors) {
+    workers.emplace_back([&, worker_processor]() {
+      std::unique_lock<std::mutex> guard(lock);
+      for (;;) {
+        cond.wait(guard, [&]() { return done || !pending.empty(); });
+        if (pending.empty()) {
+          return;
+        }
+        std::pair<size_t, DownloadedItem> job = pending.front();
+        pending.pop_front();
+        cond.notify_all();
+        guard.unlock();
+
+        try {
+          outputs[job.first] = remove_drm(worker_processor, job.second);
+        } catch (const std::exception &e) {
+          errors[job.first] = e.what();
+        } catch (...) {
+          errors[job.first] = "unknown error";
+        }
+        if (!errors[job.first].empty()) {
+          std::cerr << "error: " << job.second.acsm_file << ": "
+                    << errors[job.first] << std::endl;
+        }
+
+        guard.lock();
+      }
+    });
+  }
+
+  for (size_t i = 0; i < acsm_files.size(); i++) {
+    try {
+      verify_acsm(acsm_files[i]);
+      DownloadedItem downloaded = fetch_acsm(processor, acsm_files[i]);
+      print_transfer_stats(client);
+
+      std::unique_lock<std::mutex> guard(lock);
+      // don't download further ahead than the workers can absorb
+      cond.wait(guard, [&]() { return pending.size() < nb_workers; });
+      pending.emplace_back(i, downloaded);
+      cond.notify_all();
+    } catch (const std::exception &e) {
+      errors[i] = e.what();
+    } catch (...) {
+      errors[i] = "unknown error";
+    }
+    if (!errors[i].empty()) {
+      std::cerr << "error: " << acsm_files[i] << ": " << errors[i] << std::endl;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+  }
+  cond.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  for (gourou::DRMProcessor *worker_processor : worker_processors) {
+    delete worker_processor;
+  }
   delete processor;
-  return result;
-} catch (const gourou::Exception &e) {
-  std::cerr << "gourou library error: " << e.what() << std::endl;
-  std::cerr << "This typically indicates an issue with Adobe DRM processing." << std::endl;
-  return 1;
-} catch (const std::runtime_error &e) {
-  std::cerr << "filesystem error: " << e.what() << std::endl;
-  std::cerr << "Check file permissions and available disk space." << std::endl;
-  return 1;
-} catch (const std::exception &e) {
-  std::cerr << "error: " << e.what() << std::endl;
-  return 1;
+
+  size_t failures = 0;
+  std::cout << "batch results:" << std::endl;
+  for (size_t i = 0; i < acsm_files.size(); i++) {
+    if (errors[i].empty()) {
+      std::cout << "[OK] " << acsm_files[i] << " -> " << outputs[i] << std::endl;
+    } else {
+      std::cout << "[FAILED] " << acsm_files[i] << ": " << errors[i] << std::endl;
+      failures++;
+    }
+  }
+  std::cout << acsm_files.size() - failures << "/" << acsm_files.size()
+            << " files converted" << std::endl;
+
+  print_connection_stats(client);
+  return failures ? 1 : 0;
+}
+
+// one ACSM path per line, empty lines and lines starting with '#' are ignored
+std::vector<std::string> read_manifest(const std::string &manifest_file) {
+  std::ifstream manifest(manifest_file);
+  if (!manifest) {
+    throw std::runtime_error("unable to read manifest " + manifest_file);
+  }
+
+  std::vector<std::string> acsm_files;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    acsm_files.push_back(line);
+  }
+
+  return acsm_files;
+}
+
+void print_connection_stats(DRMProcessorClientImpl &client) {
+  DRMProcessorClientImpl::ConnectionStats stats = client.getConnectionStats();
+  GOUROU_LOG(DEBUG, "HTTP requests: " << stats.requests
+                    << ", new connections: " << stats.newConnections
+                    << ", reused connections: " << stats.reusedConnections);
+}
+
+std::string json_escape(const std::string &str) {
+  std::string res;
+  for (unsigned char c : str) {
+    switch (c) {
+    case '"': res += "\\\""; break;
+    case '\\': res += "\\\\"; break;
+    case '\n': res += "\\n"; break;
+    case '\r': res += "\\r"; break;
+    case '\t': res += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        res += buf;
+      } else {
+        res += (char)c;
+      }
+    }
+  }
+  return res;
+}
+
+// Diagnostics (library and knock) go to stderr through a background thread so
+// that enabling them doesn't slow down conversions. KNOCK_LOG_LEVEL selects
+// the level (error, warn, info, debug, trace or 0-4, default warn) and
+// KNOCK_LOG_FORMAT the format (text or json, json by default in Lambda so
+// that CloudWatch gets one structured event per message).
+void setup_logging() {
+  static const char *level_names[] = {"error", "warn", "info", "debug", "trace"};
+
+  const char *level = std::getenv("KNOCK_LOG_LEVEL");
+  if (level != nullptr) {
+    for (int i = 0; i <= gourou::LG_LOG_TRACE; i++) {
+      if (strcasecmp(level, level_names[i]) == 0 ||
+          (level[0] == '0' + i && level[1] == 0)) {
+        gourou::setLogLevel((gourou::GOUROU_LOG_LEVEL)i);
+      }
+    }
+  }
+
+  const char *format = std::getenv("KNOCK_LOG_FORMAT");
+  const bool json = format != nullptr ? strcasecmp(format, "json") == 0
+                                      : std::getenv("LAMBDA_TASK_ROOT") != nullptr;
+
+  // flushed when knock exits
+  static gourou::AsyncLogSink sink(STDERR_FILENO, json);
+  gourou::setLogSink(&sink);
+}
+
+// adds the HTTP statistics of client since the previous call
+void add_http_metrics(DRMProcessorClientImpl &client) {
+  static DRMProcessorClientImpl::ConnectionStats last = {};
+  DRMProcessorClientImpl::ConnectionStats stats = client.getConnectionStats();
+
+  metrics.add("http.requests", stats.requests - last.requests);
+  metrics.add("http.retries", stats.retries - last.retries);
+  metrics.add("http.new_connections", stats.newConnections - last.newConnections);
+  metrics.add("http.reused_connections",
+              stats.reusedConnections - last.reusedConnections);
+  last = stats;
+}
+
+// completes metrics before they're written out
+void finish_metrics(DRMProcessorClientImpl &client) {
+  add_http_metrics(client);
+
+  std::map<std::string, gourou::Metrics::Phase> phases = metrics.phases();
+  if (phases.count("download") && phases["download"].time > 0) {
+    // bytes per second
+    metrics.add("download.throughput",
+                (uint64_t)(metrics.counter("download.bytes") / phases["download"].time));
+  }
+}
+
+void write_metrics(DRMProcessorClientImpl &client) {
+  if (metrics_file.empty()) {
+    return;
+  }
+  finish_metrics(client);
+
+  std::ofstream out(metrics_file);
+  out << metrics.toJSON() << std::endl;
+  if (!out) {
+    std::cerr << "error: unable to write metrics into " << metrics_file << std::endl;
+  }
 }
 
 std::string get_data_dir() {
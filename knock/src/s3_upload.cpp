@@ -0,0 +1,179 @@
+#include <stdexcept>
+#include "s3_upload.h"
+
+S3UploadWriter::S3UploadWriter(S3Requests &requests,
+                               const std::map<std::string, UploadURLs> &uploads,
+                               gourou::Metrics *metrics)
+    : requests(requests), uploads(uploads), metrics(metrics) {}
+
+S3UploadWriter::~S3UploadWriter() {
+  // unfinished (failed) multipart uploads are aborted by their creator
+  if (sender.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done = true;
+      pending.clear();
+    }
+    changed.notify_all();
+    sender.join();
+  }
+}
+
+void S3UploadWriter::write(const char *buffer, size_t length) {
+  size += length;
+
+  if (urls) {
+    append(buffer, length);
+    return;
+  }
+
+  // not enough bytes to tell the type yet
+  part.append(buffer, length);
+  if (part.size() >= 4) {
+    start();
+  }
+}
+
+// picks the destination from the bytes buffered so far, then sends them
+void S3UploadWriter::start() {
+  std::string head;
+  head.swap(part);
+
+  if (head.compare(0, 4, "%PDF") == 0) {
+    type_name = "pdf";
+  } else if (head.compare(0, 4, std::string("PK\x03\x04", 4)) == 0) {
+    type_name = "epub";
+  } else {
+    throw std::runtime_error("unable to tell the type of the converted file");
+  }
+
+  auto upload = uploads.find(type_name);
+  if (upload == uploads.end()) {
+    throw std::invalid_argument("no " + type_name + " upload URL");
+  }
+  urls = &upload->second;
+
+  if (!urls->part_urls.empty()) {
+    etags.resize(urls->part_urls.size());
+    part.reserve(urls->part_size);
+    sender = std::thread(&S3UploadWriter::send_parts, this);
+  }
+
+  append(head.data(), head.size());
+}
+
+void S3UploadWriter::append(const char *buffer, size_t length) {
+  // an epub archive may come in big writes
+  while (!urls->part_urls.empty() && queued + 1 < urls->part_urls.size() &&
+         part.size() + length >= urls->part_size) {
+    const size_t taken = urls->part_size - part.size();
+    part.append(buffer, taken);
+    buffer += taken;
+    length -= taken;
+    queue_part();
+  }
+  // or the last part would buffer whatever remains
+  if (!urls->part_urls.empty() && part.size() + length > urls->part_size) {
+    throw std::runtime_error("the file doesn't fit in " + std::to_string(urls->part_urls.size()) +
+                             " upload parts of " + std::to_string(urls->part_size) + " bytes");
+  }
+  part.append(buffer, length);
+}
+
+// hands current part to the sender, waits while two parts are already
+// waiting to keep memory bounded
+void S3UploadWriter::queue_part() {
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this] { return pending.size() < 2 || error; });
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  pending.emplace_back(queued++, std::move(part));
+  changed.notify_all();
+
+  part = std::string();
+  part.reserve(urls->part_size);
+}
+
+void S3UploadWriter::send_parts() {
+  while (true) {
+    std::pair<size_t, std::string> current;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [this] { return done || !pending.empty(); });
+      if (pending.empty() || error) {
+        return;
+      }
+      current = std::move(pending.front());
+    }
+
+    try {
+      gourou::MetricsSpan span(metrics, "upload");
+      std::string etag = requests.put(urls->part_urls[current.first], current.second.data(),
+                                      current.second.size());
+      if (etag.empty()) {
+        throw std::runtime_error("no ETag in reply to part " + std::to_string(current.first + 1));
+      }
+      etags[current.first] = etag;
+      if (metrics) {
+        metrics->add("upload.bytes", current.second.size());
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(lock);
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    // cleared when the upload is given up
+    if (!pending.empty()) {
+      pending.pop_front();
+    }
+    changed.notify_all();
+  }
+}
+
+uint64_t S3UploadWriter::finish() {
+  if (!urls) {
+    start();
+  }
+
+  if (urls->part_urls.empty()) {
+    gourou::MetricsSpan span(metrics, "upload");
+    requests.put(urls->put_url, part.data(), part.size());
+    if (metrics) {
+      metrics->add("upload.bytes", part.size());
+    }
+    return size;
+  }
+
+  // parts are queued as soon as they are full : nothing is left when the
+  // size is a multiple of part_size, but an empty file still needs a part
+  if (!part.empty() || !queued) {
+    queue_part();
+  }
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return pending.empty() || error; });
+    done = true;
+  }
+  changed.notify_all();
+  sender.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  std::string request = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < queued; i++) {
+    request += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" +
+      etags[i] + "</ETag></Part>";
+  }
+  request += "</CompleteMultipartUpload>";
+
+  gourou::MetricsSpan span(metrics, "upload");
+  std::string reply = requests.post(urls->complete_url, request);
+  // S3 may report an error after a 200 status
+  if (reply.find("<Error>") != std::string::npos) {
+    throw std::runtime_error("unable to complete the upload: " + reply.substr(0, 256));
+  }
+  return size;
+}
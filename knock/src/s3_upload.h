@@ -0,0 +1,77 @@
+#ifndef KNOCK_S3_UPLOAD_H
+#define KNOCK_S3_UPLOAD_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <uPDFParser.h>
+#include "metrics.h"
+
+// pre-signed S3 destination of a converted file, see read_upload_urls()
+struct UploadURLs {
+  std::string put_url;                // single PUT of the whole file
+  std::vector<std::string> part_urls; // or parts of a multipart upload
+  std::string complete_url;           // and its CompleteMultipartUpload
+  size_t part_size = 8 * 1024 * 1024;
+};
+
+// HTTP requests of an upload. Parts are sent from a background thread
+// while the file is produced.
+class S3Requests {
+public:
+  virtual ~S3Requests() {}
+
+  // PUT of a whole file or of a part, returns the ETag of the reply
+  virtual std::string put(const std::string &url, const char *data, size_t size) = 0;
+  // POST of an XML request (CompleteMultipartUpload), returns the reply body
+  virtual std::string post(const std::string &url, const std::string &request) = 0;
+};
+
+// Sends the DRM free file to S3 while it is produced. The type of a
+// downloaded book is only known once its reply headers are received, so
+// the destination is picked from the first bytes written (%PDF or a zip
+// archive). With a multipart upload, parts are sent by a background thread
+// as soon as they are full (at most two are buffered) and the last URL
+// takes the remaining bytes, up to part_size : write() throws once all
+// parts are full. A single PUT needs the whole file, it is sent by finish().
+class S3UploadWriter : public uPDFParser::Writer {
+public:
+  S3UploadWriter(S3Requests &requests, const std::map<std::string, UploadURLs> &uploads,
+                 gourou::Metrics *metrics = nullptr);
+  ~S3UploadWriter();
+
+  virtual void write(const char *buffer, size_t size);
+  // sends what remains and completes the upload, returns the file size
+  uint64_t finish();
+  // "pdf" or "epub", empty until the type is known
+  const std::string &type() const { return type_name; }
+
+private:
+  void start();
+  void append(const char *buffer, size_t length);
+  void queue_part();
+  void send_parts();
+
+  S3Requests &requests;
+  const std::map<std::string, UploadURLs> &uploads;
+  gourou::Metrics *metrics;
+  const UploadURLs *urls = nullptr;
+  std::string type_name;
+  std::string part;
+  uint64_t size = 0;
+  size_t queued = 0;
+  std::deque<std::pair<size_t, std::string>> pending;
+  std::vector<std::string> etags;
+  std::exception_ptr error;
+  bool done = false;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::thread sender;
+};
+
+#endif
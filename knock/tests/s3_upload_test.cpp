@@ -0,0 +1,129 @@
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "s3_upload.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      std::cout << __FILE__ << ":" << __LINE__ << " Check failed : " << #cond << std::endl; \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+// records requests instead of sending them
+class FakeRequests : public S3Requests {
+public:
+  virtual std::string put(const std::string &url, const char *data, size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    puts.emplace_back(url, std::string(data, size));
+    return "\"etag-" + url + "\"";
+  }
+
+  virtual std::string post(const std::string &url, const std::string &request) {
+    posts.emplace_back(url, request);
+    return "<CompleteMultipartUploadResult/>";
+  }
+
+  std::mutex lock;
+  std::vector<std::pair<std::string, std::string>> puts;
+  std::vector<std::pair<std::string, std::string>> posts;
+};
+
+static std::map<std::string, UploadURLs> multipart_uploads(size_t nb_parts, size_t part_size) {
+  std::map<std::string, UploadURLs> uploads;
+  UploadURLs &urls = uploads["pdf"];
+  for (size_t i = 0; i < nb_parts; i++) {
+    urls.part_urls.push_back("part" + std::to_string(i + 1));
+  }
+  urls.complete_url = "complete";
+  urls.part_size = part_size;
+  return uploads;
+}
+
+// size is a multiple of part_size : no empty last part
+static void test_exact_parts() {
+  std::map<std::string, UploadURLs> uploads = multipart_uploads(4, 4);
+  FakeRequests requests;
+  S3UploadWriter writer(requests, uploads);
+
+  writer.write("%P", 2);
+  writer.write("DF-1.6", 6);
+  CHECK(writer.finish() == 8);
+  CHECK(writer.type() == "pdf");
+
+  CHECK(requests.puts.size() == 2);
+  CHECK(requests.puts[0] == std::make_pair(std::string("part1"), std::string("%PDF")));
+  CHECK(requests.puts[1] == std::make_pair(std::string("part2"), std::string("-1.6")));
+  CHECK(requests.posts.size() == 1);
+  CHECK(requests.posts[0].second.find("<PartNumber>2</PartNumber>") != std::string::npos);
+  CHECK(requests.posts[0].second.find("<PartNumber>3</PartNumber>") == std::string::npos);
+}
+
+// last part URL is exactly filled
+static void test_all_parts_full() {
+  std::map<std::string, UploadURLs> uploads = multipart_uploads(2, 4);
+  FakeRequests requests;
+  S3UploadWriter writer(requests, uploads);
+
+  writer.write("%PDF-1.6", 8);
+  CHECK(writer.finish() == 8);
+  CHECK(requests.puts.size() == 2);
+  CHECK(requests.puts[1].second == "-1.6");
+
+  FakeRequests overflow_requests;
+  S3UploadWriter overflow(overflow_requests, uploads);
+  bool thrown = false;
+  try {
+    overflow.write("%PDF-1.6!", 9);
+  } catch (std::runtime_error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+}
+
+static void test_remaining_part() {
+  std::map<std::string, UploadURLs> uploads = multipart_uploads(4, 4);
+  FakeRequests requests;
+  S3UploadWriter writer(requests, uploads);
+
+  writer.write("%PDF-1.6\n%", 10);
+  CHECK(writer.finish() == 10);
+  CHECK(requests.puts.size() == 3);
+  CHECK(requests.puts[2].second == "\n%");
+}
+
+// destination is picked from the first bytes, single PUT
+static void test_single_put() {
+  std::map<std::string, UploadURLs> uploads;
+  uploads["pdf"].put_url = "pdf";
+  uploads["epub"].put_url = "epub";
+  FakeRequests requests;
+  S3UploadWriter writer(requests, uploads);
+
+  const std::string zip("PK\x03\x04mimetype", 12);
+  writer.write(zip.data(), zip.size());
+  CHECK(writer.finish() == zip.size());
+  CHECK(writer.type() == "epub");
+  CHECK(requests.puts.size() == 1);
+  CHECK(requests.puts[0] == std::make_pair(std::string("epub"), zip));
+  CHECK(requests.posts.empty());
+}
+
+int main() {
+  try {
+    test_exact_parts();
+    test_all_parts_full();
+    test_remaining_part();
+    test_single_put();
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    failures++;
+  }
+
+  std::cout << (failures ? "Tests failed" : "Tests passed") << std::endl;
+  return failures ? 1 : 0;
+}